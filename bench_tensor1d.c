@@ -0,0 +1,362 @@
+/*
+Benchmarks of the core tensor ops, over sizes from 16 elements up to --max-size.
+
+Every benchmark is warmed up, then timed in repeated samples, each a batch of
+calls long enough for the clock to resolve it. We report the median and the
+99th percentile time per call, and for the ops that stream memory the
+bandwidth (bytes read + written per second) next to that of a plain memcpy on
+the same machine, which is about the best any of them can do once the data
+doesn't fit in the cache.
+
+Build and run with `make bench`, BENCH_ARGS passes options, e.g.
+    make bench BENCH_ARGS="--json --max-size 1000000000"
+
+Options:
+    --max-size N    largest size to run, default 16777216
+    --filter NAME   only the benchmarks whose name contains NAME
+    --threads N     size of the thread pool (default: as the library picks)
+    --isa NAME      kernel ISA: scalar, avx2, avx512 or neon (default: the best one)
+    --json          print JSON instead of a table, for tracking regressions
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "tensor1d.h"
+
+// ----------------------------------------------------------------------------
+// timing
+
+#define BENCH_WARMUP_NS 20000000LL  // 20 ms of warmup calls
+#define BENCH_TARGET_NS 200000000LL // then about 200 ms of samples
+#define BENCH_SAMPLE_NS 20000LL     // each at least 20 us long
+#define BENCH_MIN_SAMPLES 10
+#define BENCH_MAX_SAMPLES 1000
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// one benchmark at one size: setup allocates what run uses, run does one call
+typedef struct Bench Bench;
+struct Bench {
+    const char* name;
+    double bytes_per_element; // moved per call, 0 if it isn't a streaming op
+    int min_size;
+    void (*setup)(Bench* b, int n);
+    void (*run)(Bench* b);
+    int n;
+    Tensor* t[4];
+    int i; // for the ops that take an index
+    volatile float sink; // keeps results alive
+};
+
+void bench_teardown(Bench* b) {
+    for (int k = 0; k < 4; k++) {
+        if (b->t[k] != NULL) { tensor_free(b->t[k]); }
+        b->t[k] = NULL;
+    }
+}
+
+int compare_doubles(const void* x, const void* y) {
+    double a = *(const double*) x, b = *(const double*) y;
+    return (a > b) - (a < b);
+}
+
+typedef struct {
+    double median_ns; // per call
+    double p99_ns;
+    int samples;
+    long long calls;
+} BenchResult;
+
+// times b->run, whatever it was set up for
+BenchResult bench_time(Bench* b) {
+    // warm up, and find how many calls make a sample of BENCH_SAMPLE_NS
+    long long calls = 0;
+    long long start = now_ns();
+    long long elapsed;
+    do {
+        b->run(b);
+        calls++;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_WARMUP_NS && calls < 1000000);
+    double call_ns = (double) elapsed / calls;
+    long long batch = call_ns >= BENCH_SAMPLE_NS ? 1 : (long long) (BENCH_SAMPLE_NS / call_ns) + 1;
+    int samples = (int) (BENCH_TARGET_NS / (call_ns * batch));
+    samples = samples < BENCH_MIN_SAMPLES ? BENCH_MIN_SAMPLES : samples > BENCH_MAX_SAMPLES ? BENCH_MAX_SAMPLES : samples;
+    double* times = malloc(samples * sizeof(double));
+    for (int s = 0; s < samples; s++) {
+        long long t0 = now_ns();
+        for (long long c = 0; c < batch; c++) { b->run(b); }
+        times[s] = (double) (now_ns() - t0) / batch;
+    }
+    qsort(times, samples, sizeof(double), compare_doubles);
+    BenchResult r = { times[samples / 2], times[(int) (samples * 0.99)], samples, batch * samples };
+    free(times);
+    return r;
+}
+
+// ----------------------------------------------------------------------------
+// memcpy, the reference bandwidth
+
+#define MEMCPY_BYTES (128 << 20)
+
+// bytes read + written per second by memcpy of an out-of-cache buffer
+double memcpy_gbps(void) {
+    char* src = malloc(MEMCPY_BYTES);
+    char* dst = malloc(MEMCPY_BYTES);
+    memset(src, 1, MEMCPY_BYTES);
+    memset(dst, 0, MEMCPY_BYTES); // fault the pages in before timing
+    double best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        long long t0 = now_ns();
+        memcpy(dst, src, MEMCPY_BYTES);
+        double ns = (double) (now_ns() - t0);
+        if (ns < best) { best = ns; }
+        src[rep] = dst[MEMCPY_BYTES - 1 - rep]; // so the copies can't be elided
+    }
+    free(src);
+    free(dst);
+    return 2.0 * MEMCPY_BYTES / best;
+}
+
+// ----------------------------------------------------------------------------
+// the benchmarks
+
+void setup_none(Bench* b, int n) {}
+
+void setup_one(Bench* b, int n) {
+    b->t[0] = tensor_arange(n);
+}
+
+// n pseudo-random floats in [0, 1), for sorting
+void setup_random(Bench* b, int n) {
+    b->t[0] = tensor_empty(n);
+    float* data = b->t[0]->storage->data;
+    uint32_t state = 12345;
+    for (int i = 0; i < n; i++) {
+        state = state * 1664525u + 1013904223u; // an LCG is plenty here
+        data[i] = (state >> 8) * (1.0f / (1 << 24));
+    }
+}
+
+// a, b and out of n elements
+void setup_binary(Bench* b, int n) {
+    b->t[0] = tensor_arange(n);
+    b->t[1] = tensor_arange(n);
+    b->t[2] = tensor_empty(n);
+}
+
+// every other element of storages twice the size
+void setup_strided(Bench* b, int n) {
+    for (int k = 0; k < 3; k++) {
+        Tensor* base = tensor_arange(2 * n);
+        b->t[k] = tensor_slice(base, 0, 2 * n, 2);
+        tensor_free(base);
+    }
+}
+
+// a (n / 64, 64) matrix plus a row of 64, broadcast to every row
+#define BROADCAST_COLS 64
+
+void setup_broadcast(Bench* b, int n) {
+    int shape[2] = { n / BROADCAST_COLS, BROADCAST_COLS };
+    Tensor* flat = tensor_arange(n);
+    b->t[0] = tensor_reshape(flat, 2, shape);
+    b->t[1] = tensor_arange(BROADCAST_COLS);
+    tensor_free(flat);
+    flat = tensor_empty(n);
+    b->t[2] = tensor_reshape(flat, 2, shape);
+    tensor_free(flat);
+}
+
+void run_arange(Bench* b) {
+    tensor_free(tensor_arange(b->n));
+}
+
+void run_slice(Bench* b) {
+    tensor_free(tensor_slice(b->t[0], 1, b->n - 1, 1));
+}
+
+void run_getitem(Bench* b) {
+    b->sink = tensor_getitem(b->t[0], b->i);
+    b->i = b->i + 1 < b->n ? b->i + 1 : 0;
+}
+
+void run_setitem(Bench* b) {
+    tensor_setitem(b->t[0], b->i, 1.0f);
+    b->i = b->i + 1 < b->n ? b->i + 1 : 0;
+}
+
+void run_add_out(Bench* b) {
+    tensor_add_out(b->t[0], b->t[1], b->t[2]);
+}
+
+void run_add_alloc(Bench* b) {
+    tensor_free(tensor_add(b->t[0], b->t[1]));
+}
+
+// the same inside an arena scope, released at the end of each call
+void run_add_arena(Bench* b) {
+    tensor_arena_begin();
+    tensor_free(tensor_add(b->t[0], b->t[1]));
+    tensor_arena_end();
+}
+
+void run_addf_out(Bench* b) {
+    tensor_addf_out(b->t[0], 1.0, b->t[2]);
+}
+
+void run_mul_out(Bench* b) {
+    tensor_binary_out(BINARY_MUL, b->t[0], b->t[1], b->t[2]);
+}
+
+void run_fma_out(Bench* b) {
+    tensor_fma_out(b->t[0], b->t[1], b->t[0], b->t[2]);
+}
+
+void run_exp_out(Bench* b) {
+    tensor_unary_out(UNARY_EXP, b->t[0], b->t[2]);
+}
+
+void run_tanh_out(Bench* b) {
+    tensor_unary_out(UNARY_TANH, b->t[0], b->t[2]);
+}
+
+void run_sum(Bench* b) {
+    b->sink = tensor_sum(b->t[0]);
+}
+
+void run_max(Bench* b) {
+    b->sink = tensor_max(b->t[0]);
+}
+
+void run_dot(Bench* b) {
+    b->sink = tensor_dot(b->t[0], b->t[1]);
+}
+
+void run_cumsum(Bench* b) {
+    tensor_free(tensor_cumsum(b->t[0]));
+}
+
+void run_argsort(Bench* b) {
+    tensor_free(tensor_argsort(b->t[0], false));
+}
+
+void run_topk(Bench* b) {
+    Tensor* indices;
+    tensor_free(tensor_topk(b->t[0], b->n < 100 ? b->n : 100, true, &indices));
+    tensor_free(indices);
+}
+
+Bench benches[] = {
+    { .name = "arange", .bytes_per_element = 4, .min_size = 1, .setup = setup_none, .run = run_arange },
+    { .name = "slice", .bytes_per_element = 0, .min_size = 2, .setup = setup_one, .run = run_slice },
+    { .name = "getitem", .bytes_per_element = 0, .min_size = 1, .setup = setup_one, .run = run_getitem },
+    { .name = "setitem", .bytes_per_element = 0, .min_size = 1, .setup = setup_one, .run = run_setitem },
+    { .name = "add_contiguous", .bytes_per_element = 12, .min_size = 1, .setup = setup_binary, .run = run_add_out },
+    { .name = "add_alloc", .bytes_per_element = 12, .min_size = 1, .setup = setup_binary, .run = run_add_alloc },
+    { .name = "add_arena", .bytes_per_element = 12, .min_size = 1, .setup = setup_binary, .run = run_add_arena },
+    { .name = "add_strided", .bytes_per_element = 12, .min_size = 1, .setup = setup_strided, .run = run_add_out },
+    { .name = "add_broadcast", .bytes_per_element = 8, .min_size = BROADCAST_COLS, .setup = setup_broadcast, .run = run_add_out },
+    { .name = "addf_contiguous", .bytes_per_element = 8, .min_size = 1, .setup = setup_binary, .run = run_addf_out },
+    { .name = "mul_contiguous", .bytes_per_element = 12, .min_size = 1, .setup = setup_binary, .run = run_mul_out },
+    { .name = "fma_contiguous", .bytes_per_element = 12, .min_size = 1, .setup = setup_binary, .run = run_fma_out },
+    { .name = "exp_contiguous", .bytes_per_element = 8, .min_size = 1, .setup = setup_binary, .run = run_exp_out },
+    { .name = "tanh_contiguous", .bytes_per_element = 8, .min_size = 1, .setup = setup_binary, .run = run_tanh_out },
+    { .name = "sum", .bytes_per_element = 4, .min_size = 1, .setup = setup_one, .run = run_sum },
+    { .name = "max", .bytes_per_element = 4, .min_size = 1, .setup = setup_one, .run = run_max },
+    { .name = "dot", .bytes_per_element = 8, .min_size = 1, .setup = setup_binary, .run = run_dot },
+    { .name = "cumsum", .bytes_per_element = 8, .min_size = 1, .setup = setup_one, .run = run_cumsum },
+    { .name = "argsort", .bytes_per_element = 0, .min_size = 1, .setup = setup_random, .run = run_argsort },
+    { .name = "topk100", .bytes_per_element = 4, .min_size = 1, .setup = setup_random, .run = run_topk },
+};
+
+// ----------------------------------------------------------------------------
+// main
+
+int isa_from_name(const char* name) {
+    for (int isa = KERNEL_ISA_SCALAR; isa <= KERNEL_ISA_AVX512; isa++) {
+        if (strcmp(tensor_kernel_isa_name(isa), name) == 0) { return isa; }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    long long max_size = 1 << 24;
+    const char* filter = NULL;
+    bool json = false;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--max-size") == 0 && has_value) {
+            max_size = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && has_value) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            tensor_set_num_threads(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--isa") == 0 && has_value) {
+            int isa = isa_from_name(argv[++i]);
+            if (isa < 0) {
+                fprintf(stderr, "ValueError: unknown kernel ISA %s\n", argv[i]);
+                return 1;
+            }
+            if (!tensor_set_kernel_isa(isa)) { return 1; } // it says why
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else {
+            fprintf(stderr, "usage: %s [--max-size N] [--filter NAME] [--threads N] [--isa NAME] [--json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_size > 1000000000) { max_size = 1000000000; } // sizes are ints
+    // 16, 256, 4K, 64K, 1M, 16M, 256M, and 1e9 elements
+    long long sizes[] = { 16, 256, 4096, 65536, 1 << 20, 1 << 24, 1 << 28, 1000000000 };
+    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    double memcpy_bw = memcpy_gbps();
+    const char* isa = tensor_kernel_isa_name(tensor_get_kernel_isa());
+    if (json) {
+        printf("{\"suite\": \"c\", \"isa\": \"%s\", \"threads\": %d, \"memcpy_gbps\": %.3f, \"results\": [",
+               isa, tensor_get_num_threads(), memcpy_bw);
+    } else {
+        printf("isa %s, %d threads, memcpy %.2f GB/s\n", isa, tensor_get_num_threads(), memcpy_bw);
+        printf("%-16s %12s %12s %12s %10s %8s\n", "benchmark", "size", "median ns", "p99 ns", "GB/s", "memcpy");
+    }
+    bool first = true;
+    for (size_t k = 0; k < sizeof(benches) / sizeof(benches[0]); k++) {
+        Bench* b = &benches[k];
+        if (filter != NULL && strstr(b->name, filter) == NULL) { continue; }
+        for (int s = 0; s < num_sizes && sizes[s] <= max_size; s++) {
+            int n = (int) sizes[s];
+            if (n < b->min_size) { continue; }
+            b->n = n;
+            b->i = 0;
+            b->setup(b, n);
+            BenchResult r = bench_time(b);
+            bench_teardown(b);
+            double gbps = b->bytes_per_element * n / r.median_ns; // bytes per ns = GB/s
+            if (json) {
+                printf("%s\n  {\"name\": \"%s\", \"size\": %d, \"median_ns\": %.1f, \"p99_ns\": %.1f, \"samples\": %d, \"calls\": %lld",
+                       first ? "" : ",", b->name, n, r.median_ns, r.p99_ns, r.samples, r.calls);
+                if (b->bytes_per_element > 0) {
+                    printf(", \"gbps\": %.3f, \"memcpy_fraction\": %.3f", gbps, gbps / memcpy_bw);
+                }
+                printf("}");
+            } else if (b->bytes_per_element > 0) {
+                printf("%-16s %12d %12.1f %12.1f %10.2f %7.0f%%\n", b->name, n, r.median_ns, r.p99_ns, gbps, 100 * gbps / memcpy_bw);
+            } else {
+                printf("%-16s %12d %12.1f %12.1f %10s %8s\n", b->name, n, r.median_ns, r.p99_ns, "-", "-");
+            }
+            fflush(stdout);
+            first = false;
+        }
+    }
+    if (json) { printf("\n]}\n"); }
+    return 0;
+}
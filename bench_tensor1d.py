@@ -0,0 +1,92 @@
+"""
+Benchmarks of the Python wrapper: the cost of going through tensor1d.py and
+cffi on top of the C call itself. Each op is timed through the Tensor API and
+as the bare lib call it ends up making, the difference is the overhead per
+call. The C side alone is covered by bench_tensor1d.c, run both with:
+
+    make bench BENCH_ARGS="--json"
+
+Options the C benchmark takes (like --max-size) are accepted and ignored.
+"""
+
+import argparse
+import json
+import statistics
+import time
+
+import tensor1d
+from tensor1d import lib
+
+SAMPLE_NS = 200_000  # each sample runs calls for about 0.2 ms
+SAMPLES = 200
+
+def time_calls(fn):
+    # median and 99th percentile ns per call of fn(), after a warmup
+    calls = 1
+    while True:
+        start = time.perf_counter_ns()
+        for _ in range(calls):
+            fn()
+        elapsed = time.perf_counter_ns() - start
+        if elapsed >= SAMPLE_NS:
+            break
+        calls *= 2
+    times = []
+    for _ in range(SAMPLES):
+        start = time.perf_counter_ns()
+        for _ in range(calls):
+            fn()
+        times.append((time.perf_counter_ns() - start) / calls)
+    times.sort()
+    return statistics.median(times), times[int(len(times) * 0.99)]
+
+def benchmarks():
+    # (name, size, through the wrapper, the bare C call)
+    small, big = tensor1d.arange(16), tensor1d.arange(1 << 20)
+    out_small, out_big = tensor1d.empty(16), tensor1d.empty(1 << 20)
+    s, b = small.tensor, big.tensor
+    index = tensor1d.tensor(list(range(0, 1 << 20, 1 << 10)), dtype="int32")
+    return [
+        ("getitem", 16, lambda: small[3].item(), lambda: lib.tensor_getitem(s, 3)),
+        ("item", 16, lambda: small.item(3), lambda: lib.tensor_getitem_f64(s, 3)),
+        ("gather", 1 << 10, lambda: big[index], lambda: lib.tensor_free(lib.tensor_gather(b, index.tensor))),
+        ("setitem", 16, lambda: small.__setitem__(3, 1.0), lambda: lib.tensor_setitem_f64(s, 3, 1.0)),
+        ("len", 16, lambda: len(small), lambda: s.size),
+        ("slice", 16, lambda: small[1:15], lambda: lib.tensor_free(lib.tensor_slice(s, 1, 15, 1))),
+        ("add", 16, lambda: small + small, lambda: lib.tensor_free(lib.tensor_add(s, s))),
+        ("add_out", 16, lambda: tensor1d.add(small, small, out=out_small),
+         lambda: lib.tensor_add_out(s, s, out_small.tensor)),
+        ("addf", 16, lambda: small + 1.0, lambda: lib.tensor_free(lib.tensor_addf(s, 1.0))),
+        ("sum", 16, lambda: small.sum(), lambda: lib.tensor_sum(s)),
+        ("tolist", 16, lambda: small.tolist(), lambda: lib.tensor_copy_to(s, tensor1d.ffi.new("float[]", 16))),
+        ("add", 1 << 20, lambda: big + big, lambda: lib.tensor_free(lib.tensor_add(b, b))),
+        ("add_out", 1 << 20, lambda: tensor1d.add(big, big, out=out_big),
+         lambda: lib.tensor_add_out(b, b, out_big.tensor)),
+        ("sum", 1 << 20, lambda: big.sum(), lambda: lib.tensor_sum(b)),
+    ]
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--json", action="store_true", help="print JSON instead of a table")
+    parser.add_argument("--filter", default="", help="only the benchmarks whose name contains this")
+    args, _ = parser.parse_known_args()
+
+    results = []
+    for name, size, wrapped, bare in benchmarks():
+        if args.filter not in name:
+            continue
+        median, p99 = time_calls(wrapped)
+        bare_median, _ = time_calls(bare)
+        results.append({"name": name, "size": size, "median_ns": round(median, 1), "p99_ns": round(p99, 1),
+                        "c_median_ns": round(bare_median, 1), "overhead_ns": round(median - bare_median, 1)})
+    if args.json:
+        print(json.dumps({"suite": "python", "backend": tensor1d.backend, "results": results}, indent=1))
+        return
+    print(f"backend: {tensor1d.backend}")
+    print(f"{'benchmark':<12} {'size':>10} {'median ns':>12} {'p99 ns':>12} {'C call ns':>12} {'overhead ns':>12}")
+    for r in results:
+        print(f"{r['name']:<12} {r['size']:>10} {r['median_ns']:>12.1f} {r['p99_ns']:>12.1f} "
+              f"{r['c_median_ns']:>12.1f} {r['overhead_ns']:>12.1f}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,46 @@
+"""
+Builds _tensor1d, the cffi API-mode (out-of-line) extension module that
+tensor1d.py uses when it is there: each function of tensor1d_cdef.py gets a C
+stub compiled against tensor1d.h, so a call from Python skips the libffi
+marshalling of the ABI mode, and only the module has to be found on sys.path
+(no libtensor1d.so next to the current directory). Run it with
+
+    make ext
+
+which passes the -D flags of the Makefile (NO_POOL=1, STATS=1, BLAS=1, NUMA=1)
+on to the compiler in CFLAGS, and the libraries in LDFLAGS.
+"""
+
+import os
+import shutil
+
+import cffi
+
+from tensor1d_cdef import CDEF
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# setuptools puts LDFLAGS before the objects, where the linker drops libraries
+# nothing has asked for yet, so the -l ones (e.g. -lnuma) are linked after them
+ldflags = os.environ.get("LDFLAGS", "").split()
+os.environ["LDFLAGS"] = " ".join(flag for flag in ldflags if not flag.startswith("-l"))
+libraries = ["m"] + [flag[2:] for flag in ldflags if flag.startswith("-l") and flag != "-lm"]
+
+ffibuilder = cffi.FFI()
+ffibuilder.cdef(CDEF)
+ffibuilder.set_source(
+    "_tensor1d",
+    '#include "tensor1d.h"',
+    sources=[os.path.join(here, "tensor1d.c")],
+    include_dirs=[here],
+    define_macros=[("TENSOR1D_NO_MAIN", None)],
+    # CFLAGS and LDFLAGS in the environment are added by setuptools
+    extra_compile_args=["-O3", "-fno-trapping-math", "-fno-math-errno", "-pthread"],
+    extra_link_args=["-pthread"],
+    libraries=libraries,
+)
+
+if __name__ == "__main__":
+    # the generated C and the objects stay in build/, the module goes next to tensor1d.py
+    module = ffibuilder.compile(tmpdir=os.path.join(here, "build"))
+    shutil.copy(module, here)
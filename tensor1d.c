@@ -1,11 +1,11 @@
 /*
-Implements a 1-dimensional Tensor, similar to torch.Tensor.
+Implements a 1-dimensional Tensor (with N-dimensional views), similar to torch.Tensor.
 
 Compile and run like:
-gcc -Wall -O3 tensor1d.c -o tensor1d && ./tensor1d
+gcc -Wall -O3 -fno-trapping-math -fno-math-errno -pthread tensor1d.c -o tensor1d -lm && ./tensor1d
 
 Or create .so for use with cffi:
-gcc -O3 -shared -fPIC -o libtensor1d.so tensor1d.c
+gcc -O3 -fno-trapping-math -fno-math-errno -pthread -shared -fPIC -o libtensor1d.so tensor1d.c -lm
 */
 
 #include <stdlib.h>
@@ -13,6 +13,31 @@ gcc -O3 -shared -fPIC -o libtensor1d.so tensor1d.c
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#ifdef TENSOR1D_BLAS
+#include <cblas.h>
+#endif
+#ifdef TENSOR1D_NUMA
+#include <numa.h>
+#endif
 #include "tensor1d.h"
 
 // ----------------------------------------------------------------------------
@@ -28,241 +53,6507 @@ void *malloc_check(size_t size, const char *file, int line) {
 }
 #define mallocCheck(size) malloc_check(size, __FILE__, __LINE__)
 
+void *aligned_malloc_check(size_t alignment, size_t size, const char *file, int line) {
+    // aligned_alloc wants the size to be a multiple of the alignment
+    size = (size + alignment - 1) / alignment * alignment;
+    void *ptr = aligned_alloc(alignment, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed at %s:%d\n", file, line);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+#define alignedMallocCheck(alignment, size) aligned_malloc_check(alignment, size, __FILE__, __LINE__)
+
+// ----------------------------------------------------------------------------
+// pool allocator
+// Tensors and Storages are created and destroyed at a high rate (every t[i] from
+// Python is a new 1-element Tensor view), so instead of going to malloc/free
+// every time we keep freed blocks on free lists and hand them out again.
+// Tensor headers have one free list, and Storages (header and data live in one
+// block) are binned into power-of-two size classes of their float capacity.
+// Storages above the largest class go straight to malloc. Compile with
+// -DTENSOR1D_NO_POOL to turn the pool off, e.g. for ASan runs, where recycled
+// blocks would hide use-after-free bugs.
+// The free lists and stats are per thread, so the hot path takes no locks. A
+// block freed on another thread than the one that allocated it simply joins
+// the freeing thread's lists, and a thread's lists are released when it exits.
+
+#define POOL_MIN_CLASS 4          // smallest Storage class: 2^4 = 16 floats
+#define POOL_MAX_CLASS 20         // largest Storage class: 2^20 floats = 4MB
+#define POOL_MAX_BLOCKS 64        // max number of free blocks kept on each free list
+#define POOL_MAX_BYTES (64 << 20) // max bytes kept on all free lists of a thread
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct {
+    PoolBlock* head;
+    int count;
+} FreeList;
+
+_Thread_local FreeList pool_tensor_headers = { NULL, 0 };
+_Thread_local FreeList pool_storages[POOL_MAX_CLASS + 1];
+_Thread_local PoolStats pool_stats = { 0, 0, 0, 0 };
+_Thread_local bool pool_thread_registered = false;
+pthread_key_t pool_thread_key;
+pthread_once_t pool_thread_key_once = PTHREAD_ONCE_INIT;
+
+void pool_thread_exit(void* arg) {
+    tensor_pool_trim();
+}
+
+void pool_thread_key_create(void) {
+    pthread_key_create(&pool_thread_key, pool_thread_exit);
+}
+
+// on the first push of each thread, arrange for its lists to be released when it exits
+void pool_register_thread(void) {
+    pthread_once(&pool_thread_key_once, pool_thread_key_create);
+    pthread_setspecific(pool_thread_key, &pool_thread_registered); // any non-NULL value
+    pool_thread_registered = true;
+}
+
+// take a block off the free list, or return NULL if the caller has to allocate
+void* pool_pop(FreeList* list, size_t bytes) {
+#ifndef TENSOR1D_NO_POOL
+    if (list != NULL && list->head != NULL) {
+        PoolBlock* block = list->head;
+        list->head = block->next;
+        list->count--;
+        pool_stats.hits++;
+        pool_stats.bytes_held -= bytes;
+        return block;
+    }
+#endif
+    pool_stats.misses++;
+    return NULL;
+}
+
+// put a block on the free list, or return false if the caller has to free it
+bool pool_push(FreeList* list, void* ptr, size_t bytes) {
+#ifndef TENSOR1D_NO_POOL
+    if (list != NULL && list->count < POOL_MAX_BLOCKS && pool_stats.bytes_held + bytes <= POOL_MAX_BYTES) {
+        if (!pool_thread_registered) { pool_register_thread(); }
+        PoolBlock* block = ptr;
+        block->next = list->head;
+        list->head = block;
+        list->count++;
+        pool_stats.bytes_held += bytes;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void* pool_alloc(FreeList* list, size_t bytes) {
+    void* ptr = pool_pop(list, bytes);
+    return ptr != NULL ? ptr : mallocCheck(bytes);
+}
+
+void pool_free(FreeList* list, void* ptr, size_t bytes) {
+    if (!pool_push(list, ptr, bytes)) { free(ptr); }
+}
+
+// size class of a Storage of the given float capacity, or -1 if it is too big to be pooled
+int pool_storage_class(int size) {
+    int c = POOL_MIN_CLASS;
+    while (c <= POOL_MAX_CLASS && (1 << c) < size) { c++; }
+    return c <= POOL_MAX_CLASS ? c : -1;
+}
+
+void pool_trim_list(FreeList* list, size_t bytes) {
+    while (list->head != NULL) {
+        PoolBlock* block = list->head;
+        list->head = block->next;
+        free(block);
+        pool_stats.bytes_held -= bytes;
+    }
+    list->count = 0;
+}
+
+size_t storage_block_bytes(int size); // defined with Storage below
+void arena_trim(void); // defined with the arena allocator below
+
+// release every block cached by the calling thread back to malloc
+void tensor_pool_trim(void) {
+    pool_trim_list(&pool_tensor_headers, sizeof(Tensor));
+    for (int c = POOL_MIN_CLASS; c <= POOL_MAX_CLASS; c++) {
+        pool_trim_list(&pool_storages[c], storage_block_bytes(1 << c));
+    }
+    arena_trim();
+}
+
+void tensor_pool_stats(PoolStats* stats) {
+    *stats = pool_stats;
+#ifdef TENSOR1D_NO_POOL
+    stats->enabled = false;
+#else
+    stats->enabled = true;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// arena allocator
+// Between tensor_arena_begin and tensor_arena_end, the new Tensor headers and
+// Storages of the calling thread are bump-allocated from an arena instead of
+// the pool: allocating is a pointer increment in a big chunk, freeing only
+// counts the object as dead, and all the chunks go back to malloc at once when
+// the scope ends. This suits temporaries, e.g. the intermediates of a loss.
+// Scopes nest, and allocations come from the innermost one. A result that has
+// to outlive its scope is copied out with tensor_arena_promote. Anything of a
+// scope that is still referenced at its end escaped: tensor_arena_end returns
+// how many, and the chunks are kept until the last of them is freed, so they
+// never dangle. With -DTENSOR1D_NO_POOL every allocation gets a chunk of its
+// own, so that ASan still sees the end of each one.
+
+#define ARENA_CHUNK_BYTES (256 << 10) // allocations above a quarter of it get a chunk of their own
+#define ARENA_ALIGNMENT 64            // of the chunks, the most an allocation can ask for
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t capacity; // bytes after the header
+} ArenaChunk;
+
+#define ARENA_CHUNK_HEADER_BYTES ((sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+
+struct Arena {
+    Arena* parent; // the enclosing scope, NULL for the outermost one
+    ArenaChunk* chunks; // allocations are bumped in the first one
+    atomic_int live; // objects of it not freed yet, plus one while the scope is open
+};
+
+_Thread_local Arena* arena_current = NULL;
+// a chunk of the last arena released on this thread, kept for the next one
+// (like the pool's free lists) so that a short scope doesn't go to mmap for it
+_Thread_local ArenaChunk* arena_spare_chunk = NULL;
+
+ArenaChunk* arena_chunk_new(size_t capacity) {
+#ifndef TENSOR1D_NO_POOL
+    if (capacity == ARENA_CHUNK_BYTES && arena_spare_chunk != NULL) {
+        ArenaChunk* chunk = arena_spare_chunk;
+        arena_spare_chunk = NULL;
+        return chunk;
+    }
+#endif
+    ArenaChunk* chunk = alignedMallocCheck(ARENA_ALIGNMENT, ARENA_CHUNK_HEADER_BYTES + capacity);
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+void arena_chunk_free(ArenaChunk* chunk) {
+#ifndef TENSOR1D_NO_POOL
+    if (chunk->capacity == ARENA_CHUNK_BYTES && arena_spare_chunk == NULL) {
+        if (!pool_thread_registered) { pool_register_thread(); }
+        arena_spare_chunk = chunk;
+        return;
+    }
+#endif
+    free(chunk);
+}
+
+void* arena_alloc(Arena* arena, size_t bytes, size_t alignment) {
+    assert(alignment <= ARENA_ALIGNMENT);
+    ArenaChunk* chunk = arena->chunks;
+    size_t start = chunk != NULL ? (chunk->used + alignment - 1) / alignment * alignment : 0;
+    if (chunk == NULL || start + bytes > chunk->capacity) {
+#ifdef TENSOR1D_NO_POOL
+        size_t capacity = bytes;
+#else
+        size_t capacity = bytes > ARENA_CHUNK_BYTES / 4 ? bytes : ARENA_CHUNK_BYTES;
+#endif
+        chunk = arena_chunk_new(capacity);
+        if (capacity == bytes && arena->chunks != NULL) {
+            // a chunk of its own, keep bumping in the current one
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+        start = 0;
+    }
+    chunk->used = start + bytes;
+    atomic_fetch_add_explicit(&arena->live, 1, memory_order_relaxed);
+    return (char*) chunk + ARENA_CHUNK_HEADER_BYTES + start;
+}
+
+// drops one object of the arena (or its open scope), the last one frees the
+// arena. Objects can be freed on any thread, e.g. the inputs of an async op.
+int arena_release(Arena* arena) {
+    int live = atomic_fetch_sub_explicit(&arena->live, 1, memory_order_acq_rel) - 1;
+    if (live == 0) {
+        while (arena->chunks != NULL) {
+            ArenaChunk* chunk = arena->chunks;
+            arena->chunks = chunk->next;
+            arena_chunk_free(chunk);
+        }
+        free(arena);
+    }
+    return live;
+}
+
+void arena_trim(void) {
+    free(arena_spare_chunk);
+    arena_spare_chunk = NULL;
+}
+
+void tensor_arena_begin(void) {
+    Arena* arena = mallocCheck(sizeof(Arena));
+    arena->parent = arena_current;
+    arena->chunks = NULL;
+    atomic_init(&arena->live, 1);
+    arena_current = arena;
+}
+
+// Ends the innermost scope of the calling thread and returns the number of its
+// Tensors and Storages that escaped it (0 if its memory was released), or -1
+// if there is no open scope
+int tensor_arena_end(void) {
+    Arena* arena = arena_current;
+    if (arena == NULL) {
+        fprintf(stderr, "ValueError: tensor_arena_end without a tensor_arena_begin\n");
+        return -1;
+    }
+    arena_current = arena->parent;
+    return arena_release(arena);
+}
+
+// Tensor headers come from the arena of the current scope if there is one, from the pool otherwise
+Tensor* tensor_header_alloc(void) {
+    Arena* arena = arena_current;
+    Tensor* t = arena != NULL ? arena_alloc(arena, sizeof(Tensor), _Alignof(Tensor))
+                              : pool_alloc(&pool_tensor_headers, sizeof(Tensor));
+    t->arena = arena;
+    return t;
+}
+
+void tensor_header_free(Tensor* t) {
+    if (t->arena != NULL) {
+        arena_release(t->arena);
+    } else {
+        pool_free(&pool_tensor_headers, t, sizeof(Tensor));
+    }
+}
+
+// ----------------------------------------------------------------------------
+// instrumentation
+// Built with -DTENSOR1D_STATS (make STATS=1), the library counts the calls of
+// each op and the time spent in them, the live Tensors and Storages and the
+// bytes they hold, and at exit reports the Storages that were never freed.
+// Without it all of this compiles to nothing. The counters are global and
+// atomic, so they cover all threads. Only the outermost instrumented op of a
+// call counts (the depth is per thread), so an op isn't also counted as the
+// other ops it is made of.
+
+const char* stats_op_names[STATS_OP_COUNT] = {
+    "empty", "arange", "from_array", "getitem", "setitem", "gather", "scatter", "fill", "copy",
+    "slice", "select", "view", "contiguous", "clone", "to_dtype", "add", "addf",
+    "binary", "unary", "fma", "clamp", "where", "eval", "reduce", "scan", "sort", "dot", "matmul",
+    "to_string", "save", "load",
+};
+
+const char* tensor_stats_op_name(int op) {
+    return op >= 0 && op < STATS_OP_COUNT ? stats_op_names[op] : "unknown";
+}
+
+#ifdef TENSOR1D_STATS
+
+typedef struct {
+    atomic_llong count;
+    atomic_llong total_ns;
+} OpCounters;
+
+OpCounters stats_ops[STATS_OP_COUNT];
+atomic_llong stats_live_tensors;
+atomic_llong stats_live_storages;
+atomic_llong stats_live_bytes;
+atomic_llong stats_peak_bytes;
+atomic_llong stats_storages_allocated;
+_Thread_local int stats_depth = 0;
+
+long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// times an op from STATS_OP to the end of the enclosing scope
+typedef struct {
+    int op; // -1 if nested in another op
+    long long start;
+} StatsTimer;
+
+StatsTimer stats_timer_begin(int op) {
+    StatsTimer timer = { -1, 0 };
+    if (stats_depth++ == 0) {
+        timer.op = op;
+        timer.start = stats_now_ns();
+    }
+    return timer;
+}
+
+void stats_timer_end(StatsTimer* timer) {
+    stats_depth--;
+    if (timer->op < 0) { return; }
+    atomic_fetch_add_explicit(&stats_ops[timer->op].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats_ops[timer->op].total_ns, stats_now_ns() - timer->start, memory_order_relaxed);
+}
+
+#define STATS_OP(op) StatsTimer stats_timer __attribute__((cleanup(stats_timer_end))) = stats_timer_begin(op)
+#define STATS_TENSOR_ADD(delta) atomic_fetch_add_explicit(&stats_live_tensors, delta, memory_order_relaxed)
+
+// The live Storages, for the leak report: an open-addressing hash set of
+// pointers (with tombstones), under a lock. It's only in stats builds.
+#define STATS_TOMBSTONE ((Storage*) 1)
+
+typedef struct {
+    Storage** slots;
+    size_t capacity; // a power of two
+    size_t used;     // live entries plus tombstones
+} StorageSet;
+
+StorageSet stats_storages = { NULL, 0, 0 };
+pthread_mutex_t stats_storages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t storage_set_slot(const StorageSet* set, const Storage* s) {
+    uintptr_t h = (uintptr_t) s;
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (size_t) (h >> 16) & (set->capacity - 1);
+}
+
+void storage_set_grow(StorageSet* set) {
+    size_t capacity = set->capacity ? 2 * set->capacity : 1024;
+    StorageSet grown = { calloc(capacity, sizeof(Storage*)), capacity, 0 };
+    for (size_t i = 0; i < set->capacity; i++) {
+        Storage* s = set->slots[i];
+        if (s == NULL || s == STATS_TOMBSTONE) { continue; }
+        size_t j = storage_set_slot(&grown, s);
+        while (grown.slots[j] != NULL) { j = (j + 1) & (grown.capacity - 1); }
+        grown.slots[j] = s;
+        grown.used++;
+    }
+    free(set->slots);
+    *set = grown;
+}
+
+void storage_set_add(StorageSet* set, Storage* s) {
+    if (2 * (set->used + 1) > set->capacity) { storage_set_grow(set); }
+    size_t j = storage_set_slot(set, s);
+    while (set->slots[j] != NULL) { j = (j + 1) & (set->capacity - 1); } // reuses no tombstones
+    set->slots[j] = s;
+    set->used++;
+}
+
+void storage_set_remove(StorageSet* set, Storage* s) {
+    if (set->capacity == 0) { return; }
+    size_t j = storage_set_slot(set, s);
+    while (set->slots[j] != NULL) {
+        if (set->slots[j] == s) {
+            set->slots[j] = STATS_TOMBSTONE;
+            return;
+        }
+        j = (j + 1) & (set->capacity - 1);
+    }
+}
+
+long long storage_bytes(Storage* s) {
+    return (long long) s->data_size * tensor_dtype_size(s->dtype);
+}
+
+void stats_storage_new(Storage* s) {
+    long long bytes = storage_bytes(s);
+    atomic_fetch_add_explicit(&stats_storages_allocated, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats_live_storages, 1, memory_order_relaxed);
+    long long live = atomic_fetch_add_explicit(&stats_live_bytes, bytes, memory_order_relaxed) + bytes;
+    long long peak = atomic_load_explicit(&stats_peak_bytes, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&stats_peak_bytes, &peak, live,
+                                                                 memory_order_relaxed, memory_order_relaxed)) {}
+    pthread_mutex_lock(&stats_storages_lock);
+    storage_set_add(&stats_storages, s);
+    pthread_mutex_unlock(&stats_storages_lock);
+}
+
+void stats_storage_free(Storage* s) {
+    atomic_fetch_sub_explicit(&stats_live_storages, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&stats_live_bytes, storage_bytes(s), memory_order_relaxed);
+    pthread_mutex_lock(&stats_storages_lock);
+    storage_set_remove(&stats_storages, s);
+    pthread_mutex_unlock(&stats_storages_lock);
+}
+
+#else
+
+#define STATS_OP(op) ((void) 0)
+#define STATS_TENSOR_ADD(delta) ((void) 0)
+#define stats_storage_new(s) ((void) 0)
+#define stats_storage_free(s) ((void) 0)
+
+#endif
+
+void tensor_stats(TensorStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef TENSOR1D_STATS
+    stats->enabled = true;
+    stats->live_tensors = atomic_load(&stats_live_tensors);
+    stats->live_storages = atomic_load(&stats_live_storages);
+    stats->live_bytes = atomic_load(&stats_live_bytes);
+    stats->peak_bytes = atomic_load(&stats_peak_bytes);
+    stats->storages_allocated = atomic_load(&stats_storages_allocated);
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+        stats->ops[op].count = atomic_load(&stats_ops[op].count);
+        stats->ops[op].total_ns = atomic_load(&stats_ops[op].total_ns);
+    }
+#endif
+}
+
+// zeroes the op counters and sets the peak back to the bytes live now
+void tensor_stats_reset(void) {
+#ifdef TENSOR1D_STATS
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+        atomic_store(&stats_ops[op].count, 0);
+        atomic_store(&stats_ops[op].total_ns, 0);
+    }
+    atomic_store(&stats_storages_allocated, 0);
+    atomic_store(&stats_peak_bytes, atomic_load(&stats_live_bytes));
+#endif
+}
+
+// Writes a line for each Storage still alive (some reference to it was never
+// dropped) and returns how many there are. 0, and nothing written, without
+// TENSOR1D_STATS.
+int tensor_leak_report(FILE* file) {
+    int leaks = 0;
+#ifdef TENSOR1D_STATS
+    pthread_mutex_lock(&stats_storages_lock);
+    for (size_t i = 0; i < stats_storages.capacity; i++) {
+        Storage* s = stats_storages.slots[i];
+        if (s == NULL || s == STATS_TOMBSTONE) { continue; }
+        if (leaks++ < 20) {
+            fprintf(file, "  Storage %p: %d %s elements (%lld bytes), ref_count %d\n", (void*) s, s->data_size,
+                    tensor_dtype_name(s->dtype), storage_bytes(s), atomic_load(&s->ref_count));
+        }
+    }
+    pthread_mutex_unlock(&stats_storages_lock);
+    if (leaks > 20) { fprintf(file, "  ... and %d more\n", leaks - 20); }
+#endif
+    return leaks;
+}
+
+#ifdef TENSOR1D_STATS
+__attribute__((destructor))
+void stats_exit(void) {
+    long long live = atomic_load(&stats_live_storages);
+    if (live == 0) { return; }
+    fprintf(stderr, "tensor1d: %lld Storages (%lld bytes) were never freed:\n", live, atomic_load(&stats_live_bytes));
+    tensor_leak_report(stderr);
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// utils
+
+int ceil_div(int a, int b) {
+    // integer division that rounds up, i.e. ceil(a / b)
+    return (a + b - 1) / b;
+}
+
+int min(int a, int b) {
+    return (a < b) ? a : b;
+}
+
+int max(int a, int b) {
+    return (a > b) ? a : b;
+}
+
+// ----------------------------------------------------------------------------
+// dtypes
+// float32 is the native dtype: its elementwise ops and reductions run on the
+// (SIMD) kernels below. Every dtype, float32 included, also gets a set of typed
+// converters generated by DTYPE_LIST, so no inner loop switches on the dtype:
+// load_<dtype> reads a (strided) run of elements into doubles, dequantizing
+// int8 on the way, load_f32_<dtype> does the same into floats, and
+// store_<dtype> writes doubles back, rounding to nearest even (and
+// saturating for int8). Ops on the other dtypes work block by block through
+// small double buffers: all values of all dtypes are exact in a double, and a
+// double has more than twice the bits of the floating point dtypes, so adding
+// in double and rounding once on the store gives the same result as adding in
+// the dtype itself.
+
+#define DTYPE_BLOCK 256 // elements converted at a time
+
+uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    return bits;
+}
+
+float bits_float(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+float f16_to_f32(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        float val = (float) mantissa * 0x1p-24f; // zero or subnormal
+        return sign ? -val : val;
+    }
+    if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13); // inf or NaN
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+// rounds to nearest even, like the hardware conversions do
+uint16_t f32_to_f16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t a = x & 0x7fffffff;
+    if (a > 0x7f800000) { return sign | 0x7e00 | ((a >> 13) & 0x3ff); } // NaN stays NaN
+    if (a >= 0x477ff000) { return sign | 0x7c00; } // at least 65520 rounds to inf
+    uint32_t h, rem, halfway;
+    if (a >= 0x38800000) { // a normal half: drop 13 mantissa bits and rebias the exponent
+        h = (a - 0x38000000) >> 13;
+        rem = a & 0x1fff;
+        halfway = 0x1000;
+    } else if (a > 0x33000000) { // a subnormal half: shift in the implicit bit
+        int shift = 126 - (int) (a >> 23);
+        uint32_t m = (a & 0x7fffff) | 0x800000;
+        h = m >> shift;
+        rem = m & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        return sign; // at most 2^-25, which rounds (to even) to zero
+    }
+    // a carry out of the mantissa correctly bumps the exponent
+    if (rem > halfway || (rem == halfway && (h & 1))) { h++; }
+    return sign | (uint16_t) h;
+}
+
+float bf16_to_f32(uint16_t h) {
+    uint32_t bits = (uint32_t) h << 16;
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+uint16_t f32_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    if ((x & 0x7fffffff) > 0x7f800000) { return (uint16_t) ((x >> 16) | 0x40); } // NaN stays NaN
+    x += 0x7fff + ((x >> 16) & 1); // round to nearest even
+    return (uint16_t) (x >> 16);
+}
+
+// x rounded to a float with round-to-odd: an inexact result gets its last bit
+// set. Rounding that to a 16-bit float (to nearest) then gives the correctly
+// rounded x, which rounding to nearest twice does not always do.
+float f64_to_f32_odd(double x) {
+    float f = (float) x;
+    if ((double) f == x || x != x) { return f; }
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    if (fabs((double) f) > fabs(x)) { bits--; } // truncate towards zero
+    bits |= 1;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+// truncates like a C cast, and wraps around like int32 arithmetic; NaN gives 0
+int32_t f64_to_i32(double x) {
+    int64_t v = fabs(x) < 9.2e18 ? (int64_t) x : 0;
+    return (int32_t) (uint32_t) (uint64_t) v;
+}
+
+// rounds to nearest even and saturates, NaN gives 0
+int8_t f64_to_i8(double x) {
+    if (x != x) { return 0; }
+    double q = nearbyint(x);
+    return (int8_t) (q < -128.0 ? -128.0 : q > 127.0 ? 127.0 : q);
+}
+
+// X(name, dtype, element type, LOAD: double from element v, STORE: element from double x)
+#define DTYPE_LIST(X) \
+    X(float32, DTYPE_FLOAT32, float, (double) v, (float) x) \
+    X(float64, DTYPE_FLOAT64, double, v, x) \
+    X(float16, DTYPE_FLOAT16, uint16_t, (double) f16_to_f32(v), f32_to_f16(f64_to_f32_odd(x))) \
+    X(bfloat16, DTYPE_BFLOAT16, uint16_t, (double) bf16_to_f32(v), f32_to_bf16(f64_to_f32_odd(x))) \
+    X(int32, DTYPE_INT32, int32_t, (double) v, f64_to_i32(x)) \
+    X(int8, DTYPE_INT8, int8_t, (double) v * scale, f64_to_i8(x / scale))
+
+#define X(name, dtype, T, LOAD, STORE) \
+    void load_##name(double* out, const void* src, int stride, int n, float scale) { \
+        const T* a = src; \
+        for (int i = 0; i < n; i++) { T v = a[(ptrdiff_t) i * stride]; out[i] = LOAD; } \
+    } \
+    void load_f32_##name(float* out, const void* src, int stride, int n, float scale) { \
+        const T* a = src; \
+        for (int i = 0; i < n; i++) { T v = a[(ptrdiff_t) i * stride]; out[i] = (float) (LOAD); } \
+    } \
+    void store_##name(void* dst, int stride, const double* in, int n, float scale) { \
+        T* o = dst; \
+        for (int i = 0; i < n; i++) { double x = in[i]; o[(ptrdiff_t) i * stride] = STORE; } \
+    }
+DTYPE_LIST(X)
+#undef X
+
+typedef struct {
+    const char* name;
+    int size; // bytes per element
+    void (*load)(double* out, const void* src, int stride, int n, float scale);
+    void (*load_f32)(float* out, const void* src, int stride, int n, float scale);
+    void (*store)(void* dst, int stride, const double* in, int n, float scale);
+} DTypeInfo;
+
+#define X(name, dtype, T, LOAD, STORE) [dtype] = { #name, sizeof(T), load_##name, load_f32_##name, store_##name },
+const DTypeInfo dtype_info[DTYPE_COUNT] = { DTYPE_LIST(X) };
+#undef X
+
+bool dtype_valid(int dtype) {
+    return dtype >= 0 && dtype < DTYPE_COUNT;
+}
+
+const char* tensor_dtype_name(int dtype) {
+    return dtype_valid(dtype) ? dtype_info[dtype].name : "unknown";
+}
+
+int tensor_dtype_size(int dtype) {
+    return dtype_valid(dtype) ? dtype_info[dtype].size : 0;
+}
+
+// address of element i of a run that starts at base, in elements of dtype
+void* element_ptr(const void* base, ptrdiff_t i, int dtype) {
+    return (char*) base + i * dtype_info[dtype].size;
+}
+
+// copies n elements of elsize bytes between runs with the given strides (in elements)
+void copy_elements(void* dst, int dst_stride, const void* src, int src_stride, int n, int elsize) {
+    char* d = dst;
+    const char* s = src;
+    for (int i = 0; i < n; i++) {
+        memcpy(d + (ptrdiff_t) i * dst_stride * elsize, s + (ptrdiff_t) i * src_stride * elsize, elsize);
+    }
+}
+
+// The dtype of t1 + t2, like torch.promote_types: the wider one if both are
+// floating point (float16 with bfloat16 gives float32), the floating point one
+// if only one of them is. int8 counts as float32, since it gets dequantized.
+int tensor_promote_types(int dtype1, int dtype2) {
+    if (dtype1 == DTYPE_INT8) { dtype1 = DTYPE_FLOAT32; }
+    if (dtype2 == DTYPE_INT8) { dtype2 = DTYPE_FLOAT32; }
+    if (dtype1 == dtype2) { return dtype1; }
+    if (dtype1 == DTYPE_INT32) { return dtype2; }
+    if (dtype2 == DTYPE_INT32) { return dtype1; }
+    if (dtype1 == DTYPE_FLOAT64 || dtype2 == DTYPE_FLOAT64) { return DTYPE_FLOAT64; }
+    return DTYPE_FLOAT32;
+}
+
+// the dtype of t + a float scalar: integers give float32, like in PyTorch
+int scalar_result_dtype(int dtype) {
+    return dtype == DTYPE_INT32 || dtype == DTYPE_INT8 ? DTYPE_FLOAT32 : dtype;
+}
+
+// ----------------------------------------------------------------------------
+// Storage: simple array of elements of one dtype, defensive on index access, reference-counted
+// The reference counting allows multiple Tensors sharing the same Storage.
+// similar to torch.Storage
+// The header and the data live in a single allocation, with the data starting
+// at the next 64-byte boundary after the header: one malloc per Storage, no
+// extra pointer chase to a separate buffer, and the data is aligned to a cache
+// line (and the AVX-512 vector width). Storage::data points at that inline data.
+
+#define STORAGE_ALIGNMENT 64
+#define STORAGE_HEADER_BYTES ((sizeof(Storage) + STORAGE_ALIGNMENT - 1) / STORAGE_ALIGNMENT * STORAGE_ALIGNMENT)
+
+// bytes of the single block holding the header and `size` floats
+size_t storage_block_bytes(int size) {
+    return STORAGE_HEADER_BYTES + (size_t) size * sizeof(float);
+}
+
+// pool size class of a Storage of `size` elements of dtype: the classes count
+// floats, so other dtypes are rounded up to whole floats
+int storage_class(int size, int dtype) {
+    size_t bytes = (size_t) size * dtype_info[dtype].size;
+    if (bytes > ((size_t) sizeof(float) << POOL_MAX_CLASS)) { return -1; }
+    return pool_storage_class((int) ((bytes + sizeof(float) - 1) / sizeof(float)));
+}
+
+void* storage_map_large(size_t bytes, int size, int dtype, size_t* mapped_bytes); // defined with the thread pool below
+
+Storage* storage_new_dtype(int size, int dtype) {
+    assert(size >= 0 && dtype_valid(dtype));
+    Arena* arena = arena_current;
+    Storage* storage;
+    size_t mapped_bytes = 0;
+    if (arena != NULL) {
+        storage = arena_alloc(arena, STORAGE_HEADER_BYTES + (size_t) size * dtype_info[dtype].size, STORAGE_ALIGNMENT);
+    } else {
+        // pooled Storages round their capacity up to the size class
+        int c = storage_class(size, dtype);
+        size_t bytes = c >= 0 ? storage_block_bytes(1 << c) : STORAGE_HEADER_BYTES + (size_t) size * dtype_info[dtype].size;
+        FreeList* list = c >= 0 ? &pool_storages[c] : NULL;
+        storage = pool_pop(list, bytes);
+        // too big for the pool: mapped, if it is placed on NUMA nodes or backed by huge pages
+        if (storage == NULL && c < 0) { storage = storage_map_large(bytes, size, dtype, &mapped_bytes); }
+        if (storage == NULL) { storage = alignedMallocCheck(STORAGE_ALIGNMENT, bytes); }
+    }
+    storage->data = (char*) storage + STORAGE_HEADER_BYTES;
+    storage->data_size = size;
+    atomic_init(&storage->ref_count, 1);
+    storage->shared = false;
+    storage->owns_data = true;
+    storage->readonly = false;
+    storage->deleter = NULL;
+    storage->deleter_ctx = NULL;
+    storage->dtype = dtype;
+    storage->scale = 1.0f;
+    storage->copy_on_write = false;
+    storage->compact_below = 0.0f;
+    storage->views = NULL;
+    storage->arena = arena;
+    storage->mapped_bytes = mapped_bytes;
+    stats_storage_new(storage);
+    return storage;
+}
+
+Storage* storage_new(int size) {
+    return storage_new_dtype(size, DTYPE_FLOAT32);
+}
+
+// A Storage over memory the library does not own (e.g. a NumPy array), so no
+// copy is made. The header is a separate allocation, and when the last
+// reference goes away deleter(deleter_ctx) is called (if not NULL) to let the
+// owner release the memory. The memory has to stay valid until then.
+Storage* storage_new_external(void* data, int size, int dtype, void (*deleter)(void*), void* deleter_ctx) {
+    assert(size >= 0 && dtype_valid(dtype));
+    Storage* storage = mallocCheck(sizeof(Storage));
+    storage->data = data;
+    storage->data_size = size;
+    atomic_init(&storage->ref_count, 1);
+    storage->shared = false;
+    storage->owns_data = false;
+    storage->readonly = false;
+    storage->deleter = deleter;
+    storage->deleter_ctx = deleter_ctx;
+    storage->dtype = dtype;
+    storage->scale = 1.0f;
+    storage->copy_on_write = false;
+    storage->compact_below = 0.0f;
+    storage->views = NULL;
+    storage->arena = NULL;
+    storage->mapped_bytes = 0;
+    stats_storage_new(storage);
+    return storage;
+}
+
+// element access converts from/to double, which is exact for every dtype
+double storage_getitem(Storage* s, int idx) {
+    assert(idx >= 0 && idx < s->data_size);
+    if (s->dtype == DTYPE_FLOAT32) { return ((float*) s->data)[idx]; }
+    double val;
+    dtype_info[s->dtype].load(&val, element_ptr(s->data, idx, s->dtype), 1, 1, s->scale);
+    return val;
+}
+
+void storage_setitem(Storage* s, int idx, double val) {
+    assert(idx >= 0 && idx < s->data_size);
+    if (s->dtype == DTYPE_FLOAT32) {
+        ((float*) s->data)[idx] = (float) val;
+        return;
+    }
+    dtype_info[s->dtype].store(element_ptr(s->data, idx, s->dtype), 1, &val, 1, s->scale);
+}
+
+// Reference counting is thread-safe once a Storage is marked as shared (see
+// tensor_share), which has to happen before it is handed to another thread.
+// Until then it is only ever touched by one thread, so we skip the atomic
+// read-modify-write (a locked instruction on x86) and do a plain load + store.
+// atomic_int is identical in size and alignment to int, which is what the
+// cffi cdef in tensor1d.py declares.
+
+// returns the new reference count
+int refcount_add(atomic_int* count, int delta, bool shared) {
+    if (shared) {
+        // increments need no ordering. A decrement releases this thread's writes,
+        // and the one that drops the count to zero (and frees) has to acquire
+        // the writes of every thread that decremented before it
+        memory_order order = delta > 0 ? memory_order_relaxed : memory_order_acq_rel;
+        return atomic_fetch_add_explicit(count, delta, order) + delta;
+    }
+    int n = atomic_load_explicit(count, memory_order_relaxed) + delta;
+    atomic_store_explicit(count, n, memory_order_relaxed);
+    return n;
+}
+
+void storage_incref(Storage* s) {
+    refcount_add(&s->ref_count, 1, s->shared);
+}
+
+void storage_decref(Storage* s) {
+    if (refcount_add(&s->ref_count, -1, s->shared) == 0) {
+        stats_storage_free(s);
+        if (!s->owns_data) {
+            if (s->deleter != NULL) { s->deleter(s->deleter_ctx); }
+            free(s);
+            return;
+        }
+        if (s->arena != NULL) {
+            arena_release(s->arena);
+            return;
+        }
+        if (s->mapped_bytes > 0) {
+            munmap(s, s->mapped_bytes);
+            return;
+        }
+        int c = storage_class(s->data_size, s->dtype);
+        if (c < 0 || !pool_push(&pool_storages[c], s, storage_block_bytes(1 << c))) {
+            free(s);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// elementwise kernels
+// These run directly over the raw floats of a Storage, so the inner loops carry
+// no index wrapping, bounds checks or asserts and the compiler can vectorize
+// them. The caller validates the view (offset/size/stride) once, up front.
+
+void kernel_addf_contiguous(float* out, const float* a, float val, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + val;
+    }
+}
+
+void kernel_addf_strided(float* out, int out_stride, const float* a, int a_stride, float val, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i * out_stride] = a[i * a_stride] + val;
+    }
+}
+
+void kernel_add_contiguous(float* out, const float* a, const float* b, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+void kernel_add_strided(float* out, int out_stride, const float* a, int a_stride,
+                        const float* b, int b_stride, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i * out_stride] = a[i * a_stride] + b[i * b_stride];
+    }
+}
+
+// Math kernels: float32 sub/mul/div, exp/log/tanh/sigmoid/sqrt and fma/axpy.
+// The transcendental functions are polynomial approximations (from Cephes)
+// written without branches or libm calls, with the special cases handled by
+// selects, so the loops over them vectorize like the add kernels do. Their
+// max errors against the exact result, measured on every third float32 bit
+// pattern and every ISA (SIMD versions differ by FMA contraction only):
+//   exp      1.02 ulp, less precise where the result is subnormal (x < -87.3)
+//   log      0.83 ulp
+//   tanh     1.33 ulp
+//   sigmoid  2.41 ulp
+//   sqrt     correctly rounded (0.5 ulp), like sub/mul/div, fma and axpy
+// The loops only vectorize with -fno-trapping-math and -fno-math-errno (see
+// the Makefile), without them they give the same results one at a time.
+
+float math_exp(float x) {
+    // exp(x) = 2^n * exp(r) with n = round(x / ln 2) and |r| <= ln 2 / 2
+    x = x < -104.0f ? -104.0f : x;
+    x = x > 89.0f ? 89.0f : x;
+    float n = (x * 1.44269504088896341f + 12582912.0f) - 12582912.0f; // rounds to nearest
+    n = x == x ? n : 0.0f; // NaN can't be converted to int below
+    float r = x - n * 0.693359375f;
+    r = r + n * 2.12194440e-4f; // ln 2 in two parts, so n * ln 2 is exact
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    // 2^n as two normal powers of two, so subnormal results and overflow to
+    // inf come out of the multiplications
+    int k = (int) n;
+    int k1 = k >> 1;
+    return p * bits_float((uint32_t) (k1 + 127) << 23) * bits_float((uint32_t) (k - k1 + 127) << 23);
+}
+
+float math_log(float x) {
+    // x = m * 2^e with m in [sqrt(0.5), sqrt(2)), log(x) = e * ln 2 + log(m)
+    bool subnormal = x < 1.17549435e-38f;
+    uint32_t bits = float_bits(subnormal ? x * 8388608.0f : x); // scaled by 2^23
+    int e = (int) ((bits >> 23) & 0xff) - (subnormal ? 126 + 23 : 126);
+    float m = bits_float((bits & 0x007fffff) | 0x3f000000); // in [0.5, 1)
+    bool low = m < 0.707106781186547524f;
+    e = low ? e - 1 : e;
+    m = low ? m + m - 1.0f : m - 1.0f;
+    float z = m * m;
+    float p = 7.0376836292e-2f;
+    p = p * m - 1.1514610310e-1f;
+    p = p * m + 1.1676998740e-1f;
+    p = p * m - 1.2420140846e-1f;
+    p = p * m + 1.4249322787e-1f;
+    p = p * m - 1.6668057665e-1f;
+    p = p * m + 2.0000714765e-1f;
+    p = p * m - 2.4999993993e-1f;
+    p = p * m + 3.3333331174e-1f;
+    float fe = (float) e;
+    float y = p * m * z - fe * 2.12194440e-4f - 0.5f * z;
+    float result = m + y + fe * 0.693359375f;
+    result = x == INFINITY ? x : result;
+    result = x == 0.0f ? -INFINITY : result;
+    return x >= 0.0f ? result : NAN; // negative or NaN
+}
+
+float math_tanh(float x) {
+    // an odd polynomial for |x| < 0.625, else 1 - 2 / (exp(2|x|) + 1)
+    float z = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * z + 2.06390887954e-2f;
+    p = p * z - 5.37397155531e-2f;
+    p = p * z + 1.33314422036e-1f;
+    p = p * z - 3.33332819422e-1f;
+    float small = p * z * x + x;
+    float ax = fabsf(x);
+    float large = copysignf(1.0f - 2.0f / (math_exp(ax + ax) + 1.0f), x);
+    return ax < 0.625f ? small : large; // NaN goes to large, which keeps it
+}
+
+float math_sigmoid(float x) {
+    // e / (1 + e) for x < 0, with e = exp(x) small, else 1 / (1 + exp(-x)):
+    // exp(-|x|) never overflows, and its error isn't magnified by 1 + e
+    float e = math_exp(-fabsf(x));
+    return (x < 0.0f ? e : 1.0f) / (1.0f + e);
+}
+
+// X(isa, target, name, op, float32 expression of x, float64 expression of x)
+#define UNARY_OPS(X, isa, target) \
+    X(isa, target, exp, UNARY_EXP, math_exp(x), exp(x)) \
+    X(isa, target, log, UNARY_LOG, math_log(x), log(x)) \
+    X(isa, target, tanh, UNARY_TANH, math_tanh(x), tanh(x)) \
+    X(isa, target, sigmoid, UNARY_SIGMOID, math_sigmoid(x), 1.0 / (1.0 + exp(-x))) \
+    X(isa, target, sqrt, UNARY_SQRT, sqrtf(x), sqrt(x))
+
+// X(isa, target, name, op, expression of x and y, for float32 and float64)
+#define BINARY_OPS(X, isa, target) \
+    X(isa, target, add, BINARY_ADD, x + y) \
+    X(isa, target, sub, BINARY_SUB, x - y) \
+    X(isa, target, mul, BINARY_MUL, x * y) \
+    X(isa, target, div, BINARY_DIV, x / y)
+
+// flatten inlines the math_* functions, the loop can't vectorize around a call
+#define UNARY_KERNEL(isa, target, name, op, EXPR, EXPR_F64) \
+    target __attribute__((flatten)) void kernel_unary_##name##_##isa(float* out, const float* a, int n) { \
+        for (int i = 0; i < n; i++) { float x = a[i]; out[i] = EXPR; } \
+    }
+
+// each binary op as a op b, a op val and val op a
+#define BINARY_KERNELS(isa, target, name, op, EXPR) \
+    target void kernel_binary_##name##_##isa(float* out, const float* a, const float* b, int n) { \
+        for (int i = 0; i < n; i++) { float x = a[i], y = b[i]; out[i] = EXPR; } \
+    } \
+    target void kernel_binaryf_##name##_##isa(float* out, const float* a, float val, int n) { \
+        for (int i = 0; i < n; i++) { float x = a[i], y = val; out[i] = EXPR; } \
+    } \
+    target void kernel_rbinaryf_##name##_##isa(float* out, const float* a, float val, int n) { \
+        for (int i = 0; i < n; i++) { float x = val, y = a[i]; out[i] = EXPR; } \
+    }
+
+// all the contiguous math kernels of one ISA, compiled with the given target attribute
+#define MATH_KERNELS(isa, target) \
+    UNARY_OPS(UNARY_KERNEL, isa, target) \
+    BINARY_OPS(BINARY_KERNELS, isa, target) \
+    target void kernel_fma_##isa(float* out, const float* a, const float* b, const float* c, int n) { \
+        for (int i = 0; i < n; i++) { out[i] = fmaf(a[i], b[i], c[i]); } \
+    } \
+    target void kernel_axpy_##isa(float* out, float alpha, const float* x, const float* y, int n) { \
+        for (int i = 0; i < n; i++) { out[i] = fmaf(alpha, x[i], y[i]); } \
+    }
+
+MATH_KERNELS(scalar, )
+
+void kernel_unary_strided(int op, float* out, int out_stride, const float* a, int a_stride, int n) {
+    switch (op) {
+#define X(isa, target, name, unary_op, EXPR, EXPR_F64) \
+        case unary_op: \
+            for (int i = 0; i < n; i++) { float x = a[i * a_stride]; out[i * out_stride] = EXPR; } \
+            break;
+        UNARY_OPS(X, , )
+#undef X
+    }
+}
+
+void kernel_binary_strided(int op, float* out, int out_stride, const float* a, int a_stride,
+                           const float* b, int b_stride, int n) {
+    switch (op) {
+#define X(isa, target, name, binary_op, EXPR) \
+        case binary_op: \
+            for (int i = 0; i < n; i++) { float x = a[i * a_stride], y = b[i * b_stride]; out[i * out_stride] = EXPR; } \
+            break;
+        BINARY_OPS(X, , )
+#undef X
+    }
+}
+
+void kernel_fma_strided(float* out, int out_stride, const float* a, int a_stride, const float* b, int b_stride,
+                        const float* c, int c_stride, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i * out_stride] = fmaf(a[i * a_stride], b[i * b_stride], c[i * c_stride]);
+    }
+}
+
+void kernel_axpy_strided(float* out, int out_stride, float alpha, const float* x, int x_stride,
+                         const float* y, int y_stride, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i * out_stride] = fmaf(alpha, x[i * x_stride], y[i * y_stride]);
+    }
+}
+
+// like torch.clamp: NaN stays NaN, and lo > hi gives hi
+void kernel_clamp_contiguous(float* out, const float* a, float lo, float hi, int n) {
+    for (int i = 0; i < n; i++) {
+        float x = a[i] < lo ? lo : a[i];
+        out[i] = x > hi ? hi : x;
+    }
+}
+
+void kernel_clamp_strided(float* out, int out_stride, const float* a, int a_stride, float lo, float hi, int n) {
+    for (int i = 0; i < n; i++) {
+        float x = a[i * a_stride] < lo ? lo : a[i * a_stride];
+        out[i * out_stride] = x > hi ? hi : x;
+    }
+}
+
+void kernel_where_contiguous(float* out, const float* cond, const float* a, const float* b, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = cond[i] != 0.0f ? a[i] : b[i];
+    }
+}
+
+void kernel_where_strided(float* out, int out_stride, const float* cond, int cond_stride, const float* a, int a_stride,
+                          const float* b, int b_stride, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i * out_stride] = cond[i * cond_stride] != 0.0f ? a[i * a_stride] : b[i * b_stride];
+    }
+}
+
+// Reductions keep several independent accumulators, so consecutive additions
+// don't wait on each other and the compiler can map them onto vector lanes.
+// max/min propagate NaN like PyTorch: once a lane sees a NaN it stays NaN.
+#define REDUCE_LANES 8
+
+float kernel_sum_contiguous(const float* a, int n) {
+    float acc[REDUCE_LANES] = { 0.0f };
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) { acc[j] += a[i + j]; }
+    }
+    for (; i < n; i++) { acc[0] += a[i]; }
+    float sum = 0.0f;
+    for (int j = 0; j < REDUCE_LANES; j++) { sum += acc[j]; }
+    return sum;
+}
+
+float kernel_sum_strided(const float* a, int a_stride, int n) {
+    float acc[REDUCE_LANES] = { 0.0f };
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) { acc[j] += a[(i + j) * a_stride]; }
+    }
+    for (; i < n; i++) { acc[0] += a[i * a_stride]; }
+    float sum = 0.0f;
+    for (int j = 0; j < REDUCE_LANES; j++) { sum += acc[j]; }
+    return sum;
+}
+
+// Kahan (compensated) summation: each lane carries the low-order bits that its
+// running sum lost, so the error does not grow with n. Stays exact as written
+// because we never compile with -ffast-math, which would optimize it away.
+float kernel_sum_kahan(const float* a, int a_stride, int n) {
+    float acc[REDUCE_LANES] = { 0.0f };
+    float comp[REDUCE_LANES] = { 0.0f };
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) {
+            float y = a[(i + j) * a_stride] - comp[j];
+            float t = acc[j] + y;
+            comp[j] = (t - acc[j]) - y;
+            acc[j] = t;
+        }
+    }
+    for (; i < n; i++) {
+        float y = a[i * a_stride] - comp[0];
+        float t = acc[0] + y;
+        comp[0] = (t - acc[0]) - y;
+        acc[0] = t;
+    }
+    // and combine the lanes, compensated as well
+    float sum = 0.0f;
+    float c = 0.0f;
+    for (int j = 0; j < REDUCE_LANES; j++) {
+        float y = (acc[j] - comp[j]) - c;
+        float t = sum + y;
+        c = (t - sum) - y;
+        sum = t;
+    }
+    return sum;
+}
+
+float kernel_dot_contiguous(const float* a, const float* b, int n) {
+    float acc[REDUCE_LANES] = { 0.0f };
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) { acc[j] += a[i + j] * b[i + j]; }
+    }
+    for (; i < n; i++) { acc[0] += a[i] * b[i]; }
+    float sum = 0.0f;
+    for (int j = 0; j < REDUCE_LANES; j++) { sum += acc[j]; }
+    return sum;
+}
+
+float kernel_dot_strided(const float* a, int a_stride, const float* b, int b_stride, int n) {
+    float acc[REDUCE_LANES] = { 0.0f };
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) { acc[j] += a[(i + j) * a_stride] * b[(i + j) * b_stride]; }
+    }
+    for (; i < n; i++) { acc[0] += a[i * a_stride] * b[i * b_stride]; }
+    float sum = 0.0f;
+    for (int j = 0; j < REDUCE_LANES; j++) { sum += acc[j]; }
+    return sum;
+}
+
+// NaN-propagating max/min of two floats, keeping a if it is already NaN
+float nan_max(float a, float b) {
+    return (b > a || b != b) && a == a ? b : a;
+}
+
+float nan_min(float a, float b) {
+    return (b < a || b != b) && a == a ? b : a;
+}
+
+// max (or min, if sign is -1) of the n > 0 elements, scaled back by sign
+float kernel_max_strided(const float* a, int a_stride, int n, int sign) {
+    float acc[REDUCE_LANES];
+    for (int j = 0; j < REDUCE_LANES; j++) { acc[j] = sign * a[0]; }
+    int i = 0;
+    for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) {
+        for (int j = 0; j < REDUCE_LANES; j++) { acc[j] = nan_max(acc[j], sign * a[(i + j) * a_stride]); }
+    }
+    for (; i < n; i++) { acc[0] = nan_max(acc[0], sign * a[i * a_stride]); }
+    float best = acc[0];
+    for (int j = 1; j < REDUCE_LANES; j++) { best = nan_max(best, acc[j]); }
+    return sign * best;
+}
+
+float kernel_max_contiguous(const float* a, int n) {
+    return kernel_max_strided(a, 1, n, 1);
+}
+
+float kernel_min_contiguous(const float* a, int n) {
+    return kernel_max_strided(a, 1, n, -1);
+}
+
+// Matrix multiply micro-kernel: the GEMM_MR x GEMM_NR tile c (row-major,
+// overwritten) = a * b over k, where a is a packed panel of GEMM_MR rows (k
+// columns of GEMM_MR values) and b a packed panel of GEMM_NR columns (k rows
+// of GEMM_NR values), see tensor_matmul. The tile stays in registers for all k.
+#define GEMM_MR 6
+#define GEMM_NR 16
+
+void kernel_gemm_micro(int k, const float* a, const float* b, float* c) {
+    float acc[GEMM_MR][GEMM_NR] = { { 0.0f } };
+    for (int p = 0; p < k; p++) {
+        for (int i = 0; i < GEMM_MR; i++) {
+            for (int j = 0; j < GEMM_NR; j++) { acc[i][j] += a[i] * b[j]; }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    memcpy(c, acc, sizeof(acc));
+}
+
+// ----------------------------------------------------------------------------
+// SIMD kernels and runtime dispatch
+// One libtensor1d.so has to run on machines with different vector units, so we
+// can't compile with -march=native. Instead each SIMD kernel is compiled for its
+// own target via a function attribute, and the widest one the CPU supports is
+// picked once when the library is loaded. The scalar kernels above remain the
+// fallback, and the reference that the SIMD versions are tested against.
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+void kernel_addf_avx2(float* out, const float* a, float val, int n) {
+    __m256 v = _mm256_set1_ps(val);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i), v));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + val;
+    }
+}
+
+__attribute__((target("avx2")))
+void kernel_add_avx2(float* out, const float* a, const float* b, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+__attribute__((target("avx512f")))
+void kernel_addf_avx512(float* out, const float* a, float val, int n) {
+    __m512 v = _mm512_set1_ps(val);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(a + i), v));
+    }
+    if (i < n) {
+        // masked tail instead of a scalar loop
+        __mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(out + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, a + i), v));
+    }
+}
+
+__attribute__((target("avx512f")))
+void kernel_add_avx512(float* out, const float* a, const float* b, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+        __m512 va = _mm512_maskz_loadu_ps(m, a + i);
+        __m512 vb = _mm512_maskz_loadu_ps(m, b + i);
+        _mm512_mask_storeu_ps(out + i, m, _mm512_add_ps(va, vb));
+    }
+}
+
+__attribute__((target("avx2,fma")))
+float hsum_avx2(__m256 v) {
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+    return _mm_cvtss_f32(lo);
+}
+
+// four vector accumulators to hide the latency of the adds
+__attribute__((target("avx2,fma")))
+float kernel_sum_avx2(const float* a, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(a + i));
+        acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(a + i + 8));
+        acc2 = _mm256_add_ps(acc2, _mm256_loadu_ps(a + i + 16));
+        acc3 = _mm256_add_ps(acc3, _mm256_loadu_ps(a + i + 24));
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(a + i));
+    }
+    float sum = hsum_avx2(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (; i < n; i++) { sum += a[i]; }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+float kernel_dot_avx2(const float* a, const float* b, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (; i < n; i++) { sum += a[i] * b[i]; }
+    return sum;
+}
+
+// _mm256_max_ps drops NaNs, so we track them in a separate mask
+__attribute__((target("avx2,fma")))
+float kernel_max_avx2_signed(const float* a, int n, int sign) {
+    if (n < 8) { return kernel_max_strided(a, 1, n, sign); }
+    __m256 s = _mm256_set1_ps((float) sign);
+    __m256 best = _mm256_mul_ps(_mm256_loadu_ps(a), s);
+    __m256 nan = _mm256_cmp_ps(best, best, _CMP_UNORD_Q);
+    int i = 8;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(a + i), s);
+        best = _mm256_max_ps(best, x);
+        nan = _mm256_or_ps(nan, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+    }
+    // the last (overlapping) vector covers the tail
+    __m256 x = _mm256_mul_ps(_mm256_loadu_ps(a + n - 8), s);
+    best = _mm256_max_ps(best, x);
+    nan = _mm256_or_ps(nan, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+    if (_mm256_movemask_ps(nan) != 0) { return NAN; }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, best);
+    float m = lanes[0];
+    for (int j = 1; j < 8; j++) { m = lanes[j] > m ? lanes[j] : m; }
+    return sign * m;
+}
+
+__attribute__((target("avx2,fma")))
+float kernel_max_avx2(const float* a, int n) {
+    return kernel_max_avx2_signed(a, n, 1);
+}
+
+__attribute__((target("avx2,fma")))
+float kernel_min_avx2(const float* a, int n) {
+    return kernel_max_avx2_signed(a, n, -1);
+}
+
+// 6 rows x 2 vectors of 8: 12 accumulators, plus 2 for b and 1 for a of the 16 ymm registers
+#define GEMM_ROW_AVX2(i) \
+    ai = _mm256_broadcast_ss(a + i); \
+    c##i##0 = _mm256_fmadd_ps(ai, b0, c##i##0); \
+    c##i##1 = _mm256_fmadd_ps(ai, b1, c##i##1);
+
+__attribute__((target("avx2,fma")))
+void kernel_gemm_micro_avx2(int k, const float* a, const float* b, float* c) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps(), c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (int p = 0; p < k; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        GEMM_ROW_AVX2(0) GEMM_ROW_AVX2(1) GEMM_ROW_AVX2(2) GEMM_ROW_AVX2(3) GEMM_ROW_AVX2(4) GEMM_ROW_AVX2(5)
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    _mm256_storeu_ps(c + 0 * GEMM_NR, c00); _mm256_storeu_ps(c + 0 * GEMM_NR + 8, c01);
+    _mm256_storeu_ps(c + 1 * GEMM_NR, c10); _mm256_storeu_ps(c + 1 * GEMM_NR + 8, c11);
+    _mm256_storeu_ps(c + 2 * GEMM_NR, c20); _mm256_storeu_ps(c + 2 * GEMM_NR + 8, c21);
+    _mm256_storeu_ps(c + 3 * GEMM_NR, c30); _mm256_storeu_ps(c + 3 * GEMM_NR + 8, c31);
+    _mm256_storeu_ps(c + 4 * GEMM_NR, c40); _mm256_storeu_ps(c + 4 * GEMM_NR + 8, c41);
+    _mm256_storeu_ps(c + 5 * GEMM_NR, c50); _mm256_storeu_ps(c + 5 * GEMM_NR + 8, c51);
+}
+
+__attribute__((target("avx512f")))
+float kernel_sum_avx512(const float* a, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(a + i));
+        acc1 = _mm512_add_ps(acc1, _mm512_loadu_ps(a + i + 16));
+        acc2 = _mm512_add_ps(acc2, _mm512_loadu_ps(a + i + 32));
+        acc3 = _mm512_add_ps(acc3, _mm512_loadu_ps(a + i + 48));
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_ps(acc0, _mm512_loadu_ps(a + i));
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+        acc1 = _mm512_add_ps(acc1, _mm512_maskz_loadu_ps(m, a + i));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+__attribute__((target("avx512f")))
+float kernel_dot_avx512(const float* a, const float* b, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+// a row of the tile is one zmm register
+__attribute__((target("avx512f")))
+void kernel_gemm_micro_avx512(int k, const float* a, const float* b, float* c) {
+    __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps();
+    __m512 c3 = _mm512_setzero_ps(), c4 = _mm512_setzero_ps(), c5 = _mm512_setzero_ps();
+    for (int p = 0; p < k; p++) {
+        __m512 b0 = _mm512_load_ps(b);
+        c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, c0);
+        c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, c1);
+        c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, c2);
+        c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, c3);
+        c4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, c4);
+        c5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, c5);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    _mm512_storeu_ps(c + 0 * GEMM_NR, c0);
+    _mm512_storeu_ps(c + 1 * GEMM_NR, c1);
+    _mm512_storeu_ps(c + 2 * GEMM_NR, c2);
+    _mm512_storeu_ps(c + 3 * GEMM_NR, c3);
+    _mm512_storeu_ps(c + 4 * GEMM_NR, c4);
+    _mm512_storeu_ps(c + 5 * GEMM_NR, c5);
+}
+
+// the math kernels need no intrinsics, the compiler vectorizes them for the target
+MATH_KERNELS(avx2, __attribute__((target("avx2,fma"))))
+MATH_KERNELS(avx512, __attribute__((target("avx512f"))))
+
+#endif
+
+#if defined(__aarch64__)
+
+void kernel_addf_neon(float* out, const float* a, float val, int n) {
+    float32x4_t v = vdupq_n_f32(val);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(a + i), v));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + val;
+    }
+}
+
+void kernel_add_neon(float* out, const float* a, const float* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(out + i, vaddq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+float kernel_sum_neon(const float* a, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vaddq_f32(acc0, vld1q_f32(a + i));
+        acc1 = vaddq_f32(acc1, vld1q_f32(a + i + 4));
+        acc2 = vaddq_f32(acc2, vld1q_f32(a + i + 8));
+        acc3 = vaddq_f32(acc3, vld1q_f32(a + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vaddq_f32(acc0, vld1q_f32(a + i));
+    }
+    float sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+    for (; i < n; i++) { sum += a[i]; }
+    return sum;
+}
+
+float kernel_dot_neon(const float* a, const float* b, int n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f), acc3 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+    for (; i < n; i++) { sum += a[i] * b[i]; }
+    return sum;
+}
+
+// 6 rows x 4 vectors of 4: 24 of the 32 q registers hold the tile
+void kernel_gemm_micro_neon(int k, const float* a, const float* b, float* c) {
+    float32x4_t acc[GEMM_MR][4];
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < 4; j++) { acc[i][j] = vdupq_n_f32(0.0f); }
+    }
+    for (int p = 0; p < k; p++) {
+        float32x4_t b0 = vld1q_f32(b), b1 = vld1q_f32(b + 4), b2 = vld1q_f32(b + 8), b3 = vld1q_f32(b + 12);
+        for (int i = 0; i < GEMM_MR; i++) {
+            acc[i][0] = vfmaq_n_f32(acc[i][0], b0, a[i]);
+            acc[i][1] = vfmaq_n_f32(acc[i][1], b1, a[i]);
+            acc[i][2] = vfmaq_n_f32(acc[i][2], b2, a[i]);
+            acc[i][3] = vfmaq_n_f32(acc[i][3], b3, a[i]);
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < 4; j++) { vst1q_f32(c + i * GEMM_NR + 4 * j, acc[i][j]); }
+    }
+}
+
+#endif
+
+// the set of contiguous kernels for one ISA
+typedef struct {
+    int isa;
+    void (*addf)(float* out, const float* a, float val, int n);
+    void (*add)(float* out, const float* a, const float* b, int n);
+    float (*sum)(const float* a, int n);
+    float (*dot)(const float* a, const float* b, int n);
+    float (*max)(const float* a, int n);
+    float (*min)(const float* a, int n);
+    void (*gemm_micro)(int k, const float* a, const float* b, float* c);
+    void (*unary[UNARY_COUNT])(float* out, const float* a, int n);
+    void (*binary[BINARY_COUNT])(float* out, const float* a, const float* b, int n);
+    void (*binaryf[BINARY_COUNT])(float* out, const float* a, float val, int n);  // a op val
+    void (*rbinaryf[BINARY_COUNT])(float* out, const float* a, float val, int n); // val op a
+    void (*fma)(float* out, const float* a, const float* b, const float* c, int n);
+    void (*axpy)(float* out, float alpha, const float* x, const float* y, int n);
+} KernelTable;
+
+#define UNARY_ENTRY(isa, target, name, op, EXPR, EXPR_F64) [op] = kernel_unary_##name##_##isa,
+#define BINARY_ENTRY(isa, target, name, op, EXPR) [op] = kernel_binary_##name##_##isa,
+#define BINARYF_ENTRY(isa, target, name, op, EXPR) [op] = kernel_binaryf_##name##_##isa,
+#define RBINARYF_ENTRY(isa, target, name, op, EXPR) [op] = kernel_rbinaryf_##name##_##isa,
+
+// the math kernels of a KernelTable, from MATH_KERNELS(isa, ...)
+#define MATH_KERNEL_TABLE(isa) \
+    .unary = { UNARY_OPS(UNARY_ENTRY, isa, ) }, \
+    .binary = { BINARY_OPS(BINARY_ENTRY, isa, ) }, \
+    .binaryf = { BINARY_OPS(BINARYF_ENTRY, isa, ) }, \
+    .rbinaryf = { BINARY_OPS(RBINARYF_ENTRY, isa, ) }, \
+    .fma = kernel_fma_##isa, \
+    .axpy = kernel_axpy_##isa,
+
+const KernelTable kernels_scalar = {
+    .isa = KERNEL_ISA_SCALAR,
+    .addf = kernel_addf_contiguous,
+    .add = kernel_add_contiguous,
+    .sum = kernel_sum_contiguous,
+    .dot = kernel_dot_contiguous,
+    .max = kernel_max_contiguous,
+    .min = kernel_min_contiguous,
+    .gemm_micro = kernel_gemm_micro,
+    MATH_KERNEL_TABLE(scalar)
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+const KernelTable kernels_avx2 = {
+    .isa = KERNEL_ISA_AVX2,
+    .addf = kernel_addf_avx2,
+    .add = kernel_add_avx2,
+    .sum = kernel_sum_avx2,
+    .dot = kernel_dot_avx2,
+    .max = kernel_max_avx2,
+    .min = kernel_min_avx2,
+    .gemm_micro = kernel_gemm_micro_avx2,
+    MATH_KERNEL_TABLE(avx2)
+};
+
+// AVX-512 max/min would need the same NaN bookkeeping for little gain over AVX2
+const KernelTable kernels_avx512 = {
+    .isa = KERNEL_ISA_AVX512,
+    .addf = kernel_addf_avx512,
+    .add = kernel_add_avx512,
+    .sum = kernel_sum_avx512,
+    .dot = kernel_dot_avx512,
+    .max = kernel_max_avx2,
+    .min = kernel_min_avx2,
+    .gemm_micro = kernel_gemm_micro_avx512,
+    MATH_KERNEL_TABLE(avx512)
+};
+#endif
+
+#if defined(__aarch64__)
+const KernelTable kernels_neon = {
+    .isa = KERNEL_ISA_NEON,
+    .addf = kernel_addf_neon,
+    .add = kernel_add_neon,
+    .sum = kernel_sum_neon,
+    .dot = kernel_dot_neon,
+    .max = kernel_max_contiguous,
+    .min = kernel_min_contiguous,
+    .gemm_micro = kernel_gemm_micro_neon,
+    MATH_KERNEL_TABLE(scalar) // NEON is in the aarch64 baseline, the compiler vectorizes these with it
+};
+#endif
+
+// the kernels in use, the scalar ones until kernels_init runs
+KernelTable kernel_table = kernels_scalar;
+
+const char* tensor_kernel_isa_name(int isa) {
+    switch (isa) {
+        case KERNEL_ISA_SCALAR: return "scalar";
+        case KERNEL_ISA_NEON: return "neon";
+        case KERNEL_ISA_AVX2: return "avx2";
+        case KERNEL_ISA_AVX512: return "avx512";
+        default: return "unknown";
+    }
+}
+
+bool tensor_kernel_isa_supported(int isa) {
+    switch (isa) {
+        case KERNEL_ISA_SCALAR: return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case KERNEL_ISA_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case KERNEL_ISA_AVX512: return __builtin_cpu_supports("avx512f") && tensor_kernel_isa_supported(KERNEL_ISA_AVX2);
+#endif
+#if defined(__aarch64__)
+        case KERNEL_ISA_NEON: return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+        default: return false;
+    }
+}
+
+int tensor_get_kernel_isa(void) {
+    return kernel_table.isa;
+}
+
+bool tensor_set_kernel_isa(int isa) {
+    if (!tensor_kernel_isa_supported(isa)) {
+        fprintf(stderr, "ValueError: kernel ISA %s is not supported on this machine\n", tensor_kernel_isa_name(isa));
+        return false;
+    }
+    KernelTable k = kernels_scalar;
+    switch (isa) {
+#if defined(__x86_64__) || defined(__i386__)
+        case KERNEL_ISA_AVX2: k = kernels_avx2; break;
+        case KERNEL_ISA_AVX512: k = kernels_avx512; break;
+#endif
+#if defined(__aarch64__)
+        case KERNEL_ISA_NEON: k = kernels_neon; break;
+#endif
+        default: break;
+    }
+    kernel_table = k;
+    return true;
+}
+
+// runs once at library load: pick the widest supported ISA, unless the
+// TENSOR1D_ISA environment variable asks for a specific one (e.g. "scalar")
+__attribute__((constructor))
+void kernels_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init(); // required before __builtin_cpu_supports in a constructor
+#endif
+    const char* env = getenv("TENSOR1D_ISA");
+    if (env != NULL) {
+        for (int isa = KERNEL_ISA_SCALAR; isa <= KERNEL_ISA_AVX512; isa++) {
+            if (strcmp(env, tensor_kernel_isa_name(isa)) == 0 && tensor_set_kernel_isa(isa)) { return; }
+        }
+    }
+    for (int isa = KERNEL_ISA_AVX512; isa > KERNEL_ISA_SCALAR; isa--) {
+        if (tensor_kernel_isa_supported(isa)) {
+            tensor_set_kernel_isa(isa);
+            return;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// thread pool
+// Big ops are split into chunks of logical indices [start, end) that run on a
+// persistent pool of worker threads, so no thread is created per call. The
+// caller works on chunks too, and ops below the size threshold (or nested
+// inside another parallel op) simply run on the calling thread. The pool size
+// comes from TENSOR1D_NUM_THREADS, or tensor_set_num_threads, else the number
+// of online cores. The range is cut into a fixed set of chunks that only depends
+// on n and the pool size, so e.g. reductions give the same result on every run.
+// The chunks go to whichever thread is free, except under a NUMA policy (see
+// tensor_set_numa_policy): then the workers are pinned to the nodes in turn,
+// and chunk c always runs on thread c % num_threads (the caller being thread 0),
+// so a thread computes on the part of a large Storage it placed itself.
+
+#define PARALLEL_DEFAULT_THRESHOLD (1 << 18) // elements, i.e. 1MB of floats
+#define PARALLEL_MIN_CHUNK (1 << 14)         // don't bother threads with less work
+
+typedef void (*ParallelFn)(void* ctx, int chunk, int start, int end);
+
+typedef struct {
+    pthread_t* threads;
+    int num_workers;   // threads in the pool, excluding the caller
+    bool started;
+    bool shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; // a new job was posted (or shutdown)
+    pthread_cond_t done_cond; // a job may have finished
+    // the current job, all protected by mutex except next_chunk
+    unsigned long generation;
+    ParallelFn fn;
+    void* ctx;
+    int n;
+    int num_chunks;
+    bool placed;           // the chunks are assigned to the threads, see above
+    atomic_int next_chunk; // otherwise they are taken in turn
+    int remaining; // chunks not finished yet
+    int active;    // workers inside the current job
+} ThreadPool;
+
+ThreadPool thread_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+pthread_mutex_t thread_pool_job_lock = PTHREAD_MUTEX_INITIALIZER; // one job at a time
+int parallel_num_threads = 0; // 0 means not configured yet
+int parallel_threshold = PARALLEL_DEFAULT_THRESHOLD;
+int numa_policy = NUMA_DEFAULT;
+int huge_pages = HUGE_PAGES_OFF;
+
+#ifdef TENSOR1D_NUMA
+#define NUMA_MAX_NODES 64
+int numa_nodes[NUMA_MAX_NODES]; // that have memory, filled by tensor_set_numa_policy
+int numa_node_count = 0;
+#endif
+
+// pins worker `thread` of num_threads to its node: the threads are spread
+// over the nodes in order, as are the chunks
+void numa_pin_thread(int thread, int num_threads) {
+#ifdef TENSOR1D_NUMA
+    if (numa_node_count == 0) { return; }
+    int node = numa_nodes[(long long) thread * numa_node_count / num_threads];
+    if (numa_run_on_node(node) != 0) {
+        fprintf(stderr, "Warning: could not pin a thread to NUMA node %d: %s\n", node, strerror(errno));
+    }
+#endif
+}
+
+int chunk_start(int n, int num_chunks, int chunk) {
+    return (int) ((long long) n * chunk / num_chunks);
+}
+
+// runs chunks of the current job on `thread`, 0 for the caller
+void pool_run_chunks(ThreadPool* pool, ParallelFn fn, void* ctx, int n, int num_chunks, bool placed, int thread) {
+    int num_threads = pool->num_workers + 1;
+    for (int chunk = thread;; chunk += num_threads) {
+        if (!placed) { chunk = atomic_fetch_add(&pool->next_chunk, 1); }
+        if (chunk >= num_chunks) { break; }
+        fn(ctx, chunk, chunk_start(n, num_chunks, chunk), chunk_start(n, num_chunks, chunk + 1));
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->remaining == 0) { pthread_cond_broadcast(&pool->done_cond); }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// arg is the index of the worker's thread, from 1
+void* pool_worker(void* arg) {
+    ThreadPool* pool = &thread_pool;
+    int thread = (int) (intptr_t) arg;
+    if (numa_policy != NUMA_DEFAULT) { numa_pin_thread(thread, tensor_get_num_threads()); }
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->shutdown) { break; }
+        seen = pool->generation;
+        ParallelFn fn = pool->fn;
+        void* ctx = pool->ctx;
+        int n = pool->n;
+        int num_chunks = pool->num_chunks;
+        bool placed = pool->placed;
+        pool->active++;
+        pthread_mutex_unlock(&pool->mutex);
+        pool_run_chunks(pool, fn, ctx, n, num_chunks, placed, thread);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->active == 0) { pthread_cond_broadcast(&pool->done_cond); }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void pool_stop(ThreadPool* pool) {
+    if (!pool->started) { return; }
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->num_workers = 0;
+    pool->started = false;
+    pool->shutdown = false;
+}
+
+void pool_start(ThreadPool* pool, int num_workers) {
+    pool->threads = mallocCheck(num_workers * sizeof(pthread_t));
+    pool->num_workers = 0;
+    // the new workers start from generation 0, so they don't take the last job
+    // of a previous pool for a new one (no job runs while the pool starts)
+    pool->generation = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, (void*) (intptr_t) (i + 1)) != 0) {
+            fprintf(stderr, "Warning: could only start %d of %d threads\n", i, num_workers);
+            break;
+        }
+        pool->num_workers++;
+    }
+    pool->started = true;
+}
+
+// threads used by parallel ops, including the calling thread
+int tensor_get_num_threads(void) {
+    if (parallel_num_threads == 0) {
+        const char* env = getenv("TENSOR1D_NUM_THREADS");
+        int n = env != NULL ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+        parallel_num_threads = max(n, 1);
+    }
+    return parallel_num_threads;
+}
+
+void tensor_set_num_threads(int num_threads) {
+    pthread_mutex_lock(&thread_pool_job_lock);
+    pool_stop(&thread_pool); // restarted with the new size by the next parallel op
+    parallel_num_threads = max(num_threads, 1);
+    pthread_mutex_unlock(&thread_pool_job_lock);
+}
+
+int tensor_get_parallel_threshold(void) {
+    return parallel_threshold;
+}
+
+// ops on fewer elements than this run single-threaded
+void tensor_set_parallel_threshold(int num_elements) {
+    parallel_threshold = max(num_elements, 1);
+}
+
+// number of chunks parallel_for splits n elements into, 1 if it runs serially
+int parallel_num_chunks(int n) {
+    if (n < parallel_threshold) { return 1; }
+    int min_chunk = min(PARALLEL_MIN_CHUNK, parallel_threshold);
+    return max(min(tensor_get_num_threads(), n / min_chunk), 1);
+}
+
+// runs fn over [0, n) split into num_chunks chunks, returns when all are done
+void parallel_for_chunks(int n, int num_chunks, ParallelFn fn, void* ctx) {
+    // serial if it's small, or if another parallel op is running (e.g. we are nested in one)
+    if (num_chunks == 1 || pthread_mutex_trylock(&thread_pool_job_lock) != 0) {
+        for (int chunk = 0; chunk < num_chunks; chunk++) {
+            fn(ctx, chunk, chunk_start(n, num_chunks, chunk), chunk_start(n, num_chunks, chunk + 1));
+        }
+        return;
+    }
+    ThreadPool* pool = &thread_pool;
+    if (!pool->started) { pool_start(pool, tensor_get_num_threads() - 1); }
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->n = n;
+    pool->num_chunks = num_chunks;
+    pool->placed = numa_policy != NUMA_DEFAULT;
+    atomic_store(&pool->next_chunk, 0);
+    pool->remaining = num_chunks;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    // the caller works too, then waits for the chunks the workers picked up
+    pool_run_chunks(pool, fn, ctx, n, num_chunks, pool->placed, 0);
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->remaining > 0 || pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&thread_pool_job_lock);
+}
+
+// runs fn over [0, n) split into parallel_num_chunks(n) chunks
+void parallel_for(int n, ParallelFn fn, void* ctx) {
+    parallel_for_chunks(n, parallel_num_chunks(n), fn, ctx);
+}
+
+// join the workers when the library is unloaded
+__attribute__((destructor))
+void thread_pool_exit(void) {
+    pthread_mutex_lock(&thread_pool_job_lock);
+    pool_stop(&thread_pool);
+    pthread_mutex_unlock(&thread_pool_job_lock);
+}
+
+// ----------------------------------------------------------------------------
+// NUMA and huge pages
+// Storages too big for the pool (see POOL_MAX_CLASS) are mapped directly
+// instead of malloc'ed, when a NUMA policy or huge pages are asked for. On a
+// multi-socket host, a large Storage would otherwise live wherever the thread
+// that first writes it runs, and threaded ops on it would be limited by the
+// bandwidth between the sockets. NUMA_INTERLEAVE spreads the pages round-robin
+// over the nodes. NUMA_FIRST_TOUCH zero-fills each chunk of the Storage on the
+// pool thread that later computes on that chunk, see the thread pool above.
+// Huge pages cut the TLB misses of walking through GBs: HUGE_PAGES_THP maps
+// 2MB-aligned memory and asks for transparent huge pages, HUGE_PAGES_HUGETLB
+// takes them from the pool reserved in /proc/sys/vm/nr_hugepages.
+
+#define HUGE_PAGE_BYTES ((size_t) 2 << 20)
+
+atomic_bool hugetlb_warned = false;
+
+size_t round_up_bytes(size_t bytes, size_t multiple) {
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+// maps *length bytes of zeroed memory and rounds *length up to what was
+// mapped, NULL if that fails
+void* large_map(size_t* length) {
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (huge_pages == HUGE_PAGES_OFF) {
+        void* addr = mmap(NULL, *length, prot, flags, -1, 0);
+        return addr != MAP_FAILED ? addr : NULL;
+    }
+    size_t rounded = round_up_bytes(*length, HUGE_PAGE_BYTES);
+    if (huge_pages == HUGE_PAGES_HUGETLB) {
+        void* addr = mmap(NULL, rounded, prot, flags | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            *length = rounded;
+            return addr;
+        }
+        if (!atomic_exchange(&hugetlb_warned, true)) {
+            fprintf(stderr, "Warning: no huge pages for MAP_HUGETLB (see /proc/sys/vm/nr_hugepages), "
+                            "using transparent huge pages\n");
+        }
+    }
+    // transparent huge pages need aligned memory: map one more huge page and
+    // unmap what sticks out on either side of the aligned part
+    char* addr = mmap(NULL, rounded + HUGE_PAGE_BYTES, prot, flags, -1, 0);
+    if (addr == MAP_FAILED) { return NULL; }
+    char* aligned = (char*) round_up_bytes((uintptr_t) addr, HUGE_PAGE_BYTES);
+    if (aligned > addr) { munmap(addr, aligned - addr); }
+    munmap(aligned + rounded, addr + HUGE_PAGE_BYTES - aligned);
+    madvise(aligned, rounded, MADV_HUGEPAGE); // only a hint, e.g. THP may be off
+    *length = rounded;
+    return aligned;
+}
+
+typedef struct {
+    char* data;
+    int elsize;
+} FirstTouchArgs;
+
+void first_touch_chunk(void* ctx, int chunk, int start, int end) {
+    FirstTouchArgs* args = ctx;
+    memset(args->data + (size_t) start * args->elsize, 0, (size_t) (end - start) * args->elsize);
+}
+
+// The block of a Storage too big for the pool (bytes, for size elements of
+// dtype), placed as the NUMA policy and huge page setting say, or NULL for a
+// plain malloc if both are off (or mapping fails). Sets *mapped_bytes to the
+// length of the mapping.
+void* storage_map_large(size_t bytes, int size, int dtype, size_t* mapped_bytes) {
+    if (numa_policy == NUMA_DEFAULT && huge_pages == HUGE_PAGES_OFF) { return NULL; }
+    size_t length = bytes;
+    char* block = large_map(&length);
+    if (block == NULL) { return NULL; }
+#ifdef TENSOR1D_NUMA
+    if (numa_policy == NUMA_INTERLEAVE) { numa_interleave_memory(block, length, numa_all_nodes_ptr); }
+#endif
+    if (numa_policy == NUMA_FIRST_TOUCH) {
+        // the same chunks as the ops on a tensor of the whole Storage
+        FirstTouchArgs args = { block + STORAGE_HEADER_BYTES, dtype_info[dtype].size };
+        parallel_for(size, first_touch_chunk, &args);
+    }
+    *mapped_bytes = length;
+    return block;
+}
+
+// Places the large Storages allocated from now on, see NumaPolicy. Needs a
+// build with NUMA=1 (libnuma) and a kernel with NUMA support, else only
+// NUMA_DEFAULT is accepted. The thread pool is restarted so that its workers
+// are pinned to the nodes (or no longer pinned, for NUMA_DEFAULT).
+bool tensor_set_numa_policy(int policy) {
+    if (policy < NUMA_DEFAULT || policy > NUMA_FIRST_TOUCH) {
+        fprintf(stderr, "ValueError: unknown NUMA policy %d\n", policy);
+        return false;
+    }
+#ifdef TENSOR1D_NUMA
+    if (policy != NUMA_DEFAULT && numa_available() < 0) {
+        fprintf(stderr, "ValueError: NUMA is not available on this system\n");
+        return false;
+    }
+#else
+    if (policy != NUMA_DEFAULT) {
+        fprintf(stderr, "ValueError: NUMA policies need a build with NUMA=1\n");
+        return false;
+    }
+#endif
+    pthread_mutex_lock(&thread_pool_job_lock);
+    pool_stop(&thread_pool); // restarted by the next parallel op
+#ifdef TENSOR1D_NUMA
+    numa_node_count = 0;
+    if (policy != NUMA_DEFAULT) {
+        for (int node = 0; node <= numa_max_node() && numa_node_count < NUMA_MAX_NODES; node++) {
+            if (numa_bitmask_isbitset(numa_all_nodes_ptr, node)) { numa_nodes[numa_node_count++] = node; }
+        }
+    }
+#endif
+    numa_policy = policy;
+    pthread_mutex_unlock(&thread_pool_job_lock);
+    return true;
+}
+
+int tensor_get_numa_policy(void) {
+    return numa_policy;
+}
+
+// the nodes with memory a NUMA policy places Storages on, 0 without NUMA support
+int tensor_numa_num_nodes(void) {
+#ifdef TENSOR1D_NUMA
+    return numa_available() < 0 ? 0 : numa_num_configured_nodes();
+#else
+    return 0;
+#endif
+}
+
+// backs the large Storages allocated from now on with huge pages, see HugePages
+bool tensor_set_huge_pages(int mode) {
+    if (mode < HUGE_PAGES_OFF || mode > HUGE_PAGES_HUGETLB) {
+        fprintf(stderr, "ValueError: unknown huge pages mode %d\n", mode);
+        return false;
+    }
+    huge_pages = mode;
+    return true;
+}
+
+int tensor_get_huge_pages(void) {
+    return huge_pages;
+}
+
+// ----------------------------------------------------------------------------
+// Tensor class functions
+
+// A view is an offset into the Storage plus a shape and strides (in elements),
+// one per dimension, like in PyTorch. Most ops only care about the elements in
+// row-major order, and see a view as `size` elements at offset + i * stride.
+// That covers every 1-D view, and the N-d views whose dimensions line up into a
+// single strided run, e.g. contiguous ones: those are flat (tensor_is_flat).
+// Other views, e.g. transposed ones, are walked run by run (view_for_each_run)
+// or made flat with a copy first (flat_input).
+
+// checks a shape, and sets size to its number of elements
+bool check_shape(int ndim, const int* shape, int* size) {
+    if (ndim < 0 || ndim > TENSOR_MAX_DIMS) {
+        fprintf(stderr, "ValueError: %d dimensions, at most %d are supported\n", ndim, TENSOR_MAX_DIMS);
+        return false;
+    }
+    long long n = 1;
+    for (int d = 0; d < ndim; d++) {
+        if (shape[d] < 0) {
+            fprintf(stderr, "ValueError: negative dimension %d in shape\n", shape[d]);
+            return false;
+        }
+        n *= shape[d];
+        if (n > INT_MAX) {
+            fprintf(stderr, "ValueError: shape has more elements than a tensor can index\n");
+            return false;
+        }
+    }
+    *size = (int) n;
+    return true;
+}
+
+// the number of elements of a shape that passed check_shape
+int shape_numel(int ndim, const int* shape) {
+    int n = 1;
+    for (int d = 0; d < ndim; d++) { n *= shape[d]; }
+    return n;
+}
+
+// merges the dimensions of t that continue each other into one, skipping the
+// size-1 ones, and returns how many are left (0 for a single element)
+int view_collapse(const Tensor* t, int* shape, int* strides) {
+    int nd = 0;
+    for (int d = 0; d < t->ndim; d++) {
+        if (t->shape[d] == 1) { continue; }
+        if (nd > 0 && strides[nd - 1] == t->shape[d] * t->strides[d]) {
+            shape[nd - 1] *= t->shape[d];
+            strides[nd - 1] = t->strides[d];
+        } else {
+            shape[nd] = t->shape[d];
+            strides[nd] = t->strides[d];
+            nd++;
+        }
+    }
+    return nd;
+}
+
+// sets the shape and strides of t, and the size and flat stride that follow
+void view_set(Tensor* t, int ndim, const int* shape, const int* strides) {
+    t->ndim = ndim;
+    t->size = 1;
+    for (int d = 0; d < ndim; d++) {
+        t->shape[d] = shape[d];
+        t->strides[d] = strides[d];
+        t->size *= shape[d];
+    }
+    int collapsed_shape[TENSOR_MAX_DIMS];
+    int collapsed_strides[TENSOR_MAX_DIMS];
+    int nd = view_collapse(t, collapsed_shape, collapsed_strides);
+    if (ndim == 1) {
+        t->stride = strides[0];
+    } else {
+        t->stride = nd == 1 ? collapsed_strides[0] : nd == 0 ? 1 : 0; // 0: not flat
+    }
+}
+
+// the row-major (contiguous) strides for shape
+void view_set_contiguous(Tensor* t, int ndim, const int* shape) {
+    int strides[TENSOR_MAX_DIMS];
+    int stride = 1;
+    for (int d = ndim - 1; d >= 0; d--) {
+        strides[d] = stride;
+        stride *= max(shape[d], 1);
+    }
+    view_set(t, ndim, shape, strides);
+}
+
+// the 1-D view given by t->size and t->stride
+void view_set_1d(Tensor* t) {
+    int size = t->size;
+    int stride = t->stride;
+    view_set(t, 1, &size, &stride);
+}
+
+bool tensor_is_flat(Tensor* t) {
+    int shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS];
+    return t->size == 0 || view_collapse(t, shape, strides) <= 1;
+}
+
+// like torch's t.is_contiguous(): the elements are adjacent, in row-major order
+bool tensor_is_contiguous(Tensor* t) {
+    return tensor_is_flat(t) && (t->size <= 1 || t->stride == 1);
+}
+
+// Calls fn for the first n elements of t in row-major order, one run at a time:
+// logical elements [start, start + len) sit at storage offset + j * stride.
+// Mergeable dimensions are merged first, so runs are as long as possible.
+typedef void (*RunFn)(void* ctx, int start, ptrdiff_t offset, int stride, int len);
+
+void view_for_each_run(Tensor* t, int n, RunFn fn, void* ctx) {
+    int shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS];
+    int nd = view_collapse(t, shape, strides);
+    if (nd == 0) {
+        if (n > 0) { fn(ctx, 0, t->offset, 1, 1); }
+        return;
+    }
+    int inner = shape[nd - 1];
+    int index[TENSOR_MAX_DIMS] = { 0 };
+    ptrdiff_t offset = t->offset;
+    for (int start = 0; start < n; start += inner) {
+        fn(ctx, start, offset, strides[nd - 1], min(inner, n - start));
+        // step the outer dimensions like an odometer
+        for (int d = nd - 2; d >= 0; d--) {
+            offset += strides[d];
+            if (++index[d] < shape[d]) { break; }
+            offset -= (ptrdiff_t) strides[d] * shape[d];
+            index[d] = 0;
+        }
+    }
+}
+
+// copies elements between a view and a contiguous buffer of the same dtype, run by run
+typedef struct {
+    char* view_data; // the data of the view's Storage
+    char* flat;
+    int elsize;
+    bool into_view; // flat -> view, else view -> flat
+} CopyRunArgs;
+
+void copy_run(void* ctx, int start, ptrdiff_t offset, int stride, int len) {
+    CopyRunArgs* args = ctx;
+    char* v = args->view_data + offset * args->elsize;
+    char* f = args->flat + (ptrdiff_t) start * args->elsize;
+    if (stride == 1) {
+        memcpy(args->into_view ? v : f, args->into_view ? f : v, (size_t) len * args->elsize);
+    } else if (args->into_view) {
+        copy_elements(v, stride, f, 1, len, args->elsize);
+    } else {
+        copy_elements(f, 1, v, stride, len, args->elsize);
+    }
+}
+
+void view_copy(Tensor* t, void* flat, bool into_view) {
+    CopyRunArgs args = { t->storage->data, flat, dtype_info[t->dtype].size, into_view };
+    view_for_each_run(t, t->size, copy_run, &args);
+}
+
+// Broadcasting, like in NumPy and PyTorch: shapes are lined up at their last
+// dimension, and a dimension of size 1 (or a missing one) stretches to the size
+// of the other shape, by reading it with stride 0. E.g. (3, 1) and (4,)
+// broadcast to (3, 4).
+
+// the broadcast shape of shape1 and shape2, false if they don't broadcast
+bool broadcast_shapes(int ndim1, const int* shape1, int ndim2, const int* shape2, int* ndim, int* shape) {
+    int nd = max(ndim1, ndim2);
+    for (int d = 0; d < nd; d++) {
+        int d1 = d - (nd - ndim1);
+        int d2 = d - (nd - ndim2);
+        int n1 = d1 >= 0 ? shape1[d1] : 1;
+        int n2 = d2 >= 0 ? shape2[d2] : 1;
+        if (n1 != n2 && n1 != 1 && n2 != 1) {
+            fprintf(stderr, "ValueError: sizes %d and %d don't broadcast in dimension %d\n", n1, n2, d);
+            return false;
+        }
+        shape[d] = n1 == 1 ? n2 : n1;
+    }
+    *ndim = nd;
+    return true;
+}
+
+bool broadcast_shape(Tensor* t1, Tensor* t2, int* ndim, int* shape) {
+    return broadcast_shapes(t1->ndim, t1->shape, t2->ndim, t2->shape, ndim, shape);
+}
+
+// Walks several operands of one shape together (out and the inputs of an op),
+// each with its own strides. Dimensions of size 1 are dropped, and neighbouring
+// dimensions that continue each other in every operand are merged (like
+// view_collapse), so e.g. contiguous tensors become a single run, and the inner
+// loop over each run is as long as possible for the kernels.
+#define BROADCAST_MAX_OPERANDS 4
+
+typedef struct {
+    int num_operands;
+    int ndim; // 0 for a single element
+    int shape[TENSOR_MAX_DIMS];
+    int strides[BROADCAST_MAX_OPERANDS][TENSOR_MAX_DIMS];
+} BroadcastIter;
+
+void broadcast_iter_init(BroadcastIter* it, int ndim, const int* shape) {
+    it->num_operands = 0;
+    it->ndim = ndim;
+    memcpy(it->shape, shape, ndim * sizeof(int));
+}
+
+// adds an operand with the given strides for it->shape
+void broadcast_iter_add(BroadcastIter* it, const int* strides) {
+    memcpy(it->strides[it->num_operands++], strides, it->ndim * sizeof(int));
+}
+
+// adds an operand of the given shape and strides, which has to broadcast to it->shape
+void broadcast_iter_add_shape(BroadcastIter* it, int ndim, const int* shape, const int* strides) {
+    int it_strides[TENSOR_MAX_DIMS];
+    int lead = it->ndim - ndim;
+    for (int d = 0; d < it->ndim; d++) {
+        bool stretched = d < lead || shape[d - lead] != it->shape[d];
+        it_strides[d] = stretched ? 0 : strides[d - lead];
+    }
+    broadcast_iter_add(it, it_strides);
+}
+
+void broadcast_iter_add_tensor(BroadcastIter* it, Tensor* t) {
+    broadcast_iter_add_shape(it, t->ndim, t->shape, t->strides);
+}
+
+// call once all operands are added
+void broadcast_iter_merge(BroadcastIter* it) {
+    int nd = 0;
+    for (int d = 0; d < it->ndim; d++) {
+        if (it->shape[d] == 1) { continue; }
+        bool merge = nd > 0;
+        for (int k = 0; k < it->num_operands && merge; k++) {
+            merge = it->strides[k][nd - 1] == it->shape[d] * it->strides[k][d];
+        }
+        if (merge) {
+            it->shape[nd - 1] *= it->shape[d];
+        } else {
+            it->shape[nd] = it->shape[d];
+            nd++;
+        }
+        for (int k = 0; k < it->num_operands; k++) { it->strides[k][nd - 1] = it->strides[k][d]; }
+    }
+    it->ndim = nd;
+}
+
+// Calls fn for elements [start, end) of the shape in row-major order, one run
+// at a time: element j of the run is at offsets[k] + j * strides[k] (relative
+// to the first element) in operand k. Any range can be given, so the work
+// splits into chunks for parallel_for.
+typedef void (*BroadcastRunFn)(void* ctx, const ptrdiff_t* offsets, const int* strides, int len);
+
+void broadcast_for_each_run(const BroadcastIter* it, int start, int end, BroadcastRunFn fn, void* ctx) {
+    if (start >= end) { return; }
+    int nd = it->ndim;
+    int num = it->num_operands;
+    ptrdiff_t offsets[BROADCAST_MAX_OPERANDS] = { 0 };
+    int inner_strides[BROADCAST_MAX_OPERANDS] = { 0 };
+    if (nd == 0) {
+        fn(ctx, offsets, inner_strides, 1);
+        return;
+    }
+    int inner = it->shape[nd - 1];
+    for (int k = 0; k < num; k++) { inner_strides[k] = it->strides[k][nd - 1]; }
+    // the index of element start
+    int index[TENSOR_MAX_DIMS];
+    int pos = start % inner;
+    int rest = start / inner;
+    for (int d = nd - 2; d >= 0; d--) {
+        index[d] = rest % it->shape[d];
+        rest /= it->shape[d];
+        for (int k = 0; k < num; k++) { offsets[k] += (ptrdiff_t) index[d] * it->strides[k][d]; }
+    }
+    for (int k = 0; k < num; k++) { offsets[k] += (ptrdiff_t) pos * inner_strides[k]; }
+    for (int i = start; i < end;) {
+        int len = min(inner - pos, end - i);
+        fn(ctx, offsets, inner_strides, len);
+        i += len;
+        // back to the start of the run, then step the outer dimensions like an odometer
+        for (int k = 0; k < num; k++) { offsets[k] -= (ptrdiff_t) pos * inner_strides[k]; }
+        pos = 0;
+        for (int d = nd - 2; d >= 0; d--) {
+            for (int k = 0; k < num; k++) { offsets[k] += it->strides[k][d]; }
+            if (++index[d] < it->shape[d]) { break; }
+            for (int k = 0; k < num; k++) { offsets[k] -= (ptrdiff_t) it->strides[k][d] * it->shape[d]; }
+            index[d] = 0;
+        }
+    }
+}
+
+
+// Compaction. A view keeps all of its Storage alive, so a 4-byte slice of a
+// huge tensor pins the whole buffer. tensor_compact moves a view to a Storage of
+// just its own elements, and tensor_storage_utilization finds the views worth
+// it. With tensor_set_auto_compact a Storage does it by itself: when the second
+// to last reference to it goes away, and the view left uses less than the set
+// fraction of it, that view is compacted and the old Storage freed. To find the
+// view left, such a Storage keeps a list of its views (intrusive, through the
+// Tensor headers). Shared Storages are never compacted behind the back of the
+// threads using them, their lists are only kept consistent, under views_lock.
+
+pthread_mutex_t views_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// elements of its Storage that t can reach, expanded dimensions reach just one
+int view_reach(Tensor* t) {
+    if (t->size == 0) { return 0; }
+    long long n = 1;
+    for (int d = 0; d < t->ndim; d++) {
+        if (t->strides[d] != 0) { n *= t->shape[d]; }
+    }
+    return n < t->storage->data_size ? (int) n : t->storage->data_size; // as_strided views can overlap
+}
+
+// the fraction of the elements of its Storage that t can reach
+float tensor_storage_utilization(Tensor* t) {
+    tensor_eval(t);
+    int data_size = t->storage->data_size;
+    return data_size == 0 ? 1.0f : (float) view_reach(t) / data_size;
+}
+
+// adds a new view to the list of its Storage, if it keeps one
+void view_track(Tensor* v) {
+    Storage* s = v->storage;
+    v->next_view = NULL;
+    v->prev_link = NULL;
+    if (s == NULL || s->compact_below <= 0.0f) { return; }
+    if (s->shared) { pthread_mutex_lock(&views_lock); }
+    v->next_view = s->views;
+    if (s->views != NULL) { s->views->prev_link = &v->next_view; }
+    s->views = v;
+    v->prev_link = &s->views;
+    if (s->shared) { pthread_mutex_unlock(&views_lock); }
+}
+
+void view_untrack(Tensor* v) {
+    if (v->prev_link == NULL) { return; } // only ever set by v itself
+    Storage* s = v->storage;
+    if (s->shared) { pthread_mutex_lock(&views_lock); }
+    *v->prev_link = v->next_view;
+    if (v->next_view != NULL) { v->next_view->prev_link = v->prev_link; }
+    v->next_view = NULL;
+    v->prev_link = NULL;
+    if (s->shared) { pthread_mutex_unlock(&views_lock); }
+}
+
+// Moves t to a new Storage holding a contiguous copy of just its elements,
+// with the flags of the old one. The other views keep the old Storage, and
+// the reference t had to it is returned, for storage_release.
+Storage* view_rematerialize(Tensor* t) {
+    Storage* old = t->storage;
+    Storage* s = storage_new_dtype(t->size, t->dtype);
+    s->shared = old->shared; // the refcount of t follows it
+    s->readonly = old->readonly;
+    s->scale = old->scale;
+    s->copy_on_write = old->copy_on_write;
+    s->compact_below = old->compact_below;
+    view_copy(t, s->data, false);
+    view_untrack(t);
+    t->storage = s;
+    t->offset = 0;
+    view_set_contiguous(t, t->ndim, t->shape);
+    view_track(t);
+    return old;
+}
+
+// drops a reference of a view (already untracked) to s, compacting the last
+// view left if it uses too little of s
+void storage_release(Storage* s) {
+    if (!s->shared && s->compact_below > 0.0f && atomic_load_explicit(&s->ref_count, memory_order_relaxed) == 2) {
+        // the one other reference is the only view that can be in the list
+        Tensor* last = s->views;
+        if (last != NULL && tensor_storage_utilization(last) < s->compact_below) {
+            storage_decref(s);
+            s = view_rematerialize(last); // its reference, the last one
+        }
+    }
+    storage_decref(s);
+}
+
+// torch.clone: a contiguous copy of t in a Storage of its own
+Tensor* tensor_clone(Tensor* t) {
+    STATS_OP(STATS_OP_CLONE);
+    tensor_eval(t);
+    Tensor* c = tensor_empty_shape(t->ndim, t->shape, t->dtype);
+    c->storage->scale = t->storage->scale;
+    view_copy(t, c->storage->data, false);
+    return c;
+}
+
+// A copy of t on the heap, contiguous like tensor_clone, to keep a result of an
+// arena scope past its end. t itself, with a new reference, if neither its
+// header nor its Storage come from an arena.
+Tensor* tensor_arena_promote(Tensor* t) {
+    tensor_eval(t);
+    if (t->arena == NULL && t->storage->arena == NULL) {
+        tensor_incref(t);
+        return t;
+    }
+    Arena* arena = arena_current;
+    arena_current = NULL;
+    Tensor* c = tensor_clone(t);
+    arena_current = arena;
+    return c;
+}
+
+// Moves t in place to a right-sized contiguous Storage of its own, if its
+// current one holds more elements than t has. Returns whether it did.
+bool tensor_compact(Tensor* t) {
+    tensor_eval(t);
+    if (t->size >= t->storage->data_size) { return false; }
+    storage_release(view_rematerialize(t));
+    return true;
+}
+
+// From now on, when all views of the Storage of t but one are gone and that
+// one reaches less than min_utilization of it, it is compacted. Views made
+// before this call are not tracked, call it on the base tensor before slicing.
+// 0 turns it off again.
+void tensor_set_auto_compact(Tensor* t, float min_utilization) {
+    tensor_eval(t);
+    Storage* s = t->storage;
+    s->compact_below = min_utilization;
+    if (min_utilization <= 0.0f) { return; }
+    if (t->prev_link == NULL) { view_track(t); }
+    // t may already be the last view
+    if (atomic_load_explicit(&s->ref_count, memory_order_relaxed) == 1 && tensor_storage_utilization(t) < min_utilization) {
+        storage_decref(view_rematerialize(t));
+    }
+}
+
+// torch.empty(size, dtype=dtype)
+Tensor* tensor_empty_dtype(int size, int dtype) {
+    STATS_OP(STATS_OP_EMPTY);
+    if (!dtype_valid(dtype)) {
+        fprintf(stderr, "ValueError: unknown dtype %d\n", dtype);
+        return NULL;
+    }
+    Tensor* t = tensor_header_alloc();
+    t->storage = storage_new_dtype(size, dtype);
+    // at init we cover the whole storage, i.e. range(start=0, stop=size, step=1)
+    t->offset = 0;
+    t->size = size;
+    t->stride = 1;
+    view_set_1d(t);
+    // holds the text representation of the tensor
+    t->repr = NULL;
+    atomic_init(&t->ref_count, 1);
+    t->expr = NULL;
+    t->dtype = dtype;
+    view_track(t);
+    STATS_TENSOR_ADD(1);
+    return t;
+}
+
+// torch.empty(size)
+Tensor* tensor_empty(int size) {
+    return tensor_empty_dtype(size, DTYPE_FLOAT32);
+}
+
+// torch.empty(shape, dtype=dtype), contiguous
+Tensor* tensor_empty_shape(int ndim, const int* shape, int dtype) {
+    STATS_OP(STATS_OP_EMPTY);
+    int size;
+    if (!check_shape(ndim, shape, &size)) { return NULL; }
+    Tensor* t = tensor_empty_dtype(size, dtype);
+    if (t != NULL) { view_set_contiguous(t, ndim, shape); }
+    return t;
+}
+
+// Wrap existing memory of `size` elements of dtype in a Tensor without copying
+// it, e.g. torch.from_numpy. See storage_new_external for the deleter.
+Tensor* tensor_from_blob_dtype(void* data, int size, int dtype, void (*deleter)(void*), void* deleter_ctx) {
+    STATS_OP(STATS_OP_FROM_ARRAY);
+    Tensor* t = tensor_header_alloc();
+    t->storage = storage_new_external(data, size, dtype, deleter, deleter_ctx);
+    t->offset = 0;
+    t->size = size;
+    t->stride = 1;
+    view_set_1d(t);
+    t->repr = NULL;
+    atomic_init(&t->ref_count, 1);
+    t->expr = NULL;
+    t->dtype = dtype;
+    view_track(t);
+    STATS_TENSOR_ADD(1);
+    return t;
+}
+
+Tensor* tensor_from_blob(float* data, int size, void (*deleter)(void*), void* deleter_ctx) {
+    return tensor_from_blob_dtype(data, size, DTYPE_FLOAT32, deleter, deleter_ctx);
+}
+
+// a new Tensor holding a copy of `size` floats, in one memcpy
+Tensor* tensor_from_array(const float* data, int size) {
+    STATS_OP(STATS_OP_FROM_ARRAY);
+    Tensor* t = tensor_empty(size);
+    memcpy(t->storage->data, data, size * sizeof(float));
+    return t;
+}
+
+// a new Tensor of dtype holding `size` doubles, converted (int8 with scale 1)
+Tensor* tensor_from_array_f64(const double* data, int size, int dtype) {
+    STATS_OP(STATS_OP_FROM_ARRAY);
+    Tensor* t = tensor_empty_dtype(size, dtype);
+    if (t == NULL) { return NULL; }
+    dtype_info[dtype].store(t->storage->data, 1, data, size, 1.0f);
+    return t;
+}
+
+// torch.arange(size)
+Tensor* tensor_arange(int size) {
+    STATS_OP(STATS_OP_ARANGE);
+    Tensor* t = tensor_empty(size);
+    for (int i = 0; i < t->size; i++) {
+        tensor_setitem(t, i, (float) i);
+    }
+    return t;
+}
+
+// ix counts the elements in row-major order, also for N-d views
+int logical_to_physical(Tensor *t, int ix) {
+    if (t->ndim == 1) { return t->offset + ix * t->stride; }
+    int idx = t->offset;
+    for (int d = t->ndim - 1; d >= 0; d--) {
+        idx += (ix % t->shape[d]) * t->strides[d];
+        ix /= t->shape[d];
+    }
+    return idx;
+}
+
+// pointer to the first element of the view, i.e. logical index 0
+// (a lazy tensor gets evaluated here, so it has data to point to)
+void* tensor_data_ptr(Tensor* t) {
+    tensor_eval(t);
+    return element_ptr(t->storage->data, t->offset, t->dtype);
+}
+
+// dequantization scale of the elements of t, 1 for all but int8
+float tensor_scale(Tensor* t) {
+    tensor_eval(t);
+    return t->storage->scale;
+}
+
+typedef struct {
+    Tensor* t;
+    void* dst;
+    bool f64;
+} CopyToArgs;
+
+void copy_to_run(void* ctx, int start, ptrdiff_t offset, int stride, int len) {
+    CopyToArgs* args = ctx;
+    Tensor* t = args->t;
+    const void* a = element_ptr(t->storage->data, offset, t->dtype);
+    if (args->f64) {
+        dtype_info[t->dtype].load((double*) args->dst + start, a, stride, len, t->storage->scale);
+    } else if (t->dtype == DTYPE_FLOAT32 && stride == 1) {
+        memcpy((float*) args->dst + start, a, len * sizeof(float));
+    } else {
+        dtype_info[t->dtype].load_f32((float*) args->dst + start, a, stride, len, t->storage->scale);
+    }
+}
+
+// copy the logical elements of t (i.e. respecting its view, in row-major order) into dst, as floats
+void tensor_copy_to(Tensor* t, float* dst) {
+    tensor_eval(t);
+    CopyToArgs args = { t, dst, false };
+    view_for_each_run(t, t->size, copy_to_run, &args);
+}
+
+// same as tensor_copy_to, as doubles, which is exact for every dtype
+void tensor_copy_to_f64(Tensor* t, double* dst) {
+    tensor_eval(t);
+    CopyToArgs args = { t, dst, true };
+    view_for_each_run(t, t->size, copy_to_run, &args);
+}
+
+// Index into the tensor.
+// Note that both PyTorch and numpy actually return a 1-element Tensor when you index like:
+// val = t[ix]
+// This particular function returns the actual value, i.e.:
+// val = t[ix].item()
+// as a double, which holds the elements of every dtype exactly
+double tensor_getitem_f64(Tensor* t, int ix) {
+    STATS_OP(STATS_OP_GETITEM);
+    // handle negative indices by wrapping around
+    if (ix < 0) { ix = t->size + ix; }
+    // oob indices raise IndexError (and we return NaN)
+    if (ix >= t->size) {
+        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
+        return NAN;
+    }
+    // get the physical index into the storage and return the value
+    tensor_eval(t);
+    int idx = logical_to_physical(t, ix);
+    return storage_getitem(t->storage, idx);
+}
+
+// same, as a float
+float tensor_getitem(Tensor* t, int ix) {
+    return (float) tensor_getitem_f64(t, ix);
+}
+
+// The _astensor version of getitem:
+// val = t[ix]
+// i.e. consistent with PyTorch/numpy create a 1-element Tensor and return it.
+// On an N-d tensor, t[ix] is row ix, see tensor_select.
+Tensor* tensor_getitem_astensor(Tensor* t, int ix) {
+    STATS_OP(STATS_OP_GETITEM);
+    if (t->ndim != 1) { return tensor_select(t, 0, ix); }
+    // wrap around negative indices so we can do +1 below with confidence
+    if (ix < 0) { ix = t->size + ix; }
+    // effectively: t[ix:ix+1:1] <=> t[ix:ix+1] <=> t[ix]
+    Tensor* slice = tensor_slice(t, ix, ix + 1, 1);
+    return slice;
+}
+
+// A read-only tensor (e.g. over a read-only mapped file, or a read-only
+// buffer) rejects setitem and being the destination of an op. The flag lives
+// on the Storage, so it covers every view of it.
+bool tensor_is_readonly(Tensor* t) {
+    return t->storage != NULL && t->storage->readonly; // lazy tensors own fresh memory
+}
+
+// marks the storage under t read-only, there is no way back
+void tensor_set_readonly(Tensor* t) {
+    tensor_eval(t);
+    t->storage->readonly = true;
+}
+
+// Copy-on-write is opt-in, per Storage. Its views share it while they only
+// read, and the first write through a view while other views still reference
+// the Storage first gives that view a private copy of just its own elements,
+// so the write shows up in no other view. A Storage only one view references
+// is written in place, as usual: the check on the write path is one read of
+// the refcount. Memory exported zero-copy (e.g. with numpy()) is written
+// behind its back, and isn't covered.
+void tensor_set_copy_on_write(Tensor* t, bool enabled) {
+    tensor_eval(t);
+    t->storage->copy_on_write = enabled;
+}
+
+bool tensor_is_copy_on_write(Tensor* t) {
+    return t->storage != NULL && t->storage->copy_on_write;
+}
+
+// call before writing to t: false if it is read-only, and under copy-on-write
+// t is detached from the other views first
+bool check_writable(Tensor* t) {
+    if (tensor_is_readonly(t)) {
+        fprintf(stderr, "ValueError: tensor is read-only\n");
+        return false;
+    }
+    Storage* s = t->storage;
+    if (s != NULL && atomic_load_explicit(&s->ref_count, memory_order_relaxed) > 1 && s->copy_on_write) {
+        storage_release(view_rematerialize(t));
+    }
+    return true;
+}
+
+// does what a write to t does first, for a caller that then writes to t
+// through a view of its own: under copy-on-write that view alone would get a copy
+bool tensor_make_writable(Tensor* t) {
+    tensor_eval(t);
+    return check_writable(t);
+}
+
+// t[ix] = val
+// the value is rounded to the dtype of t (and quantized for int8)
+void tensor_setitem_f64(Tensor* t, int ix, double val) {
+    STATS_OP(STATS_OP_SETITEM);
+    // handle negative indices by wrapping around
+    if (ix < 0) { ix = t->size + ix; }
+    if (ix >= t->size) {
+        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
+        return;
+    }
+    if (!check_writable(t)) { return; }
+    tensor_eval(t);
+    int idx = logical_to_physical(t, ix);
+    storage_setitem(t->storage, idx, val);
+}
+
+void tensor_setitem(Tensor* t, int ix, float val) {
+    tensor_setitem_f64(t, ix, val);
+}
+
+// same as .item() on a torch.Tensor: strips 1-element Tensor to simple scalar
+float tensor_item(Tensor* t) {
+    if (t->size != 1) {
+        fprintf(stderr, "ValueError: can only convert an array of size 1 to a Python scalar\n");
+        return NAN;
+    }
+    return tensor_getitem(t, 0);
+}
+
+// a new Tensor over the same Storage, with the same view (for now)
+Tensor* view_new(Tensor* t) {
+    tensor_eval(t);
+    Tensor* v = tensor_header_alloc();
+    v->storage = t->storage; // inherit the underlying storage!
+    v->offset = t->offset;
+    view_set(v, t->ndim, t->shape, t->strides);
+    v->repr = NULL;
+    atomic_init(&v->ref_count, 1);
+    v->expr = NULL;
+    v->dtype = t->dtype;
+    storage_incref(v->storage); // increment the reference count
+    view_track(v);
+    STATS_TENSOR_ADD(1);
+    return v;
+}
+
+// wraps a negative dim around, false (and an IndexError) if it's out of range.
+// ndim is that of the result, e.g. one more than t->ndim for tensor_unsqueeze
+bool normalize_dim(int* dim, int ndim) {
+    if (*dim < 0) { *dim += ndim; }
+    if (*dim < 0 || *dim >= ndim) {
+        fprintf(stderr, "IndexError: dimension out of range (expected to be in range of [%d, %d])\n", -ndim, ndim - 1);
+        return false;
+    }
+    return true;
+}
+
+// return a new Tensor with a new view, but same Storage, i.e.:
+// t[start:end:step]
+// which slices the first dimension of an N-d tensor
+Tensor* tensor_slice(Tensor* t, int start, int end, int step) {
+    if (t->ndim == 0) {
+        fprintf(stderr, "IndexError: cannot slice a 0-d tensor\n");
+        return tensor_empty(0);
+    }
+    Tensor* s = tensor_slice_dim(t, 0, start, end, step);
+    return s != NULL ? s : tensor_empty(0);
+}
+
+// t[:, ..., start:end:step] along dimension dim. A negative step walks
+// backwards from start, like in NumPy (PyTorch doesn't allow it), and gives a
+// view with a negative stride: nothing is copied. Indices are clipped like
+// Python's slice.indices, so with a negative step an end of -n - 1 or lower
+// (where -1 would wrap to the last element) means "down to the first one".
+Tensor* tensor_slice_dim(Tensor* t, int dim, int start, int end, int step) {
+    STATS_OP(STATS_OP_SLICE);
+    if (!normalize_dim(&dim, t->ndim)) { return NULL; }
+    if (step == 0) {
+        fprintf(stderr, "ValueError: slice step cannot be zero\n");
+        return NULL;
+    }
+    int n = t->shape[dim];
+    // 1) handle negative indices by wrapping around
+    if (start < 0) { start = n + start; }
+    if (end < 0) { end = n + end; }
+    // 2) handle out-of-bounds indices: clip to [0, n], or to [-1, n - 1]
+    // walking backwards, where -1 stands for "before the first element"
+    int lo = step > 0 ? 0 : -1;
+    int hi = step > 0 ? n : n - 1;
+    start = min(max(start, lo), hi);
+    end = min(max(end, lo), hi);
+    // 3) handle step
+    int len = step > 0 ? ceil_div(end - start, step) : ceil_div(start - end, -step);
+    len = max(len, 0);
+    // create the new Tensor: same Storage but new View
+    Tensor* s = view_new(t);
+    if (len > 0) { s->offset = t->offset + start * t->strides[dim]; }
+    s->shape[dim] = len;
+    s->strides[dim] = t->strides[dim] * step;
+    view_set(s, s->ndim, s->shape, s->strides);
+    return s;
+}
+
+// t[..., index, ...]: the view of one index along dim, which has one dimension less
+Tensor* tensor_select(Tensor* t, int dim, int index) {
+    STATS_OP(STATS_OP_SELECT);
+    if (!normalize_dim(&dim, t->ndim)) { return NULL; }
+    int n = t->shape[dim];
+    if (index < 0) { index = n + index; }
+    if (index < 0 || index >= n) {
+        fprintf(stderr, "IndexError: index %d is out of bounds for dimension %d with size %d\n", index, dim, n);
+        return NULL;
+    }
+    Tensor* s = view_new(t);
+    s->offset = t->offset + index * t->strides[dim];
+    for (int d = dim; d < t->ndim - 1; d++) {
+        s->shape[d] = t->shape[d + 1];
+        s->strides[d] = t->strides[d + 1];
+    }
+    view_set(s, t->ndim - 1, s->shape, s->strides);
+    return s;
+}
+
+// torch.as_strided: any view over the Storage of t, as long as every element
+// it can reach lies within the Storage
+Tensor* tensor_as_strided(Tensor* t, int ndim, const int* shape, const int* strides, int offset) {
+    STATS_OP(STATS_OP_VIEW);
+    int size;
+    if (!check_shape(ndim, shape, &size)) { return NULL; }
+    tensor_eval(t);
+    long long lo = offset, hi = offset;
+    for (int d = 0; d < ndim && size > 0; d++) {
+        long long reach = (long long) (shape[d] - 1) * strides[d];
+        if (reach < 0) { lo += reach; } else { hi += reach; }
+    }
+    if (size > 0 && (lo < 0 || hi >= t->storage->data_size)) {
+        fprintf(stderr, "ValueError: view reaches elements [%lld, %lld], out of bounds of a storage of %d\n",
+                lo, hi, t->storage->data_size);
+        return NULL;
+    }
+    Tensor* s = view_new(t);
+    s->offset = offset;
+    view_set(s, ndim, shape, strides);
+    return s;
+}
+
+// Computes the strides that view t with a new shape without copying, like
+// PyTorch's computeStride: dimensions of t that are contiguous with each other
+// form chunks, and each chunk can be re-split into any dimensions with the same
+// number of elements. Returns false if the new shape would need a copy.
+bool reshape_strides(Tensor* t, int ndim, const int* shape, int* strides) {
+    if (t->size == 0 || t->ndim == 0) {
+        int stride = 1;
+        for (int d = ndim - 1; d >= 0; d--) {
+            strides[d] = stride;
+            stride *= max(shape[d], 1);
+        }
+        return true;
+    }
+    int view_d = ndim - 1;
+    int chunk_base_stride = t->strides[t->ndim - 1];
+    long long tensor_numel = 1;
+    long long view_numel = 1;
+    for (int tensor_d = t->ndim - 1; tensor_d >= 0; tensor_d--) {
+        tensor_numel *= t->shape[tensor_d];
+        // a chunk ends where the next dimension out doesn't continue this one
+        if (tensor_d == 0 || (t->shape[tensor_d - 1] != 1 && t->strides[tensor_d - 1] != tensor_numel * chunk_base_stride)) {
+            while (view_d >= 0 && (view_numel < tensor_numel || shape[view_d] == 1)) {
+                strides[view_d] = (int) (view_numel * chunk_base_stride);
+                view_numel *= shape[view_d];
+                view_d--;
+            }
+            if (view_numel != tensor_numel) { return false; }
+            if (tensor_d > 0) {
+                chunk_base_stride = t->strides[tensor_d - 1];
+                tensor_numel = 1;
+                view_numel = 1;
+            }
+        }
+    }
+    return view_d == -1;
+}
+
+// t.reshape(shape): a view when the layout allows it (see reshape_strides),
+// else a reshaped contiguous copy. One dimension can be -1, it is inferred.
+Tensor* tensor_reshape(Tensor* t, int ndim, const int* shape) {
+    STATS_OP(STATS_OP_VIEW);
+    if (ndim < 0 || ndim > TENSOR_MAX_DIMS) {
+        fprintf(stderr, "ValueError: %d dimensions, at most %d are supported\n", ndim, TENSOR_MAX_DIMS);
+        return NULL;
+    }
+    int new_shape[TENSOR_MAX_DIMS];
+    int infer = -1;
+    long long known = 1;
+    for (int d = 0; d < ndim; d++) {
+        new_shape[d] = shape[d];
+        if (shape[d] == -1 && infer < 0) {
+            infer = d;
+        } else if (shape[d] < 0) {
+            fprintf(stderr, "ValueError: invalid shape dimension %d\n", shape[d]);
+            return NULL;
+        } else {
+            known *= shape[d];
+        }
+    }
+    if (infer >= 0 && known > 0 && t->size % known == 0) {
+        new_shape[infer] = (int) (t->size / known);
+        known = t->size;
+    }
+    if (known != t->size || (infer >= 0 && new_shape[infer] < 0)) {
+        fprintf(stderr, "ValueError: cannot reshape a tensor of %d elements\n", t->size);
+        return NULL;
+    }
+    int strides[TENSOR_MAX_DIMS];
+    tensor_eval(t);
+    if (reshape_strides(t, ndim, new_shape, strides)) {
+        Tensor* v = view_new(t);
+        view_set(v, ndim, new_shape, strides);
+        return v;
+    }
+    Tensor* c = tensor_contiguous(t);
+    Tensor* v = view_new(c);
+    view_set_contiguous(v, ndim, new_shape);
+    tensor_decref(c);
+    return v;
+}
+
+// t.permute(dims): dimension d of the result is dimension dims[d] of t
+Tensor* tensor_permute(Tensor* t, const int* dims) {
+    STATS_OP(STATS_OP_VIEW);
+    bool seen[TENSOR_MAX_DIMS] = { false };
+    int shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS];
+    for (int d = 0; d < t->ndim; d++) {
+        int src = dims[d];
+        if (!normalize_dim(&src, t->ndim)) { return NULL; }
+        if (seen[src]) {
+            fprintf(stderr, "ValueError: repeated dimension %d in permute\n", src);
+            return NULL;
+        }
+        seen[src] = true;
+        shape[d] = t->shape[src];
+        strides[d] = t->strides[src];
+    }
+    Tensor* v = view_new(t);
+    view_set(v, t->ndim, shape, strides);
+    return v;
+}
+
+// t.transpose(dim0, dim1), e.g. the matrix transpose for a 2-D tensor
+Tensor* tensor_transpose(Tensor* t, int dim0, int dim1) {
+    if (!normalize_dim(&dim0, t->ndim) || !normalize_dim(&dim1, t->ndim)) { return NULL; }
+    int dims[TENSOR_MAX_DIMS];
+    for (int d = 0; d < t->ndim; d++) { dims[d] = d; }
+    dims[dim0] = dim1;
+    dims[dim1] = dim0;
+    return tensor_permute(t, dims);
+}
+
+// t.unsqueeze(dim): a new dimension of size 1 at dim
+Tensor* tensor_unsqueeze(Tensor* t, int dim) {
+    STATS_OP(STATS_OP_VIEW);
+    if (t->ndim == TENSOR_MAX_DIMS) {
+        fprintf(stderr, "ValueError: a tensor can have at most %d dimensions\n", TENSOR_MAX_DIMS);
+        return NULL;
+    }
+    if (!normalize_dim(&dim, t->ndim + 1)) { return NULL; }
+    int shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS];
+    for (int d = 0, src = 0; d <= t->ndim; d++) {
+        if (d == dim) {
+            shape[d] = 1;
+            strides[d] = src < t->ndim ? t->shape[src] * t->strides[src] : 1;
+        } else {
+            shape[d] = t->shape[src];
+            strides[d] = t->strides[src];
+            src++;
+        }
+    }
+    Tensor* v = view_new(t);
+    view_set(v, t->ndim + 1, shape, strides);
+    return v;
+}
+
+// t.expand(shape): size-1 dimensions (and new leading ones) are repeated to
+// the given sizes with a stride of 0, so nothing is copied. -1 keeps a size.
+// Writing to an expanded view writes the same element several times.
+Tensor* tensor_expand(Tensor* t, int ndim, const int* shape) {
+    STATS_OP(STATS_OP_VIEW);
+    if (ndim < t->ndim || ndim > TENSOR_MAX_DIMS) {
+        fprintf(stderr, "ValueError: cannot expand %d dimensions to %d\n", t->ndim, ndim);
+        return NULL;
+    }
+    int new_shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS];
+    int lead = ndim - t->ndim;
+    for (int d = 0; d < ndim; d++) {
+        int size = d < lead ? 1 : t->shape[d - lead];
+        int stride = d < lead ? 0 : t->strides[d - lead];
+        if (shape[d] == -1 && d >= lead) {
+            new_shape[d] = size;
+            strides[d] = stride;
+        } else if (shape[d] == size) {
+            new_shape[d] = size;
+            strides[d] = size == 1 ? 0 : stride;
+        } else if (size == 1 && shape[d] >= 0) {
+            new_shape[d] = shape[d];
+            strides[d] = 0;
+        } else {
+            fprintf(stderr, "ValueError: cannot expand size %d to %d in dimension %d\n", size, shape[d], d);
+            return NULL;
+        }
+    }
+    Tensor* v = view_new(t);
+    view_set(v, ndim, new_shape, strides);
+    return v;
+}
+
+// t.contiguous(): t itself (with a new reference) if it already is contiguous,
+// otherwise a contiguous copy with the same shape
+Tensor* tensor_contiguous(Tensor* t) {
+    STATS_OP(STATS_OP_CONTIGUOUS);
+    tensor_eval(t);
+    if (tensor_is_contiguous(t)) {
+        tensor_incref(t);
+        return t;
+    }
+    return tensor_clone(t);
+}
+
+// flat views are used as they are, others get a contiguous copy. Give the
+// result back to release_input once done.
+Tensor* flat_input(Tensor* t) {
+    tensor_eval(t);
+    return tensor_is_flat(t) ? t : tensor_contiguous(t);
+}
+
+void release_input(Tensor* t, Tensor* flat) {
+    if (flat != t && flat != NULL) { tensor_decref(flat); }
+}
+
+// Lazy mode: while it is on (per thread, see tensor_set_lazy), tensor_add and
+// tensor_addf don't compute anything. They return a Tensor without a Storage
+// that holds an Expr node: the op plus references to its operands. Chains like
+// (a + b) + 1.0 + c become a small tree that is only evaluated when the data is
+// needed (getitem, item, slicing, printing, reductions, or tensor_eval). The
+// whole tree is then computed in one fused pass, block by block, with the
+// intermediate values kept in small L1-sized buffers instead of full temporary
+// Tensors, so memory traffic is one read per input and one write of the result.
+// Inputs are read at evaluation time: writing to them in between shows up in
+// the result, just like it would for a view.
+
+#define EXPR_BLOCK 256    // elements evaluated at a time, per level of the tree
+#define EXPR_MAX_DEPTH 32 // deeper operands get evaluated when the node is built
+
+typedef enum { EXPR_ADD, EXPR_ADDF } ExprOp;
+
+struct Expr {
+    ExprOp op;
+    int depth;  // 1 + the depth of the deepest operand
+    Tensor* a;  // operands, each holds a reference
+    Tensor* b;  // NULL for EXPR_ADDF
+    float val;  // the scalar of EXPR_ADDF
+};
+
+_Thread_local bool lazy_mode = false;
+
+void tensor_set_lazy(bool lazy) {
+    lazy_mode = lazy;
+}
+
+bool tensor_get_lazy(void) {
+    return lazy_mode;
+}
+
+int expr_depth(Tensor* t) {
+    return t->expr != NULL ? t->expr->depth : 0;
+}
+
+// a lazy operand becomes a leaf (gets evaluated) if it would broadcast or make
+// the tree too deep, and a leaf that is not flat is replaced by a contiguous copy
+Tensor* expr_operand(Tensor* t, int size) {
+    if (t->expr != NULL && (t->size != size || expr_depth(t) >= EXPR_MAX_DEPTH)) { tensor_eval(t); }
+    if (t->expr == NULL && !tensor_is_flat(t)) { return tensor_contiguous(t); }
+    tensor_incref(t);
+    return t;
+}
+
+// the result has the given shape, which a and b have the size of, or a single element
+Tensor* expr_new(ExprOp op, int ndim, const int* shape, Tensor* a, Tensor* b, float val) {
+    int size = shape_numel(ndim, shape);
+    Expr* e = mallocCheck(sizeof(Expr));
+    e->op = op;
+    e->a = expr_operand(a, size);
+    e->b = b != NULL ? expr_operand(b, size) : NULL;
+    e->val = val;
+    e->depth = 1 + max(expr_depth(e->a), b != NULL ? expr_depth(e->b) : 0);
+    Tensor* t = tensor_header_alloc();
+    t->storage = NULL; // until it is evaluated
+    t->offset = 0;
+    view_set_contiguous(t, ndim, shape);
+    t->repr = NULL;
+    atomic_init(&t->ref_count, 1);
+    t->expr = e;
+    t->dtype = DTYPE_FLOAT32; // only float32 results are lazy, see tensor_add
+    view_track(t);
+    STATS_TENSOR_ADD(1);
+    return t;
+}
+
+void expr_free(Expr* e) {
+    tensor_decref(e->a);
+    if (e->b != NULL) { tensor_decref(e->b); }
+    free(e);
+}
+
+// out[i] = leaf[start + i] for i < n, where a 1-element leaf broadcasts.
+// Leaves of other dtypes are converted (int8 dequantized) on the fly.
+void expr_load_leaf(Tensor* leaf, int start, int n, float* out) {
+    const void* a = tensor_data_ptr(leaf);
+    if (leaf->size == 1) {
+        float val = tensor_getitem(leaf, 0);
+        for (int i = 0; i < n; i++) { out[i] = val; }
+    } else if (leaf->dtype != DTYPE_FLOAT32) {
+        dtype_info[leaf->dtype].load_f32(out, element_ptr(a, (ptrdiff_t) start * leaf->stride, leaf->dtype),
+                                         leaf->stride, n, tensor_scale(leaf));
+    } else if (leaf->stride == 1) {
+        memcpy(out, (const float*) a + start, n * sizeof(float));
+    } else {
+        for (int i = 0; i < n; i++) { out[i] = ((const float*) a)[(start + i) * leaf->stride]; }
+    }
+}
+
+// out[i] += leaf[start + i] for i < n, reading a float32 leaf straight from its Storage
+void expr_add_leaf(Tensor* leaf, int start, int n, float* out) {
+    if (leaf->dtype != DTYPE_FLOAT32) {
+        float tmp[EXPR_BLOCK];
+        expr_load_leaf(leaf, start, n, tmp);
+        kernel_table.add(out, out, tmp, n);
+        return;
+    }
+    const float* b = tensor_data_ptr(leaf);
+    if (leaf->size == 1) {
+        kernel_table.addf(out, out, b[0], n);
+    } else if (leaf->stride == 1) {
+        kernel_table.add(out, out, b + start, n);
+    } else {
+        kernel_add_strided(out, 1, out, 1, b + start * leaf->stride, leaf->stride, n);
+    }
+}
+
+// evaluate elements [start, start + n) of t into out, with n <= EXPR_BLOCK
+void expr_eval_block(Tensor* t, int start, int n, float* out) {
+    Expr* e = t->expr;
+    if (e == NULL) {
+        expr_load_leaf(t, start, n, out);
+        return;
+    }
+    expr_eval_block(e->a, start, n, out);
+    if (e->op == EXPR_ADDF) {
+        kernel_table.addf(out, out, e->val, n);
+    } else if (e->b->expr == NULL) {
+        expr_add_leaf(e->b, start, n, out);
+    } else {
+        float tmp[EXPR_BLOCK];
+        expr_eval_block(e->b, start, n, tmp);
+        kernel_table.add(out, out, tmp, n);
+    }
+}
+
+typedef struct {
+    Tensor* t;
+    float* out;
+} ExprEvalArgs;
+
+void expr_eval_chunk(void* ctx, int chunk, int start, int end) {
+    ExprEvalArgs* args = ctx;
+    for (int i = start; i < end; i += EXPR_BLOCK) {
+        expr_eval_block(args->t, i, min(EXPR_BLOCK, end - i), args->out + i);
+    }
+}
+
+// evaluate a lazy tensor into its own (contiguous) Storage, no-op for other tensors
+Tensor* tensor_eval(Tensor* t) {
+    if (t->expr == NULL) { return t; }
+    STATS_OP(STATS_OP_EVAL);
+    Storage* storage = storage_new(t->size);
+    ExprEvalArgs args = { t, (float*) storage->data };
+    parallel_for(t->size, expr_eval_chunk, &args);
+    expr_free(t->expr);
+    t->expr = NULL;
+    t->storage = storage;
+    return t;
+}
+
+// Arithmetic comes in three flavors, following PyTorch:
+// tensor_addf(t, val)          -> returns a new tensor, i.e. t + val
+// tensor_addf_out(t, val, out) -> writes into an existing tensor, i.e. torch.add(t, val, out=out)
+// tensor_addf_(t, val)         -> in-place, i.e. t += val
+// The _out versions accept any view of the right size as the destination, so
+// hot loops can reuse one buffer instead of allocating a result every call.
+// The destination may be one of the inputs, but must not partially overlap it.
+// They return out, or NULL (and leave out untouched) if the sizes don't match.
+
+bool check_out_size(Tensor* out, int size) {
+    if (out->size != size) {
+        fprintf(stderr, "ValueError: output size %d does not match result size %d\n", out->size, size);
+        return false;
+    }
+    return true;
+}
+
+// an expanded view can't be written to: several of its elements are one in memory
+bool check_no_overlap(Tensor* out) {
+    for (int d = 0; d < out->ndim; d++) {
+        if (out->shape[d] > 1 && out->strides[d] == 0) {
+            fprintf(stderr, "ValueError: output has elements that share memory (an expanded view)\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// the strides that write a result of the given shape to out in row-major
+// order: out's own if it has that shape, else those of its flat run laid out
+// in the shape. False if out has another shape and isn't flat.
+bool out_strides(Tensor* out, int ndim, const int* shape, int* strides) {
+    if (out->ndim == ndim && memcmp(out->shape, shape, ndim * sizeof(int)) == 0) {
+        memcpy(strides, out->strides, ndim * sizeof(int));
+        return true;
+    }
+    if (!tensor_is_flat(out)) { return false; }
+    int stride = out->stride;
+    for (int d = ndim - 1; d >= 0; d--) {
+        strides[d] = stride;
+        stride *= max(shape[d], 1);
+    }
+    return true;
+}
+
+// Ops on float32 tensors run on the kernels above, all other dtypes go block by
+// block through double buffers (see DTYPE_LIST). Like in PyTorch, the inputs
+// are cast to the compute dtype (the promoted dtype of the inputs), the op is
+// done in that dtype, and the result is cast to the dtype of out.
+
+typedef enum {
+    TYPED_ADDF,
+    TYPED_ADD,
+    TYPED_COPY,
+    TYPED_FILL,
+    TYPED_UNARY,   // a UnaryOp of a
+    TYPED_BINARY,  // a BinaryOp of a and b
+    TYPED_BINARYF, // a BinaryOp of a and val
+    TYPED_FMA,     // a * b + c, rounded once
+    TYPED_AXPY,    // val * a + b, rounded once
+    TYPED_CLAMP,   // a clamped to [val, val2]
+    TYPED_WHERE,   // b where a is nonzero, else c
+} TypedOp;
+
+// an elementwise op, without its operands
+typedef struct {
+    TypedOp op;
+    int math_op;   // the UnaryOp or BinaryOp of TYPED_UNARY, TYPED_BINARY(F)
+    bool reversed; // TYPED_BINARYF computes val op a instead of a op val
+    double val;    // the scalar of TYPED_ADDF, TYPED_FILL, TYPED_BINARYF and TYPED_AXPY, the min of TYPED_CLAMP
+    double val2;   // the max of TYPED_CLAMP
+} ElementwiseOp;
+
+typedef struct {
+    void* data;
+    int stride;
+    int dtype;
+    float scale;
+} TypedOperand;
+
+TypedOperand typed_operand(Tensor* t) {
+    TypedOperand x = { tensor_data_ptr(t), t->stride, t->dtype, tensor_scale(t) };
+    return x;
+}
+
+// rounds n values to dtype, with a store and a load. No-op for float64, which
+// holds all values exactly, and int8, whose scale belongs to a Storage.
+void round_to_dtype(double* values, int n, int dtype) {
+    if (dtype == DTYPE_FLOAT64 || dtype == DTYPE_INT8) { return; }
+    double tmp[DTYPE_BLOCK];
+    dtype_info[dtype].store(tmp, 1, values, n, 1.0f);
+    dtype_info[dtype].load(values, tmp, 1, n, 1.0f);
+}
+
+// loads elements [start, start + n) of x into values, cast to dtype
+void typed_load(const TypedOperand* x, int start, int n, int dtype, double* values) {
+    dtype_info[x->dtype].load(values, element_ptr(x->data, (ptrdiff_t) start * x->stride, x->dtype), x->stride, n, x->scale);
+    if (x->dtype != dtype) { round_to_dtype(values, n, dtype); }
+}
+
+// the float64 versions of the math kernels, in place on values (and the other operand)
+void unary_f64(int op, double* values, int n) {
+    switch (op) {
+#define X(isa, target, name, unary_op, EXPR, EXPR_F64) \
+        case unary_op: \
+            for (int j = 0; j < n; j++) { double x = values[j]; values[j] = EXPR_F64; } \
+            break;
+        UNARY_OPS(X, , )
+#undef X
+    }
+}
+
+void binary_f64(int op, double* values, const double* other, bool reversed, int n) {
+    switch (op) {
+#define X(isa, target, name, binary_op, EXPR) \
+        case binary_op: \
+            for (int j = 0; j < n; j++) { \
+                double x = reversed ? other[j] : values[j], y = reversed ? values[j] : other[j]; \
+                values[j] = EXPR; \
+            } \
+            break;
+        BINARY_OPS(X, , )
+#undef X
+    }
+}
+
+// arguments of an elementwise op, passed to the chunks it is split into
+typedef struct {
+    ElementwiseOp e;
+    int compute_dtype;
+    bool f32;    // float32 in and out: runs go to the kernels
+    TypedOperand operands[BROADCAST_MAX_OPERANDS]; // out, a, b, c
+    BroadcastIter it;
+} ElementwiseArgs;
+
+// one run of float32 elements: each operand has its own stride, where a stride
+// of 0 is a broadcast value, which the addf kernels take as a scalar
+void f32_run(const ElementwiseArgs* args, float* o, const float* a, const float* b, const float* c,
+             const int* strides, int n) {
+    const ElementwiseOp* e = &args->e;
+    int os = strides[0], as = strides[1];
+    float val = (float) e->val;
+    switch (e->op) {
+        case TYPED_FILL:
+            for (int i = 0; i < n; i++) { o[(ptrdiff_t) i * os] = val; }
+            return;
+        case TYPED_ADDF:
+            if (os == 1 && as == 1) {
+                kernel_table.addf(o, a, val, n);
+            } else {
+                kernel_addf_strided(o, os, a, as, val, n);
+            }
+            return;
+        case TYPED_UNARY:
+            if (os == 1 && as == 1) {
+                kernel_table.unary[e->math_op](o, a, n);
+            } else {
+                kernel_unary_strided(e->math_op, o, os, a, as, n);
+            }
+            return;
+        case TYPED_BINARYF:
+            if (os == 1 && as == 1) {
+                (e->reversed ? kernel_table.rbinaryf : kernel_table.binaryf)[e->math_op](o, a, val, n);
+            } else if (e->reversed) {
+                kernel_binary_strided(e->math_op, o, os, &val, 0, a, as, n);
+            } else {
+                kernel_binary_strided(e->math_op, o, os, a, as, &val, 0, n);
+            }
+            return;
+        case TYPED_CLAMP:
+            if (os == 1 && as == 1) {
+                kernel_clamp_contiguous(o, a, val, (float) e->val2, n);
+            } else {
+                kernel_clamp_strided(o, os, a, as, val, (float) e->val2, n);
+            }
+            return;
+        default:
+            break;
+    }
+    int bs = strides[2];
+    bool contiguous = os == 1 && as == 1 && bs == 1;
+    if (e->op == TYPED_ADD || e->op == TYPED_BINARY) {
+        int op = e->op == TYPED_ADD ? BINARY_ADD : e->math_op;
+        if (contiguous) {
+            if (e->op == TYPED_ADD) {
+                kernel_table.add(o, a, b, n);
+            } else {
+                kernel_table.binary[op](o, a, b, n);
+            }
+        } else if (os == 1 && as == 1 && bs == 0) {
+            (op == BINARY_ADD ? kernel_table.addf : kernel_table.binaryf[op])(o, a, b[0], n);
+        } else if (os == 1 && as == 0 && bs == 1) {
+            (op == BINARY_ADD ? kernel_table.addf : kernel_table.rbinaryf[op])(o, b, a[0], n);
+        } else if (op == BINARY_ADD) {
+            kernel_add_strided(o, os, a, as, b, bs, n);
+        } else {
+            kernel_binary_strided(op, o, os, a, as, b, bs, n);
+        }
+    } else if (e->op == TYPED_AXPY) {
+        if (contiguous) {
+            kernel_table.axpy(o, val, a, b, n);
+        } else {
+            kernel_axpy_strided(o, os, val, a, as, b, bs, n);
+        }
+    } else if (e->op == TYPED_FMA || e->op == TYPED_WHERE) {
+        int cs = strides[3];
+        if (contiguous && cs == 1) {
+            (e->op == TYPED_FMA ? kernel_table.fma : kernel_where_contiguous)(o, a, b, c, n);
+        } else {
+            (e->op == TYPED_FMA ? kernel_fma_strided : kernel_where_strided)(o, os, a, as, b, bs, c, cs, n);
+        }
+    }
+}
+
+// one run of elements of other dtypes, through double buffers; x[0] is out
+void typed_run(const ElementwiseArgs* args, const TypedOperand* x, int n) {
+    const ElementwiseOp* e = &args->e;
+    int num_inputs = args->it.num_operands - 1;
+    double v[DTYPE_BLOCK];
+    double w[DTYPE_BLOCK];
+    double u[DTYPE_BLOCK];
+    for (int i = 0; i < n; i += DTYPE_BLOCK) {
+        int len = min(DTYPE_BLOCK, n - i);
+        if (e->op == TYPED_FILL) {
+            for (int j = 0; j < len; j++) { v[j] = e->val; }
+        } else {
+            // a condition is tested in its own dtype, casting could round it to 0
+            typed_load(&x[1], i, len, e->op == TYPED_WHERE ? x[1].dtype : args->compute_dtype, v);
+        }
+        if (num_inputs > 1) { typed_load(&x[2], i, len, args->compute_dtype, w); }
+        if (num_inputs > 2) { typed_load(&x[3], i, len, args->compute_dtype, u); }
+        switch (e->op) {
+            case TYPED_ADD:
+                for (int j = 0; j < len; j++) { v[j] += w[j]; }
+                break;
+            case TYPED_ADDF:
+                for (int j = 0; j < len; j++) { v[j] += e->val; }
+                break;
+            case TYPED_UNARY:
+                unary_f64(e->math_op, v, len);
+                break;
+            case TYPED_BINARYF:
+                for (int j = 0; j < len; j++) { w[j] = e->val; }
+                // fall through
+            case TYPED_BINARY:
+                binary_f64(e->math_op, v, w, e->reversed, len);
+                break;
+            case TYPED_FMA:
+                for (int j = 0; j < len; j++) { v[j] = fma(v[j], w[j], u[j]); }
+                break;
+            case TYPED_AXPY:
+                for (int j = 0; j < len; j++) { v[j] = fma(e->val, v[j], w[j]); }
+                break;
+            case TYPED_CLAMP:
+                for (int j = 0; j < len; j++) {
+                    double y = v[j] < e->val ? e->val : v[j];
+                    v[j] = y > e->val2 ? e->val2 : y;
+                }
+                break;
+            case TYPED_WHERE:
+                for (int j = 0; j < len; j++) { v[j] = v[j] != 0.0 ? w[j] : u[j]; }
+                break;
+            default:
+                break;
+        }
+        const TypedOperand* out = &x[0];
+        if (out->dtype != args->compute_dtype) { round_to_dtype(v, len, args->compute_dtype); }
+        dtype_info[out->dtype].store(element_ptr(out->data, (ptrdiff_t) i * out->stride, out->dtype), out->stride, v, len, out->scale);
+    }
+}
+
+void elementwise_run(void* ctx, const ptrdiff_t* offsets, const int* strides, int n) {
+    ElementwiseArgs* args = ctx;
+    // the elements of a run are independent, so one that writes backwards (out
+    // is a reversed view) is done front to back instead, from its last element:
+    // reversed operands then get stride 1 and the contiguous kernels
+    bool reverse = strides[0] < 0;
+    int run_strides[BROADCAST_MAX_OPERANDS];
+    TypedOperand x[BROADCAST_MAX_OPERANDS];
+    for (int k = 0; k < args->it.num_operands; k++) {
+        ptrdiff_t offset = offsets[k] + (reverse ? (ptrdiff_t) (n - 1) * strides[k] : 0);
+        run_strides[k] = reverse ? -strides[k] : strides[k];
+        x[k] = args->operands[k];
+        x[k].data = element_ptr(x[k].data, offset, x[k].dtype);
+        x[k].stride = run_strides[k];
+    }
+    if (args->f32) {
+        int num_operands = args->it.num_operands;
+        f32_run(args, x[0].data, x[1].data, num_operands > 2 ? x[2].data : NULL, num_operands > 3 ? x[3].data : NULL,
+                run_strides, n);
+    } else {
+        typed_run(args, x, n);
+    }
+}
+
+void elementwise_chunk(void* ctx, int chunk, int start, int end) {
+    ElementwiseArgs* args = ctx;
+    broadcast_for_each_run(&args->it, start, end, elementwise_run, args);
+}
+
+// the broadcast shape of a, b and c, of which b and c may be NULL
+bool broadcast_inputs(Tensor* a, Tensor* b, Tensor* c, int* ndim, int* shape, int* size) {
+    *ndim = a->ndim;
+    memcpy(shape, a->shape, a->ndim * sizeof(int));
+    Tensor* inputs[2] = { b, c };
+    for (int k = 0; k < 2; k++) {
+        if (inputs[k] == NULL) { continue; }
+        int prev[TENSOR_MAX_DIMS];
+        memcpy(prev, shape, *ndim * sizeof(int));
+        if (!broadcast_shapes(*ndim, prev, inputs[k]->ndim, inputs[k]->shape, ndim, shape)) { return false; }
+    }
+    return check_shape(*ndim, shape, size);
+}
+
+// Runs an elementwise op on a (and b, c) broadcast together into out, element
+// i of the result going to element i of out in row-major order. All operands
+// are walked in place, whatever their strides, by one broadcasting iterator.
+// An out of another shape than the result has to be flat, else the result is
+// computed into a buffer and copied from there.
+Tensor* elementwise_op(const ElementwiseOp* e, Tensor* a, Tensor* b, Tensor* c, int compute_dtype, Tensor* out) {
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!broadcast_inputs(a, b, c, &ndim, shape, &size)) { return NULL; }
+    if (!check_out_size(out, size) || !check_writable(out) || !check_no_overlap(out)) { return NULL; }
+    Tensor* inputs[3] = { a, b, c };
+    int num_inputs = c != NULL ? 3 : b != NULL ? 2 : 1;
+    for (int k = 0; k < num_inputs; k++) { tensor_eval(inputs[k]); }
+    tensor_eval(out);
+    Tensor* fout = out;
+    int strides[TENSOR_MAX_DIMS];
+    if (!out_strides(out, ndim, shape, strides)) {
+        fout = tensor_empty_dtype(out->size, out->dtype);
+        fout->storage->scale = out->storage->scale;
+        out_strides(fout, ndim, shape, strides);
+    }
+    ElementwiseArgs args;
+    args.e = *e;
+    args.compute_dtype = compute_dtype;
+    args.f32 = e->op != TYPED_COPY && out->dtype == DTYPE_FLOAT32 && compute_dtype == DTYPE_FLOAT32;
+    for (int k = 0; k < num_inputs; k++) { args.f32 = args.f32 && inputs[k]->dtype == DTYPE_FLOAT32; }
+    args.operands[0] = typed_operand(fout);
+    broadcast_iter_init(&args.it, ndim, shape);
+    broadcast_iter_add(&args.it, strides);
+    for (int k = 0; k < num_inputs; k++) {
+        args.operands[k + 1] = typed_operand(inputs[k]);
+        broadcast_iter_add_tensor(&args.it, inputs[k]);
+    }
+    broadcast_iter_merge(&args.it);
+    parallel_for(size, elementwise_chunk, &args);
+    if (fout != out) {
+        view_copy(out, fout->storage->data, true);
+        tensor_decref(fout);
+    }
+    return out;
+}
+
+// elementwise_op for the ops that take at most one scalar
+Tensor* elementwise(TypedOp op, Tensor* a, Tensor* b, double val, int compute_dtype, Tensor* out) {
+    ElementwiseOp e = { op, 0, false, val, 0.0 };
+    return elementwise_op(&e, a, b, NULL, compute_dtype, out);
+}
+
+// t + val into out, computed in compute_dtype
+Tensor* addf_out(Tensor* t, double val, int compute_dtype, Tensor* out) {
+    // like torch, the scalar is rounded to float unless we compute in float64
+    if (compute_dtype != DTYPE_FLOAT64) { val = (float) val; }
+    return elementwise(TYPED_ADDF, t, NULL, val, compute_dtype, out);
+}
+
+Tensor* tensor_addf_out(Tensor* t, double val, Tensor* out) {
+    STATS_OP(STATS_OP_ADDF);
+    // adds a scalar to each element of the tensor, writes the result into out
+    return addf_out(t, val, scalar_result_dtype(t->dtype), out);
+}
+
+// a new tensor for the result of an op, contiguous with the shape of like
+Tensor* result_like(Tensor* like, int dtype) {
+    return tensor_empty_shape(like->ndim, like->shape, dtype);
+}
+
+Tensor* tensor_addf(Tensor* t, double val) {
+    STATS_OP(STATS_OP_ADDF);
+    int dtype = scalar_result_dtype(t->dtype);
+    // lazy expressions are evaluated in float32, other results are computed right away
+    if (lazy_mode && dtype == DTYPE_FLOAT32) { return expr_new(EXPR_ADDF, t->ndim, t->shape, t, NULL, (float) val); }
+    Tensor* result = result_like(t, dtype);
+    return tensor_addf_out(t, val, result);
+}
+
+Tensor* tensor_addf_(Tensor* t, double val) {
+    STATS_OP(STATS_OP_ADDF);
+    return tensor_addf_out(t, val, t);
+}
+
+bool same_shape(Tensor* t1, Tensor* t2) {
+    if (t1->ndim != t2->ndim) { return false; }
+    for (int d = 0; d < t1->ndim; d++) {
+        if (t1->shape[d] != t2->shape[d]) { return false; }
+    }
+    return true;
+}
+
+Tensor* tensor_add_out(Tensor* t1, Tensor* t2, Tensor* out) {
+    STATS_OP(STATS_OP_ADD);
+    int dtype = tensor_promote_types(t1->dtype, t2->dtype);
+    return elementwise(TYPED_ADD, t1, t2, 0.0, dtype, out);
+}
+
+Tensor* tensor_add(Tensor* t1, Tensor* t2) {
+    STATS_OP(STATS_OP_ADD);
+    // the result has the broadcast shape of the two, see broadcast_shape
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!broadcast_shape(t1, t2, &ndim, shape) || !check_shape(ndim, shape, &size)) { return NULL; }
+    int dtype = tensor_promote_types(t1->dtype, t2->dtype);
+    // lazy leaves are read in row-major order, so only single elements can broadcast
+    bool fusable = (t1->size == size || t1->size == 1) && (t2->size == size || t2->size == 1);
+    if (lazy_mode && dtype == DTYPE_FLOAT32 && fusable) { return expr_new(EXPR_ADD, ndim, shape, t1, t2, 0.0f); }
+    Tensor* result = tensor_empty_shape(ndim, shape, dtype);
+    return tensor_add_out(t1, t2, result);
+}
+
+Tensor* tensor_add_(Tensor* t1, Tensor* t2) {
+    STATS_OP(STATS_OP_ADD);
+    // in-place: t2 has to broadcast to t1, the out size check enforces that
+    return tensor_add_out(t1, t2, t1);
+}
+
+// Elementwise math ops, on the kernels of MATH_KERNELS for float32:
+// tensor_binary(op, t1, t2)              -> t1 op t2, e.g. t1 - t2 for BINARY_SUB
+// tensor_binaryf(op, t, val, reversed)   -> t op val, or val op t if reversed
+// tensor_unary(op, t)                    -> e.g. exp(t) for UNARY_EXP
+// tensor_fma(a, b, c)                    -> a * b + c
+// tensor_axpy(alpha, x, y)               -> alpha * x + y, tensor_axpy_ into y
+// tensor_clamp(t, lo, hi)                -> t clamped to [lo, hi], ±INFINITY for no bound
+// tensor_where(cond, a, b)               -> a where cond is nonzero, else b
+// Tensor inputs broadcast together and promote like tensor_add, except that
+// dividing integers gives float32 (true division, like torch). Like with
+// tensor_addf, a scalar turns integers into float32, and so do the unary ops.
+// fma and axpy round once, like fmaf. The _out versions write into out like
+// tensor_add_out.
+
+bool check_math_op(int op, int count, const char* kind) {
+    if (op < 0 || op >= count) {
+        fprintf(stderr, "ValueError: unknown %s op %d\n", kind, op);
+        return false;
+    }
+    return true;
+}
+
+int binary_result_dtype(int op, int dtype1, int dtype2) {
+    int dtype = tensor_promote_types(dtype1, dtype2);
+    return op == BINARY_DIV && dtype == DTYPE_INT32 ? DTYPE_FLOAT32 : dtype;
+}
+
+Tensor* tensor_binary_out(int op, Tensor* t1, Tensor* t2, Tensor* out) {
+    STATS_OP(STATS_OP_BINARY);
+    if (!check_math_op(op, BINARY_COUNT, "binary")) { return NULL; }
+    ElementwiseOp e = { TYPED_BINARY, op, false, 0.0, 0.0 };
+    return elementwise_op(&e, t1, t2, NULL, binary_result_dtype(op, t1->dtype, t2->dtype), out);
+}
+
+Tensor* tensor_binary(int op, Tensor* t1, Tensor* t2) {
+    STATS_OP(STATS_OP_BINARY);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!check_math_op(op, BINARY_COUNT, "binary") || !broadcast_inputs(t1, t2, NULL, &ndim, shape, &size)) {
+        return NULL;
+    }
+    Tensor* result = tensor_empty_shape(ndim, shape, binary_result_dtype(op, t1->dtype, t2->dtype));
+    return tensor_binary_out(op, t1, t2, result);
+}
+
+Tensor* tensor_binaryf_out(int op, Tensor* t, double val, bool reversed, Tensor* out) {
+    STATS_OP(STATS_OP_BINARY);
+    if (!check_math_op(op, BINARY_COUNT, "binary")) { return NULL; }
+    int dtype = scalar_result_dtype(t->dtype);
+    // the scalar is rounded like in addf_out
+    ElementwiseOp e = { TYPED_BINARYF, op, reversed, dtype == DTYPE_FLOAT64 ? val : (float) val, 0.0 };
+    return elementwise_op(&e, t, NULL, NULL, dtype, out);
+}
+
+Tensor* tensor_binaryf(int op, Tensor* t, double val, bool reversed) {
+    STATS_OP(STATS_OP_BINARY);
+    if (!check_math_op(op, BINARY_COUNT, "binary")) { return NULL; }
+    Tensor* result = result_like(t, scalar_result_dtype(t->dtype));
+    return tensor_binaryf_out(op, t, val, reversed, result);
+}
+
+Tensor* tensor_sub(Tensor* t1, Tensor* t2) {
+    return tensor_binary(BINARY_SUB, t1, t2);
+}
+
+Tensor* tensor_mul(Tensor* t1, Tensor* t2) {
+    return tensor_binary(BINARY_MUL, t1, t2);
+}
+
+Tensor* tensor_div(Tensor* t1, Tensor* t2) {
+    return tensor_binary(BINARY_DIV, t1, t2);
+}
+
+Tensor* tensor_unary_out(int op, Tensor* t, Tensor* out) {
+    STATS_OP(STATS_OP_UNARY);
+    if (!check_math_op(op, UNARY_COUNT, "unary")) { return NULL; }
+    ElementwiseOp e = { TYPED_UNARY, op, false, 0.0, 0.0 };
+    return elementwise_op(&e, t, NULL, NULL, scalar_result_dtype(t->dtype), out);
+}
+
+Tensor* tensor_unary(int op, Tensor* t) {
+    STATS_OP(STATS_OP_UNARY);
+    if (!check_math_op(op, UNARY_COUNT, "unary")) { return NULL; }
+    Tensor* result = result_like(t, scalar_result_dtype(t->dtype));
+    return tensor_unary_out(op, t, result);
+}
+
+Tensor* tensor_exp(Tensor* t) {
+    return tensor_unary(UNARY_EXP, t);
+}
+
+Tensor* tensor_log(Tensor* t) {
+    return tensor_unary(UNARY_LOG, t);
+}
+
+Tensor* tensor_tanh(Tensor* t) {
+    return tensor_unary(UNARY_TANH, t);
+}
+
+Tensor* tensor_sigmoid(Tensor* t) {
+    return tensor_unary(UNARY_SIGMOID, t);
+}
+
+Tensor* tensor_sqrt(Tensor* t) {
+    return tensor_unary(UNARY_SQRT, t);
+}
+
+Tensor* tensor_fma_out(Tensor* a, Tensor* b, Tensor* c, Tensor* out) {
+    STATS_OP(STATS_OP_FMA);
+    ElementwiseOp e = { TYPED_FMA, 0, false, 0.0, 0.0 };
+    int dtype = tensor_promote_types(tensor_promote_types(a->dtype, b->dtype), c->dtype);
+    return elementwise_op(&e, a, b, c, dtype, out);
+}
+
+Tensor* tensor_fma(Tensor* a, Tensor* b, Tensor* c) {
+    STATS_OP(STATS_OP_FMA);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!broadcast_inputs(a, b, c, &ndim, shape, &size)) { return NULL; }
+    int dtype = tensor_promote_types(tensor_promote_types(a->dtype, b->dtype), c->dtype);
+    return tensor_fma_out(a, b, c, tensor_empty_shape(ndim, shape, dtype));
+}
+
+// alpha * x + y into out, x has to broadcast to the shape of out
+Tensor* axpy_out(double alpha, Tensor* x, Tensor* y, Tensor* out) {
+    int dtype = scalar_result_dtype(tensor_promote_types(x->dtype, y->dtype));
+    ElementwiseOp e = { TYPED_AXPY, 0, false, dtype == DTYPE_FLOAT64 ? alpha : (float) alpha, 0.0 };
+    return elementwise_op(&e, x, y, NULL, dtype, out);
+}
+
+Tensor* tensor_axpy(double alpha, Tensor* x, Tensor* y) {
+    STATS_OP(STATS_OP_FMA);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!broadcast_inputs(x, y, NULL, &ndim, shape, &size)) { return NULL; }
+    int dtype = scalar_result_dtype(tensor_promote_types(x->dtype, y->dtype));
+    return axpy_out(alpha, x, y, tensor_empty_shape(ndim, shape, dtype));
+}
+
+// in-place: y += alpha * x, the BLAS axpy
+Tensor* tensor_axpy_(double alpha, Tensor* x, Tensor* y) {
+    STATS_OP(STATS_OP_FMA);
+    return axpy_out(alpha, x, y, y);
+}
+
+// keeps the dtype of t (int8 gives float32, like all ops)
+Tensor* tensor_clamp(Tensor* t, double lo, double hi) {
+    STATS_OP(STATS_OP_CLAMP);
+    int dtype = t->dtype == DTYPE_INT8 ? DTYPE_FLOAT32 : t->dtype;
+    ElementwiseOp e = { TYPED_CLAMP, 0, false, lo, hi };
+    return elementwise_op(&e, t, NULL, NULL, dtype, result_like(t, dtype));
+}
+
+Tensor* tensor_where(Tensor* cond, Tensor* a, Tensor* b) {
+    STATS_OP(STATS_OP_WHERE);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int size = 0;
+    if (!broadcast_inputs(cond, a, b, &ndim, shape, &size)) { return NULL; }
+    int dtype = tensor_promote_types(a->dtype, b->dtype);
+    ElementwiseOp e = { TYPED_WHERE, 0, false, 0.0, 0.0 };
+    return elementwise_op(&e, cond, a, b, dtype, tensor_empty_shape(ndim, shape, dtype));
+}
+
+// a copy of t converted to dtype, i.e. t.to(dtype). int8 gets a scale of 1,
+// see tensor_quantize for other scales
+Tensor* tensor_to_dtype(Tensor* t, int dtype) {
+    STATS_OP(STATS_OP_TO_DTYPE);
+    if (!dtype_valid(dtype)) {
+        fprintf(stderr, "ValueError: unknown dtype %d\n", dtype);
+        return NULL;
+    }
+    Tensor* result = result_like(t, dtype);
+    return elementwise(TYPED_COPY, t, NULL, 0.0, t->dtype, result);
+}
+
+// Indexing with index tensors, one call for a whole batch of elements instead
+// of one getitem or setitem each: t[index] gathers rows of t (elements, for
+// 1-D t) into a new tensor of shape index.shape + t.shape[1:], and t[index] =
+// values scatters into t. Indices are int32, negative ones count from the end,
+// and all of them are checked before anything is written. tensor_fill_ and
+// tensor_copy_ write a whole view (e.g. a slice) in place.
+
+// the indices in index wrapped into [0, n), in a new buffer to free. NULL if
+// index isn't int32 or an index is out of bounds.
+int* index_values(Tensor* index, int n) {
+    if (index->dtype != DTYPE_INT32) {
+        fprintf(stderr, "IndexError: indices must be int32, not %s\n", tensor_dtype_name(index->dtype));
+        return NULL;
+    }
+    Tensor* flat = flat_input(index);
+    const int32_t* data = tensor_data_ptr(flat);
+    int* values = mallocCheck((size_t) max(index->size, 1) * sizeof(int));
+    for (int i = 0; i < index->size; i++) {
+        int ix = data[(ptrdiff_t) i * flat->stride];
+        values[i] = ix < 0 ? ix + n : ix;
+        if (values[i] < 0 || values[i] >= n) {
+            fprintf(stderr, "IndexError: index %d is out of bounds for dimension 0 with size %d\n", ix, n);
+            free(values);
+            values = NULL;
+            break;
+        }
+    }
+    release_input(index, flat);
+    return values;
+}
+
+// the shape of t[index]: index.shape + t.shape[1:], false if t can't be indexed
+bool index_shape(Tensor* t, Tensor* index, int* ndim, int* shape) {
+    if (t->ndim == 0 || index->ndim + t->ndim - 1 > TENSOR_MAX_DIMS) {
+        fprintf(stderr, "IndexError: cannot index a %d-d tensor with a %d-d index\n", t->ndim, index->ndim);
+        return false;
+    }
+    *ndim = index->ndim + t->ndim - 1;
+    memcpy(shape, index->shape, index->ndim * sizeof(int));
+    memcpy(shape + index->ndim, t->shape + 1, (t->ndim - 1) * sizeof(int));
+    return true;
+}
+
+// the view of row ix of t, as a header on the stack that holds no references
+Tensor row_view(Tensor* t, int ix) {
+    Tensor row = *t;
+    row.offset = t->offset + ix * t->strides[0];
+    view_set(&row, t->ndim - 1, t->shape + 1, t->strides + 1);
+    return row;
+}
+
+typedef struct {
+    Tensor* t;
+    const int* index;
+    char* out;
+} GatherArgs;
+
+void gather_chunk(void* ctx, int chunk, int start, int end) {
+    GatherArgs* args = ctx;
+    Tensor* t = args->t;
+    int elsize = dtype_info[t->dtype].size;
+    if (t->ndim == 1) {
+        const char* data = t->storage->data;
+        for (int k = start; k < end; k++) {
+            ptrdiff_t offset = t->offset + (ptrdiff_t) args->index[k] * t->stride;
+            memcpy(args->out + (ptrdiff_t) k * elsize, data + offset * elsize, elsize);
+        }
+        return;
+    }
+    int row_size = shape_numel(t->ndim - 1, t->shape + 1);
+    for (int k = start; k < end; k++) {
+        Tensor row = row_view(t, args->index[k]);
+        view_copy(&row, args->out + (ptrdiff_t) k * row_size * elsize, false);
+    }
+}
+
+// t[index], a new contiguous tensor with the dtype (and scale) of t
+Tensor* tensor_gather(Tensor* t, Tensor* index) {
+    STATS_OP(STATS_OP_GATHER);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    if (!index_shape(t, index, &ndim, shape)) { return NULL; }
+    tensor_eval(t);
+    int* values = index_values(index, t->shape[0]);
+    if (values == NULL) { return NULL; }
+    Tensor* result = tensor_empty_shape(ndim, shape, t->dtype);
+    if (result != NULL) {
+        result->storage->scale = t->storage->scale;
+        GatherArgs args = { t, values, result->storage->data };
+        parallel_for(index->size, gather_chunk, &args);
+    }
+    free(values);
+    return result;
+}
+
+// t[index] = values, with values broadcast to the shape of t[index]. Indices
+// that repeat are written in order, so the last one wins. Returns t.
+Tensor* tensor_scatter(Tensor* t, Tensor* index, Tensor* values) {
+    STATS_OP(STATS_OP_SCATTER);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    if (!index_shape(t, index, &ndim, shape)) { return NULL; }
+    tensor_eval(t);
+    int* ix = index_values(index, t->shape[0]);
+    if (ix == NULL) { return NULL; }
+    // the values in the dtype and scale of t, laid out like t[index]: also a
+    // copy, in case values is a view of t itself
+    Tensor* expanded = tensor_expand(values, ndim, shape);
+    Tensor* src = expanded != NULL ? tensor_empty_shape(ndim, shape, t->dtype) : NULL;
+    if (src != NULL) {
+        src->storage->scale = t->storage->scale;
+        elementwise(TYPED_COPY, expanded, NULL, 0.0, values->dtype, src);
+    }
+    if (expanded != NULL) { tensor_decref(expanded); }
+    Tensor* result = src != NULL && check_writable(t) ? t : NULL;
+    if (result != NULL) {
+        int elsize = dtype_info[t->dtype].size;
+        int row_size = shape_numel(t->ndim - 1, t->shape + 1);
+        char* data = src->storage->data;
+        char* t_data = t->storage->data;
+        for (int k = 0; k < index->size; k++) {
+            if (t->ndim == 1) {
+                ptrdiff_t offset = t->offset + (ptrdiff_t) ix[k] * t->stride;
+                memcpy(t_data + offset * elsize, data + (ptrdiff_t) k * elsize, elsize);
+            } else {
+                Tensor row = row_view(t, ix[k]);
+                view_copy(&row, data + (ptrdiff_t) k * row_size * elsize, true);
+            }
+        }
+    }
+    if (src != NULL) { tensor_decref(src); }
+    free(ix);
+    return result;
+}
+
+// t.fill_(val): val, rounded to the dtype of t, in every element of the view
+Tensor* tensor_fill_(Tensor* t, double val) {
+    STATS_OP(STATS_OP_FILL);
+    return elementwise(TYPED_FILL, t, NULL, val, t->dtype, t);
+}
+
+// dst.copy_(src): src broadcast to the shape of dst and converted to its dtype
+Tensor* tensor_copy_(Tensor* dst, Tensor* src) {
+    STATS_OP(STATS_OP_COPY);
+    tensor_eval(src);
+    tensor_eval(dst);
+    // views of one Storage can overlap, then src is read from a copy
+    Tensor* from = src->storage == dst->storage ? tensor_clone(src) : src;
+    Tensor* expanded = tensor_expand(from, dst->ndim, dst->shape);
+    if (from != src) { tensor_decref(from); }
+    if (expanded == NULL) { return NULL; }
+    Tensor* result = elementwise(TYPED_COPY, expanded, NULL, 0.0, src->dtype, dst);
+    tensor_decref(expanded);
+    return result;
+}
+
+// Reductions: sum, mean, max/min, argmax/argmin and dot, over any view.
+// Sums are pairwise: blocks of PAIRWISE_BLOCK elements are summed by the
+// (vectorized) kernels, and the block sums are added up in a balanced tree, so
+// the rounding error grows with log(n) instead of n, at no extra cost. For
+// even more accuracy, tensor_sum_kahan uses compensated summation.
+// Big tensors are reduced in chunks on the thread pool, and the chunk results
+// are then combined in order, so the result doesn't depend on thread timing.
+
+#define PAIRWISE_BLOCK 1024
+#define REDUCE_STACK_PARTIALS 64 // chunk results kept on the stack, else malloc
+
+float pairwise_sum(const float* a, int a_stride, int n) {
+    if (n <= PAIRWISE_BLOCK) {
+        return a_stride == 1 ? kernel_table.sum(a, n) : kernel_sum_strided(a, a_stride, n);
+    }
+    int half = n / 2;
+    return pairwise_sum(a, a_stride, half) + pairwise_sum(a + half * a_stride, a_stride, n - half);
+}
+
+float pairwise_dot(const float* a, int a_stride, const float* b, int b_stride, int n) {
+    if (n <= PAIRWISE_BLOCK) {
+        if (a_stride == 1 && b_stride == 1) { return kernel_table.dot(a, b, n); }
+        return kernel_dot_strided(a, a_stride, b, b_stride, n);
+    }
+    int half = n / 2;
+    return pairwise_dot(a, a_stride, b, b_stride, half)
+         + pairwise_dot(a + half * a_stride, a_stride, b + half * b_stride, b_stride, n - half);
+}
+
+typedef enum { REDUCE_SUM, REDUCE_SUM_KAHAN, REDUCE_DOT, REDUCE_MAX, REDUCE_MIN } ReduceOp;
+
+// arguments of a reduction, passed to the chunks it is split into
+typedef struct {
+    ReduceOp op;
+    const float* a;
+    int a_stride;
+    const float* b;
+    int b_stride;
+    float* partials; // one result per chunk
+} ReduceArgs;
+
+void reduce_chunk(void* ctx, int chunk, int start, int end) {
+    ReduceArgs* args = ctx;
+    const float* a = args->a + start * args->a_stride;
+    int n = end - start;
+    float result = 0.0f;
+    switch (args->op) {
+        case REDUCE_SUM:
+            result = pairwise_sum(a, args->a_stride, n);
+            break;
+        case REDUCE_SUM_KAHAN:
+            result = kernel_sum_kahan(a, args->a_stride, n);
+            break;
+        case REDUCE_DOT:
+            result = pairwise_dot(a, args->a_stride, args->b + start * args->b_stride, args->b_stride, n);
+            break;
+        case REDUCE_MAX:
+            result = args->a_stride == 1 ? kernel_table.max(a, n) : kernel_max_strided(a, args->a_stride, n, 1);
+            break;
+        case REDUCE_MIN:
+            result = args->a_stride == 1 ? kernel_table.min(a, n) : kernel_max_strided(a, args->a_stride, n, -1);
+            break;
+    }
+    args->partials[chunk] = result;
+}
+
+float reduce_float32(ReduceOp op, Tensor* t1, Tensor* t2) {
+    int n = t1->size;
+    int num_chunks = parallel_num_chunks(n);
+    float stack_partials[REDUCE_STACK_PARTIALS];
+    float* partials = num_chunks <= REDUCE_STACK_PARTIALS ? stack_partials : mallocCheck(num_chunks * sizeof(float));
+    ReduceArgs args = {
+        op, tensor_data_ptr(t1), t1->stride,
+        t2 != NULL ? tensor_data_ptr(t2) : NULL, t2 != NULL ? t2->stride : 0,
+        partials
+    };
+    // a reversed view is reduced in memory order instead, from its last
+    // element, so stride -1 gets the contiguous kernels (dot pairs up the
+    // elements of both the same way, so b has to run backwards too)
+    if (n > 0 && args.a_stride < 0 && (t2 == NULL || args.b_stride <= 0)) {
+        args.a += (ptrdiff_t) (n - 1) * args.a_stride;
+        args.a_stride = -args.a_stride;
+        if (t2 != NULL) {
+            args.b += (ptrdiff_t) (n - 1) * args.b_stride;
+            args.b_stride = -args.b_stride;
+        }
+    }
+    parallel_for(n, reduce_chunk, &args);
+    // combine the chunk results, in chunk order
+    float result;
+    switch (op) {
+        case REDUCE_SUM_KAHAN: result = kernel_sum_kahan(partials, 1, num_chunks); break;
+        case REDUCE_MAX: result = kernel_max_strided(partials, 1, num_chunks, 1); break;
+        case REDUCE_MIN: result = kernel_max_strided(partials, 1, num_chunks, -1); break;
+        default: result = kernel_sum_strided(partials, 1, num_chunks); break;
+    }
+    if (partials != stack_partials) { free(partials); }
+    return result;
+}
+
+// Reductions over the other dtypes convert DTYPE_BLOCK elements at a time to
+// double and accumulate in double, which is at least as accurate as the
+// float32 path (so there the Kahan sum is the plain sum).
+
+double nan_max_f64(double a, double b) {
+    return (a != a || a > b) ? a : (b != b || b > a) ? b : a;
+}
+
+typedef struct {
+    ReduceOp op;
+    TypedOperand a;
+    TypedOperand b;
+    double* partials; // one result per chunk
+} TypedReduceArgs;
+
+void typed_reduce_chunk(void* ctx, int chunk, int start, int end) {
+    TypedReduceArgs* args = ctx;
+    double x[DTYPE_BLOCK];
+    double y[DTYPE_BLOCK];
+    bool is_max = args->op == REDUCE_MAX;
+    bool is_extremum = is_max || args->op == REDUCE_MIN;
+    double result = is_extremum ? (is_max ? -INFINITY : INFINITY) : 0.0;
+    for (int i = start; i < end; i += DTYPE_BLOCK) {
+        int n = min(DTYPE_BLOCK, end - i);
+        typed_load(&args->a, i, n, args->a.dtype, x);
+        double acc = 0.0;
+        if (args->op == REDUCE_DOT) {
+            typed_load(&args->b, i, n, args->b.dtype, y);
+            for (int j = 0; j < n; j++) { acc += x[j] * y[j]; }
+        } else if (is_max) {
+            for (int j = 0; j < n; j++) { result = nan_max_f64(result, x[j]); }
+        } else if (is_extremum) {
+            for (int j = 0; j < n; j++) { result = -nan_max_f64(-result, -x[j]); }
+        } else {
+            for (int j = 0; j < n; j++) { acc += x[j]; }
+        }
+        if (!is_extremum) { result += acc; }
+    }
+    args->partials[chunk] = result;
+}
+
+double reduce_typed(ReduceOp op, Tensor* t1, Tensor* t2) {
+    int num_chunks = parallel_num_chunks(t1->size);
+    double stack_partials[REDUCE_STACK_PARTIALS];
+    double* partials = num_chunks <= REDUCE_STACK_PARTIALS ? stack_partials : mallocCheck(num_chunks * sizeof(double));
+    TypedReduceArgs args;
+    args.op = op;
+    args.a = typed_operand(t1);
+    if (t2 != NULL) { args.b = typed_operand(t2); }
+    args.partials = partials;
+    parallel_for(t1->size, typed_reduce_chunk, &args);
+    // combine the chunk results, in chunk order
+    double result = partials[0];
+    for (int i = 1; i < num_chunks; i++) {
+        if (op == REDUCE_MAX) {
+            result = nan_max_f64(result, partials[i]);
+        } else if (op == REDUCE_MIN) {
+            result = -nan_max_f64(-result, -partials[i]);
+        } else {
+            result += partials[i];
+        }
+    }
+    if (partials != stack_partials) { free(partials); }
+    return result;
+}
+
+double reduce_flat(ReduceOp op, Tensor* t1, Tensor* t2) {
+    if (t1->dtype == DTYPE_FLOAT32 && (t2 == NULL || t2->dtype == DTYPE_FLOAT32)) { return reduce_float32(op, t1, t2); }
+    if (t1->size == 0) { return 0.0; } // there are no partials to combine
+    return reduce_typed(op, t1, t2);
+}
+
+// reduces all elements, of any view (see flat_input)
+double reduce(ReduceOp op, Tensor* t1, Tensor* t2) {
+    STATS_OP(STATS_OP_REDUCE);
+    Tensor* f1 = flat_input(t1);
+    Tensor* f2 = t2 != NULL ? flat_input(t2) : NULL;
+    double result = reduce_flat(op, f1, f2);
+    release_input(t1, f1);
+    release_input(t2, f2);
+    return result;
+}
+
+// torch.sum(t)
+float tensor_sum(Tensor* t) {
+    return (float) reduce(REDUCE_SUM, t, NULL);
+}
+
+// same as tensor_sum, but with Kahan (compensated) summation
+float tensor_sum_kahan(Tensor* t) {
+    return (float) reduce(REDUCE_SUM_KAHAN, t, NULL);
+}
+
+// torch.mean(t), NaN for an empty tensor just like PyTorch
+float tensor_mean(Tensor* t) {
+    STATS_OP(STATS_OP_REDUCE);
+    if (t->size == 0) { return NAN; }
+    return (float) (reduce(REDUCE_SUM, t, NULL) / t->size);
+}
+
+// torch.max(t), torch.min(t): NaN if any element is NaN
+float tensor_max(Tensor* t) {
+    if (t->size == 0) {
+        fprintf(stderr, "ValueError: max of an empty tensor\n");
+        return NAN;
+    }
+    return (float) reduce(REDUCE_MAX, t, NULL);
+}
+
+float tensor_min(Tensor* t) {
+    if (t->size == 0) {
+        fprintf(stderr, "ValueError: min of an empty tensor\n");
+        return NAN;
+    }
+    return (float) reduce(REDUCE_MIN, t, NULL);
+}
+
+// index of the first element equal to val (NaN matches NaN), or -1
+int find_first_flat(Tensor* t, double val) {
+    bool is_nan = val != val;
+    if (t->dtype == DTYPE_FLOAT32) {
+        const float* a = tensor_data_ptr(t);
+        for (int i = 0; i < t->size; i++) {
+            float x = a[i * t->stride];
+            if (x == val || (is_nan && x != x)) { return i; }
+        }
+        return -1;
+    }
+    TypedOperand a = typed_operand(t);
+    double x[DTYPE_BLOCK];
+    for (int i = 0; i < t->size; i += DTYPE_BLOCK) {
+        int n = min(DTYPE_BLOCK, t->size - i);
+        typed_load(&a, i, n, a.dtype, x);
+        for (int j = 0; j < n; j++) {
+            if (x[j] == val || (is_nan && x[j] != x[j])) { return i + j; }
+        }
+    }
+    return -1;
+}
+
+// the index counts in row-major order, for N-d tensors too
+int tensor_find_first(Tensor* t, double val) {
+    STATS_OP(STATS_OP_REDUCE);
+    Tensor* f = flat_input(t);
+    int index = find_first_flat(f, val);
+    release_input(t, f);
+    return index;
+}
+
+// torch.argmax(t), torch.argmin(t): the first index of the max/min (or of a NaN)
+int tensor_argmax(Tensor* t) {
+    STATS_OP(STATS_OP_REDUCE);
+    if (t->size == 0) {
+        fprintf(stderr, "ValueError: argmax of an empty tensor\n");
+        return -1;
+    }
+    return tensor_find_first(t, reduce(REDUCE_MAX, t, NULL));
+}
+
+int tensor_argmin(Tensor* t) {
+    STATS_OP(STATS_OP_REDUCE);
+    if (t->size == 0) {
+        fprintf(stderr, "ValueError: argmin of an empty tensor\n");
+        return -1;
+    }
+    return tensor_find_first(t, reduce(REDUCE_MIN, t, NULL));
+}
+
+// torch.dot(t1, t2)
+float tensor_dot(Tensor* t1, Tensor* t2) {
+    STATS_OP(STATS_OP_DOT);
+    if (t1->size != t2->size) {
+        fprintf(stderr, "ValueError: dot of tensors of different sizes %d and %d\n", t1->size, t2->size);
+        return NAN;
+    }
+    return (float) reduce(REDUCE_DOT, t1, t2);
+}
+
+// Scans, sorting and top-k, over the elements of any view in row-major order
+// (like NumPy with axis=None), with a 1-D result.
+// tensor_cumsum and tensor_cummax are two-pass block scans: the chunks of the
+// thread pool first compute their totals in parallel, an exclusive scan of the
+// few totals gives each chunk the value carried into it, and then the chunks
+// scan their elements in parallel, starting from that carry. Sums accumulate
+// in double.
+// tensor_sort and tensor_argsort are a stable LSD radix sort, 8 bits per pass,
+// of the elements mapped to unsigned keys that order like the values (32 bits
+// for the dtypes that fit in a float, 64 for float64 and int32). Each pass
+// counts the digits per chunk in parallel, and the counts then give every
+// chunk the positions it scatters its keys to, again in parallel. Passes where
+// all keys have the same digit are skipped. Like PyTorch, NaNs sort after
+// every number (before, if descending), and -0.0 equals 0.0.
+// tensor_topk does not sort: every chunk keeps a heap of the best k elements
+// it has seen, and the heaps of the chunks are merged, so it takes about n
+// comparisons against the worst of the heap when k is small. Ties go to the
+// smaller index. For a k that is a big part of n the radix sort is faster.
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_MIN_SIZE 64    // smaller sorts use insertion sort
+#define TOPK_SORT_FRACTION 8 // top-k of more than n / this many elements sorts
+
+typedef enum { SCAN_SUM, SCAN_MAX } ScanOp;
+
+typedef struct {
+    ScanOp op;
+    TypedOperand a;
+    TypedOperand out; // contiguous
+    double* carry; // per chunk its total after pass 1, then the value carried into it, then out of it
+} ScanArgs;
+
+double scan_combine(ScanOp op, double acc, double x) {
+    return op == SCAN_SUM ? acc + x : nan_max_f64(acc, x);
+}
+
+void scan_total_chunk(void* ctx, int chunk, int start, int end) {
+    ScanArgs* args = ctx;
+    double total = args->op == SCAN_SUM ? 0.0 : -INFINITY;
+    if (args->a.dtype == DTYPE_FLOAT32) {
+        int stride = args->a.stride;
+        for (int i = start; i < end; i += PAIRWISE_BLOCK) {
+            const float* a = (const float*) args->a.data + (ptrdiff_t) i * stride;
+            int n = min(PAIRWISE_BLOCK, end - i);
+            double block = args->op == SCAN_SUM ? pairwise_sum(a, stride, n)
+                         : stride == 1 ? kernel_table.max(a, n) : kernel_max_strided(a, stride, n, 1);
+            total = scan_combine(args->op, total, block);
+        }
+    } else {
+        double x[DTYPE_BLOCK];
+        for (int i = start; i < end; i += DTYPE_BLOCK) {
+            int n = min(DTYPE_BLOCK, end - i);
+            typed_load(&args->a, i, n, args->a.dtype, x);
+            for (int j = 0; j < n; j++) { total = scan_combine(args->op, total, x[j]); }
+        }
+    }
+    args->carry[chunk] = total;
+}
+
+void scan_chunk(void* ctx, int chunk, int start, int end) {
+    ScanArgs* args = ctx;
+    double acc = args->carry[chunk];
+    if (args->a.dtype == DTYPE_FLOAT32 && args->out.dtype == DTYPE_FLOAT32) {
+        const float* a = args->a.data;
+        float* out = args->out.data;
+        int stride = args->a.stride;
+        if (args->op == SCAN_SUM) {
+            for (int i = start; i < end; i++) { acc += a[(ptrdiff_t) i * stride]; out[i] = (float) acc; }
+        } else {
+            for (int i = start; i < end; i++) { acc = nan_max_f64(acc, a[(ptrdiff_t) i * stride]); out[i] = (float) acc; }
+        }
+        args->carry[chunk] = acc;
+        return;
+    }
+    double x[DTYPE_BLOCK];
+    int elsize = dtype_info[args->out.dtype].size;
+    for (int i = start; i < end; i += DTYPE_BLOCK) {
+        int n = min(DTYPE_BLOCK, end - i);
+        typed_load(&args->a, i, n, args->a.dtype, x);
+        for (int j = 0; j < n; j++) { acc = scan_combine(args->op, acc, x[j]); x[j] = acc; }
+        dtype_info[args->out.dtype].store((char*) args->out.data + (ptrdiff_t) i * elsize, 1, x, n, 1.0f);
+    }
+    args->carry[chunk] = acc;
+}
+
+// scans flat f into the contiguous out of the same size, starting from the
+// carry acc (0 or -inf for a fresh scan), and returns the carry out of it
+double scan_into(ScanOp op, Tensor* f, double acc, Tensor* out) {
+    int n = f->size;
+    if (n == 0) { return acc; }
+    int num_chunks = parallel_num_chunks(n);
+    double stack_carry[REDUCE_STACK_PARTIALS];
+    double* carry = num_chunks <= REDUCE_STACK_PARTIALS ? stack_carry : mallocCheck(num_chunks * sizeof(double));
+    ScanArgs args = { op, typed_operand(f), typed_operand(out), carry };
+    if (num_chunks > 1) { parallel_for_chunks(n, num_chunks, scan_total_chunk, &args); }
+    for (int c = 0; c < num_chunks; c++) {
+        double total = carry[c];
+        carry[c] = acc;
+        if (c + 1 < num_chunks) { acc = scan_combine(op, acc, total); }
+    }
+    parallel_for_chunks(n, num_chunks, scan_chunk, &args);
+    acc = carry[num_chunks - 1];
+    if (carry != stack_carry) { free(carry); }
+    return acc;
+}
+
+// the dtype of a scan of t: int8 is dequantized, the other dtypes are kept
+int scan_dtype(Tensor* t) {
+    return t->dtype == DTYPE_INT8 ? DTYPE_FLOAT32 : t->dtype;
+}
+
+Tensor* scan(ScanOp op, Tensor* t) {
+    STATS_OP(STATS_OP_SCAN);
+    Tensor* f = flat_input(t);
+    Tensor* result = tensor_empty_dtype(f->size, scan_dtype(f));
+    scan_into(op, f, op == SCAN_SUM ? 0.0 : -INFINITY, result);
+    release_input(t, f);
+    return result;
+}
+
+// torch.cumsum(t.flatten(), 0)
+Tensor* tensor_cumsum(Tensor* t) {
+    return scan(SCAN_SUM, t);
+}
+
+// torch.cummax(t.flatten(), 0).values: NaN from the first NaN on
+Tensor* tensor_cummax(Tensor* t) {
+    return scan(SCAN_MAX, t);
+}
+
+// sort keys: unsigned integers that order like the values, with all NaNs the
+// largest key, and -0.0 the key of 0.0
+uint32_t sort_key_f32(float x) {
+    if (x != x) { return UINT32_MAX; }
+    uint32_t bits = float_bits(x == 0.0f ? 0.0f : x);
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+uint64_t sort_key_f64(double x) {
+    if (x != x) { return UINT64_MAX; }
+    double y = x == 0.0 ? 0.0 : x;
+    uint64_t bits;
+    memcpy(&bits, &y, 8);
+    return bits & 0x8000000000000000ull ? ~bits : bits | 0x8000000000000000ull;
+}
+
+// float64 and int32 need 64-bit keys, the other dtypes are exact in a float
+bool sort_wide_keys(int dtype) {
+    return dtype == DTYPE_FLOAT64 || dtype == DTYPE_INT32;
+}
+
+// What the radix sort moves around: a key and the index of its element
+// together, so that each pass scatters one stream per digit, not two. For
+// 32-bit keys that is one uint64_t with the key in the upper half, and as the
+// indices of equal keys are in increasing order, sorting the whole uint64_t
+// sorts by key, stably.
+typedef struct {
+    uint64_t key;
+    int index;
+} SortItem;
+
+typedef struct {
+    TypedOperand a;
+    bool descending;
+    bool wide;
+    void* items[2]; // uint64_t or SortItem, the current order is in [src], a pass writes [1 - src]
+    int src;
+    int shift;
+    int (*counts)[RADIX_BUCKETS]; // per chunk, then the position of its first item of each digit
+} SortArgs;
+
+void sort_items_chunk(void* ctx, int chunk, int start, int end) {
+    SortArgs* args = ctx;
+    uint64_t* packed = args->items[0];
+    SortItem* items = args->items[0];
+    // descending is ascending by the complement, which keeps equal keys equal
+    uint64_t flip = args->descending ? UINT64_MAX : 0;
+    if (args->a.dtype == DTYPE_FLOAT32) {
+        const float* a = args->a.data;
+        for (int i = start; i < end; i++) {
+            uint32_t key = sort_key_f32(a[(ptrdiff_t) i * args->a.stride]) ^ (uint32_t) flip;
+            packed[i] = (uint64_t) key << 32 | (uint32_t) i;
+        }
+        return;
+    }
+    double x[DTYPE_BLOCK];
+    for (int i = start; i < end; i += DTYPE_BLOCK) {
+        int n = min(DTYPE_BLOCK, end - i);
+        typed_load(&args->a, i, n, args->a.dtype, x);
+        for (int j = 0; j < n; j++) {
+            if (args->wide) {
+                items[i + j].key = sort_key_f64(x[j]) ^ flip;
+                items[i + j].index = i + j;
+            } else {
+                uint32_t key = sort_key_f32((float) x[j]) ^ (uint32_t) flip;
+                packed[i + j] = (uint64_t) key << 32 | (uint32_t) (i + j);
+            }
+        }
+    }
+}
+
+#define RADIX_DIGIT(key, shift) ((int) ((key) >> (shift)) & (RADIX_BUCKETS - 1))
+
+void radix_count_chunk(void* ctx, int chunk, int start, int end) {
+    SortArgs* args = ctx;
+    int* counts = args->counts[chunk];
+    memset(counts, 0, RADIX_BUCKETS * sizeof(int));
+    if (args->wide) {
+        const SortItem* items = args->items[args->src];
+        for (int i = start; i < end; i++) { counts[RADIX_DIGIT(items[i].key, args->shift)]++; }
+    } else {
+        const uint64_t* packed = args->items[args->src];
+        for (int i = start; i < end; i++) { counts[RADIX_DIGIT(packed[i], args->shift + 32)]++; }
+    }
+}
+
+void radix_scatter_chunk(void* ctx, int chunk, int start, int end) {
+    SortArgs* args = ctx;
+    int* pos = args->counts[chunk];
+    if (args->wide) {
+        const SortItem* items = args->items[args->src];
+        SortItem* out = args->items[1 - args->src];
+        for (int i = start; i < end; i++) { out[pos[RADIX_DIGIT(items[i].key, args->shift)]++] = items[i]; }
+    } else {
+        const uint64_t* packed = args->items[args->src];
+        uint64_t* out = args->items[1 - args->src];
+        for (int i = start; i < end; i++) { out[pos[RADIX_DIGIT(packed[i], args->shift + 32)]++] = packed[i]; }
+    }
+}
+
+#undef RADIX_DIGIT
+
+// stable insertion sort of the first n items, in place
+void insertion_sort_items(SortArgs* args, int n) {
+    if (args->wide) {
+        SortItem* items = args->items[0];
+        for (int i = 1; i < n; i++) {
+            SortItem item = items[i];
+            int j = i;
+            for (; j > 0 && items[j - 1].key > item.key; j--) { items[j] = items[j - 1]; }
+            items[j] = item;
+        }
+    } else {
+        uint64_t* packed = args->items[0];
+        for (int i = 1; i < n; i++) {
+            uint64_t item = packed[i];
+            int j = i;
+            for (; j > 0 && packed[j - 1] > item; j--) { packed[j] = packed[j - 1]; }
+            packed[j] = item;
+        }
+    }
+}
+
+// the stable sorting order of the n elements of flat f: an int32 tensor of
+// the indices of the smallest (largest if descending) first
+Tensor* sort_order(Tensor* f, bool descending) {
+    int n = f->size;
+    SortArgs args;
+    args.a = typed_operand(f);
+    args.descending = descending;
+    args.wide = sort_wide_keys(f->dtype);
+    size_t item_bytes = (size_t) max(n, 1) * (args.wide ? sizeof(SortItem) : sizeof(uint64_t));
+    args.items[0] = mallocCheck(2 * item_bytes);
+    args.items[1] = (char*) args.items[0] + item_bytes;
+    args.src = 0;
+    int num_chunks = parallel_num_chunks(n);
+    parallel_for_chunks(n, num_chunks, sort_items_chunk, &args);
+    if (n < RADIX_MIN_SIZE) {
+        insertion_sort_items(&args, n);
+    } else {
+        args.counts = mallocCheck(num_chunks * sizeof(*args.counts));
+        for (args.shift = 0; args.shift < (args.wide ? 64 : 32); args.shift += RADIX_BITS) {
+            parallel_for_chunks(n, num_chunks, radix_count_chunk, &args);
+            // the items of each digit go in chunk order, which keeps the sort stable
+            int pos = 0;
+            bool one_digit = false;
+            for (int d = 0; d < RADIX_BUCKETS; d++) {
+                int start = pos;
+                for (int c = 0; c < num_chunks; c++) {
+                    int count = args.counts[c][d];
+                    args.counts[c][d] = pos;
+                    pos += count;
+                }
+                if (pos - start == n) { one_digit = true; } // this pass would not move anything
+            }
+            if (one_digit) { continue; }
+            parallel_for_chunks(n, num_chunks, radix_scatter_chunk, &args);
+            args.src = 1 - args.src;
+        }
+        free(args.counts);
+    }
+    Tensor* order = tensor_empty_dtype(n, DTYPE_INT32);
+    int32_t* index = order->storage->data;
+    if (args.wide) {
+        const SortItem* items = args.items[args.src];
+        for (int i = 0; i < n; i++) { index[i] = items[i].index; }
+    } else {
+        const uint64_t* packed = args.items[args.src];
+        for (int i = 0; i < n; i++) { index[i] = (int32_t) (uint32_t) packed[i]; }
+    }
+    free(args.items[0]);
+    return order;
+}
+
+// the elements of flat f at the n indices, as a new contiguous 1-D tensor
+Tensor* gather_flat(Tensor* f, const int* index, int n) {
+    Tensor line = *f;
+    view_set_1d(&line);
+    Tensor* result = tensor_empty_dtype(n, f->dtype);
+    result->storage->scale = f->storage->scale;
+    GatherArgs args = { &line, index, result->storage->data };
+    parallel_for(n, gather_chunk, &args);
+    return result;
+}
+
+// torch.sort(t.flatten(), stable=True): the sorted values, and their indices
+// into t (an int32 tensor) in *indices unless indices is NULL
+Tensor* tensor_sort(Tensor* t, bool descending, Tensor** indices) {
+    STATS_OP(STATS_OP_SORT);
+    Tensor* f = flat_input(t);
+    Tensor* order = sort_order(f, descending);
+    Tensor* values = gather_flat(f, order->storage->data, f->size);
+    release_input(t, f);
+    if (indices != NULL) {
+        *indices = order;
+    } else {
+        tensor_decref(order);
+    }
+    return values;
+}
+
+// torch.argsort(t.flatten(), stable=True), an int32 tensor
+Tensor* tensor_argsort(Tensor* t, bool descending) {
+    STATS_OP(STATS_OP_SORT);
+    Tensor* f = flat_input(t);
+    Tensor* order = sort_order(f, descending);
+    release_input(t, f);
+    return order;
+}
+
+typedef struct {
+    uint64_t key; // the sort key, complemented for the smallest
+    int index;
+} TopkEntry;
+
+// whether a goes before b in the result
+bool topk_before(TopkEntry a, TopkEntry b) {
+    return a.key > b.key || (a.key == b.key && a.index < b.index);
+}
+
+// heap[0, n) is a heap with the entry that goes last at the top
+void topk_sift_down(TopkEntry* heap, int n, int i) {
+    for (;;) {
+        int last = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < n && topk_before(heap[last], heap[left])) { last = left; }
+        if (right < n && topk_before(heap[last], heap[right])) { last = right; }
+        if (last == i) { return; }
+        TopkEntry tmp = heap[i];
+        heap[i] = heap[last];
+        heap[last] = tmp;
+        i = last;
+    }
+}
+
+// adds e to the heap of the best *count (at most k) entries
+void topk_push(TopkEntry* heap, int* count, int k, TopkEntry e) {
+    if (*count < k) {
+        int i = (*count)++;
+        while (i > 0 && topk_before(heap[(i - 1) / 2], e)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = e;
+    } else if (topk_before(e, heap[0])) {
+        heap[0] = e;
+        topk_sift_down(heap, k, 0);
+    }
+}
+
+typedef struct {
+    TypedOperand a;
+    int k;
+    uint64_t flip; // complements the keys for the smallest
+    TopkEntry* heaps; // k per chunk
+    int* counts;
+} TopkArgs;
+
+void topk_chunk(void* ctx, int chunk, int start, int end) {
+    TopkArgs* args = ctx;
+    TopkEntry* heap = args->heaps + (ptrdiff_t) chunk * args->k;
+    int count = 0;
+    // the indices only grow, so an element that doesn't beat the top of a full heap is out
+#define TOPK_ADD(x, i) { \
+        TopkEntry e = { sort_key_f64(x) ^ args->flip, i }; \
+        if (count < args->k || e.key > heap[0].key) { topk_push(heap, &count, args->k, e); } \
+    }
+    if (args->a.dtype == DTYPE_FLOAT32) {
+        const float* a = args->a.data;
+        for (int i = start; i < end; i++) { TOPK_ADD(a[(ptrdiff_t) i * args->a.stride], i); }
+    } else {
+        double x[DTYPE_BLOCK];
+        for (int i = start; i < end; i += DTYPE_BLOCK) {
+            int n = min(DTYPE_BLOCK, end - i);
+            typed_load(&args->a, i, n, args->a.dtype, x);
+            for (int j = 0; j < n; j++) { TOPK_ADD(x[j], i + j); }
+        }
+    }
+#undef TOPK_ADD
+    args->counts[chunk] = count;
+}
+
+// the k >= 1 largest (or smallest) elements of flat f, best first: an int32 tensor of their indices
+Tensor* topk_order(Tensor* f, int k, bool largest) {
+    int n = f->size;
+    if ((long long) k * TOPK_SORT_FRACTION > n) {
+        Tensor* order = sort_order(f, largest);
+        Tensor* first = tensor_slice(order, 0, k, 1);
+        tensor_decref(order);
+        tensor_compact(first);
+        return first;
+    }
+    int num_chunks = parallel_num_chunks(n);
+    TopkArgs args = {
+        typed_operand(f), k, largest ? 0 : UINT64_MAX,
+        mallocCheck((size_t) num_chunks * k * sizeof(TopkEntry)), mallocCheck(num_chunks * sizeof(int))
+    };
+    parallel_for_chunks(n, num_chunks, topk_chunk, &args);
+    // merge the heaps of the chunks into the first one, then sort it
+    TopkEntry* heap = args.heaps;
+    int count = args.counts[0];
+    for (int c = 1; c < num_chunks; c++) {
+        for (int i = 0; i < args.counts[c]; i++) { topk_push(heap, &count, k, args.heaps[(ptrdiff_t) c * k + i]); }
+    }
+    for (int end = count - 1; end > 0; end--) {
+        TopkEntry tmp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = tmp;
+        topk_sift_down(heap, end, 0);
+    }
+    Tensor* order = tensor_empty_dtype(count, DTYPE_INT32);
+    int32_t* index = order->storage->data;
+    for (int i = 0; i < count; i++) { index[i] = heap[i].index; }
+    free(args.heaps);
+    free(args.counts);
+    return order;
+}
+
+// torch.topk(t.flatten(), k, largest=largest): the k largest (smallest)
+// values, best first, and their indices into t (an int32 tensor) in
+// *indices unless indices is NULL
+Tensor* tensor_topk(Tensor* t, int k, bool largest, Tensor** indices) {
+    STATS_OP(STATS_OP_SORT);
+    if (k < 0 || k > t->size) {
+        fprintf(stderr, "ValueError: selected index k=%d out of range for %d elements\n", k, t->size);
+        return NULL;
+    }
+    Tensor* f = flat_input(t);
+    // k == 0 selects nothing, and topk_order needs room for at least one entry per heap
+    Tensor* order = k == 0 ? tensor_empty_dtype(0, DTYPE_INT32) : topk_order(f, k, largest);
+    Tensor* values = gather_flat(f, tensor_data_ptr(order), k);
+    release_input(t, f);
+    if (indices != NULL) {
+        *indices = order;
+    } else {
+        tensor_decref(order);
+    }
+    return values;
+}
+
+// Matrix multiply, like torch.matmul: 2-D x 2-D is the matrix product, a 1-D
+// operand is a row vector on the left or a column vector on the right (and
+// that dimension is dropped from the result again), and the dimensions before
+// the last two are batch dimensions, which broadcast. Operands may have any
+// strides, e.g. a transposed view is multiplied without a copy.
+// float32 (and float16, bfloat16 and int8, which are computed in float32 like
+// PyTorch does on the CPU) runs on a cache-blocked GEMM in the style of
+// GotoBLAS/BLIS: B is packed GEMM_KC x GEMM_NC at a time (for L3) into panels
+// of GEMM_NR columns (for L1), A GEMM_MC x GEMM_KC at a time (for L2) into
+// panels of GEMM_MR rows, and the micro-kernel multiplies a panel of each into
+// a register tile. Packing makes every load of the micro-kernel contiguous,
+// whatever the strides of the operands. The tiles of C are spread over the
+// thread pool. Tiny products skip the packing, and matrix-vector products with
+// contiguous rows use the dot kernel. float64 and int32 are computed in double
+// with plain loops. Built with BLAS=1, float32 products in a layout BLAS takes
+// go to cblas_sgemm instead.
+
+#define GEMM_KC 256
+#define GEMM_MC 144               // a multiple of GEMM_MR
+#define GEMM_NC 3072              // a multiple of GEMM_NR
+#define GEMM_SMALL (32 * 32 * 32) // m * n * k below this skips the packing
+
+// c (m x n) = a (m x k) * b (k x n), element (i, j) of c at c[i * c_rs + j * c_cs] etc.
+typedef struct {
+    int m, n, k;
+    bool f64; // double elements, else float
+    void* a;
+    int a_rs, a_cs;
+    void* b;
+    int b_rs, b_cs;
+    void* c;
+    int c_rs, c_cs;
+} Gemm;
+
+void gemm_f64(const Gemm* g) {
+    const double* a = g->a;
+    const double* b = g->b;
+    double* c = g->c;
+    for (int i = 0; i < g->m; i++) {
+        double* row = c + (ptrdiff_t) i * g->c_rs;
+        for (int j = 0; j < g->n; j++) { row[(ptrdiff_t) j * g->c_cs] = 0.0; }
+        for (int p = 0; p < g->k; p++) {
+            double x = a[(ptrdiff_t) i * g->a_rs + (ptrdiff_t) p * g->a_cs];
+            const double* brow = b + (ptrdiff_t) p * g->b_rs;
+            for (int j = 0; j < g->n; j++) { row[(ptrdiff_t) j * g->c_cs] += x * brow[(ptrdiff_t) j * g->b_cs]; }
+        }
+    }
+}
+
+void gemm_small(const Gemm* g) {
+    const float* a = g->a;
+    const float* b = g->b;
+    float* c = g->c;
+    for (int i = 0; i < g->m; i++) {
+        for (int j = 0; j < g->n; j++) {
+            float acc = 0.0f;
+            for (int p = 0; p < g->k; p++) {
+                acc += a[(ptrdiff_t) i * g->a_rs + (ptrdiff_t) p * g->a_cs] * b[(ptrdiff_t) p * g->b_rs + (ptrdiff_t) j * g->b_cs];
+            }
+            c[(ptrdiff_t) i * g->c_rs + (ptrdiff_t) j * g->c_cs] = acc;
+        }
+    }
+}
+
+// n == 1, with the rows of a and the column b contiguous: one dot product per row
+void gemv_chunk(void* ctx, int chunk, int start, int end) {
+    const Gemm* g = ctx;
+    const float* a = g->a;
+    float* c = g->c;
+    for (int i = start; i < end; i++) {
+        c[(ptrdiff_t) i * g->c_rs] = kernel_table.dot(a + (ptrdiff_t) i * g->a_rs, g->b, g->k);
+    }
+}
+
+void gemv(const Gemm* g) {
+    long long elements = (long long) g->m * g->k;
+    int work = elements < INT_MAX ? (int) elements : INT_MAX;
+    parallel_for_chunks(g->m, min(parallel_num_chunks(work), g->m), gemv_chunk, (void*) g);
+}
+
+// packs rows [ic, ic + mc) x columns [pc, pc + kc) of a into panels of GEMM_MR
+// rows, zero padded: element (i, p) of a panel at p * GEMM_MR + i
+void gemm_pack_a(const Gemm* g, int ic, int mc, int pc, int kc, float* out) {
+    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+        int rows = min(GEMM_MR, mc - ir);
+        const float* a = (const float*) g->a + (ptrdiff_t) (ic + ir) * g->a_rs + (ptrdiff_t) pc * g->a_cs;
+        for (int p = 0; p < kc; p++) {
+            for (int i = 0; i < GEMM_MR; i++) {
+                *out++ = i < rows ? a[(ptrdiff_t) i * g->a_rs + (ptrdiff_t) p * g->a_cs] : 0.0f;
+            }
+        }
+    }
+}
+
+// the current block of the blocked GEMM
+typedef struct {
+    const Gemm* g;
+    int jc, nc; // columns of c and b
+    int pc, kc; // rows of b, columns of a
+    float* packed_a; // m x kc, in blocks of GEMM_MC rows (block ic at ic * kc) of panels of GEMM_MR rows
+    float* packed_b; // kc x nc, in panels of GEMM_NR columns
+    int col_groups; // the panels are split into this many groups, for the threads
+} GemmBlock;
+
+// packs the blocks [start, end) of GEMM_MC rows of the block of a
+void gemm_pack_a_chunk(void* ctx, int chunk, int start, int end) {
+    GemmBlock* blk = ctx;
+    const Gemm* g = blk->g;
+    for (int block = start; block < end; block++) {
+        int ic = block * GEMM_MC;
+        gemm_pack_a(g, ic, min(GEMM_MC, g->m - ic), blk->pc, blk->kc, blk->packed_a + (ptrdiff_t) ic * blk->kc);
+    }
+}
+
+// packs panels [start, end) of the block of b, zero padded: element (p, j) of
+// a panel at p * GEMM_NR + j
+void gemm_pack_b_chunk(void* ctx, int chunk, int start, int end) {
+    GemmBlock* blk = ctx;
+    const Gemm* g = blk->g;
+    for (int panel = start; panel < end; panel++) {
+        int jr = panel * GEMM_NR;
+        int cols = min(GEMM_NR, blk->nc - jr);
+        const float* b = (const float*) g->b + (ptrdiff_t) blk->pc * g->b_rs + (ptrdiff_t) (blk->jc + jr) * g->b_cs;
+        float* out = blk->packed_b + (ptrdiff_t) panel * blk->kc * GEMM_NR;
+        for (int p = 0; p < blk->kc; p++, out += GEMM_NR) {
+            const float* row = b + (ptrdiff_t) p * g->b_rs;
+            if (cols == GEMM_NR && g->b_cs == 1) {
+                memcpy(out, row, GEMM_NR * sizeof(float));
+            } else {
+                for (int j = 0; j < GEMM_NR; j++) { out[j] = j < cols ? row[(ptrdiff_t) j * g->b_cs] : 0.0f; }
+            }
+        }
+    }
+}
+
+// writes the valid rows x cols of a tile to c, adding to c after the first block of k
+void gemm_store_tile(const float* tile, float* c, int rs, int cs, int rows, int cols, bool accumulate) {
+    for (int i = 0; i < rows; i++) {
+        float* row = c + (ptrdiff_t) i * rs;
+        const float* t = tile + i * GEMM_NR;
+        if (accumulate) {
+            for (int j = 0; j < cols; j++) { row[(ptrdiff_t) j * cs] += t[j]; }
+        } else {
+            for (int j = 0; j < cols; j++) { row[(ptrdiff_t) j * cs] = t[j]; }
+        }
+    }
+}
+
+// items [start, end) of the block: item = (block of GEMM_MC rows, group of panels)
+void gemm_block_chunk(void* ctx, int chunk, int start, int end) {
+    GemmBlock* blk = ctx;
+    const Gemm* g = blk->g;
+    float tile[GEMM_MR * GEMM_NR];
+    int panels = ceil_div(blk->nc, GEMM_NR);
+    int group_panels = ceil_div(panels, blk->col_groups);
+    for (int item = start; item < end; item++) {
+        int ic = item / blk->col_groups * GEMM_MC;
+        int mc = min(GEMM_MC, g->m - ic);
+        const float* packed_a = blk->packed_a + (ptrdiff_t) ic * blk->kc;
+        int first = item % blk->col_groups * group_panels;
+        for (int panel = first; panel < min(first + group_panels, panels); panel++) {
+            int jr = panel * GEMM_NR;
+            const float* b = blk->packed_b + (ptrdiff_t) panel * blk->kc * GEMM_NR;
+            for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                kernel_table.gemm_micro(blk->kc, packed_a + (ptrdiff_t) ir * blk->kc, b, tile);
+                float* c = (float*) g->c + (ptrdiff_t) (ic + ir) * g->c_rs + (ptrdiff_t) (blk->jc + jr) * g->c_cs;
+                gemm_store_tile(tile, c, g->c_rs, g->c_cs, min(GEMM_MR, mc - ir), min(GEMM_NR, blk->nc - jr), blk->pc > 0);
+            }
+        }
+    }
+}
+
+void gemm_blocked(const Gemm* g) {
+    // big products run on the thread pool, unless we are already in a parallel op
+    int threads = (long long) g->m * g->n * g->k >= parallel_threshold ? tensor_get_num_threads() : 1;
+    int row_blocks = ceil_div(g->m, GEMM_MC);
+    GemmBlock blk;
+    blk.g = g;
+    // all of a is packed for each block of k, once, instead of by every group of panels
+    blk.packed_a = alignedMallocCheck(64, (size_t) row_blocks * GEMM_MC * min(GEMM_KC, g->k) * sizeof(float));
+    blk.packed_b = alignedMallocCheck(64, (size_t) GEMM_KC * GEMM_NC * sizeof(float));
+    for (blk.jc = 0; blk.jc < g->n; blk.jc += GEMM_NC) {
+        blk.nc = min(GEMM_NC, g->n - blk.jc);
+        int panels = ceil_div(blk.nc, GEMM_NR);
+        // about two items per thread, so they balance out
+        blk.col_groups = threads > 1 ? min(panels, ceil_div(2 * threads, row_blocks)) : 1;
+        int items = row_blocks * blk.col_groups;
+        for (blk.pc = 0; blk.pc < g->k; blk.pc += GEMM_KC) {
+            blk.kc = min(GEMM_KC, g->k - blk.pc);
+            parallel_for_chunks(row_blocks, min(threads, row_blocks), gemm_pack_a_chunk, &blk);
+            parallel_for_chunks(panels, min(threads, panels), gemm_pack_b_chunk, &blk);
+            parallel_for_chunks(items, threads > 1 ? items : 1, gemm_block_chunk, &blk);
+        }
+    }
+    free(blk.packed_a);
+    free(blk.packed_b);
+}
+
+#ifdef TENSOR1D_BLAS
+// a rows x cols matrix with strides (rs, cs) as BLAS takes it: row-major with
+// leading dimension ld, or the transpose of one
+bool blas_layout(int rows, int cols, int rs, int cs, CBLAS_TRANSPOSE* trans, int* ld) {
+    if (cs == 1 && rs >= max(cols, 1)) {
+        *trans = CblasNoTrans;
+        *ld = rs;
+        return true;
+    }
+    if (rs == 1 && cs >= max(rows, 1)) {
+        *trans = CblasTrans;
+        *ld = cs;
+        return true;
+    }
+    return false;
+}
+
+bool gemm_blas(const Gemm* g) {
+    CBLAS_TRANSPOSE trans_a, trans_b, trans_c;
+    int lda, ldb, ldc;
+    if (!blas_layout(g->m, g->k, g->a_rs, g->a_cs, &trans_a, &lda) ||
+        !blas_layout(g->k, g->n, g->b_rs, g->b_cs, &trans_b, &ldb) ||
+        !blas_layout(g->m, g->n, g->c_rs, g->c_cs, &trans_c, &ldc) || trans_c != CblasNoTrans) {
+        return false;
+    }
+    cblas_sgemm(CblasRowMajor, trans_a, trans_b, g->m, g->n, g->k, 1.0f, g->a, lda, g->b, ldb, 0.0f, g->c, ldc);
+    return true;
+}
+#endif
+
+void gemm(const Gemm* g) {
+    if (g->m == 0 || g->n == 0) { return; }
+    if (g->f64) {
+        gemm_f64(g);
+        return;
+    }
+    if ((long long) g->m * g->n * g->k < GEMM_SMALL) {
+        gemm_small(g);
+        return;
+    }
+#ifdef TENSOR1D_BLAS
+    if (gemm_blas(g)) { return; }
+#endif
+    if (g->n == 1 && g->a_cs == 1 && g->b_rs == 1) {
+        gemv(g);
+    } else if (g->m == 1 && g->b_rs == 1 && g->a_cs == 1) {
+        // a row times b is b transposed times a column
+        Gemm t = { g->n, 1, g->k, false, g->b, g->b_cs, g->b_rs, g->a, g->a_cs, g->a_rs, g->c, g->c_cs, g->c_rs };
+        gemv(&t);
+    } else {
+        gemm_blocked(g);
+    }
+}
+
+// a stack of matrices: the first one, and the batch dimensions on top
+typedef struct {
+    Gemm g;
+    int elsize;
+    BroadcastIter it; // over the batch shape, operands c, a, b
+} BatchedGemm;
+
+void gemm_batch_run(void* ctx, const ptrdiff_t* offsets, const int* strides, int len) {
+    BatchedGemm* bg = ctx;
+    for (int i = 0; i < len; i++) {
+        Gemm g = bg->g;
+        g.c = (char*) g.c + (offsets[0] + (ptrdiff_t) i * strides[0]) * bg->elsize;
+        g.a = (char*) g.a + (offsets[1] + (ptrdiff_t) i * strides[1]) * bg->elsize;
+        g.b = (char*) g.b + (offsets[2] + (ptrdiff_t) i * strides[2]) * bg->elsize;
+        gemm(&g);
+    }
+}
+
+void gemm_batch_chunk(void* ctx, int chunk, int start, int end) {
+    BatchedGemm* bg = ctx;
+    broadcast_for_each_run(&bg->it, start, end, gemm_batch_run, bg);
+}
+
+// t as a stack of matrices (batch..., rows, cols): a 1-D t is a row vector on
+// the left of a matmul, or a column vector on the right
+void as_matrices(Tensor* t, bool left, int* ndim, int* shape, int* strides) {
+    *ndim = t->ndim;
+    memcpy(shape, t->shape, t->ndim * sizeof(int));
+    memcpy(strides, t->strides, t->ndim * sizeof(int));
+    if (t->ndim == 1) {
+        *ndim = 2;
+        if (left) {
+            shape[1] = t->shape[0];
+            strides[1] = t->strides[0];
+            shape[0] = 1;
+            strides[0] = t->shape[0] * t->strides[0];
+        } else {
+            shape[1] = 1;
+            strides[1] = 1;
+        }
+    }
+}
+
+// the shape of matmul(a, b), false if they can't be multiplied
+bool matmul_shape(Tensor* a, Tensor* b, int* ndim, int* shape) {
+    if (a->ndim == 0 || b->ndim == 0) {
+        fprintf(stderr, "ValueError: matmul needs tensors with at least one dimension\n");
+        return false;
+    }
+    int a_ndim, b_ndim;
+    int a_shape[TENSOR_MAX_DIMS], a_strides[TENSOR_MAX_DIMS], b_shape[TENSOR_MAX_DIMS], b_strides[TENSOR_MAX_DIMS];
+    as_matrices(a, true, &a_ndim, a_shape, a_strides);
+    as_matrices(b, false, &b_ndim, b_shape, b_strides);
+    if (a_shape[a_ndim - 1] != b_shape[b_ndim - 2]) {
+        fprintf(stderr, "ValueError: matmul of %d x %d and %d x %d matrices\n",
+                a_shape[a_ndim - 2], a_shape[a_ndim - 1], b_shape[b_ndim - 2], b_shape[b_ndim - 1]);
+        return false;
+    }
+    if (!broadcast_shapes(a_ndim - 2, a_shape, b_ndim - 2, b_shape, ndim, shape)) { return false; }
+    if (a->ndim > 1) { shape[(*ndim)++] = a_shape[a_ndim - 2]; }
+    if (b->ndim > 1) { shape[(*ndim)++] = b_shape[b_ndim - 1]; }
+    return true;
+}
+
+// c = matmul(a, b), where a and b are float32 (or both float64) and c has the
+// result dtype and strides c_strides for the result shape
+void matmul_into(Tensor* a, Tensor* b, Tensor* c, const int* c_strides) {
+    int a_ndim, b_ndim;
+    int a_shape[TENSOR_MAX_DIMS], a_strides[TENSOR_MAX_DIMS], b_shape[TENSOR_MAX_DIMS], b_strides[TENSOR_MAX_DIMS];
+    as_matrices(a, true, &a_ndim, a_shape, a_strides);
+    as_matrices(b, false, &b_ndim, b_shape, b_strides);
+    int batch_ndim;
+    int batch[TENSOR_MAX_DIMS];
+    broadcast_shapes(a_ndim - 2, a_shape, b_ndim - 2, b_shape, &batch_ndim, batch);
+    BatchedGemm bg;
+    Gemm* g = &bg.g;
+    g->m = a_shape[a_ndim - 2];
+    g->k = a_shape[a_ndim - 1];
+    g->n = b_shape[b_ndim - 1];
+    g->f64 = c->dtype == DTYPE_FLOAT64;
+    g->a = tensor_data_ptr(a);
+    g->a_rs = a_strides[a_ndim - 2];
+    g->a_cs = a_strides[a_ndim - 1];
+    g->b = tensor_data_ptr(b);
+    g->b_rs = b_strides[b_ndim - 2];
+    g->b_cs = b_strides[b_ndim - 1];
+    // the rows and columns of c, where the dimension of a 1-D operand is dropped
+    g->c = tensor_data_ptr(c);
+    int d = batch_ndim;
+    g->c_rs = a->ndim > 1 ? c_strides[d++] : 0;
+    g->c_cs = b->ndim > 1 ? c_strides[d] : 1;
+    if (a->ndim == 1) { g->c_rs = g->n * g->c_cs; }
+    bg.elsize = dtype_info[c->dtype].size;
+    broadcast_iter_init(&bg.it, batch_ndim, batch);
+    broadcast_iter_add(&bg.it, c_strides);
+    broadcast_iter_add_shape(&bg.it, a_ndim - 2, a_shape, a_strides);
+    broadcast_iter_add_shape(&bg.it, b_ndim - 2, b_shape, b_strides);
+    broadcast_iter_merge(&bg.it);
+    // with enough matrices each thread takes whole ones, else each product is split up
+    int num_batches = shape_numel(batch_ndim, batch);
+    long long work = (long long) num_batches * g->m * g->n * g->k;
+    int threads = work >= parallel_threshold && num_batches >= tensor_get_num_threads() ? tensor_get_num_threads() : 1;
+    parallel_for_chunks(num_batches, threads, gemm_batch_chunk, &bg);
+}
+
+// t itself (with a new reference) if it has the dtype, else a converted copy
+Tensor* as_dtype(Tensor* t, int dtype) {
+    tensor_eval(t);
+    if (t->dtype == dtype) {
+        tensor_incref(t);
+        return t;
+    }
+    return tensor_to_dtype(t, dtype);
+}
+
+Tensor* tensor_matmul_out(Tensor* a, Tensor* b, Tensor* out) {
+    STATS_OP(STATS_OP_MATMUL);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    if (!matmul_shape(a, b, &ndim, shape)) { return NULL; }
+    if (!check_out_size(out, shape_numel(ndim, shape)) || !check_writable(out) || !check_no_overlap(out)) { return NULL; }
+    int dtype = tensor_promote_types(a->dtype, b->dtype);
+    int compute_dtype = dtype == DTYPE_FLOAT64 || dtype == DTYPE_INT32 ? DTYPE_FLOAT64 : DTYPE_FLOAT32;
+    Tensor* ca = as_dtype(a, compute_dtype);
+    Tensor* cb = as_dtype(b, compute_dtype);
+    tensor_eval(out);
+    // out is written directly, unless it needs a conversion, has a layout we
+    // can't write in place, or overlaps an input
+    Tensor* c = out;
+    int strides[TENSOR_MAX_DIMS];
+    if (out->dtype != compute_dtype || !out_strides(out, ndim, shape, strides) ||
+        out->storage == ca->storage || out->storage == cb->storage) {
+        c = tensor_empty_shape(ndim, shape, compute_dtype);
+        memcpy(strides, c->strides, sizeof(strides));
+    }
+    matmul_into(ca, cb, c, strides);
+    if (c != out) {
+        elementwise(TYPED_COPY, c, NULL, 0.0, compute_dtype, out);
+        tensor_decref(c);
+    }
+    tensor_decref(ca);
+    tensor_decref(cb);
+    return out;
+}
+
+Tensor* tensor_matmul(Tensor* a, Tensor* b) {
+    STATS_OP(STATS_OP_MATMUL);
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    if (!matmul_shape(a, b, &ndim, shape)) { return NULL; }
+    Tensor* result = tensor_empty_shape(ndim, shape, tensor_promote_types(a->dtype, b->dtype));
+    return tensor_matmul_out(a, b, result);
+}
+
+// the fixed-rank variants, like torch.mm, torch.mv and torch.bmm
+
+bool check_ndims(Tensor* a, Tensor* b, int a_ndim, int b_ndim, const char* op) {
+    if (a->ndim != a_ndim || b->ndim != b_ndim) {
+        fprintf(stderr, "ValueError: %s expects %d-D and %d-D tensors, got %d-D and %d-D\n", op, a_ndim, b_ndim, a->ndim, b->ndim);
+        return false;
+    }
+    return true;
+}
+
+Tensor* tensor_mm(Tensor* a, Tensor* b) {
+    return check_ndims(a, b, 2, 2, "mm") ? tensor_matmul(a, b) : NULL;
+}
+
+Tensor* tensor_mv(Tensor* a, Tensor* v) {
+    return check_ndims(a, v, 2, 1, "mv") ? tensor_matmul(a, v) : NULL;
+}
+
+Tensor* tensor_bmm(Tensor* a, Tensor* b) {
+    if (!check_ndims(a, b, 3, 3, "bmm")) { return NULL; }
+    if (a->shape[0] != b->shape[0]) {
+        fprintf(stderr, "ValueError: bmm of batches of %d and %d matrices\n", a->shape[0], b->shape[0]);
+        return NULL;
+    }
+    return tensor_matmul(a, b);
+}
+
+// Quantizes t to int8 with the given scale: q = round(x / scale), saturated to
+// [-128, 127]. A scale <= 0 picks max(|t|) / 127, so the whole range fits.
+Tensor* tensor_quantize(Tensor* t, float scale) {
+    STATS_OP(STATS_OP_TO_DTYPE);
+    if (!(scale > 0.0f)) {
+        double absmax = t->size > 0 ? fmax(fabs(reduce(REDUCE_MAX, t, NULL)), fabs(reduce(REDUCE_MIN, t, NULL))) : 0.0;
+        scale = absmax > 0.0 && isfinite(absmax) ? (float) (absmax / 127.0) : 1.0f;
+    }
+    Tensor* result = result_like(t, DTYPE_INT8);
+    result->storage->scale = scale;
+    return elementwise(TYPED_COPY, t, NULL, 0.0, t->dtype, result);
+}
+
+// Printing. Like NumPy, tensors with more than print_threshold elements are
+// summarized to their first and last print_edge_items elements around a "...",
+// so logging a huge tensor stays cheap. tensor_format streams the text to a
+// callback in pieces of at most FORMAT_BUFFER bytes, so even the full text of
+// a huge tensor never has to be held in memory at once; tensor_write and
+// tensor_to_string are built on it.
+
+int print_threshold = 1000;
+int print_edge_items = 3;
+
+// arguments < 0 leave the current value, see numpy.set_printoptions
+void tensor_set_print_options(int threshold, int edge_items) {
+    if (threshold >= 0) { print_threshold = threshold; }
+    if (edge_items >= 0) { print_edge_items = edge_items; }
+}
+
+int tensor_get_print_threshold(void) {
+    return print_threshold;
+}
+
+int tensor_get_print_edge_items(void) {
+    return print_edge_items;
+}
+
+// Writes val like sprintf("%.1f") does, but several times faster. val*10 is
+// exact in a double (a float has 24 bits of mantissa), so rounding it to an
+// integer (half to even, as printf does) gives exactly the printed digits.
+// Non-finite and huge values, where that integer would overflow, go to sprintf.
+// Returns the length, out needs room for FORMAT_MAX_ITEM chars.
+int format_float(char* out, float val) {
+    double scaled = (double) val * 10.0;
+    if (!isfinite(scaled) || fabs(scaled) >= 1e18) { return sprintf(out, "%.1f", val); }
+    unsigned long long u = (unsigned long long) fabs(nearbyint(scaled));
+    char digits[24]; // in reverse, the decimal first
+    int n = 0;
+    digits[n++] = (char) ('0' + u % 10);
+    u /= 10;
+    do {
+        digits[n++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    int len = 0;
+    if (signbit(val)) { out[len++] = '-'; } // also for -0.0 and e.g. -0.01, like printf
+    while (n > 1) { out[len++] = digits[--n]; }
+    out[len++] = '.';
+    out[len++] = digits[0];
+    out[len] = '\0';
+    return len;
+}
+
+#define FORMAT_BUFFER 4096
+#define FORMAT_MAX_ITEM 320 // "%.1f" of -DBL_MAX is 311 chars
+
+typedef struct {
+    TextSink sink;
+    void* ctx;
+    int len;
+    char buf[FORMAT_BUFFER];
+} Formatter;
+
+void formatter_flush(Formatter* f) {
+    if (f->len > 0) { f->sink(f->ctx, f->buf, f->len); }
+    f->len = 0;
+}
+
+// makes room for another FORMAT_MAX_ITEM chars
+char* formatter_reserve(Formatter* f) {
+    if (f->len + FORMAT_MAX_ITEM > FORMAT_BUFFER) { formatter_flush(f); }
+    return f->buf + f->len;
+}
+
+void formatter_puts(Formatter* f, const char* s) {
+    int len = strlen(s);
+    memcpy(formatter_reserve(f), s, len);
+    f->len += len;
+}
+
+// the element at offset in the Storage data of t as text. Integer dtypes print as integers
+// (int8 only with a scale of 1, otherwise the dequantized values are fractional), the rest like "%.1f".
+int format_element(char* out, Tensor* t, const void* data, ptrdiff_t offset) {
+    if (t->dtype == DTYPE_FLOAT32) { return format_float(out, ((const float*) data)[offset]); }
+    double val;
+    float scale = t->storage->scale;
+    dtype_info[t->dtype].load(&val, element_ptr(data, offset, t->dtype), 1, 1, scale);
+    switch (t->dtype) {
+        case DTYPE_FLOAT16:
+        case DTYPE_BFLOAT16:
+            return format_float(out, (float) val); // exact as a float
+        case DTYPE_INT32:
+            return sprintf(out, "%d", (int) val);
+        case DTYPE_INT8:
+            if (scale == 1.0f) { return sprintf(out, "%d", (int) val); }
+            return sprintf(out, "%.1f", val);
+        default:
+            return sprintf(out, "%.1f", val);
+    }
+}
+
+// N-d tensors print as nested lists, a summarized one shows the edge items of every dimension
+void format_dim(Formatter* f, Tensor* t, const void* data, int dim, ptrdiff_t offset, bool summarized) {
+    if (dim == t->ndim) { // a 0-d tensor is just its value
+        f->len += format_element(formatter_reserve(f), t, data, offset);
+        return;
+    }
+    int n = t->shape[dim];
+    int edge = print_edge_items;
+    formatter_puts(f, "[");
+    for (int i = 0; i < n; i++) {
+        if (summarized && 2 * edge < n && i == edge) {
+            // with no edge items there is nothing after the ellipsis, like NumPy's [...]
+            if (edge == 0) {
+                formatter_puts(f, "...");
+                break;
+            }
+            formatter_puts(f, "..., ");
+            i = n - edge;
+        }
+        ptrdiff_t element = offset + (ptrdiff_t) i * t->strides[dim];
+        if (dim == t->ndim - 1) {
+            f->len += format_element(formatter_reserve(f), t, data, element);
+        } else {
+            format_dim(f, t, data, dim + 1, element, summarized);
+        }
+        if (i < n - 1) { formatter_puts(f, ", "); }
+    }
+    formatter_puts(f, "]");
+}
+
+void tensor_format(Tensor* t, bool summarize, TextSink sink, void* ctx) {
+    STATS_OP(STATS_OP_TO_STRING);
+    tensor_eval(t);
+    Formatter f;
+    f.sink = sink;
+    f.ctx = ctx;
+    f.len = 0;
+    format_dim(&f, t, t->storage->data, 0, t->offset, summarize && t->size > print_threshold);
+    formatter_flush(&f);
+}
+
+void file_sink(void* ctx, const char* text, size_t len) {
+    fwrite(text, 1, len, ctx);
+}
+
+// streams the text to file, returns false on a write error
+bool tensor_write(Tensor* t, FILE* file, bool summarize) {
+    tensor_format(t, summarize, file_sink, file);
+    return !ferror(file);
+}
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} StringBuilder;
+
+void string_sink(void* ctx, const char* text, size_t len) {
+    StringBuilder* sb = ctx;
+    if (sb->len + len + 1 > sb->capacity) {
+        sb->capacity = 2 * sb->capacity > sb->len + len + 1 ? 2 * sb->capacity : sb->len + len + 1;
+        sb->data = realloc(sb->data, sb->capacity);
+        if (sb->data == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed at %s:%d\n", __FILE__, __LINE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(sb->data + sb->len, text, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+// The (summarized) text of t. It's rebuilt on every call, so it's never stale
+// after the data changed (through this or any other view); the returned string
+// is owned by t and valid until the next call or until t is freed.
+char* tensor_to_string(Tensor* t) {
+    StringBuilder sb = { NULL, 0, 0 };
+    tensor_format(t, true, string_sink, &sb);
+    free(t->repr);
+    t->repr = sb.data;
+    return t->repr;
+}
+
+void tensor_print(Tensor* t) {
+    tensor_write(t, stdout, true);
+    printf("\n");
+}
+
+// Tensors are reference-counted too, and can be shared between threads the same
+// way as their Storage: a Tensor counts as shared once its Storage does.
+bool tensor_shared(Tensor* t) {
+    return t->storage != NULL && t->storage->shared; // lazy tensors are never shared
+}
+
+void tensor_incref(Tensor* t) {
+    refcount_add(&t->ref_count, 1, tensor_shared(t));
+}
+
+void tensor_decref(Tensor* t) {
+    if (refcount_add(&t->ref_count, -1, tensor_shared(t)) == 0) {
+        if (t->expr != NULL) { expr_free(t->expr); }
+        if (t->storage != NULL) {
+            view_untrack(t);
+            storage_release(t->storage);
+        }
+        free(t->repr);
+        tensor_header_free(t);
+        STATS_TENSOR_ADD(-1);
+    }
+}
+
+// drops the caller's reference, so with a single owner this frees the tensor
+void tensor_free(Tensor* t) {
+    tensor_decref(t);
+}
+
+// Make the reference counts of t and of its Storage (so also of all other views
+// over it) thread-safe. Call before handing any of them to another thread.
+void tensor_share(Tensor* t) {
+    tensor_eval(t);
+    // once shared, other threads may be reading the flag: no more writes to it
+    if (!t->storage->shared) { t->storage->shared = true; }
+}
+
 // ----------------------------------------------------------------------------
-// utils
+// memory-mapped files
 
-int ceil_div(int a, int b) {
-    // integer division that rounds up, i.e. ceil(a / b)
-    return (a + b - 1) / b;
+// Tensors over a file mapped into memory, for datasets larger than RAM: the
+// kernel pages the data in on first touch and can drop clean pages again under
+// memory pressure. The file holds raw floats (or elements of another dtype, see
+// tensor_mmap_dtype) in native byte order, starting at byte `offset`. The
+// mapping is external memory (see tensor_from_blob), and is unmapped when the
+// last view of it goes away. The file itself can be closed right after
+// mapping, the mapping keeps it open.
+//
+// MMAP_READONLY maps the file shared and read-only, so the tensor is read-only.
+// MMAP_COPY_ON_WRITE maps it private and writable: pages are copied on the
+// first write to them, and the changes never reach the file.
+
+typedef struct {
+    void* addr;
+    size_t length;
+} MmapRegion;
+
+void mmap_region_release(void* ctx) {
+    MmapRegion* region = ctx;
+    munmap(region->addr, region->length);
+    free(region);
 }
 
-int min(int a, int b) {
-    return (a < b) ? a : b;
+// size is in elements of dtype, or -1 for everything from offset to the end of the file
+Tensor* tensor_mmap_dtype(const char* path, long long offset, int size, int mode, int dtype) {
+    STATS_OP(STATS_OP_LOAD);
+    if (mode != MMAP_READONLY && mode != MMAP_COPY_ON_WRITE) {
+        fprintf(stderr, "ValueError: unknown mmap mode %d\n", mode);
+        return NULL;
+    }
+    if (!dtype_valid(dtype)) {
+        fprintf(stderr, "ValueError: unknown dtype %d\n", dtype);
+        return NULL;
+    }
+    long long elsize = dtype_info[dtype].size;
+    if (offset < 0 || offset % elsize != 0) {
+        fprintf(stderr, "ValueError: mmap offset %lld is not a non-negative multiple of %lld\n", offset, elsize);
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "IOError: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "IOError: cannot stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    long long available = offset < st.st_size ? (st.st_size - offset) / elsize : 0;
+    if (size < 0) {
+        if (available > INT_MAX) {
+            fprintf(stderr, "ValueError: %s holds %lld elements, more than a tensor can index\n", path, available);
+            close(fd);
+            return NULL;
+        }
+        size = (int) available;
+    }
+    if (size > available) {
+        fprintf(stderr, "ValueError: %s holds %lld elements after offset %lld, asked for %d\n", path, available, offset, size);
+        close(fd);
+        return NULL;
+    }
+    if (size == 0) { // mmap can't map 0 bytes
+        close(fd);
+        Tensor* t = tensor_empty_dtype(0, dtype);
+        if (mode == MMAP_READONLY) { t->storage->readonly = true; }
+        return t;
+    }
+    // the mapping has to start on a page boundary, the data starts `lead` bytes in
+    long long page = sysconf(_SC_PAGESIZE);
+    long long map_offset = offset / page * page;
+    size_t lead = (size_t) (offset - map_offset);
+    size_t length = lead + (size_t) size * elsize;
+    int prot = mode == MMAP_READONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = mode == MMAP_READONLY ? MAP_SHARED : MAP_PRIVATE;
+    void* addr = mmap(NULL, length, prot, flags, fd, (off_t) map_offset);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "IOError: cannot mmap %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    MmapRegion* region = mallocCheck(sizeof(MmapRegion));
+    region->addr = addr;
+    region->length = length;
+    Tensor* t = tensor_from_blob_dtype((char*) addr + lead, size, dtype, mmap_region_release, region);
+    if (mode == MMAP_READONLY) { t->storage->readonly = true; }
+    return t;
 }
 
-int max(int a, int b) {
-    return (a > b) ? a : b;
+// size is in floats, or -1 for everything from offset to the end of the file
+Tensor* tensor_mmap(const char* path, long long offset, int size, int mode) {
+    return tensor_mmap_dtype(path, offset, size, mode, DTYPE_FLOAT32);
+}
+
+// Tells the kernel how the memory under a view is going to be read, e.g.
+// ADVISE_SEQUENTIAL before streaming through a mapped file, or ADVISE_WILLNEED
+// on the next slice while working on the current one. Covers all pages the
+// view touches, for strided views that is the whole span. Only a hint, it never
+// changes the data, so it's fine on any tensor (not just mapped ones).
+bool tensor_advise(Tensor* t, int advice) {
+    int madv;
+    switch (advice) {
+        case ADVISE_NORMAL: madv = MADV_NORMAL; break;
+        case ADVISE_SEQUENTIAL: madv = MADV_SEQUENTIAL; break;
+        case ADVISE_RANDOM: madv = MADV_RANDOM; break;
+        case ADVISE_WILLNEED: madv = MADV_WILLNEED; break;
+        default:
+            fprintf(stderr, "ValueError: unknown access advice %d\n", advice);
+            return false;
+    }
+    if (t->size == 0) { return true; }
+    tensor_eval(t);
+    ptrdiff_t lo = t->offset, hi = t->offset;
+    for (int d = 0; d < t->ndim; d++) {
+        ptrdiff_t reach = (ptrdiff_t) (t->shape[d] - 1) * t->strides[d];
+        if (reach < 0) { lo += reach; } else { hi += reach; }
+    }
+    char* first = element_ptr(t->storage->data, lo, t->dtype);
+    char* last = element_ptr(t->storage->data, hi, t->dtype);
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) first / page * page;
+    uintptr_t end = ((uintptr_t) (last + dtype_info[t->dtype].size) + page - 1) / page * page;
+    if (madvise((void*) start, end - start, madv) != 0) {
+        fprintf(stderr, "IOError: madvise failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
 // ----------------------------------------------------------------------------
-// Storage: simple array of floats, defensive on index access, reference-counted
-// The reference counting allows multiple Tensors sharing the same Storage.
-// similar to torch.Storage
+// serialization
 
-Storage* storage_new(int size) {
-    assert(size >= 0);
-    Storage* storage = mallocCheck(sizeof(Storage));
-    storage->data = mallocCheck(size * sizeof(float));
-    storage->data_size = size;
-    storage->ref_count = 1;
-    return storage;
+// The .t1d file format: a 64-byte header, then the elements as raw
+// little-endian values of the dtype. The header fields are little-endian too:
+//   bytes  0..3   magic "T1D\0"
+//   bytes  4..7   format version, 1
+//   bytes  8..11  dtype, a DType (0 = float32)
+//   bytes 12..15  the scale of an int8 file as float32 bits, 0 for other dtypes
+//   bytes 16..23  number of elements
+//   bytes 24..31  Fletcher-64 checksum of the data bytes
+//   bytes 32..63  reserved, 0
+// Padding the header to 64 bytes keeps the data cache-line aligned when the
+// file is memory-mapped (see tensor_load_mmap).
+//
+// Contiguous data on a little-endian host is written and read with a single
+// fwrite/fread, straight from/into the tensor. Strided views (and byte swapping
+// on big-endian hosts, or converting to another dtype when reading) go through
+// a staging buffer of T1D_CHUNK elements, so only the logical elements are
+// written and no contiguous copy is made.
+// T1dWriter/T1dReader stream a tensor in pieces, so a checkpoint can be bigger
+// than memory (or than an int size): memory use is bounded by the piece size.
+
+#define T1D_MAGIC "T1D" // 4 bytes with the terminating 0
+#define T1D_VERSION 1
+#define T1D_HEADER_BYTES 64
+#define T1D_CHUNK (1 << 16)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define T1D_NATIVE_LE false
+#else
+#define T1D_NATIVE_LE true
+#endif
+
+// Fletcher-64 over the 32-bit little-endian words of the data. Cheap enough to
+// run at memory speed, and catches truncation, reordering and bit flips. The
+// data can come in pieces of any length, the last partial word is padded with 0.
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t pending; // bytes of an incomplete word, little-endian
+    int pending_bytes;
+} Checksum;
+
+void checksum_word(Checksum* c, uint32_t word) {
+    c->lo = (c->lo + word) % 0xffffffffu;
+    c->hi = (c->hi + c->lo) % 0xffffffffu;
 }
 
-float storage_getitem(Storage* s, int idx) {
-    assert(idx >= 0 && idx < s->data_size);
-    return s->data[idx];
+void checksum_update(Checksum* c, const void* data, size_t num_bytes) {
+    const unsigned char* p = data;
+    // complete the word left over from the last piece
+    while (c->pending_bytes > 0 && num_bytes > 0) {
+        c->pending |= (uint32_t) *p++ << (8 * c->pending_bytes);
+        num_bytes--;
+        if (++c->pending_bytes == 4) {
+            checksum_word(c, c->pending);
+            c->pending = 0;
+            c->pending_bytes = 0;
+        }
+    }
+    size_t num_words = num_bytes / 4;
+    uint64_t lo = c->lo, hi = c->hi;
+    while (num_words > 0) {
+        // lo < 2^44 and hi < 2^56 within a block, so we only reduce once per block
+        size_t block = num_words < 4096 ? num_words : 4096;
+        for (size_t i = 0; i < block; i++) {
+            uint32_t word;
+            memcpy(&word, p + i * 4, 4);
+            if (!T1D_NATIVE_LE) { word = __builtin_bswap32(word); }
+            lo += word;
+            hi += lo;
+        }
+        lo %= 0xffffffffu;
+        hi %= 0xffffffffu;
+        p += block * 4;
+        num_words -= block;
+    }
+    c->lo = lo;
+    c->hi = hi;
+    for (size_t i = 0; i < num_bytes % 4; i++) {
+        c->pending |= (uint32_t) p[i] << (8 * c->pending_bytes++);
+    }
 }
 
-void storage_setitem(Storage* s, int idx, float val) {
-    assert(idx >= 0 && idx < s->data_size);
-    s->data[idx] = val;
+uint64_t checksum_value(const Checksum* c) {
+    Checksum done = *c;
+    if (done.pending_bytes > 0) { checksum_word(&done, done.pending); }
+    return (done.hi << 32) | done.lo;
 }
 
-void storage_incref(Storage* s) {
-    s->ref_count++;
+// swaps the bytes of n elements of elsize bytes, in place
+void swap_bytes(void* data, int n, int elsize) {
+    if (elsize == 2) {
+        uint16_t* x = data;
+        for (int i = 0; i < n; i++) { x[i] = __builtin_bswap16(x[i]); }
+    } else if (elsize == 4) {
+        uint32_t* x = data;
+        for (int i = 0; i < n; i++) { x[i] = __builtin_bswap32(x[i]); }
+    } else if (elsize == 8) {
+        uint64_t* x = data;
+        for (int i = 0; i < n; i++) { x[i] = __builtin_bswap64(x[i]); }
+    }
 }
 
-void storage_decref(Storage* s) {
-    s->ref_count--;
-    if (s->ref_count == 0) {
-        free(s->data);
-        free(s);
+void put_le(unsigned char* p, uint64_t val, int num_bytes) {
+    for (int i = 0; i < num_bytes; i++) { p[i] = (unsigned char) (val >> (8 * i)); }
+}
+
+uint64_t get_le(const unsigned char* p, int num_bytes) {
+    uint64_t val = 0;
+    for (int i = 0; i < num_bytes; i++) { val |= (uint64_t) p[i] << (8 * i); }
+    return val;
+}
+
+struct T1dWriter {
+    FILE* file;
+    uint64_t size; // elements written so far
+    int dtype;     // of the elements, set by the first write
+    float scale;
+    Checksum checksum;
+    void* chunk; // staging buffer, allocated on first use
+    bool failed;
+};
+
+T1dWriter* t1d_writer_open(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "IOError: cannot open %s for writing: %s\n", path, strerror(errno));
+        return NULL;
     }
+    T1dWriter* w = mallocCheck(sizeof(T1dWriter));
+    w->file = file;
+    w->size = 0;
+    w->dtype = -1;
+    w->scale = 1.0f;
+    w->checksum = (Checksum) { 0, 0, 0, 0 };
+    w->chunk = NULL;
+    w->failed = false;
+    // placeholder, the real header is written by t1d_writer_close once the size
+    // and checksum are known
+    unsigned char header[T1D_HEADER_BYTES] = { 0 };
+    if (fwrite(header, 1, T1D_HEADER_BYTES, file) != T1D_HEADER_BYTES) {
+        fprintf(stderr, "IOError: cannot write to %s: %s\n", path, strerror(errno));
+        w->failed = true;
+    }
+    return w;
 }
 
-// ----------------------------------------------------------------------------
-// Tensor class functions
+// writes n native elements of the writer's dtype, which may be byte swapped in place
+bool t1d_write_elements(T1dWriter* w, void* data, int n) {
+    int elsize = dtype_info[w->dtype].size;
+    if (!T1D_NATIVE_LE) { swap_bytes(data, n, elsize); }
+    checksum_update(&w->checksum, data, (size_t) n * elsize);
+    if (fwrite(data, elsize, n, w->file) != (size_t) n) {
+        fprintf(stderr, "IOError: write failed: %s\n", strerror(errno));
+        w->failed = true;
+        return false;
+    }
+    w->size += n;
+    return true;
+}
 
-// torch.empty(size)
-Tensor* tensor_empty(int size) {
-    Tensor* t = mallocCheck(sizeof(Tensor));
-    t->storage = storage_new(size);
-    // at init we cover the whole storage, i.e. range(start=0, stop=size, step=1)
-    t->offset = 0;
-    t->size = size;
-    t->stride = 1;
-    // holds the text representation of the tensor
-    t->repr = NULL;
+// writes n elements of the writer's dtype at data + i * stride
+bool t1d_write_run(T1dWriter* w, void* data, int stride, int n) {
+    if (stride == 1 && T1D_NATIVE_LE) {
+        return t1d_write_elements(w, data, n);
+    }
+    int elsize = dtype_info[w->dtype].size;
+    if (w->chunk == NULL) { w->chunk = mallocCheck((size_t) T1D_CHUNK * sizeof(double)); }
+    for (int start = 0; start < n; start += T1D_CHUNK) {
+        int m = min(T1D_CHUNK, n - start);
+        copy_elements(w->chunk, 1, element_ptr(data, (ptrdiff_t) start * stride, w->dtype), stride, m, elsize);
+        if (!t1d_write_elements(w, w->chunk, m)) { return false; }
+    }
+    return true;
+}
+
+typedef struct {
+    T1dWriter* w;
+    Tensor* t;
+} WriteRunArgs;
+
+void write_run(void* ctx, int start, ptrdiff_t offset, int stride, int len) {
+    WriteRunArgs* args = ctx;
+    if (args->w->failed) { return; }
+    t1d_write_run(args->w, element_ptr(args->t->storage->data, offset, args->t->dtype), stride, len);
+}
+
+// appends the elements of t (any view, in row-major order) to the file. All
+// pieces of a file have the dtype (and for int8 the scale) of the first one.
+bool t1d_writer_write(T1dWriter* w, Tensor* t) {
+    STATS_OP(STATS_OP_SAVE);
+    if (w->failed) { return false; }
+    tensor_eval(t);
+    if (w->dtype < 0) {
+        w->dtype = t->dtype;
+        w->scale = tensor_scale(t);
+    } else if (t->dtype != w->dtype || tensor_scale(t) != w->scale) {
+        fprintf(stderr, "ValueError: cannot append %s elements to a file of %s elements\n",
+                tensor_dtype_name(t->dtype), tensor_dtype_name(w->dtype));
+        return false;
+    }
+    WriteRunArgs args = { w, t };
+    view_for_each_run(t, t->size, write_run, &args);
+    return !w->failed;
+}
+
+// writes the header and closes the file, false if anything failed on the way
+bool t1d_writer_close(T1dWriter* w) {
+    int dtype = w->dtype >= 0 ? w->dtype : DTYPE_FLOAT32;
+    unsigned char header[T1D_HEADER_BYTES] = { 0 };
+    memcpy(header, T1D_MAGIC, 4);
+    put_le(header + 4, T1D_VERSION, 4);
+    put_le(header + 8, dtype, 4);
+    put_le(header + 12, dtype == DTYPE_INT8 ? float_bits(w->scale) : 0, 4);
+    put_le(header + 16, w->size, 8);
+    put_le(header + 24, checksum_value(&w->checksum), 8);
+    bool ok = !w->failed;
+    if (ok && (fseek(w->file, 0, SEEK_SET) != 0 || fwrite(header, 1, T1D_HEADER_BYTES, w->file) != T1D_HEADER_BYTES)) {
+        fprintf(stderr, "IOError: cannot write header: %s\n", strerror(errno));
+        ok = false;
+    }
+    if (fclose(w->file) != 0) {
+        fprintf(stderr, "IOError: close failed: %s\n", strerror(errno));
+        ok = false;
+    }
+    free(w->chunk);
+    free(w);
+    return ok;
+}
+
+bool tensor_save(Tensor* t, const char* path) {
+    STATS_OP(STATS_OP_SAVE);
+    T1dWriter* w = t1d_writer_open(path);
+    if (w == NULL) { return false; }
+    t1d_writer_write(w, t);
+    return t1d_writer_close(w);
+}
+
+struct T1dReader {
+    FILE* file;
+    uint64_t size;      // elements in the file
+    uint64_t remaining; // elements not read yet
+    int dtype;
+    float scale;
+    uint64_t expected_checksum;
+    Checksum checksum;
+    void* chunk; // staging buffer, allocated on first use
+};
+
+// checks the header, and that the file holds exactly the data it announces
+T1dReader* t1d_reader_open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "IOError: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    unsigned char header[T1D_HEADER_BYTES];
+    struct stat st;
+    const char* problem = NULL;
+    if (fread(header, 1, T1D_HEADER_BYTES, file) != T1D_HEADER_BYTES || memcmp(header, T1D_MAGIC, 4) != 0) {
+        problem = "not a .t1d file";
+    } else if (get_le(header + 4, 4) != T1D_VERSION) {
+        problem = "unsupported format version";
+    } else if (!dtype_valid((int) get_le(header + 8, 4))) {
+        problem = "unsupported dtype";
+    } else if (fstat(fileno(file), &st) != 0
+               || (uint64_t) st.st_size != T1D_HEADER_BYTES + get_le(header + 16, 8) * dtype_info[get_le(header + 8, 4)].size) {
+        problem = "file size does not match the header, truncated?";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "IOError: %s: %s\n", path, problem);
+        fclose(file);
+        return NULL;
+    }
+    T1dReader* r = mallocCheck(sizeof(T1dReader));
+    r->file = file;
+    r->size = get_le(header + 16, 8);
+    r->remaining = r->size;
+    r->dtype = (int) get_le(header + 8, 4);
+    r->scale = r->dtype == DTYPE_INT8 ? bits_float((uint32_t) get_le(header + 12, 4)) : 1.0f;
+    r->expected_checksum = get_le(header + 24, 8);
+    r->checksum = (Checksum) { 0, 0, 0, 0 };
+    r->chunk = NULL;
+    return r;
+}
+
+long long t1d_reader_size(T1dReader* r) {
+    return (long long) r->size;
+}
+
+int t1d_reader_dtype(T1dReader* r) {
+    return r->dtype;
+}
+
+float t1d_reader_scale(T1dReader* r) {
+    return r->scale;
+}
+
+// reads n elements of the file's dtype into data, as native values
+bool t1d_read_elements(T1dReader* r, void* data, int n) {
+    int elsize = dtype_info[r->dtype].size;
+    if (fread(data, elsize, n, r->file) != (size_t) n) {
+        fprintf(stderr, "IOError: read failed, truncated file?\n");
+        return false;
+    }
+    checksum_update(&r->checksum, data, (size_t) n * elsize);
+    if (!T1D_NATIVE_LE) { swap_bytes(data, n, elsize); }
+    return true;
+}
+
+// reads n elements into a run of out at data + i * stride, converting them
+// to the dtype of out (o, with its scale) if that's not the file's
+bool t1d_read_run(T1dReader* r, const TypedOperand* o, void* data, int stride, int n) {
+    bool same_dtype = o->dtype == r->dtype && o->scale == r->scale;
+    if (stride == 1 && same_dtype) { return t1d_read_elements(r, data, n); }
+    if (r->chunk == NULL) { r->chunk = mallocCheck((size_t) T1D_CHUNK * sizeof(double)); }
+    for (int start = 0; start < n; start += T1D_CHUNK) {
+        int m = min(T1D_CHUNK, n - start);
+        if (!t1d_read_elements(r, r->chunk, m)) { return false; }
+        if (same_dtype) {
+            copy_elements(element_ptr(data, (ptrdiff_t) start * stride, o->dtype), stride, r->chunk, 1, m, dtype_info[r->dtype].size);
+            continue;
+        }
+        double values[DTYPE_BLOCK];
+        for (int i = 0; i < m; i += DTYPE_BLOCK) {
+            int k = min(DTYPE_BLOCK, m - i);
+            dtype_info[r->dtype].load(values, element_ptr(r->chunk, i, r->dtype), 1, k, r->scale);
+            void* dst = element_ptr(data, (ptrdiff_t) (start + i) * stride, o->dtype);
+            dtype_info[o->dtype].store(dst, stride, values, k, o->scale);
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    T1dReader* r;
+    TypedOperand out;
+    void* storage_data;
+    bool ok;
+} ReadRunArgs;
+
+void read_run(void* ctx, int start, ptrdiff_t offset, int stride, int len) {
+    ReadRunArgs* args = ctx;
+    if (!args->ok) { return; }
+    args->ok = t1d_read_run(args->r, &args->out, element_ptr(args->storage_data, offset, args->out.dtype), stride, len);
+}
+
+// Reads the next min(out->size, remaining) elements into out (any writable
+// view, filled in row-major order), and returns how many, so 0 at the end of
+// the file, or -1 on error. If out has another dtype (or int8 scale) than the
+// file, the elements are converted, e.g. an int8 file read into a float32
+// tensor gets dequantized. The checksum is verified when the last element has been read.
+long long t1d_reader_read(T1dReader* r, Tensor* out) {
+    STATS_OP(STATS_OP_LOAD);
+    if (!check_writable(out)) { return -1; }
+    int n = r->remaining < (uint64_t) out->size ? (int) r->remaining : out->size;
+    ReadRunArgs args = { r, typed_operand(out), out->storage->data, true };
+    view_for_each_run(out, n, read_run, &args);
+    if (!args.ok) { return -1; }
+    r->remaining -= n;
+    if (n > 0 && r->remaining == 0 && checksum_value(&r->checksum) != r->expected_checksum) {
+        fprintf(stderr, "IOError: checksum mismatch, the file is corrupted\n");
+        return -1;
+    }
+    return n;
+}
+
+void t1d_reader_close(T1dReader* r) {
+    fclose(r->file);
+    free(r->chunk);
+    free(r);
+}
+
+// reads a whole .t1d file into a new tensor of its dtype, with one fread, and verifies it
+Tensor* tensor_load(const char* path) {
+    STATS_OP(STATS_OP_LOAD);
+    T1dReader* r = t1d_reader_open(path);
+    if (r == NULL) { return NULL; }
+    if (r->size > INT_MAX) {
+        fprintf(stderr, "ValueError: %s holds %llu elements, more than a tensor can index, use a T1dReader\n",
+                path, (unsigned long long) r->size);
+        t1d_reader_close(r);
+        return NULL;
+    }
+    Tensor* t = tensor_empty_dtype((int) r->size, r->dtype);
+    t->storage->scale = r->scale;
+    if (t->size > 0 && t1d_reader_read(r, t) != t->size) {
+        tensor_decref(t);
+        t = NULL;
+    }
+    t1d_reader_close(r);
     return t;
 }
 
-// torch.arange(size)
-Tensor* tensor_arange(int size) {
-    Tensor* t = tensor_empty(size);
-    for (int i = 0; i < t->size; i++) {
-        tensor_setitem(t, i, (float) i);
+// Maps the data of a .t1d file instead of reading it, see tensor_mmap for the
+// modes. Only the header is checked: verifying the checksum would read every
+// page, which is what mapping avoids. Use tensor_load to get a verified copy.
+Tensor* tensor_load_mmap(const char* path, int mode) {
+    STATS_OP(STATS_OP_LOAD);
+    if (!T1D_NATIVE_LE) {
+        fprintf(stderr, "ValueError: .t1d files can only be mapped on little-endian hosts\n");
+        return NULL;
     }
+    T1dReader* r = t1d_reader_open(path);
+    if (r == NULL) { return NULL; }
+    long long size = (long long) r->size;
+    int dtype = r->dtype;
+    float scale = r->scale;
+    t1d_reader_close(r);
+    if (size > INT_MAX) {
+        fprintf(stderr, "ValueError: %s holds %lld elements, more than a tensor can index\n", path, size);
+        return NULL;
+    }
+    Tensor* t = tensor_mmap_dtype(path, T1D_HEADER_BYTES, (int) size, mode, dtype);
+    if (t != NULL) { t->storage->scale = scale; }
     return t;
 }
 
-int logical_to_physical(Tensor *t, int ix) {
-    int idx = t->offset + ix * t->stride;
-    return idx;
+// ----------------------------------------------------------------------------
+// async ops
+// tensor_*_async queue an op for a few background threads and return at once
+// with a TensorFuture: tensor_future_done polls it, tensor_future_wait blocks
+// until it is done, without spinning. The op itself still splits over the
+// thread pool like any other. The inputs are referenced (and made thread-safe
+// with tensor_share, which also evaluates lazy ones) until the op is done, so
+// the caller may drop its own references right away, but writing to them in
+// the meantime races with the op, as with any other thread. An optional
+// callback runs on the background thread once the op is done. Ops are started
+// in the order they were queued, and as there are ASYNC_WORKERS threads, a load
+// can run while the previous chunk is computed on, so I/O overlaps compute.
+
+#define ASYNC_WORKERS 2
+
+typedef enum { ASYNC_ADD, ASYNC_ADDF, ASYNC_MATMUL, ASYNC_SUM, ASYNC_DOT, ASYNC_LOAD, ASYNC_FILL } AsyncOp;
+
+long long stream_fill(TensorStream* s, Tensor* buffer); // defined with TensorStream below
+
+struct TensorFuture {
+    AsyncOp op;
+    Tensor* a; // inputs, referenced until the op is done
+    Tensor* b;
+    double val; // of ASYNC_ADDF, or the mmap mode of ASYNC_LOAD (-1 reads the file)
+    char* path;
+    TensorStream* stream; // of ASYNC_FILL, which fills a with its next chunk
+    Tensor* result; // NULL for the scalar ops, and if the op failed
+    double value;   // of ASYNC_SUM and ASYNC_DOT, the count of ASYNC_FILL
+    TensorFutureCallback callback;
+    void* callback_ctx;
+    atomic_bool done;
+    atomic_int ref_count; // the caller's, and the queue's until the op is done
+    TensorFuture* next;   // in the queue
+};
+
+typedef struct {
+    pthread_t threads[ASYNC_WORKERS];
+    int num_threads; // started so far, 0 until the first op is queued
+    bool shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; // an op was queued (or shutdown)
+    pthread_cond_t done_cond; // an op is done
+    TensorFuture* head;
+    TensorFuture* tail;
+} AsyncQueue;
+
+AsyncQueue async_queue = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+void future_release(TensorFuture* f) {
+    if (atomic_fetch_sub(&f->ref_count, 1) == 1) {
+        if (f->result != NULL) { tensor_decref(f->result); }
+        free(f->path);
+        free(f);
+    }
 }
 
-// Index into the tensor.
-// Note that both PyTorch and numpy actually return a 1-element Tensor when you index like:
-// val = t[ix]
-// This particular function returns the actual float, i.e.:
-// val = t[ix].item()
-float tensor_getitem(Tensor* t, int ix) {
-    // handle negative indices by wrapping around
-    if (ix < 0) { ix = t->size + ix; }
-    // oob indices raise IndexError (and we return NaN)
-    if (ix >= t->size) {
-        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
-        return NAN;
+// runs the op of f, then marks it done and calls its callback
+void future_run(AsyncQueue* q, TensorFuture* f) {
+    switch (f->op) {
+        case ASYNC_ADD: f->result = tensor_add(f->a, f->b); break;
+        case ASYNC_ADDF: f->result = tensor_addf(f->a, f->val); break;
+        case ASYNC_MATMUL: f->result = tensor_matmul(f->a, f->b); break;
+        case ASYNC_SUM: f->value = tensor_sum(f->a); break;
+        case ASYNC_DOT: f->value = tensor_dot(f->a, f->b); break;
+        case ASYNC_LOAD: f->result = f->val < 0 ? tensor_load(f->path) : tensor_load_mmap(f->path, (int) f->val); break;
+        case ASYNC_FILL: f->value = (double) stream_fill(f->stream, f->a); break;
     }
-    // get the physical index into the storage and return the value
-    int idx = logical_to_physical(t, ix);
-    float val = storage_getitem(t->storage, idx);
-    return val;
+    if (f->result != NULL) { tensor_share(f->result); } // handed to the caller's thread
+    if (f->a != NULL) { tensor_decref(f->a); }
+    if (f->b != NULL) { tensor_decref(f->b); }
+    f->a = f->b = NULL;
+    pthread_mutex_lock(&q->mutex);
+    atomic_store(&f->done, true);
+    pthread_cond_broadcast(&q->done_cond);
+    pthread_mutex_unlock(&q->mutex);
+    if (f->callback != NULL) { f->callback(f->callback_ctx, f); }
+    future_release(f);
 }
 
-// The _astensor version of getitem:
-// val = t[ix]
-// i.e. consistent with PyTorch/numpy create a 1-element Tensor and return it
-Tensor* tensor_getitem_astensor(Tensor* t, int ix) {
-    // wrap around negative indices so we can do +1 below with confidence
-    if (ix < 0) { ix = t->size + ix; }
-    // effectively: t[ix:ix+1:1] <=> t[ix:ix+1] <=> t[ix]
-    Tensor* slice = tensor_slice(t, ix, ix + 1, 1);
-    return slice;
+void* async_worker(void* arg) {
+    AsyncQueue* q = arg;
+    pthread_mutex_lock(&q->mutex);
+    for (;;) {
+        while (q->head == NULL && !q->shutdown) {
+            pthread_cond_wait(&q->work_cond, &q->mutex);
+        }
+        if (q->head == NULL) { break; } // shut down, once the queue is drained
+        TensorFuture* f = q->head;
+        q->head = f->next;
+        if (q->head == NULL) { q->tail = NULL; }
+        pthread_mutex_unlock(&q->mutex);
+        future_run(q, f);
+        pthread_mutex_lock(&q->mutex);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
 }
 
-// t[ix] = val
-void tensor_setitem(Tensor* t, int ix, float val) {
-    // handle negative indices by wrapping around
-    if (ix < 0) { ix = t->size + ix; }
-    if (ix >= t->size) {
-        fprintf(stderr, "IndexError: index %d is out of bounds of %d\n", ix, t->size);
-        return;
+TensorFuture* async_submit(AsyncOp op, Tensor* a, Tensor* b, double val, const char* path, TensorStream* stream,
+                           TensorFutureCallback callback, void* callback_ctx) {
+    TensorFuture* f = mallocCheck(sizeof(TensorFuture));
+    f->op = op;
+    f->a = a;
+    f->b = b;
+    f->val = val;
+    f->path = path != NULL ? strdup(path) : NULL;
+    f->stream = stream;
+    f->result = NULL;
+    f->value = NAN;
+    f->callback = callback;
+    f->callback_ctx = callback_ctx;
+    atomic_init(&f->done, false);
+    atomic_init(&f->ref_count, 2);
+    f->next = NULL;
+    for (int i = 0; i < 2; i++) {
+        Tensor* t = i == 0 ? a : b;
+        if (t != NULL) {
+            tensor_share(t);
+            tensor_incref(t);
+        }
     }
-    int idx = logical_to_physical(t, ix);
-    storage_setitem(t->storage, idx, val);
+    AsyncQueue* q = &async_queue;
+    pthread_mutex_lock(&q->mutex);
+    while (q->num_threads < ASYNC_WORKERS && pthread_create(&q->threads[q->num_threads], NULL, async_worker, q) == 0) {
+        q->num_threads++;
+    }
+    bool queued = q->num_threads > 0;
+    if (queued) {
+        if (q->tail != NULL) { q->tail->next = f; } else { q->head = f; }
+        q->tail = f;
+        pthread_cond_signal(&q->work_cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    if (!queued) {
+        fprintf(stderr, "Warning: could not start a thread for async ops, running it now\n");
+        future_run(q, f);
+    }
+    return f;
 }
 
-// same as .item() on a torch.Tensor: strips 1-element Tensor to simple scalar
-float tensor_item(Tensor* t) {
-    if (t->size != 1) {
-        fprintf(stderr, "ValueError: can only convert an array of size 1 to a Python scalar\n");
-        return NAN;
+TensorFuture* tensor_add_async(Tensor* t1, Tensor* t2, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_ADD, t1, t2, 0.0, NULL, NULL, callback, ctx);
+}
+
+TensorFuture* tensor_addf_async(Tensor* t, double val, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_ADDF, t, NULL, val, NULL, NULL, callback, ctx);
+}
+
+TensorFuture* tensor_matmul_async(Tensor* a, Tensor* b, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_MATMUL, a, b, 0.0, NULL, NULL, callback, ctx);
+}
+
+TensorFuture* tensor_sum_async(Tensor* t, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_SUM, t, NULL, 0.0, NULL, NULL, callback, ctx);
+}
+
+TensorFuture* tensor_dot_async(Tensor* t1, Tensor* t2, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_DOT, t1, t2, 0.0, NULL, NULL, callback, ctx);
+}
+
+// tensor_load, or tensor_load_mmap with an MmapMode >= 0
+TensorFuture* tensor_load_async(const char* path, int mmap_mode, TensorFutureCallback callback, void* ctx) {
+    return async_submit(ASYNC_LOAD, NULL, NULL, mmap_mode, path, NULL, callback, ctx);
+}
+
+bool tensor_future_done(TensorFuture* f) {
+    return atomic_load(&f->done);
+}
+
+void tensor_future_wait(TensorFuture* f) {
+    if (atomic_load(&f->done)) { return; }
+    AsyncQueue* q = &async_queue;
+    pthread_mutex_lock(&q->mutex);
+    while (!atomic_load(&f->done)) {
+        pthread_cond_wait(&q->done_cond, &q->mutex);
     }
-    return tensor_getitem(t, 0);
+    pthread_mutex_unlock(&q->mutex);
 }
 
-// return a new Tensor with a new view, but same Storage, i.e.:
-// t[start:end:step]
-Tensor* tensor_slice(Tensor* t, int start, int end, int step) {
-    // 1) handle negative indices by wrapping around
-    if (start < 0) { start = t->size + start; }
-    if (end < 0) { end = t->size + end; }
-    // 2) handle out-of-bounds indices: clip to [0, t->size] range
-    start = min(max(start, 0), t->size);
-    end = min(max(end, 0), t->size);
-    // 3) handle step
-    if (step == 0) {
-        fprintf(stderr, "ValueError: slice step cannot be zero\n");
-        return tensor_empty(0);
+// the tensor a done op returned, as a new reference. NULL if the op failed
+// (and printed why) or returns a scalar
+Tensor* tensor_future_tensor(TensorFuture* f) {
+    tensor_future_wait(f);
+    if (f->result != NULL) { tensor_incref(f->result); }
+    return f->result;
+}
+
+// the scalar of a done tensor_sum_async or tensor_dot_async
+double tensor_future_value(TensorFuture* f) {
+    tensor_future_wait(f);
+    return f->value;
+}
+
+// drops the caller's reference, the op still runs to the end if it isn't done
+void tensor_future_free(TensorFuture* f) {
+    future_release(f);
+}
+
+// the queued ops are finished before the library is unloaded
+__attribute__((destructor))
+void async_exit(void) {
+    AsyncQueue* q = &async_queue;
+    pthread_mutex_lock(&q->mutex);
+    q->shutdown = true;
+    pthread_cond_broadcast(&q->work_cond);
+    int num_threads = q->num_threads;
+    pthread_mutex_unlock(&q->mutex);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(q->threads[i], NULL);
     }
-    if (step < 0) {
-        // TODO possibly support negative step
-        // PyTorch does not support negative step (numpy does)
-        fprintf(stderr, "ValueError: slice step cannot be negative\n");
-        return tensor_empty(0);
+    q->num_threads = 0;
+    q->shutdown = false;
+}
+
+// ----------------------------------------------------------------------------
+// streams
+// A TensorStream hands out a .t1d file (or whatever a fill function produces)
+// in chunks of a fixed size, for data larger than memory. tensor_stream_next
+// returns one reused chunk tensor: it stays valid until the next call, so
+// copy what must outlive it. Reads are double buffered: while the caller
+// computes on chunk N, chunk N+1 is read into the other buffer by an async
+// job (see the async ops above), so the I/O overlaps the compute and a stream
+// allocates its two buffers once, however long it is. A mapped stream copies
+// nothing: its chunks are views of the mapping, and the pages of the next one
+// are prefetched with ADVISE_WILLNEED. A TensorReducer carries the partial
+// result of a reduction (or the carry of a scan) from one chunk to the next.
+
+struct TensorStream {
+    int chunk_size;
+    int dtype;
+    long long size;        // elements in all, -1 if not known (fill functions)
+    T1dReader* reader;     // the source of tensor_stream_open,
+    TensorStreamFill fill; // or of tensor_stream_new,
+    void* fill_ctx;
+    Tensor* mapped;        // or of tensor_stream_mmap
+    long long position;    // elements of it handed out so far
+    Tensor* buffers[2];    // read into in turn, NULL for mapped streams
+    Tensor* chunks[2];     // views of the filled part of each buffer (or of mapped), handed out
+    int current;           // the buffer of the chunk handed out last
+    TensorFuture* pending; // filling the other buffer, NULL if no fill is in flight
+    bool done;
+    bool failed;
+};
+
+// runs on an async worker, one fill of a stream at a time
+long long stream_fill(TensorStream* s, Tensor* buffer) {
+    if (s->reader != NULL) { return t1d_reader_read(s->reader, buffer); }
+    long long n = s->fill(s->fill_ctx, buffer);
+    if (n > buffer->size) {
+        fprintf(stderr, "ValueError: stream fill function returned %lld elements, more than the chunk size %d\n",
+                n, buffer->size);
+        return -1;
     }
-    // create the new Tensor: same Storage but new View
-    Tensor* s = mallocCheck(sizeof(Tensor));
-    s->storage = t->storage; // inherit the underlying storage!
-    s->size = ceil_div(end - start, step);
-    s->offset = t->offset + start * t->stride;
-    s->stride = t->stride * step;
-    s->repr = NULL;
-    storage_incref(s->storage); // increment the reference count
+    return n;
+}
+
+void stream_prefetch(TensorStream* s, int buffer) {
+    s->pending = async_submit(ASYNC_FILL, s->buffers[buffer], NULL, 0.0, NULL, s, NULL, NULL);
+}
+
+// the buffers are on the heap, even inside an arena scope, as the stream
+// usually outlives the loop body
+TensorStream* stream_new(int chunk_size, int dtype, float scale, bool buffered) {
+    TensorStream* s = mallocCheck(sizeof(TensorStream));
+    *s = (TensorStream) { .chunk_size = chunk_size, .dtype = dtype, .size = -1, .current = 1 };
+    if (!buffered) { return s; }
+    Arena* arena = arena_current;
+    arena_current = NULL;
+    for (int i = 0; i < 2; i++) {
+        s->buffers[i] = tensor_empty_dtype(chunk_size, dtype);
+        s->buffers[i]->storage->scale = scale;
+        s->chunks[i] = view_new(s->buffers[i]);
+    }
+    arena_current = arena;
     return s;
 }
 
-Tensor* tensor_addf(Tensor* t, float val) {
-    // adds a float to each element of the tensor, returns a new tensor
-    Tensor* result = tensor_empty(t->size);
-    for (int i = 0; i < t->size; i++) {
-        float old_val = tensor_getitem(t, i);
-        float new_val = old_val + val;
-        tensor_setitem(result, i, new_val);
+// points the view v of mapped at the chunk starting at element start
+void stream_map_chunk(TensorStream* s, Tensor* v, long long start) {
+    v->offset = s->mapped->offset + (int) start;
+    v->size = (int) min(s->chunk_size, (int) (s->size - start));
+    view_set_1d(v);
+}
+
+// dtype -1 is that of the file
+bool check_stream_args(int chunk_size, int dtype) {
+    if (chunk_size <= 0) {
+        fprintf(stderr, "ValueError: chunk size must be positive, got %d\n", chunk_size);
+        return false;
     }
-    return result;
+    if (dtype != -1 && !dtype_valid(dtype)) {
+        fprintf(stderr, "ValueError: unknown dtype %d\n", dtype);
+        return false;
+    }
+    return true;
 }
 
-bool broadcastable(Tensor* t1, Tensor* t2) {
-    // two tensors broadcast if, in each dimension (we only have 1 here)
-    // tensors either have the same size, or one of their sizes is 1
-    return t1->size == t2->size || t1->size == 1 || t2->size == 1;
+// Streams a .t1d file, read chunk_size elements at a time into buffers of
+// dtype, or of the file's dtype (and int8 scale) if dtype is -1. Another
+// dtype converts on the fly, e.g. DTYPE_FLOAT32 dequantizes an int8 file. The
+// checksum is verified with the last chunk.
+TensorStream* tensor_stream_open(const char* path, int chunk_size, int dtype) {
+    if (!check_stream_args(chunk_size, dtype)) { return NULL; }
+    T1dReader* r = t1d_reader_open(path);
+    if (r == NULL) { return NULL; }
+    TensorStream* s = stream_new(chunk_size, dtype == -1 ? r->dtype : dtype, dtype == -1 ? r->scale : 1.0f, true);
+    s->reader = r;
+    s->size = (long long) r->size;
+    stream_prefetch(s, 0);
+    return s;
 }
 
-Tensor* tensor_add(Tensor* t1, Tensor* t2) {
-    if (!broadcastable(t1, t2)) { return NULL; }
-    int result_size = max(t1->size, t2->size);
-    Tensor* result = tensor_empty(result_size);
-    int t1_index = 0;
-    int t2_index = 0;
-    int t1_stride = t1->size > 1 ? 1 : 0; // either we walk this tensor or not
-    int t2_stride = t2->size > 1 ? 1 : 0; // either we walk this tensor or not
-    // walk the output tensor and add the values
-    for (int result_index = 0; result_index < result_size; result_index++) {
-        float val1 = tensor_getitem(t1, t1_index);
-        float val2 = tensor_getitem(t2, t2_index);
-        float val = val1 + val2;
-        tensor_setitem(result, result_index, val);
-        t1_index += t1_stride;
-        t2_index += t2_stride;
+// Streams a .t1d file through a read-only mapping (see tensor_load_mmap), in
+// chunks of the file's dtype that are views of the mapping. Like
+// tensor_load_mmap, the checksum isn't verified.
+TensorStream* tensor_stream_mmap(const char* path, int chunk_size) {
+    if (!check_stream_args(chunk_size, -1)) { return NULL; }
+    Arena* arena = arena_current;
+    arena_current = NULL;
+    Tensor* mapped = tensor_load_mmap(path, MMAP_READONLY);
+    arena_current = arena;
+    if (mapped == NULL) { return NULL; }
+    TensorStream* s = stream_new(chunk_size, mapped->dtype, mapped->storage->scale, false);
+    s->mapped = mapped;
+    s->size = mapped->size;
+    arena_current = NULL;
+    s->chunks[0] = view_new(mapped);
+    arena_current = arena;
+    if (mapped->size > 0) {
+        tensor_advise(mapped, ADVISE_SEQUENTIAL);
+        stream_map_chunk(s, s->chunks[0], 0);
+        tensor_advise(s->chunks[0], ADVISE_WILLNEED);
     }
-    return result;
+    return s;
 }
 
-char* tensor_to_string(Tensor* t) {
-    // if we already have a string representation, return it
-    if (t->repr != NULL) { return t->repr; }
-    // otherwise create a new string representation
-    int max_size = t->size * 20 + 3; // 20 chars/number, brackets and commas
-    t->repr = mallocCheck(max_size);
-    char* current = t->repr;
-    current += sprintf(current, "[");
-    for (int i = 0; i < t->size; i++) {
-        float val = tensor_getitem(t, i);
-        current += sprintf(current, "%.1f", val);
-        if (i < t->size - 1) {
-            current += sprintf(current, ", ");
+// Streams whatever fill produces, see TensorStreamFill. fill runs on a
+// background thread, one call at a time, while the caller works on the
+// previous chunk.
+TensorStream* tensor_stream_new(int chunk_size, int dtype, TensorStreamFill fill, void* ctx) {
+    if (!check_stream_args(chunk_size, dtype)) { return NULL; }
+    if (dtype == -1) {
+        fprintf(stderr, "ValueError: a stream of a fill function needs a dtype\n");
+        return NULL;
+    }
+    TensorStream* s = stream_new(chunk_size, dtype, 1.0f, true);
+    s->fill = fill;
+    s->fill_ctx = ctx;
+    stream_prefetch(s, 0);
+    return s;
+}
+
+// waits for the fill in flight, and returns how many elements it got
+long long stream_wait(TensorStream* s) {
+    TensorFuture* f = s->pending;
+    s->pending = NULL;
+    tensor_future_wait(f);
+    long long n = (long long) f->value;
+    tensor_future_free(f);
+    return n;
+}
+
+Tensor* stream_next_mapped(TensorStream* s) {
+    Tensor* chunk = s->chunks[0];
+    if (s->position >= s->size) { return NULL; }
+    stream_map_chunk(s, chunk, s->position);
+    s->position += chunk->size;
+    if (s->position < s->size) {
+        // a header on the stack is enough to advise on the chunk after it
+        Tensor next = *chunk;
+        stream_map_chunk(s, &next, s->position);
+        tensor_advise(&next, ADVISE_WILLNEED);
+    }
+    return chunk;
+}
+
+// The next chunk, borrowed from the stream and valid until the next call. NULL
+// at the end, and on error, see tensor_stream_failed.
+Tensor* tensor_stream_next(TensorStream* s) {
+    if (s->done) { return NULL; }
+    if (s->mapped != NULL) {
+        Tensor* chunk = stream_next_mapped(s);
+        s->done = chunk == NULL;
+        return chunk;
+    }
+    long long n = stream_wait(s);
+    if (n <= 0) {
+        s->done = true;
+        s->failed = n < 0;
+        return NULL;
+    }
+    // the caller is done with the other buffer now, it gets the chunk after this one
+    s->current ^= 1;
+    stream_prefetch(s, s->current ^ 1);
+    Tensor* chunk = s->chunks[s->current];
+    chunk->size = (int) n;
+    view_set_1d(chunk);
+    s->position += n;
+    return chunk;
+}
+
+// elements in all, -1 for fill functions
+long long tensor_stream_size(TensorStream* s) {
+    return s->size;
+}
+
+// whether a read or fill failed (and printed why), which ends the stream early
+bool tensor_stream_failed(TensorStream* s) {
+    return s->failed;
+}
+
+// waits for the fill in flight, if any, so fill isn't called after this
+void tensor_stream_close(TensorStream* s) {
+    if (s->pending != NULL) { stream_wait(s); }
+    for (int i = 0; i < 2; i++) {
+        if (s->chunks[i] != NULL) { tensor_decref(s->chunks[i]); }
+        if (s->buffers[i] != NULL) { tensor_decref(s->buffers[i]); }
+    }
+    if (s->mapped != NULL) { tensor_decref(s->mapped); }
+    if (s->reader != NULL) { t1d_reader_close(s->reader); }
+    free(s);
+}
+
+// starts a reduction (or scan) of op, see StreamReduceOp
+void tensor_reducer_init(TensorReducer* r, int op) {
+    bool is_max = op == STREAM_MAX || op == STREAM_ARGMAX || op == STREAM_CUMMAX;
+    bool is_min = op == STREAM_MIN || op == STREAM_ARGMIN;
+    *r = (TensorReducer) { op, is_max ? -INFINITY : is_min ? INFINITY : 0.0, 0.0, 0, -1 };
+}
+
+bool check_reducer_op(int op, bool scan) {
+    bool is_scan = op == STREAM_CUMSUM || op == STREAM_CUMMAX;
+    if (op < STREAM_SUM || op > STREAM_CUMMAX || (scan && !is_scan)) {
+        fprintf(stderr, "ValueError: %s op %d\n", scan ? "not a scan" : "unknown reducer", op);
+        return false;
+    }
+    return true;
+}
+
+// Folds the next chunk into r. The sums of the chunks are added up with
+// Neumaier's compensation, so the rounding doesn't grow with their number.
+bool tensor_reducer_update(TensorReducer* r, Tensor* chunk) {
+    if (!check_reducer_op(r->op, false)) { return false; }
+    switch (r->op) {
+        case STREAM_SUM:
+        case STREAM_MEAN:
+        case STREAM_CUMSUM: {
+            double x = reduce(REDUCE_SUM, chunk, NULL);
+            double sum = r->value + x;
+            r->compensation += fabs(r->value) >= fabs(x) ? (r->value - sum) + x : (x - sum) + r->value;
+            r->value = sum;
+            break;
+        }
+        default: {
+            if (chunk->size == 0) { break; }
+            bool is_min = r->op == STREAM_MIN || r->op == STREAM_ARGMIN;
+            double m = reduce(is_min ? REDUCE_MIN : REDUCE_MAX, chunk, NULL);
+            // NaN wins and stays, otherwise the first of equal values does
+            bool better = m != m || (is_min ? m < r->value : m > r->value);
+            if (r->index < 0 || (r->value == r->value && better)) {
+                r->value = m;
+                r->index = r->count + tensor_find_first(chunk, m);
+            }
         }
     }
-    current += sprintf(current, "]");
-    // ensure we didn't write past the end of the buffer
-    assert(current - t->repr < max_size);
-    return t->repr;
+    r->count += chunk->size;
+    return true;
 }
 
-void tensor_print(Tensor* t) {
-    char* str = tensor_to_string(t);
-    printf("%s\n", str);
+// Scans the next chunk into out (contiguous, of its size) or, if out is NULL,
+// a new tensor, continuing from the carry of the chunks before, so the chunks
+// of a stream scanned in order give the torch.cumsum/cummax of all of it.
+Tensor* tensor_reducer_scan(TensorReducer* r, Tensor* chunk, Tensor* out) {
+    STATS_OP(STATS_OP_SCAN);
+    if (!check_reducer_op(r->op, true)) { return NULL; }
+    if (out != NULL) {
+        tensor_eval(out);
+        if (!check_out_size(out, chunk->size) || !check_writable(out)) { return NULL; }
+        if (!tensor_is_contiguous(out)) {
+            fprintf(stderr, "ValueError: the out of a scan must be contiguous\n");
+            return NULL;
+        }
+    }
+    Tensor* f = flat_input(chunk);
+    Tensor* result = out != NULL ? out : tensor_empty_dtype(f->size, scan_dtype(f));
+    ScanOp op = r->op == STREAM_CUMSUM ? SCAN_SUM : SCAN_MAX;
+    r->value = scan_into(op, f, r->value + r->compensation, result);
+    r->compensation = 0.0;
+    r->count += f->size;
+    release_input(chunk, f);
+    return result;
 }
 
-void tensor_free(Tensor* t) {
-    storage_decref(t->storage);
-    free(t->repr);
-    free(t);
+// the result so far: NaN for the mean, max or min of no elements, the index
+// for argmax and argmin (-1 if there were none), the carry for scans
+double tensor_reducer_value(TensorReducer* r) {
+    switch (r->op) {
+        case STREAM_SUM: return r->value + r->compensation;
+        case STREAM_MEAN: return r->count > 0 ? (r->value + r->compensation) / r->count : NAN;
+        case STREAM_MAX:
+        case STREAM_MIN: return r->index >= 0 ? r->value : NAN;
+        case STREAM_ARGMAX:
+        case STREAM_ARGMIN: return (double) r->index;
+        default: return r->value + r->compensation;
+    }
 }
 
 // ----------------------------------------------------------------------------
 
+// a small demo, left out when the library is linked into another program
+// such as bench_tensor1d
+#ifndef TENSOR1D_NO_MAIN
 int main(int argc, char *argv[]) {
     // create a tensor with 20 elements
     Tensor* t = tensor_arange(20);
@@ -283,3 +6574,4 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+#endif
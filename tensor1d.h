@@ -6,37 +6,388 @@ tensor1d.h
 #define TENSOR1D_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+// element types. Arithmetic promotes like PyTorch (see tensor_promote_types), int8
+// is a quantized type: element q stands for q * scale, and ops dequantize it
+typedef enum {
+    DTYPE_FLOAT32 = 0,
+    DTYPE_FLOAT64,
+    DTYPE_FLOAT16,
+    DTYPE_BFLOAT16,
+    DTYPE_INT32,
+    DTYPE_INT8,
+    DTYPE_COUNT,
+} DType;
+
+typedef struct Tensor Tensor; // defined below, a Storage can list its views
+typedef struct Arena Arena; // allocator of a tensor_arena_begin scope, defined in tensor1d.c
 
 typedef struct {
-    float* data;
+    void* data; // data_size elements of type dtype
     int data_size;
-    int ref_count;
+    atomic_int ref_count;
+    bool shared; // may be referenced from several threads, see tensor_share
+    bool owns_data; // false if data is external memory, e.g. wrapped with tensor_from_blob
+    bool readonly; // writes are rejected, e.g. for read-only memory-mapped files
+    void (*deleter)(void* ctx); // called when an external Storage is freed, may be NULL
+    void* deleter_ctx;
+    int dtype;
+    float scale; // of DTYPE_INT8, 1 for the other dtypes
+    bool copy_on_write; // views that write while others share it get a copy, see tensor_set_copy_on_write
+    float compact_below; // utilization under which its last view is compacted, 0 if never, see tensor_set_auto_compact
+    Tensor* views; // views of it made since tensor_set_auto_compact, linked by next_view
+    Arena* arena; // that it was allocated from, NULL if it is on the heap
+    size_t mapped_bytes; // of a large Storage mapped for a NUMA policy or huge pages, 0 if malloc'ed
 } Storage;
 
+typedef struct Expr Expr; // node of a lazy expression, defined in tensor1d.c
+
+// max number of dimensions, shape and strides are stored inline in the Tensor
+// so a view needs no allocation besides its header
+#define TENSOR_MAX_DIMS 8
+
 // The equivalent of tensor in PyTorch
-typedef struct {
+struct Tensor {
     Storage* storage;
     int offset;
-    int size;
-    int stride;
-    char* repr; // holds the text representation of the tensor
-} Tensor;
+    int size; // number of elements, the product of shape
+    int stride; // between consecutive elements in row-major order, if the view is flat (see tensor_is_flat)
+    char* repr; // holds the string last returned by tensor_to_string
+    atomic_int ref_count;
+    Expr* expr; // set while the tensor is lazy, see tensor_set_lazy
+    int dtype; // same as storage->dtype, also set while the tensor is lazy
+    int ndim;
+    int shape[TENSOR_MAX_DIMS];
+    int strides[TENSOR_MAX_DIMS]; // in elements, per dimension
+    Tensor* next_view; // in the list of storage->views
+    Tensor** prev_link; // the pointer to this one in that list, NULL if it isn't in it
+    Arena* arena; // that the header was allocated from, NULL if it is on the heap
+};
+
+// how tensor_mmap maps a file
+typedef enum {
+    MMAP_READONLY = 0,   // shared read-only mapping, writes are rejected
+    MMAP_COPY_ON_WRITE,  // private mapping, writes stay in memory and never reach the file
+} MmapMode;
+
+// access pattern hints for tensor_advise, see madvise(2)
+typedef enum {
+    ADVISE_NORMAL = 0,
+    ADVISE_SEQUENTIAL,   // aggressive readahead, pages can be dropped soon after use
+    ADVISE_RANDOM,       // no readahead
+    ADVISE_WILLNEED,     // start reading the range in now
+} AccessAdvice;
+
+// where the pages of large Storages go, see tensor_set_numa_policy
+typedef enum {
+    NUMA_DEFAULT = 0,    // the kernel's: on the node of the thread that touches them first
+    NUMA_INTERLEAVE,     // round-robin over all nodes
+    NUMA_FIRST_TOUCH,    // each part on the node of the pool thread that computes on it
+} NumaPolicy;
+
+// what backs large Storages, see tensor_set_huge_pages
+typedef enum {
+    HUGE_PAGES_OFF = 0,
+    HUGE_PAGES_THP,      // transparent huge pages, madvise(MADV_HUGEPAGE) on 2MB-aligned memory
+    HUGE_PAGES_HUGETLB,  // MAP_HUGETLB from the reserved pool, or THP when it is empty
+} HugePages;
+
+// streaming writer/reader of .t1d files, defined in tensor1d.c
+typedef struct T1dWriter T1dWriter;
+typedef struct T1dReader T1dReader;
+
+// receives the text of a tensor piece by piece, see tensor_format
+typedef void (*TextSink)(void* ctx, const char* text, size_t len);
+
+// an op running in the background, see tensor_add_async. The callback runs on
+// the background thread once the op is done.
+typedef struct TensorFuture TensorFuture;
+typedef void (*TensorFutureCallback)(void* ctx, TensorFuture* future);
+
+// a source of fixed-size chunks, see tensor_stream_open. A fill function
+// writes the next elements into chunk (contiguous, of the stream's chunk size
+// and dtype) and returns how many, 0 at the end, or -1 on error.
+typedef struct TensorStream TensorStream;
+typedef long long (*TensorStreamFill)(void* ctx, Tensor* chunk);
+
+// what a TensorReducer computes over the chunks of a stream
+typedef enum {
+    STREAM_SUM = 0,
+    STREAM_MEAN,
+    STREAM_MAX,
+    STREAM_MIN,
+    STREAM_ARGMAX,
+    STREAM_ARGMIN,
+    STREAM_CUMSUM,  // a scan, see tensor_reducer_scan
+    STREAM_CUMMAX,
+} StreamReduceOp;
+
+// the state a reduction (or scan) carries from one chunk to the next
+typedef struct {
+    int op;
+    double value;        // the sum, max or min so far, or the carry of a scan
+    double compensation; // of the running sum, which is compensated across chunks
+    long long count;     // elements seen so far
+    long long index;     // of the max/min so far, -1 before the first element
+} TensorReducer;
+
+// counters of the pool allocator that recycles Tensor/Storage memory
+typedef struct {
+    long long hits;       // allocations served from a free list
+    long long misses;     // allocations that had to go to malloc
+    long long bytes_held; // bytes currently sitting on the free lists
+    bool enabled;         // false when built with TENSOR1D_NO_POOL
+} PoolStats;
+
+// ops counted by the instrumentation of TENSOR1D_STATS builds, see tensor_stats.
+// Only the outermost op of a call is counted, e.g. tensor_add and not the
+// tensor_empty and tensor_add_out it calls
+typedef enum {
+    STATS_OP_EMPTY = 0,
+    STATS_OP_ARANGE,
+    STATS_OP_FROM_ARRAY,
+    STATS_OP_GETITEM,
+    STATS_OP_SETITEM,
+    STATS_OP_GATHER,
+    STATS_OP_SCATTER,
+    STATS_OP_FILL,
+    STATS_OP_COPY,
+    STATS_OP_SLICE,
+    STATS_OP_SELECT,
+    STATS_OP_VIEW,       // reshape, permute/transpose, unsqueeze, expand, as_strided
+    STATS_OP_CONTIGUOUS,
+    STATS_OP_CLONE,
+    STATS_OP_TO_DTYPE,
+    STATS_OP_ADD,
+    STATS_OP_ADDF,
+    STATS_OP_BINARY,     // sub, mul, div and their scalar versions
+    STATS_OP_UNARY,      // exp, log, tanh, sigmoid, sqrt
+    STATS_OP_FMA,        // fma, axpy
+    STATS_OP_CLAMP,
+    STATS_OP_WHERE,
+    STATS_OP_EVAL,
+    STATS_OP_REDUCE,     // sum, mean, max/min, argmax/argmin
+    STATS_OP_SCAN,       // cumsum, cummax
+    STATS_OP_SORT,       // sort, argsort, topk
+    STATS_OP_DOT,
+    STATS_OP_MATMUL,
+    STATS_OP_TO_STRING,
+    STATS_OP_SAVE,
+    STATS_OP_LOAD,
+    STATS_OP_COUNT,
+} StatsOp;
+
+typedef struct {
+    long long count;
+    long long total_ns; // wall time spent in the op, summed over the calls
+} OpStats;
+
+// a snapshot of the instrumentation counters, all 0 if not enabled
+typedef struct {
+    bool enabled;                 // false unless built with TENSOR1D_STATS
+    long long live_tensors;       // Tensor headers (views included) not freed yet
+    long long live_storages;
+    long long live_bytes;         // of the data of the live Storages
+    long long peak_bytes;         // the most live_bytes since the start (or tensor_stats_reset)
+    long long storages_allocated; // in total
+    OpStats ops[STATS_OP_COUNT];
+} TensorStats;
+
+// elementwise ops of tensor_binary, tensor_add being the one for BINARY_ADD
+typedef enum {
+    BINARY_ADD = 0,
+    BINARY_SUB,
+    BINARY_MUL,
+    BINARY_DIV,
+    BINARY_COUNT,
+} BinaryOp;
+
+// elementwise functions of tensor_unary
+typedef enum {
+    UNARY_EXP = 0,
+    UNARY_LOG,
+    UNARY_TANH,
+    UNARY_SIGMOID,
+    UNARY_SQRT,
+    UNARY_COUNT,
+} UnaryOp;
+
+// instruction sets the contiguous elementwise kernels can dispatch to
+typedef enum {
+    KERNEL_ISA_SCALAR = 0,
+    KERNEL_ISA_NEON,
+    KERNEL_ISA_AVX2,
+    KERNEL_ISA_AVX512,
+} KernelIsa;
 
 Tensor* tensor_empty(int size);
+Tensor* tensor_from_blob(float* data, int size, void (*deleter)(void*), void* deleter_ctx);
+Tensor* tensor_from_array(const float* data, int size);
+void tensor_copy_to(Tensor* t, float* dst);
+Tensor* tensor_empty_dtype(int size, int dtype);
+Tensor* tensor_from_blob_dtype(void* data, int size, int dtype, void (*deleter)(void*), void* deleter_ctx);
+Tensor* tensor_from_array_f64(const double* data, int size, int dtype);
+void tensor_copy_to_f64(Tensor* t, double* dst);
+Tensor* tensor_to_dtype(Tensor* t, int dtype);
+Tensor* tensor_quantize(Tensor* t, float scale);
+float tensor_scale(Tensor* t);
+const char* tensor_dtype_name(int dtype);
+int tensor_dtype_size(int dtype);
+int tensor_promote_types(int dtype1, int dtype2);
+Tensor* tensor_mmap(const char* path, long long offset, int size, int mode);
+Tensor* tensor_mmap_dtype(const char* path, long long offset, int size, int mode, int dtype);
+bool tensor_advise(Tensor* t, int advice);
+void tensor_set_readonly(Tensor* t);
+bool tensor_is_readonly(Tensor* t);
+void tensor_set_copy_on_write(Tensor* t, bool enabled);
+bool tensor_is_copy_on_write(Tensor* t);
+bool tensor_make_writable(Tensor* t);
+Tensor* tensor_clone(Tensor* t);
+bool tensor_compact(Tensor* t);
+float tensor_storage_utilization(Tensor* t);
+void tensor_set_auto_compact(Tensor* t, float min_utilization);
+bool tensor_save(Tensor* t, const char* path);
+Tensor* tensor_load(const char* path);
+Tensor* tensor_load_mmap(const char* path, int mode);
+T1dWriter* t1d_writer_open(const char* path);
+bool t1d_writer_write(T1dWriter* w, Tensor* t);
+bool t1d_writer_close(T1dWriter* w);
+T1dReader* t1d_reader_open(const char* path);
+long long t1d_reader_size(T1dReader* r);
+int t1d_reader_dtype(T1dReader* r);
+float t1d_reader_scale(T1dReader* r);
+long long t1d_reader_read(T1dReader* r, Tensor* out);
+void t1d_reader_close(T1dReader* r);
 int logical_to_physical(Tensor *t, int ix);
+void* tensor_data_ptr(Tensor* t);
 float tensor_getitem(Tensor* t, int ix);
+double tensor_getitem_f64(Tensor* t, int ix);
 Tensor* tensor_getitem_astensor(Tensor* t, int ix);
 float tensor_item(Tensor* t);
 void tensor_setitem(Tensor* t, int ix, float val);
+void tensor_setitem_f64(Tensor* t, int ix, double val);
 Tensor* tensor_arange(int size);
 char* tensor_to_string(Tensor* t);
 void tensor_print(Tensor* t);
+void tensor_format(Tensor* t, bool summarize, TextSink sink, void* ctx);
+bool tensor_write(Tensor* t, FILE* file, bool summarize);
+void tensor_set_print_options(int threshold, int edge_items);
+int tensor_get_print_threshold(void);
+int tensor_get_print_edge_items(void);
 Tensor* tensor_slice(Tensor* t, int start, int end, int step);
-Tensor* tensor_addf(Tensor* t, float val);
+Tensor* tensor_slice_dim(Tensor* t, int dim, int start, int end, int step);
+Tensor* tensor_select(Tensor* t, int dim, int index);
+Tensor* tensor_empty_shape(int ndim, const int* shape, int dtype);
+Tensor* tensor_as_strided(Tensor* t, int ndim, const int* shape, const int* strides, int offset);
+Tensor* tensor_reshape(Tensor* t, int ndim, const int* shape);
+Tensor* tensor_transpose(Tensor* t, int dim0, int dim1);
+Tensor* tensor_permute(Tensor* t, const int* dims);
+Tensor* tensor_unsqueeze(Tensor* t, int dim);
+Tensor* tensor_expand(Tensor* t, int ndim, const int* shape);
+Tensor* tensor_contiguous(Tensor* t);
+bool tensor_is_contiguous(Tensor* t);
+bool tensor_is_flat(Tensor* t);
+Tensor* tensor_addf(Tensor* t, double val);
+Tensor* tensor_addf_out(Tensor* t, double val, Tensor* out);
+Tensor* tensor_addf_(Tensor* t, double val);
 Tensor* tensor_add(Tensor* t1, Tensor* t2);
+Tensor* tensor_add_out(Tensor* t1, Tensor* t2, Tensor* out);
+Tensor* tensor_add_(Tensor* t1, Tensor* t2);
+Tensor* tensor_binary(int op, Tensor* t1, Tensor* t2);
+Tensor* tensor_binary_out(int op, Tensor* t1, Tensor* t2, Tensor* out);
+Tensor* tensor_binaryf(int op, Tensor* t, double val, bool reversed);
+Tensor* tensor_binaryf_out(int op, Tensor* t, double val, bool reversed, Tensor* out);
+Tensor* tensor_sub(Tensor* t1, Tensor* t2);
+Tensor* tensor_mul(Tensor* t1, Tensor* t2);
+Tensor* tensor_div(Tensor* t1, Tensor* t2);
+Tensor* tensor_unary(int op, Tensor* t);
+Tensor* tensor_unary_out(int op, Tensor* t, Tensor* out);
+Tensor* tensor_exp(Tensor* t);
+Tensor* tensor_log(Tensor* t);
+Tensor* tensor_tanh(Tensor* t);
+Tensor* tensor_sigmoid(Tensor* t);
+Tensor* tensor_sqrt(Tensor* t);
+Tensor* tensor_fma(Tensor* a, Tensor* b, Tensor* c);
+Tensor* tensor_fma_out(Tensor* a, Tensor* b, Tensor* c, Tensor* out);
+Tensor* tensor_axpy(double alpha, Tensor* x, Tensor* y);
+Tensor* tensor_axpy_(double alpha, Tensor* x, Tensor* y);
+Tensor* tensor_clamp(Tensor* t, double lo, double hi);
+Tensor* tensor_where(Tensor* cond, Tensor* a, Tensor* b);
+Tensor* tensor_gather(Tensor* t, Tensor* index);
+Tensor* tensor_scatter(Tensor* t, Tensor* index, Tensor* values);
+Tensor* tensor_fill_(Tensor* t, double val);
+Tensor* tensor_copy_(Tensor* dst, Tensor* src);
+float tensor_sum(Tensor* t);
+float tensor_sum_kahan(Tensor* t);
+float tensor_mean(Tensor* t);
+float tensor_max(Tensor* t);
+float tensor_min(Tensor* t);
+int tensor_argmax(Tensor* t);
+int tensor_argmin(Tensor* t);
+float tensor_dot(Tensor* t1, Tensor* t2);
+Tensor* tensor_cumsum(Tensor* t);
+Tensor* tensor_cummax(Tensor* t);
+Tensor* tensor_sort(Tensor* t, bool descending, Tensor** indices);
+Tensor* tensor_argsort(Tensor* t, bool descending);
+Tensor* tensor_topk(Tensor* t, int k, bool largest, Tensor** indices);
+Tensor* tensor_matmul(Tensor* a, Tensor* b);
+Tensor* tensor_matmul_out(Tensor* a, Tensor* b, Tensor* out);
+Tensor* tensor_mm(Tensor* a, Tensor* b);
+Tensor* tensor_mv(Tensor* a, Tensor* v);
+Tensor* tensor_bmm(Tensor* a, Tensor* b);
 void tensor_incref(Tensor* t);
 void tensor_decref(Tensor* t);
 void tensor_free(Tensor* t);
+void tensor_share(Tensor* t);
+void tensor_set_lazy(bool lazy);
+bool tensor_get_lazy(void);
+Tensor* tensor_eval(Tensor* t);
+int tensor_get_num_threads(void);
+void tensor_set_num_threads(int num_threads);
+int tensor_get_parallel_threshold(void);
+void tensor_set_parallel_threshold(int num_elements);
+bool tensor_set_numa_policy(int policy);
+int tensor_get_numa_policy(void);
+int tensor_numa_num_nodes(void);
+bool tensor_set_huge_pages(int mode);
+int tensor_get_huge_pages(void);
+const char* tensor_kernel_isa_name(int isa);
+bool tensor_kernel_isa_supported(int isa);
+int tensor_get_kernel_isa(void);
+bool tensor_set_kernel_isa(int isa);
+void tensor_pool_stats(PoolStats* stats);
+void tensor_pool_trim(void);
+void tensor_arena_begin(void);
+int tensor_arena_end(void);
+Tensor* tensor_arena_promote(Tensor* t);
+void tensor_stats(TensorStats* stats);
+void tensor_stats_reset(void);
+const char* tensor_stats_op_name(int op);
+TensorFuture* tensor_add_async(Tensor* t1, Tensor* t2, TensorFutureCallback callback, void* ctx);
+TensorFuture* tensor_addf_async(Tensor* t, double val, TensorFutureCallback callback, void* ctx);
+TensorFuture* tensor_matmul_async(Tensor* a, Tensor* b, TensorFutureCallback callback, void* ctx);
+TensorFuture* tensor_sum_async(Tensor* t, TensorFutureCallback callback, void* ctx);
+TensorFuture* tensor_dot_async(Tensor* t1, Tensor* t2, TensorFutureCallback callback, void* ctx);
+TensorFuture* tensor_load_async(const char* path, int mmap_mode, TensorFutureCallback callback, void* ctx);
+bool tensor_future_done(TensorFuture* f);
+void tensor_future_wait(TensorFuture* f);
+Tensor* tensor_future_tensor(TensorFuture* f);
+double tensor_future_value(TensorFuture* f);
+void tensor_future_free(TensorFuture* f);
+TensorStream* tensor_stream_open(const char* path, int chunk_size, int dtype);
+TensorStream* tensor_stream_mmap(const char* path, int chunk_size);
+TensorStream* tensor_stream_new(int chunk_size, int dtype, TensorStreamFill fill, void* ctx);
+Tensor* tensor_stream_next(TensorStream* s);
+long long tensor_stream_size(TensorStream* s);
+bool tensor_stream_failed(TensorStream* s);
+void tensor_stream_close(TensorStream* s);
+void tensor_reducer_init(TensorReducer* r, int op);
+bool tensor_reducer_update(TensorReducer* r, Tensor* chunk);
+Tensor* tensor_reducer_scan(TensorReducer* r, Tensor* chunk, Tensor* out);
+double tensor_reducer_value(TensorReducer* r);
+int tensor_leak_report(FILE* file);
 
 #endif // TENSOR1D_H
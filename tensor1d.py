@@ -1,55 +1,145 @@
-import cffi
+import atexit
+import concurrent.futures
+import contextlib
+import io
+import itertools
+import math
+import os
+import warnings
+import weakref
 
 # -----------------------------------------------------------------------------
-ffi = cffi.FFI()
-ffi.cdef("""
-typedef struct {
-    float* data;
-    int data_size;
-    int ref_count;
-} Storage;
-
-// The equivalent of tensor in PyTorch
-typedef struct {
-    Storage* storage;
-    int offset;
-    int size;
-    int stride;
-    char* repr; // holds the text representation of the tensor
-} Tensor;
-
-Tensor* tensor_empty(int size);
-int logical_to_physical(Tensor *t, int ix);
-float tensor_getitem(Tensor* t, int ix);
-Tensor* tensor_getitem_astensor(Tensor* t, int ix);
-float tensor_item(Tensor* t);
-void tensor_setitem(Tensor* t, int ix, float val);
-Tensor* tensor_arange(int size);
-char* tensor_to_string(Tensor* t);
-void tensor_print(Tensor* t);
-Tensor* tensor_slice(Tensor* t, int start, int end, int step);
-Tensor* tensor_addf(Tensor* t, float val);
-Tensor* tensor_add(Tensor* t1, Tensor* t2);
-void tensor_incref(Tensor* t);
-void tensor_decref(Tensor* t);
-void tensor_free(Tensor* t);
-""")
-lib = ffi.dlopen("./libtensor1d.so")  # Make sure to compile the C code into a shared library
+# Two backends for the same lib. _tensor1d is the cffi API-mode extension that
+# build_tensor1d.py compiles (make ext): calls go straight through C stubs built
+# against tensor1d.h. Without it the declarations are parsed at import and
+# libtensor1d.so is loaded in ABI mode, where every call goes through libffi,
+# which costs more per call. TENSOR1D_BACKEND=api (or abi) picks one. Both
+# release the GIL for the duration of every C call.
+backend = os.environ.get("TENSOR1D_BACKEND", "api")
+if backend not in ("api", "abi"):
+    raise ImportError(f"unknown TENSOR1D_BACKEND {backend!r}, expected 'api' or 'abi'")
+if backend == "api":
+    try:
+        from _tensor1d import ffi, lib
+    except ImportError:
+        if "TENSOR1D_BACKEND" in os.environ:
+            raise
+        backend = "abi"
+if backend == "abi":
+    import cffi
+    from tensor1d_cdef import CDEF
+    ffi = cffi.FFI()
+    ffi.cdef(CDEF)
+    # next to this file, not in the current directory
+    lib = ffi.dlopen(os.path.join(os.path.dirname(os.path.abspath(__file__)), "libtensor1d.so"))
 # -----------------------------------------------------------------------------
 
+# dtype names, as in torch/numpy. int8 is quantized, see quantize()
+_DTYPES = {
+    "float32": lib.DTYPE_FLOAT32,
+    "float64": lib.DTYPE_FLOAT64,
+    "float16": lib.DTYPE_FLOAT16,
+    "bfloat16": lib.DTYPE_BFLOAT16,
+    "int32": lib.DTYPE_INT32,
+    "int8": lib.DTYPE_INT8,
+}
+
+def _dtype(name):
+    if name is None:
+        return lib.DTYPE_FLOAT32
+    if name not in _DTYPES:
+        raise ValueError(f"unknown dtype {name!r}, expected one of {list(_DTYPES)}")
+    return _DTYPES[name]
+
+def _flatten(data):
+    # nested lists -> (flat list of values, shape), like torch.tensor takes them
+    shape = []
+    level = data
+    while isinstance(level, (list, tuple, range)):
+        shape.append(len(level))
+        if len(level) == 0:
+            break
+        level = level[0]
+    values = list(data)
+    for d in range(1, len(shape)):
+        if any(not isinstance(row, (list, tuple, range)) or len(row) != shape[d] for row in values):
+            raise ValueError(f"expected sequences of length {shape[d]} at dim {d}")
+        values = [x for row in values for x in row]
+    return values, shape
+
+def _nest(values, shape):
+    # the inverse of _flatten, for tolist()
+    if len(shape) == 0:
+        return values[0]
+    if len(shape) == 1:
+        return values
+    step = len(values) // shape[0] if shape[0] else 0
+    return [_nest(values[i * step:(i + 1) * step], shape[1:]) for i in range(shape[0])]
+
+def _shape_arg(shape):
+    # shape given as ints, or as one tuple/list of them, like in torch
+    if len(shape) == 1 and isinstance(shape[0], (tuple, list)):
+        shape = shape[0]
+    return [int(n) for n in shape]
+
+def _reach(shape, strides):
+    # the lowest and highest offsets, from the first element, of a non-empty view
+    lo = sum((n - 1) * s for n, s in zip(shape, strides) if s < 0)
+    hi = sum((n - 1) * s for n, s in zip(shape, strides) if s > 0)
+    return lo, hi
+
+def _slice_args(key, n):
+    # start, stop and step of a slice of n elements for tensor_slice_dim, with
+    # the defaults of Python: a negative step starts at the end and runs down to
+    # the first element, which is a stop below -n
+    step = 1 if key.step is None else key.step
+    start = key.start if key.start is not None else (0 if step > 0 else n)
+    stop = key.stop if key.stop is not None else (n if step > 0 else -n - 1)
+    return start, stop, step
+
+def _index_tensor(key):
+    # indices for tensor_gather/tensor_scatter: an int32 tensor, or a list of ints
+    return key if isinstance(key, Tensor) else Tensor(key, dtype="int32")
+
+def _values_tensor(value):
+    # values to write, as a tensor. float64 holds any scalar exactly until it is
+    # rounded to the dtype of the destination
+    if isinstance(value, Tensor):
+        return value
+    return Tensor(list(value) if isinstance(value, (list, tuple)) else [float(value)], dtype="float64")
+
+def _view(c_tensor, what):
+    # view functions (and others like matmul) return NULL, and print why, on bad arguments
+    if c_tensor == ffi.NULL:
+        raise ValueError(f"invalid arguments to {what}")
+    return Tensor(c_tensor=c_tensor)
+
 class Tensor:
-    def __init__(self, size_or_data=None, c_tensor=None):
+    def __init__(self, size_or_data=None, c_tensor=None, dtype=None):
         # let's ensure only one of size_or_data and c_tensor is passed
         assert (size_or_data is not None) ^ (c_tensor is not None), "Either size_or_data or c_tensor must be passed"
         # let's initialize the tensor
         if c_tensor is not None:
             self.tensor = c_tensor
         elif isinstance(size_or_data, int):
-            self.tensor = lib.tensor_empty(size_or_data)
-        elif isinstance(size_or_data, (list, range)):
-            self.tensor = lib.tensor_arange(len(size_or_data))
-            for i, val in enumerate(size_or_data):
-                lib.tensor_setitem(self.tensor, i, float(val))
+            self.tensor = lib.tensor_empty_dtype(size_or_data, _dtype(dtype))
+        elif isinstance(size_or_data, (list, tuple, range)):
+            # convert in one go on the cffi side, then a single bulk copy.
+            # Nested lists make an N-d tensor
+            values, shape = _flatten(size_or_data)
+            if _dtype(dtype) == lib.DTYPE_FLOAT32:
+                values = ffi.new("float[]", values)
+                flat = lib.tensor_from_array(values, len(values))
+            else:
+                values = ffi.new("double[]", values)
+                flat = lib.tensor_from_array_f64(values, len(values), _dtype(dtype))
+            if len(shape) == 1:
+                self.tensor = flat
+            else:
+                self.tensor = lib.tensor_reshape(flat, len(shape), ffi.new("int[]", shape))
+                lib.tensor_decref(flat)
+                if self.tensor == ffi.NULL:
+                    raise ValueError(f"cannot make a tensor of shape {tuple(shape)}")
         else:
             raise TypeError("Input must be an integer size or a list/range of values")
 
@@ -61,40 +151,310 @@ class Tensor:
                 lib.tensor_free(self.tensor)
 
     def __getitem__(self, key):
-        if isinstance(key, int):
+        if isinstance(key, (list, Tensor)):
+            # a batch of indices: one gather in C, instead of a call per element
+            index = _index_tensor(key) # kept alive until the call returns
+            c_tensor = lib.tensor_gather(self.tensor, index.tensor)
+            if c_tensor == ffi.NULL:
+                raise IndexError("invalid indices, see the message above")
+            return Tensor(c_tensor=c_tensor)
+        if self.ndim == 1 and isinstance(key, int):
             c_tensor = lib.tensor_getitem_astensor(self.tensor, key)
             return Tensor(c_tensor=c_tensor)
-        elif isinstance(key, slice):
-            # assign default values to start, stop, and step
-            start = key.start if key.start is not None else 0
-            stop = self.tensor.size if key.stop is None else key.stop
-            step = 1 if key.step is None else key.step
+        elif self.ndim == 1 and isinstance(key, slice):
+            start, stop, step = _slice_args(key, self.tensor.size)
             # call the C function to slice the tensor
             sliced_tensor = lib.tensor_slice(self.tensor, start, stop, step)
             return Tensor(c_tensor=sliced_tensor)  # Pass the C tensor directly
-        else:
-            raise TypeError("Invalid index type")
+        # N-d: one int or slice per dimension, e.g. t[1], t[:, 2], t[1:, ::2]
+        key = key if isinstance(key, tuple) else (key,)
+        if len(key) > self.ndim:
+            raise IndexError(f"too many indices for a tensor of dimension {self.ndim}")
+        view = self
+        dim = 0
+        for k in key:
+            if isinstance(k, int):
+                n = view.tensor.shape[dim]
+                if not -n <= k < n:
+                    raise IndexError(f"index {k} is out of bounds for dimension {dim} with size {n}")
+                view = Tensor(c_tensor=lib.tensor_select(view.tensor, dim, k))
+            elif isinstance(k, slice):
+                start, stop, step = _slice_args(k, view.tensor.shape[dim])
+                view = _view(lib.tensor_slice_dim(view.tensor, dim, start, stop, step), "slice")
+                dim += 1
+            else:
+                raise TypeError("Invalid index type")
+        return view
 
     def __setitem__(self, key, value):
-        if isinstance(key, int):
-            lib.tensor_setitem(self.tensor, key, float(value))
+        if self.is_readonly():
+            raise ValueError("assignment to a read-only tensor")
+        scalar = not isinstance(value, (Tensor, list, tuple))
+        ints = key if isinstance(key, tuple) else (key,)
+        if scalar and isinstance(key, int) and self.ndim == 1:
+            lib.tensor_setitem_f64(self.tensor, key, float(value))
+        elif scalar and len(ints) == self.ndim and all(isinstance(k, int) for k in ints):
+            # written through self, not a temporary view, so copy-on-write
+            # (see set_copy_on_write) doesn't redirect the write into a copy
+            lib.tensor_setitem_f64(self.tensor, self._flat_index(key), float(value))
+        elif isinstance(key, (list, Tensor)):
+            # scattered in one C call, also through self
+            index, values = _index_tensor(key), _values_tensor(value)
+            c_tensor = lib.tensor_scatter(self.tensor, index.tensor, values.tensor)
+            if c_tensor == ffi.NULL:
+                raise IndexError("invalid indices or values, see the message above")
         else:
-            raise TypeError("Invalid index type")
+            # slices and rows: the whole view is written in one call
+            with self._writing():
+                view = self[key]
+                if scalar:
+                    c_tensor = lib.tensor_fill_(view.tensor, float(value))
+                else:
+                    values = _values_tensor(value)
+                    c_tensor = lib.tensor_copy_(view.tensor, values.tensor)
+            if c_tensor == ffi.NULL:
+                raise ValueError(f"cannot assign to a view of shape {view.shape}")
+
+    @contextlib.contextmanager
+    def _writing(self):
+        # for a write through a temporary view of self (e.g. t[1:3] = 0): under
+        # copy-on-write that view would get a copy of its own, so self is
+        # detached from its other views instead, and the view writes in place
+        if not self.is_copy_on_write():
+            yield
+            return
+        lib.tensor_make_writable(self.tensor)
+        lib.tensor_set_copy_on_write(self.tensor, False)
+        try:
+            yield
+        finally:
+            lib.tensor_set_copy_on_write(self.tensor, True)
+
+    def fill_(self, value):
+        if lib.tensor_fill_(self.tensor, float(value)) == ffi.NULL:
+            raise ValueError("cannot fill this tensor")
+        return self
+
+    def copy_(self, src):
+        # src is broadcast to the shape of self and converted to its dtype
+        src = _values_tensor(src)
+        if lib.tensor_copy_(self.tensor, src.tensor) == ffi.NULL:
+            raise ValueError(f"cannot copy a tensor of shape {src.shape} into {self.shape}")
+        return self
+
+    def _flat_index(self, key):
+        # the row-major index of the single element that key selects
+        key = key if isinstance(key, tuple) else (key,)
+        if len(key) > self.ndim:
+            raise IndexError(f"too many indices for a tensor of dimension {self.ndim}")
+        index = 0
+        for dim, n in enumerate(self.shape):
+            k = key[dim] if dim < len(key) else slice(None)
+            if isinstance(k, slice):
+                selected = range(*k.indices(n))
+                if len(selected) != 1:
+                    raise TypeError("can only assign a value to a single element")
+                k = selected[0]
+            elif not isinstance(k, int):
+                raise TypeError("Invalid index type")
+            elif not -n <= k < n:
+                raise IndexError(f"index {k} is out of bounds for dimension {dim} with size {n}")
+            index = index * n + k % n
+        return index
+
+    def add(self, other, out=None):
+        # self + other, written into the existing tensor out if one is given
+        if out is not None and not isinstance(out, Tensor):
+            raise TypeError("out must be a Tensor")
+        if isinstance(other, (int, float)):
+            if out is None:
+                c_tensor = lib.tensor_addf(self.tensor, float(other))
+            else:
+                c_tensor = lib.tensor_addf_out(self.tensor, float(other), out.tensor)
+        elif isinstance(other, Tensor):
+            if out is None:
+                c_tensor = lib.tensor_add(self.tensor, other.tensor)
+            else:
+                c_tensor = lib.tensor_add_out(self.tensor, other.tensor, out.tensor)
+        else:
+            raise TypeError("Invalid type for addition")
+        if c_tensor == ffi.NULL:
+            raise ValueError("RuntimeError: tensor add returned NULL")
+        return Tensor(c_tensor=c_tensor) if out is None else out
 
     def __add__(self, other):
+        return self.add(other)
+
+    def __iadd__(self, other):
+        # in-place, so += updates the existing storage instead of allocating
         if isinstance(other, (int, float)):
-            c_tensor = lib.tensor_addf(self.tensor, float(other))
+            c_tensor = lib.tensor_addf_(self.tensor, float(other))
         elif isinstance(other, Tensor):
-            c_tensor = lib.tensor_add(self.tensor, other.tensor)
+            c_tensor = lib.tensor_add_(self.tensor, other.tensor)
         else:
             raise TypeError("Invalid type for addition")
         if c_tensor == ffi.NULL:
             raise ValueError("RuntimeError: tensor add returned NULL")
-        return Tensor(c_tensor=c_tensor)
+        return self
+
+    def _binary(self, op, other, out=None, reversed=False, what="binary op"):
+        # self op other (other op self if reversed), written into out if one is given
+        if out is not None and not isinstance(out, Tensor):
+            raise TypeError("out must be a Tensor")
+        if isinstance(other, (int, float)):
+            if out is None:
+                c_tensor = lib.tensor_binaryf(op, self.tensor, float(other), reversed)
+            else:
+                c_tensor = lib.tensor_binaryf_out(op, self.tensor, float(other), reversed, out.tensor)
+        elif isinstance(other, Tensor):
+            a, b = (other, self) if reversed else (self, other)
+            if out is None:
+                c_tensor = lib.tensor_binary(op, a.tensor, b.tensor)
+            else:
+                c_tensor = lib.tensor_binary_out(op, a.tensor, b.tensor, out.tensor)
+        else:
+            raise TypeError(f"Invalid type for {what}")
+        if c_tensor == ffi.NULL:
+            raise ValueError(f"invalid arguments to {what}, see the message above")
+        return Tensor(c_tensor=c_tensor) if out is None else out
+
+    def sub(self, other, out=None):
+        return self._binary(lib.BINARY_SUB, other, out, what="sub")
+
+    def mul(self, other, out=None):
+        return self._binary(lib.BINARY_MUL, other, out, what="mul")
+
+    def div(self, other, out=None):
+        # true division: integers give float32
+        return self._binary(lib.BINARY_DIV, other, out, what="div")
+
+    def __radd__(self, other):
+        return self.add(other)
+
+    def __sub__(self, other):
+        return self.sub(other)
+
+    def __rsub__(self, other):
+        return self._binary(lib.BINARY_SUB, other, reversed=True, what="sub")
+
+    def __mul__(self, other):
+        return self.mul(other)
+
+    def __rmul__(self, other):
+        return self.mul(other)
+
+    def __truediv__(self, other):
+        return self.div(other)
+
+    def __rtruediv__(self, other):
+        return self._binary(lib.BINARY_DIV, other, reversed=True, what="div")
+
+    def __neg__(self):
+        return self._binary(lib.BINARY_MUL, -1.0, what="neg")
+
+    # in-place, like +=: the result is written into self
+    def __isub__(self, other):
+        return self.sub(other, out=self)
+
+    def __imul__(self, other):
+        return self.mul(other, out=self)
+
+    def __itruediv__(self, other):
+        return self.div(other, out=self)
+
+    def _unary(self, op, what, out=None):
+        if out is None:
+            c_tensor = lib.tensor_unary(op, self.tensor)
+        elif isinstance(out, Tensor):
+            c_tensor = lib.tensor_unary_out(op, self.tensor, out.tensor)
+        else:
+            raise TypeError("out must be a Tensor")
+        if c_tensor == ffi.NULL:
+            raise ValueError(f"invalid arguments to {what}, see the message above")
+        return Tensor(c_tensor=c_tensor) if out is None else out
+
+    # float32 uses polynomial approximations, see the errors in tensor1d.c
+    def exp(self, out=None):
+        return self._unary(lib.UNARY_EXP, "exp", out)
+
+    def log(self, out=None):
+        return self._unary(lib.UNARY_LOG, "log", out)
+
+    def tanh(self, out=None):
+        return self._unary(lib.UNARY_TANH, "tanh", out)
+
+    def sigmoid(self, out=None):
+        return self._unary(lib.UNARY_SIGMOID, "sigmoid", out)
+
+    def sqrt(self, out=None):
+        return self._unary(lib.UNARY_SQRT, "sqrt", out)
+
+    def clamp(self, min=None, max=None):
+        lo = -math.inf if min is None else float(min)
+        hi = math.inf if max is None else float(max)
+        return Tensor(c_tensor=lib.tensor_clamp(self.tensor, lo, hi))
+
+    def axpy_(self, alpha, x):
+        # self += alpha * x, rounded once
+        if lib.tensor_axpy_(float(alpha), x.tensor, self.tensor) == ffi.NULL:
+            raise ValueError(f"cannot add a tensor of shape {x.shape} into {self.shape}")
+        return self
 
     def __len__(self):
+        # like torch: the size of the first dimension
+        if self.ndim == 0:
+            raise TypeError("len() of a 0-d tensor")
+        return self.tensor.shape[0]
+
+    def numel(self):
         return self.tensor.size
 
+    @property
+    def ndim(self):
+        return self.tensor.ndim
+
+    @property
+    def shape(self):
+        return tuple(self.tensor.shape[d] for d in range(self.tensor.ndim))
+
+    def stride(self):
+        # in elements, per dimension, like torch's t.stride()
+        return tuple(self.tensor.strides[d] for d in range(self.tensor.ndim))
+
+    # views: these share the storage, nothing is copied (except by reshape,
+    # when the layout doesn't allow a view, and contiguous)
+
+    def reshape(self, *shape):
+        shape = _shape_arg(shape)
+        return _view(lib.tensor_reshape(self.tensor, len(shape), ffi.new("int[]", shape)), "reshape")
+
+    def transpose(self, dim0, dim1):
+        return _view(lib.tensor_transpose(self.tensor, dim0, dim1), "transpose")
+
+    def permute(self, *dims):
+        dims = _shape_arg(dims)
+        if len(dims) != self.ndim:
+            raise ValueError(f"permute needs {self.ndim} dims, got {len(dims)}")
+        return _view(lib.tensor_permute(self.tensor, ffi.new("int[]", dims)), "permute")
+
+    @property
+    def T(self):
+        # all dimensions reversed, the matrix transpose for 2-D tensors
+        return self.permute(*reversed(range(self.ndim)))
+
+    def unsqueeze(self, dim):
+        return _view(lib.tensor_unsqueeze(self.tensor, dim), "unsqueeze")
+
+    def expand(self, *shape):
+        shape = _shape_arg(shape)
+        return _view(lib.tensor_expand(self.tensor, len(shape), ffi.new("int[]", shape)), "expand")
+
+    def contiguous(self):
+        return Tensor(c_tensor=lib.tensor_contiguous(self.tensor))
+
+    def is_contiguous(self):
+        return lib.tensor_is_contiguous(self.tensor)
+
     def __repr__(self):
         return self.__str__()
 
@@ -103,18 +463,915 @@ class Tensor:
         py_str = ffi.string(c_str).decode('utf-8')
         return py_str
 
+    def write(self, file, summarize=True):
+        # streams the text to a file-like object, in pieces, so with
+        # summarize=False even a huge tensor is never one big string
+        handle = ffi.new_handle(file)
+        lib.tensor_format(self.tensor, summarize, _write_text, handle)
+
+    def to_string(self, summarize=True):
+        out = io.StringIO()
+        self.write(out, summarize)
+        return out.getvalue()
+
+    def sum(self, kahan=False):
+        # pairwise summation by default, kahan=True for compensated summation
+        return lib.tensor_sum_kahan(self.tensor) if kahan else lib.tensor_sum(self.tensor)
+
+    def mean(self):
+        return lib.tensor_mean(self.tensor)
+
+    def max(self):
+        if self.numel() == 0:
+            raise ValueError("max of an empty tensor")
+        return lib.tensor_max(self.tensor)
+
+    def min(self):
+        if self.numel() == 0:
+            raise ValueError("min of an empty tensor")
+        return lib.tensor_min(self.tensor)
+
+    def argmax(self):
+        if self.numel() == 0:
+            raise ValueError("argmax of an empty tensor")
+        return lib.tensor_argmax(self.tensor)
+
+    def argmin(self):
+        if self.numel() == 0:
+            raise ValueError("argmin of an empty tensor")
+        return lib.tensor_argmin(self.tensor)
+
+    # scans, sort and top-k run over all elements in row-major order (like
+    # NumPy with axis=None) and give 1-D results, indices are int32 tensors
+    def cumsum(self):
+        return Tensor(c_tensor=lib.tensor_cumsum(self.tensor))
+
+    def cummax(self):
+        return Tensor(c_tensor=lib.tensor_cummax(self.tensor))
+
+    def sort(self, descending=False):
+        # stable, returns (values, indices) like torch.sort
+        indices = ffi.new("Tensor**")
+        values = Tensor(c_tensor=lib.tensor_sort(self.tensor, descending, indices))
+        return values, Tensor(c_tensor=indices[0])
+
+    def argsort(self, descending=False):
+        return Tensor(c_tensor=lib.tensor_argsort(self.tensor, descending))
+
+    def topk(self, k, largest=True):
+        # (values, indices) of the k largest (smallest) elements, best first
+        if not 0 <= k <= self.numel():
+            raise ValueError(f"selected index k={k} out of range for {self.numel()} elements")
+        indices = ffi.new("Tensor**")
+        values = Tensor(c_tensor=lib.tensor_topk(self.tensor, k, largest, indices))
+        return values, Tensor(c_tensor=indices[0])
+
+    def dot(self, other):
+        if not isinstance(other, Tensor):
+            raise TypeError("dot needs another Tensor")
+        if self.numel() != other.numel():
+            raise ValueError("dot of tensors of different sizes")
+        return lib.tensor_dot(self.tensor, other.tensor)
+
+    def matmul(self, other, out=None):
+        # like torch.matmul: matrix products, with 1-D vectors and broadcast batch dimensions
+        if not isinstance(other, Tensor):
+            raise TypeError("matmul needs another Tensor")
+        if out is None:
+            return _view(lib.tensor_matmul(self.tensor, other.tensor), "matmul")
+        if not isinstance(out, Tensor):
+            raise TypeError("out must be a Tensor")
+        if lib.tensor_matmul_out(self.tensor, other.tensor, out.tensor) == ffi.NULL:
+            raise ValueError("invalid arguments to matmul")
+        return out
+
+    def __matmul__(self, other):
+        return self.matmul(other)
+
+    def mm(self, other):
+        return _view(lib.tensor_mm(self.tensor, other.tensor), "mm")
+
+    def mv(self, vec):
+        return _view(lib.tensor_mv(self.tensor, vec.tensor), "mv")
+
+    def bmm(self, other):
+        return _view(lib.tensor_bmm(self.tensor, other.tensor), "bmm")
+
+    def eval(self):
+        # evaluates a lazy tensor (see lazy()), no-op otherwise
+        lib.tensor_eval(self.tensor)
+        return self
+
+    def is_lazy(self):
+        return self.tensor.expr != ffi.NULL
+
+    def is_readonly(self):
+        return lib.tensor_is_readonly(self.tensor)
+
+    def set_copy_on_write(self, enabled=True):
+        # opt-in: views of this storage share it only until they write, see tensor1d.c
+        lib.tensor_set_copy_on_write(self.tensor, enabled)
+        return self
+
+    def is_copy_on_write(self):
+        return lib.tensor_is_copy_on_write(self.tensor)
+
+    def clone(self):
+        return Tensor(c_tensor=lib.tensor_clone(self.tensor))
+
+    def compact(self):
+        # moves this view to a right-sized storage of its own, so the one it was
+        # a small part of can be freed. False if it already fills its storage
+        return lib.tensor_compact(self.tensor)
+
+    def storage_utilization(self):
+        # the fraction of its storage this view reaches, low ones are worth compact()
+        return lib.tensor_storage_utilization(self.tensor)
+
+    def set_auto_compact(self, min_utilization=0.25):
+        # the last view left of this storage is compacted if it uses less than
+        # min_utilization of it, for views made from now on. 0 turns it off
+        lib.tensor_set_auto_compact(self.tensor, min_utilization)
+        return self
+
+    def advise(self, advice):
+        # hint how the memory under this view will be read, see mmap()
+        if advice not in _ADVICE:
+            raise ValueError(f"unknown advice {advice!r}, expected one of {sorted(_ADVICE)}")
+        if not lib.tensor_advise(self.tensor, _ADVICE[advice]):
+            raise OSError("madvise failed")
+        return self
+
+    @property
+    def dtype(self):
+        return ffi.string(lib.tensor_dtype_name(self.tensor.dtype)).decode('utf-8')
+
+    @property
+    def scale(self):
+        # of an int8 tensor: element q stands for q * scale
+        return lib.tensor_scale(self.tensor)
+
+    def to(self, dtype):
+        # a converted copy, like torch's t.to(dtype)
+        return Tensor(c_tensor=lib.tensor_to_dtype(self.tensor, _dtype(dtype)))
+
+    def quantize(self, scale=None):
+        # int8 copy with q = round(x / scale), by default the scale fits max(|x|)
+        return Tensor(c_tensor=lib.tensor_quantize(self.tensor, 0.0 if scale is None else scale))
+
+    def _is_integer(self):
+        # integer values come back as Python ints, like in torch
+        return self.tensor.dtype == lib.DTYPE_INT32 or (self.tensor.dtype == lib.DTYPE_INT8 and self.scale == 1.0)
+
     def tolist(self):
-        return [lib.tensor_getitem(self.tensor, i) for i in range(len(self))]
+        # one bulk copy out of the tensor, instead of a call per element.
+        # N-d tensors give nested lists
+        if self.tensor.dtype == lib.DTYPE_FLOAT32:
+            values = ffi.new("float[]", self.numel())
+            lib.tensor_copy_to(self.tensor, values)
+            values = list(values)
+        else:
+            values = ffi.new("double[]", self.numel())
+            lib.tensor_copy_to_f64(self.tensor, values)
+            values = [int(v) for v in values] if self._is_integer() else list(values)
+        return values if self.ndim == 1 else _nest(values, self.shape)
+
+    def save(self, path):
+        save(self, path)
+
+    def numpy(self):
+        # zero-copy: the array shares memory with the tensor, and keeps it alive
+        import numpy as np
+        # int8 arrays hold the quantized values, see scale
+        if self.dtype == "bfloat16":
+            raise TypeError("numpy has no bfloat16")
+        np_dtype = np.dtype(self.dtype)
+        shape, strides = self.shape, self.stride()
+        # a view of its own keeps the storage alive, even if this tensor is later
+        # moved to another one (by copy-on-write or compaction)
+        c_tensor = lib.tensor_as_strided(self.tensor, self.ndim, ffi.new("int[]", shape),
+                                         ffi.new("int[]", strides), self.tensor.offset)
+        # the buffer covers the elements from the lowest to the highest address,
+        # the first element is not the lowest one in views with negative strides
+        lo, hi = _reach(shape, strides) if self.numel() > 0 else (0, -1)
+        ptr = ffi.cast("char*", lib.tensor_data_ptr(c_tensor)) + lo * np_dtype.itemsize
+        owner = ffi.gc(ptr, lambda _: lib.tensor_decref(c_tensor))
+        array = np.frombuffer(ffi.buffer(owner, (hi - lo + 1) * np_dtype.itemsize), dtype=np_dtype)
+        if self.is_readonly():
+            array.flags.writeable = False
+        if self.is_contiguous():
+            return array.reshape(shape)
+        return np.lib.stride_tricks.as_strided(array[-lo:], shape=shape, strides=[s * array.itemsize for s in strides])
+
+    def __array__(self, dtype=None, copy=None):
+        array = self.numpy()
+        if dtype is not None:
+            return array.astype(dtype)
+        return array.copy() if copy else array
+
+    def item(self, *index):
+        # like numpy's item(): t.item(i) is the scalar at row-major index i (and
+        # t.item(i, j) the one at t[i, j]), read in one call without making a
+        # Tensor for t[i] first
+        if index:
+            flat = index[0] if len(index) == 1 else self._flat_index(index)
+            if not -self.numel() <= flat < self.numel():
+                raise IndexError(f"index {flat} is out of bounds for size {self.numel()}")
+            val = lib.tensor_getitem_f64(self.tensor, flat)
+            return int(val) if self._is_integer() else val
+        if self.numel() != 1:
+            return lib.tensor_item(self.tensor) # reports the error
+        val = lib.tensor_getitem_f64(self.tensor, 0)
+        return int(val) if self._is_integer() else val
+
+@ffi.callback("void(void*, const char*, size_t)")
+def _write_text(ctx, text, length):
+    ffi.from_handle(ctx).write(ffi.unpack(text, length).decode('utf-8'))
 
-    def item(self):
-        return lib.tensor_item(self.tensor)
+# like numpy.set_printoptions: tensors with more than threshold elements print
+# as their first and last edgeitems elements around a "..."
+def set_printoptions(threshold=None, edgeitems=None):
+    lib.tensor_set_print_options(-1 if threshold is None else threshold, -1 if edgeitems is None else edgeitems)
+
+def get_printoptions():
+    return {"threshold": lib.tensor_get_print_threshold(), "edgeitems": lib.tensor_get_print_edge_items()}
+
+# -----------------------------------------------------------------------------
+# external memory: a Storage can wrap memory owned by a Python object without
+# copying. The object is kept alive here until the library calls back to say
+# the last reference to that Storage is gone.
+
+_external = {}
+_external_ids = itertools.count(1)
+
+@ffi.callback("void(void*)")
+def _release_external(ctx):
+    if _external is not None: # can be None while the interpreter shuts down
+        _external.pop(int(ffi.cast("uintptr_t", ctx)), None)
+
+def _wrap_external(ptr, size, owner, dtype=lib.DTYPE_FLOAT32):
+    key = next(_external_ids)
+    _external[key] = owner
+    return lib.tensor_from_blob_dtype(ptr, size, dtype, _release_external, ffi.cast("void*", key))
+
+def from_buffer(obj):
+    # zero-copy view of any buffer-protocol object holding float32s, the
+    # tensor is read-only if the buffer is (e.g. bytes)
+    try:
+        buf, readonly = ffi.from_buffer("float[]", obj, require_writable=True), False
+    except BufferError:
+        buf, readonly = ffi.from_buffer("float[]", obj), True
+    t = Tensor(c_tensor=_wrap_external(buf, len(buf), (obj, buf)))
+    if readonly:
+        lib.tensor_set_readonly(t.tensor)
+    return t
+
+def from_numpy(array):
+    # zero-copy view of a NumPy array, strided (e.g. transposed) arrays are fine
+    if array.dtype.name not in _DTYPES or not 1 <= array.ndim <= lib.TENSOR_MAX_DIMS:
+        raise TypeError(f"from_numpy needs an array of 1 to {lib.TENSOR_MAX_DIMS} dims of one of {list(_DTYPES)}")
+    if not array.flags.writeable:
+        raise ValueError("from_numpy needs a writable array")
+    if array.size == 0:
+        return empty(array.shape, dtype=array.dtype.name)
+    strides = []
+    for stride in array.strides:
+        stride, rem = divmod(stride, array.itemsize)
+        if rem != 0:
+            raise ValueError("from_numpy needs strides that are multiples of the element size")
+        strides.append(stride)
+    # the wrapped memory starts at the lowest address, e.g. the last element of a[::-1]
+    lo, hi = _reach(array.shape, strides)
+    ptr = ffi.cast("char*", array.__array_interface__["data"][0]) + lo * array.itemsize
+    base = Tensor(c_tensor=_wrap_external(ffi.cast("void*", ptr), hi - lo + 1, array, _DTYPES[array.dtype.name]))
+    if array.ndim == 1 and strides[0] == 1:
+        return base
+    shape = list(array.shape)
+    return _view(lib.tensor_as_strided(base.tensor, len(shape), ffi.new("int[]", shape), ffi.new("int[]", strides), -lo), "from_numpy")
+
+# -----------------------------------------------------------------------------
+# memory-mapped files: the tensor is backed by the file, pages are read in on
+# demand, so files larger than RAM are fine
+
+_MMAP_MODES = {"r": lib.MMAP_READONLY, "c": lib.MMAP_COPY_ON_WRITE}
+_ADVICE = {
+    "normal": lib.ADVISE_NORMAL,
+    "sequential": lib.ADVISE_SEQUENTIAL,
+    "random": lib.ADVISE_RANDOM,
+    "willneed": lib.ADVISE_WILLNEED,
+}
+
+def mmap(path, offset=0, size=-1, mode="r", dtype=None):
+    # maps `size` raw elements (-1: all) starting `offset` bytes into the file.
+    # mode "r" is read-only, "c" is copy-on-write: writes stay in memory only
+    if mode not in _MMAP_MODES:
+        raise ValueError(f"unknown mode {mode!r}, expected 'r' or 'c'")
+    c_tensor = lib.tensor_mmap_dtype(_path(path), offset, size, _MMAP_MODES[mode], _dtype(dtype))
+    if c_tensor == ffi.NULL:
+        raise OSError(f"cannot mmap {path}")
+    return Tensor(c_tensor=c_tensor)
+
+# -----------------------------------------------------------------------------
+# serialization to .t1d files: a small header and the raw float32s
 
-def empty(size):
-    return Tensor(size)
+def _path(path):
+    return str(path).encode('utf-8')
+
+def save(t, path):
+    if not lib.tensor_save(t.tensor, _path(path)):
+        raise OSError(f"cannot save to {path}")
+
+def load(path, mmap_mode=None):
+    # reads the whole file (and verifies its checksum), or with mmap_mode "r"
+    # or "c" maps it instead, see mmap()
+    if mmap_mode is None:
+        c_tensor = lib.tensor_load(_path(path))
+    elif mmap_mode in _MMAP_MODES:
+        c_tensor = lib.tensor_load_mmap(_path(path), _MMAP_MODES[mmap_mode])
+    else:
+        raise ValueError(f"unknown mmap_mode {mmap_mode!r}, expected None, 'r' or 'c'")
+    if c_tensor == ffi.NULL:
+        raise OSError(f"cannot load {path}")
+    return Tensor(c_tensor=c_tensor)
+
+class Writer:
+    # writes a .t1d file piece by piece, so it can be bigger than memory:
+    #   with tensor1d.Writer(path) as w:
+    #       for piece in pieces: w.write(piece)
+    def __init__(self, path):
+        self.path = path
+        self.writer = None
+        writer = lib.t1d_writer_open(_path(path))
+        if writer == ffi.NULL:
+            raise OSError(f"cannot open {path}")
+        self.writer = writer
+
+    def write(self, t):
+        if self.writer is None:
+            raise ValueError("write to a closed Writer")
+        if not lib.t1d_writer_write(self.writer, t.tensor):
+            raise OSError(f"cannot write to {self.path}")
+
+    def close(self):
+        if self.writer is not None:
+            writer, self.writer = self.writer, None
+            if not lib.t1d_writer_close(writer):
+                raise OSError(f"cannot write to {self.path}")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+class Reader:
+    # reads a .t1d file piece by piece, the checksum is verified at the end:
+    #   with tensor1d.Reader(path) as r:
+    #       for chunk in r.chunks(1 << 20): ...
+    def __init__(self, path):
+        self.reader = None
+        reader = lib.t1d_reader_open(_path(path))
+        if reader == ffi.NULL:
+            raise OSError(f"cannot open {path}")
+        self.reader = reader
+        self.size = lib.t1d_reader_size(self.reader)
+        self.dtype = ffi.string(lib.tensor_dtype_name(lib.t1d_reader_dtype(reader))).decode('utf-8')
+        self.scale = lib.t1d_reader_scale(reader)
+
+    def read_into(self, out):
+        # fills (the start of) out with the next elements, returns how many
+        if self.reader is None:
+            raise ValueError("read from a closed Reader")
+        n = lib.t1d_reader_read(self.reader, out.tensor)
+        if n < 0:
+            raise OSError("read failed")
+        return n
+
+    def chunks(self, chunk_size=1 << 16, dtype=None):
+        # yields the data in views of one reused buffer, so copy what you keep.
+        # The buffer has the file's dtype unless another one is given, e.g.
+        # dtype="float32" dequantizes an int8 file on the fly
+        buf = empty(chunk_size, dtype=self.dtype if dtype is None else dtype)
+        if dtype is None:
+            buf.tensor.storage.scale = self.scale
+
+        while True:
+            n = self.read_into(buf)
+            if n == 0:
+                return
+            yield buf if n == chunk_size else buf[:n]
+
+    def close(self):
+        if self.reader is not None:
+            lib.t1d_reader_close(self.reader)
+            self.reader = None
+
+    def __del__(self):
+        if lib is not None:
+            self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+def empty(*shape, dtype=None):
+    # empty(n) is 1-D, empty(2, 3) or empty((2, 3)) N-d
+    shape = _shape_arg(shape)
+    if len(shape) == 1:
+        return Tensor(shape[0], dtype=dtype)
+    return _view(lib.tensor_empty_shape(len(shape), ffi.new("int[]", shape), _dtype(dtype)), "empty")
 
 def arange(size):
     c_tensor = lib.tensor_arange(size)
     return Tensor(c_tensor=c_tensor)
 
-def tensor(data):
-    return Tensor(data)
\ No newline at end of file
+def tensor(data, dtype=None):
+    return Tensor(data, dtype=dtype)
+
+def quantize(t, scale=None):
+    return t.quantize(scale)
+
+def promote_types(dtype1, dtype2):
+    return ffi.string(lib.tensor_dtype_name(lib.tensor_promote_types(_dtype(dtype1), _dtype(dtype2)))).decode('utf-8')
+
+def add(t, other, out=None):
+    return t.add(other, out=out)
+
+def sub(t, other, out=None):
+    return t.sub(other, out=out)
+
+def mul(t, other, out=None):
+    return t.mul(other, out=out)
+
+def div(t, other, out=None):
+    return t.div(other, out=out)
+
+def exp(t, out=None):
+    return t.exp(out=out)
+
+def log(t, out=None):
+    return t.log(out=out)
+
+def tanh(t, out=None):
+    return t.tanh(out=out)
+
+def sigmoid(t, out=None):
+    return t.sigmoid(out=out)
+
+def sqrt(t, out=None):
+    return t.sqrt(out=out)
+
+def clamp(t, min=None, max=None):
+    return t.clamp(min, max)
+
+def fma(a, b, c):
+    # a * b + c in one pass, rounded once
+    return _view(lib.tensor_fma(a.tensor, b.tensor, c.tensor), "fma")
+
+def axpy(alpha, x, y):
+    # alpha * x + y, rounded once
+    return _view(lib.tensor_axpy(float(alpha), x.tensor, y.tensor), "axpy")
+
+def where(cond, a, b):
+    # a where cond is nonzero, else b
+    return _view(lib.tensor_where(cond.tensor, a.tensor, b.tensor), "where")
+
+def cumsum(t):
+    return t.cumsum()
+
+def cummax(t):
+    return t.cummax()
+
+def sort(t, descending=False):
+    return t.sort(descending)
+
+def argsort(t, descending=False):
+    return t.argsort(descending)
+
+def topk(t, k, largest=True):
+    return t.topk(k, largest)
+
+def matmul(t, other, out=None):
+    return t.matmul(other, out=out)
+
+def mm(t, other):
+    return t.mm(other)
+
+def mv(t, vec):
+    return t.mv(vec)
+
+def bmm(t, other):
+    return t.bmm(other)
+
+def clone(t):
+    return t.clone()
+
+def reshape(t, *shape):
+    return t.reshape(*shape)
+
+def transpose(t, dim0, dim1):
+    return t.transpose(dim0, dim1)
+
+def permute(t, *dims):
+    return t.permute(*dims)
+
+# -----------------------------------------------------------------------------
+# SIMD kernel selection: the best ISA is picked when the library loads, these
+# let you inspect it or switch, e.g. to "scalar" to get the reference kernels
+
+_ISAS = [lib.KERNEL_ISA_SCALAR, lib.KERNEL_ISA_NEON, lib.KERNEL_ISA_AVX2, lib.KERNEL_ISA_AVX512]
+
+def _isa_name(isa):
+    return ffi.string(lib.tensor_kernel_isa_name(isa)).decode('utf-8')
+
+def supported_kernel_isas():
+    return [_isa_name(isa) for isa in _ISAS if lib.tensor_kernel_isa_supported(isa)]
+
+def get_kernel_isa():
+    return _isa_name(lib.tensor_get_kernel_isa())
+
+def set_kernel_isa(name):
+    for isa in _ISAS:
+        if _isa_name(isa) == name:
+            if not lib.tensor_set_kernel_isa(isa):
+                raise ValueError(f"kernel ISA {name} is not supported on this machine")
+            return
+    raise ValueError(f"unknown kernel ISA {name}")
+
+# -----------------------------------------------------------------------------
+# pool allocator that recycles Tensor/Storage memory
+
+def pool_stats():
+    stats = ffi.new("PoolStats*")
+    lib.tensor_pool_stats(stats)
+    return {
+        "hits": stats.hits,
+        "misses": stats.misses,
+        "bytes_held": stats.bytes_held,
+        "enabled": bool(stats.enabled),
+    }
+
+def stats():
+    # a snapshot of the instrumentation of a `make STATS=1` build, for metrics:
+    # live/peak bytes and counts, and calls and total ns per op. All 0 (and
+    # "enabled" False) in a normal build
+    stats = ffi.new("TensorStats*")
+    lib.tensor_stats(stats)
+    ops = {}
+    for op in range(lib.STATS_OP_COUNT):
+        name = ffi.string(lib.tensor_stats_op_name(op)).decode()
+        ops[name] = {"count": stats.ops[op].count, "total_ns": stats.ops[op].total_ns}
+    return {
+        "enabled": bool(stats.enabled),
+        "live_tensors": stats.live_tensors,
+        "live_storages": stats.live_storages,
+        "live_bytes": stats.live_bytes,
+        "peak_bytes": stats.peak_bytes,
+        "storages_allocated": stats.storages_allocated,
+        "ops": ops,
+    }
+
+def stats_reset():
+    # zeroes the op counters, the peak starts over from the bytes live now
+    lib.tensor_stats_reset()
+
+def pool_trim():
+    lib.tensor_pool_trim()
+
+# -----------------------------------------------------------------------------
+# arena scopes: inside `with tensor1d.arena() as scope:` the new tensors of this
+# thread are bump-allocated from an arena that is released in one go at the end
+# of the block. A result that outlives it is copied out with scope.promote(t).
+# Tensors still referenced at the end escaped: they stay valid (the arena is
+# released once they are freed), scope.escaped counts them and a
+# ResourceWarning is issued, so temporaries should be gone by then, e.g.
+# `out = scope.promote(loss(x, y))`, where loss's own locals die on return.
+
+class ArenaScope:
+    def __init__(self):
+        self.escaped = 0
+
+    def promote(self, t):
+        return Tensor(c_tensor=lib.tensor_arena_promote(t.tensor))
+
+@contextlib.contextmanager
+def arena():
+    scope = ArenaScope()
+    lib.tensor_arena_begin()
+    try:
+        yield scope
+    finally:
+        scope.escaped = lib.tensor_arena_end()
+        if scope.escaped > 0:
+            warnings.warn(f"{scope.escaped} tensors and storages escaped the arena scope, "
+                          "it is released once they are freed", ResourceWarning, stacklevel=3)
+
+# -----------------------------------------------------------------------------
+# threading: ops on at least `threshold` elements are split across a pool of
+# worker threads, sized from TENSOR1D_NUM_THREADS or the number of cores
+
+def get_num_threads():
+    return lib.tensor_get_num_threads()
+
+def set_num_threads(num_threads):
+    lib.tensor_set_num_threads(num_threads)
+
+def get_parallel_threshold():
+    return lib.tensor_get_parallel_threshold()
+
+def set_parallel_threshold(num_elements):
+    lib.tensor_set_parallel_threshold(num_elements)
+
+# placement of large storages (those too big for the pool, over 4MB): on a
+# multi-socket host "interleave" spreads their pages over the NUMA nodes, and
+# "first_touch" puts each part on the node of the pinned pool thread that
+# computes on it (both need a `make NUMA=1` build). Huge pages ("thp", or
+# "hugetlb" from the reserved pool) cut TLB misses
+
+_NUMA_POLICIES = {"default": lib.NUMA_DEFAULT, "interleave": lib.NUMA_INTERLEAVE, "first_touch": lib.NUMA_FIRST_TOUCH}
+_HUGE_PAGES = {"off": lib.HUGE_PAGES_OFF, "thp": lib.HUGE_PAGES_THP, "hugetlb": lib.HUGE_PAGES_HUGETLB}
+
+def set_numa_policy(policy):
+    if policy not in _NUMA_POLICIES:
+        raise ValueError(f"unknown NUMA policy {policy!r}, expected one of {list(_NUMA_POLICIES)}")
+    if not lib.tensor_set_numa_policy(_NUMA_POLICIES[policy]):
+        raise ValueError(f"NUMA policy {policy!r} is not supported by this build or system")
+
+def get_numa_policy():
+    return {v: k for k, v in _NUMA_POLICIES.items()}[lib.tensor_get_numa_policy()]
+
+def numa_num_nodes():
+    # 0 if this build or system has no NUMA support
+    return lib.tensor_numa_num_nodes()
+
+def set_huge_pages(mode):
+    if mode not in _HUGE_PAGES:
+        raise ValueError(f"unknown huge pages mode {mode!r}, expected one of {list(_HUGE_PAGES)}")
+    lib.tensor_set_huge_pages(_HUGE_PAGES[mode])
+
+def get_huge_pages():
+    return {v: k for k, v in _HUGE_PAGES.items()}[lib.tensor_get_huge_pages()]
+
+# -----------------------------------------------------------------------------
+# lazy mode: inside `with tensor1d.lazy():` additions build an expression that
+# is evaluated in a single fused pass when the result is first needed
+
+def set_lazy(lazy):
+    lib.tensor_set_lazy(lazy)
+
+def get_lazy():
+    return bool(lib.tensor_get_lazy())
+
+@contextlib.contextmanager
+def lazy(enabled=True):
+    previous = get_lazy()
+    set_lazy(enabled)
+    try:
+        yield
+    finally:
+        set_lazy(previous)
+
+# -----------------------------------------------------------------------------
+# async ops: add_async() & co. return a Future right away and run the op on
+# background threads in C, without holding the GIL, e.g. to keep an event loop
+# responsive, or to load the next file while computing on the current one.
+# The inputs stay alive until the op is done, but must not be written to
+# meanwhile. A Future is a concurrent.futures.Future that can also be awaited.
+
+class Future(concurrent.futures.Future):
+    def __await__(self):
+        import asyncio
+        return asyncio.wrap_future(self).__await__()
+
+_futures = {}
+_future_ids = itertools.count(1)
+
+@ffi.callback("void(void*, TensorFuture*)")
+def _future_done(ctx, c_future):
+    # runs on the background thread of the op, with the GIL
+    future, scalar = _futures.pop(int(ffi.cast("uintptr_t", ctx)))
+    if scalar:
+        future.set_result(lib.tensor_future_value(c_future))
+    else:
+        c_tensor = lib.tensor_future_tensor(c_future)
+        if c_tensor == ffi.NULL:
+            future.set_exception(ValueError("async op failed, see the message above"))
+        else:
+            future.set_result(Tensor(c_tensor=c_tensor))
+    lib.tensor_future_free(c_future)
+
+def _submit(submit, *args, scalar=False):
+    key = next(_future_ids)
+    future = Future()
+    future.set_running_or_notify_cancel() # queued ops can't be cancelled
+    _futures[key] = (future, scalar)
+    submit(*args, _future_done, ffi.cast("void*", key))
+    return future
+
+@atexit.register
+def _wait_futures():
+    # their callbacks need the interpreter, so ops still running are waited for
+    for future, _ in list(_futures.values()):
+        future.exception()
+
+def add_async(t, other):
+    if isinstance(other, (int, float)):
+        return _submit(lib.tensor_addf_async, t.tensor, float(other))
+    return _submit(lib.tensor_add_async, t.tensor, other.tensor)
+
+def matmul_async(t, other):
+    return _submit(lib.tensor_matmul_async, t.tensor, other.tensor)
+
+def sum_async(t):
+    return _submit(lib.tensor_sum_async, t.tensor, scalar=True)
+
+def dot_async(t, other):
+    return _submit(lib.tensor_dot_async, t.tensor, other.tensor, scalar=True)
+
+def load_async(path, mmap_mode=None):
+    # load() in the background: reads (and verifies) the whole file, or maps it
+    if mmap_mode is not None and mmap_mode not in _MMAP_MODES:
+        raise ValueError(f"unknown mmap_mode {mmap_mode!r}, expected None, 'r' or 'c'")
+    return _submit(lib.tensor_load_async, _path(path), -1 if mmap_mode is None else _MMAP_MODES[mmap_mode])
+
+# -----------------------------------------------------------------------------
+# streams: a .t1d file, or the 1-D tensors (or lists, or numbers) an iterable
+# yields, in chunks of a fixed size, for data larger than memory. The next
+# chunk is read (or pulled from the iterable, on a background thread) while the
+# current one is worked on, and the chunks reuse two buffers, so clone what you
+# keep. With mmap=True the chunks are views of the mapped file instead. A
+# Reducer carries a reduction, or the carry of a scan, from chunk to chunk:
+#   total = tensor1d.Reducer("sum")
+#   with tensor1d.stream("big.t1d", 1 << 20) as s:
+#       for chunk in s: total.update(chunk)
+#   total.value
+
+# weak, so that a stream dropped before its end is collected, and closed, and a
+# fill of a stream that is gone ends it
+_streams = weakref.WeakValueDictionary()
+_stream_ids = itertools.count(1)
+
+@ffi.callback("long long(void*, Tensor*)")
+def _stream_fill(ctx, c_chunk):
+    # runs on an async worker, with the GIL
+    stream = _streams.get(int(ffi.cast("uintptr_t", ctx)))
+    if stream is None:
+        return 0
+    try:
+        lib.tensor_incref(c_chunk)
+        return stream._fill(Tensor(c_tensor=c_chunk))
+    except BaseException as e:
+        stream._error = e
+        return -1
+
+class Stream:
+    def __init__(self, source, chunk_size=1 << 20, dtype=None, mmap=False):
+        self.stream = ffi.NULL
+        self._key = None
+        self._error = None
+        if isinstance(source, (str, bytes, os.PathLike)):
+            if mmap:
+                if dtype is not None:
+                    raise ValueError("a mapped stream has the dtype of the file")
+                stream = lib.tensor_stream_mmap(_path(os.fsdecode(source)), chunk_size)
+            else:
+                stream = lib.tensor_stream_open(_path(os.fsdecode(source)), chunk_size, -1 if dtype is None else _dtype(dtype))
+            if stream == ffi.NULL:
+                raise OSError(f"cannot stream {os.fsdecode(source)}")
+        else:
+            if mmap:
+                raise ValueError("only files can be mapped")
+            self._items = iter(source)
+            self._rest, self._offset = None, 0 # the part of the last item that didn't fit
+            self._key = next(_stream_ids)
+            _streams[self._key] = self
+            stream = lib.tensor_stream_new(chunk_size, _dtype(dtype), _stream_fill, ffi.cast("void*", self._key))
+            if stream == ffi.NULL:
+                del _streams[self._key]
+                raise ValueError(f"invalid arguments to stream: chunk_size {chunk_size}, dtype {dtype}")
+        self.stream = stream
+        size = lib.tensor_stream_size(stream)
+        self.size = None if size < 0 else size
+
+    def _fill(self, chunk):
+        # copies the next items into chunk, numbers are gathered to copy them in one go
+        size, n, numbers = len(chunk), 0, []
+        def flush():
+            nonlocal n
+            if numbers:
+                chunk[n:n + len(numbers)].copy_(numbers)
+                n += len(numbers)
+                numbers.clear()
+        while n + len(numbers) < size:
+            if self._rest is None:
+                item = next(self._items, None)
+                if item is None:
+                    break
+                if isinstance(item, (int, float)):
+                    numbers.append(item)
+                    continue
+                flush()
+                if isinstance(item, Tensor) and item.ndim != 1:
+                    raise ValueError(f"a stream takes 1-D tensors, got one of shape {item.shape}")
+                self._rest, self._offset = item, 0
+            flush()
+            k = min(len(self._rest) - self._offset, size - n)
+            chunk[n:n + k].copy_(self._rest[self._offset:self._offset + k])
+            n += k
+            self._offset += k
+            if self._offset == len(self._rest):
+                self._rest = None
+        flush()
+        return n
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        if self.stream == ffi.NULL:
+            raise StopIteration
+        c_chunk = lib.tensor_stream_next(self.stream)
+        if c_chunk == ffi.NULL:
+            failed = lib.tensor_stream_failed(self.stream)
+            self.close()
+            if self._error is not None:
+                raise self._error
+            if failed:
+                raise OSError("stream read failed")
+            raise StopIteration
+        # borrowed from the stream, valid until the next chunk
+        lib.tensor_incref(c_chunk)
+        return Tensor(c_tensor=c_chunk)
+
+    def close(self):
+        if self.stream != ffi.NULL:
+            lib.tensor_stream_close(self.stream) # waits for the fill in flight
+            self.stream = ffi.NULL
+        if self._key is not None:
+            _streams.pop(self._key, None)
+            self._key = None
+
+    def __del__(self):
+        if lib is not None:
+            self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+@atexit.register
+def _close_streams():
+    # iterables are pulled from on a background thread that needs the interpreter
+    for stream in list(_streams.values()):
+        stream.close()
+
+def stream(source, chunk_size=1 << 20, dtype=None, mmap=False):
+    # closed at the end of the data, or use `with` to close it early
+    return Stream(source, chunk_size, dtype, mmap)
+
+_REDUCER_OPS = {
+    "sum": lib.STREAM_SUM,
+    "mean": lib.STREAM_MEAN,
+    "max": lib.STREAM_MAX,
+    "min": lib.STREAM_MIN,
+    "argmax": lib.STREAM_ARGMAX,
+    "argmin": lib.STREAM_ARGMIN,
+    "cumsum": lib.STREAM_CUMSUM,
+    "cummax": lib.STREAM_CUMMAX,
+}
+
+class Reducer:
+    # update() folds in a chunk, value is the result over all of them so far:
+    # a float, or an int index for "argmax"/"argmin". The scans "cumsum" and
+    # "cummax" return each chunk's part of the scan of everything from scan()
+    def __init__(self, op):
+        if op not in _REDUCER_OPS:
+            raise ValueError(f"unknown reducer op {op!r}, expected one of {list(_REDUCER_OPS)}")
+        self.op = op
+        self.state = ffi.new("TensorReducer*")
+        lib.tensor_reducer_init(self.state, _REDUCER_OPS[op])
+
+    def update(self, chunk):
+        lib.tensor_reducer_update(self.state, chunk.tensor)
+        return self
+
+    def scan(self, chunk, out=None):
+        if self.op not in ("cumsum", "cummax"):
+            raise ValueError(f"{self.op} is not a scan")
+        c_tensor = lib.tensor_reducer_scan(self.state, chunk.tensor, ffi.NULL if out is None else out.tensor)
+        if c_tensor == ffi.NULL:
+            raise ValueError("invalid out for scan")
+        return out if out is not None else Tensor(c_tensor=c_tensor)
+
+    @property
+    def count(self):
+        return self.state.count
+
+    @property
+    def value(self):
+        value = lib.tensor_reducer_value(self.state)
+        return int(value) if self.op in ("argmax", "argmin") else value
@@ -1,3 +1,6 @@
+import array
+import gc
+import math
 import pytest
 import torch
 import tensor1d
@@ -100,6 +103,71 @@ def test_slices_with_steps(step):
 
     assert_tensor_equal(torch_result, tensor1d_result)
 
+# negative steps reverse, as in NumPy (torch has flip for it)
+@pytest.mark.parametrize("key", [
+    slice(None, None, -1), slice(None, None, -3), slice(7, 2, -2), slice(-1, -30, -1),
+    slice(2, 7, -1), slice(100, -100, -4), slice(-3, None, -1), slice(None, 5, -2),
+])
+def test_slices_with_negative_steps(key):
+    t = tensor1d.arange(20)
+    view = t[key]
+    assert view.tolist() == [float(i) for i in range(20)[key]]
+    assert view.tensor.storage == t.tensor.storage
+    assert view[::-1].tolist() == view.tolist()[::-1]
+
+def test_negative_step_views():
+    r = torch.arange(24, dtype=torch.float32).reshape(2, 3, 4)
+    t = tensor1d.arange(24).reshape(2, 3, 4)
+    assert_tensor_equal(r.flip(0, 2), t[::-1, :, ::-1])
+    assert_tensor_equal(r.flip(1)[:, 1:], t[:, ::-1][:, 1:])
+    rev = t[::-1, ::-1, ::-1]
+    assert rev.stride() == (-12, -4, -1) and not rev.is_contiguous()
+    assert_tensor_equal(r.flip(0, 1, 2).contiguous(), rev.contiguous())
+    assert_tensor_equal(r.flip(0, 1, 2).reshape(24), rev.reshape(24))
+    assert_tensor_equal(r.flip(1) + r, t[:, ::-1] + t)
+    assert rev.sum() == r.sum().item() and rev.argmax() == 0
+
+def test_negative_step_kernels_and_threads():
+    values = [((i * 31) % 977) * 0.01 - 3.0 for i in range(20000)]
+    t = tensor1d.tensor(values)
+    r = torch.tensor(values).flip(0)
+    original_isa = tensor1d.get_kernel_isa()
+    old_threads = tensor1d.get_num_threads()
+    old_threshold = tensor1d.get_parallel_threshold()
+    try:
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            for num_threads in [1, 4]:
+                tensor1d.set_num_threads(num_threads)
+                tensor1d.set_parallel_threshold(1000)
+                rev = t[::-1]
+                assert rev.sum() == pytest.approx(r.sum().item(), rel=1e-5)
+                assert rev.dot(rev) == pytest.approx(r.dot(r).item(), rel=1e-5)
+                assert rev.dot(t) == pytest.approx(r.dot(r.flip(0)).item(), rel=1e-5)
+                assert (rev.max(), rev.argmax(), rev.argmin()) == (r.max().item(), r.argmax().item(), r.argmin().item())
+                assert_tensor_equal(r + 1.0, rev + 1.0)
+                assert_tensor_equal(r + r, rev + rev)
+                assert_tensor_equal(r + r.flip(0), rev + t)
+                out = tensor1d.empty(20000)
+                tensor1d.add(rev, 2.0, out=out[::-1])
+                assert_tensor_equal(r.flip(0) + 2.0, out)
+                copy = t.clone()
+                view = copy[::-1]
+                view += rev
+                assert_tensor_equal(r.flip(0) * 2, copy)
+    finally:
+        tensor1d.set_kernel_isa(original_isa)
+        tensor1d.set_num_threads(old_threads)
+        tensor1d.set_parallel_threshold(old_threshold)
+
+def test_negative_step_matmul_and_save(tmp_path):
+    a = tensor1d.tensor([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+    b = torch.tensor([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+    assert_tensor_equal(b.flip(1) @ b.T.flip(0), a[:, ::-1] @ a.T[::-1])
+    path = str(tmp_path / "rev.t1d")
+    a[::-1, ::-1].save(path)
+    assert tensor1d.load(path).tolist() == [6.0, 5.0, 4.0, 3.0, 2.0, 1.0]
+
 # Test for behavior with different slice sizes
 @pytest.mark.parametrize("size", [10, 20, 50, 100])
 def test_slices_with_different_sizes(size):
@@ -176,6 +244,102 @@ def test_setitem_indirect():
     tensor1d_view[-1] = 200
     assert_tensor_equal(torch_tensor, tensor1d_tensor)
 
+# batched indexing: lists or index tensors gather and scatter in one call
+def test_gather_scatter():
+    torch_tensor = torch.arange(10, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(10)
+    assert_tensor_equal(torch_tensor[[3, 0, -1, 3]], tensor1d_tensor[[3, 0, -1, 3]])
+    index = tensor1d.tensor([[1, 2], [9, 8]], dtype="int32")
+    assert_tensor_equal(torch_tensor[torch.tensor([[1, 2], [9, 8]])], tensor1d_tensor[index])
+    assert tensor1d_tensor[::-2][[0, 1]].tolist() == [9, 7] and tensor1d_tensor[[]].tolist() == []
+    # repeated indices are written in order, the last one wins
+    torch_tensor[[1, 4, 1]] = torch.tensor([10.0, 40.0, 11.0])
+    tensor1d_tensor[[1, 4, 1]] = tensor1d.tensor([10.0, 40.0, 11.0])
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    torch_tensor[[0, -2]] = 5
+    tensor1d_tensor[[0, -2]] = 5
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # rows of an N-d tensor, with values broadcast over them
+    torch_nd = torch.arange(12, dtype=torch.float32).reshape(3, 4)
+    tensor1d_nd = tensor1d.arange(12).reshape(3, 4)
+    assert_tensor_equal(torch_nd[[2, 0]], tensor1d_nd[[2, 0]])
+    assert_tensor_equal(torch_nd.t()[[1]], tensor1d_nd.transpose(0, 1)[[1]])
+    torch_nd[[0, 2]] = torch.tensor([1.0, 2.0, 3.0, 4.0])
+    tensor1d_nd[[0, 2]] = [1.0, 2.0, 3.0, 4.0]
+    assert_tensor_equal(torch_nd, tensor1d_nd)
+    # the dtype (and int8 scale) of the tensor is kept
+    q = tensor1d.tensor([0.5, -1.0, 2.0]).quantize(0.5)
+    assert q[[2, 0]].dtype == "int8" and q[[2, 0]].tolist() == [2.0, 0.5]
+    q[[1]] = 1.5
+    assert q.tolist() == [0.5, 1.5, 2.0]
+    ints = tensor1d.tensor([1, 2, 3], dtype="int32")
+    ints[[0]] = 7.9
+    assert ints[[0, 2]].tolist() == [7, 3]
+    with pytest.raises(IndexError):
+        tensor1d_tensor[[10]]
+    with pytest.raises(IndexError):
+        tensor1d_tensor[[0, -11]] = 1
+    with pytest.raises(IndexError):
+        tensor1d_tensor[tensor1d.tensor([1.0])]
+    with pytest.raises(IndexError):
+        tensor1d_tensor[[0, 1]] = [1.0, 2.0, 3.0]
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+
+# views written in one call: fill_, copy_ and assignment to slices
+def test_fill_copy_and_slice_assignment():
+    torch_tensor = torch.arange(10, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(10)
+    torch_tensor[2:8:2] = 1.5
+    tensor1d_tensor[2:8:2] = 1.5
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    torch_tensor[0::3] = torch.tensor([4.0, 3.0, 2.0, 1.0])
+    tensor1d_tensor[::-3] = [1.0, 2.0, 3.0, 4.0]
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    # overlapping source and destination read the source before writing
+    torch_tensor[1:] = torch_tensor[:-1].clone()
+    tensor1d_tensor[1:] = tensor1d_tensor[:-1]
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    assert tensor1d_tensor.fill_(-2).tolist() == [-2.0] * 10
+    torch_nd = torch.zeros(3, 4)
+    tensor1d_nd = tensor1d.empty(3, 4).fill_(0)
+    torch_nd[1] = 7
+    tensor1d_nd[1] = 7
+    torch_nd[:, 1:3] = torch.tensor([[1.0], [2.0], [3.0]])
+    tensor1d_nd[:, 1:3] = tensor1d.tensor([[1.0], [2.0], [3.0]])
+    assert_tensor_equal(torch_nd, tensor1d_nd)
+    # copy_ broadcasts and converts to the dtype of the destination
+    halves = tensor1d.empty(2, 3, dtype="float16").copy_(tensor1d.tensor([0.1, 2.0, 1e5], dtype="float64"))
+    assert_tensor_equal(torch.tensor([0.1, 2.0, 1e5], dtype=torch.float64).to(torch.float16).expand(2, 3), halves)
+    big = tensor1d.empty(100_000)
+    tensor1d.set_num_threads(4)
+    try:
+        big[::-1] = 3.0
+        big[1::2].copy_(tensor1d.arange(50_000))
+    finally:
+        tensor1d.set_num_threads(1)
+    assert big[:4].tolist() == [3.0, 0.0, 3.0, 1.0] and big[-1].item() == 49_999.0
+    # under copy-on-write the assignment writes to t, not to a copy in the view
+    t = tensor1d.arange(6).set_copy_on_write()
+    other = t[:3]
+    t[1:3] = 9
+    t[4:] = [8.0, 7.0]
+    assert t.tolist() == [0, 9, 9, 3, 8, 7] and other.tolist() == [0, 1, 2]
+    assert t.is_copy_on_write() and t.tensor.storage != other.tensor.storage
+    with pytest.raises(ValueError):
+        tensor1d_nd[1:] = tensor1d.arange(3)
+    with pytest.raises(ValueError):
+        tensor1d.arange(3).expand(2, 3).fill_(1)
+
+# t.item(i): one element as a Python scalar, without making a Tensor for t[i]
+def test_item_at_index():
+    t = tensor1d.arange(12).reshape(3, 4)
+    assert t.item(5) == 5.0 and t.item(1, 2) == 6.0 and t.item(-1) == 11.0
+    assert t[2].item(-1) == 11.0 and tensor1d.tensor([4, 5], dtype="int32").item(1) == 5
+    with pytest.raises(IndexError):
+        t.item(3, 0)
+    with pytest.raises(IndexError):
+        t.item(12)
+
 # test addition
 def test_addition():
 
@@ -210,3 +374,1349 @@ def test_addition():
 
     with pytest.raises(ValueError):
         tensor1d_tensor + tensor1d.arange(5)
+
+# test addition on strided views (non-contiguous fast path)
+def test_addition_strided():
+    torch_tensor = torch.arange(40, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(40)
+
+    # strided view plus a scalar
+    torch_result = torch_tensor[1:31:3] + 0.5
+    tensor1d_result = tensor1d_tensor[1:31:3] + 0.5
+    assert_tensor_equal(torch_result, tensor1d_result)
+
+    # strided view plus a contiguous view of the same size
+    torch_result = torch_tensor[::4] + torch_tensor[10:20]
+    tensor1d_result = tensor1d_tensor[::4] + tensor1d_tensor[10:20]
+    assert_tensor_equal(torch_result, tensor1d_result)
+
+    # strided view plus a 1-element slice (broadcast)
+    torch_result = torch_tensor[::2] + torch_tensor[7:8]
+    tensor1d_result = tensor1d_tensor[::2] + tensor1d_tensor[7:8]
+    assert_tensor_equal(torch_result, tensor1d_result)
+
+# every SIMD kernel must match the scalar reference kernel exactly
+@pytest.mark.parametrize("size", [1, 3, 8, 17, 64, 1001])
+def test_simd_kernels_match_scalar(size):
+    a = tensor1d.tensor([i * 0.37 - 5.0 for i in range(size)])
+    b = tensor1d.tensor([i * -1.13 + 2.5 for i in range(size)])
+    original = tensor1d.get_kernel_isa()
+    try:
+        tensor1d.set_kernel_isa("scalar")
+        expected_add = (a + b).tolist()
+        expected_addf = (a + 0.1).tolist()
+        # the correctly rounded math kernels too
+        expected_math = [(a - b).tolist(), (a * b).tolist(), (a / b).tolist(), (0.1 / a).tolist(),
+                         (a * a).sqrt().tolist(), tensor1d.fma(a, b, a).tolist(), tensor1d.axpy(0.1, a, b).tolist()]
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            assert (a + b).tolist() == expected_add
+            assert (a + 0.1).tolist() == expected_addf
+            assert [(a - b).tolist(), (a * b).tolist(), (a / b).tolist(), (0.1 / a).tolist(),
+                    (a * a).sqrt().tolist(), tensor1d.fma(a, b, a).tolist(), tensor1d.axpy(0.1, a, b).tolist()] == expected_math
+    finally:
+        tensor1d.set_kernel_isa(original)
+
+def test_invalid_kernel_isa():
+    with pytest.raises(ValueError):
+        tensor1d.set_kernel_isa("not an isa")
+
+# test in-place addition, which writes into the existing storage
+def test_inplace_addition():
+    torch_tensor = torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(20)
+    tensor1d_before = tensor1d_tensor
+
+    torch_tensor += 5.0
+    tensor1d_tensor += 5.0
+    assert tensor1d_tensor is tensor1d_before
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+
+    torch_tensor += torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor += tensor1d.arange(20)
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+
+    # broadcasting a 1-element tensor into a bigger one is fine
+    torch_tensor += torch.tensor([2.0])
+    tensor1d_tensor += tensor1d.tensor([2.0])
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+
+    # in-place add through a strided view updates the base tensor
+    torch_view = torch_tensor[1:15:3]
+    tensor1d_view = tensor1d_tensor[1:15:3]
+    torch_view += 100.0
+    tensor1d_view += 100.0
+    assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    assert str(tensor1d_view) == str(tensor1d.tensor(torch_view.tolist()))
+
+    # but the result can't be bigger than the destination
+    with pytest.raises(ValueError):
+        t = tensor1d.tensor([1.0])
+        t += tensor1d.arange(5)
+
+    with pytest.raises(TypeError):
+        tensor1d_tensor += "not a valid input"
+
+# test addition into a caller-supplied output tensor
+def test_addition_out():
+    torch_tensor = torch.arange(20, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(20)
+
+    torch_out = torch.empty(20)
+    tensor1d_out = tensor1d.empty(20)
+    torch.add(torch_tensor, torch_tensor, out=torch_out)
+    result = tensor1d.add(tensor1d_tensor, tensor1d_tensor, out=tensor1d_out)
+    assert result is tensor1d_out
+    assert_tensor_equal(torch_out, tensor1d_out)
+
+    # a strided view is a fine destination
+    torch_base = torch.arange(40, dtype=torch.float32)
+    tensor1d_base = tensor1d.arange(40)
+    torch.add(torch_tensor, 1.5, out=torch_base[::2])
+    tensor1d_tensor.add(1.5, out=tensor1d_base[::2])
+    assert_tensor_equal(torch_base, tensor1d_base)
+
+    # the destination size has to match the result size
+    with pytest.raises(ValueError):
+        tensor1d.add(tensor1d_tensor, 1.0, out=tensor1d.empty(3))
+
+# elementwise math ops: sub/mul/div broadcast, promote and take scalars like add
+def test_binary_ops():
+    x = [[i * 0.75 - 4.0 + j for i in range(5)] for j in range(3)]
+    y = [i * 0.5 + 0.25 for i in range(5)]
+    torch_x, torch_y = torch.tensor(x), torch.tensor(y)
+    tx, ty = tensor1d.tensor(x), tensor1d.tensor(y)
+    assert_tensor_equal(torch_x - torch_y, tx - ty)
+    assert_tensor_equal(torch_x * torch_y, tx * ty)
+    assert_tensor_equal(torch_x / torch_y, tx / ty)
+    assert_tensor_equal(torch_y - torch_x, ty - tx)
+    for s in [2.5, -3.0]:
+        assert_tensor_equal(torch_x - s, tx - s)
+        assert_tensor_equal(s - torch_x, s - tx)
+        assert_tensor_equal(torch_x * s, tx * s)
+        assert_tensor_equal(s * torch_x, s * tx)
+        assert_tensor_equal(torch_x / s, tx / s)
+        assert_tensor_equal(s / torch_y, s / ty)
+        assert_tensor_equal(s + torch_x, s + tx)
+    assert_tensor_equal(-torch_x, -tx)
+    # strided operands, and a broadcast one of stride 0
+    assert_tensor_equal(torch_x.T * torch_x.T, tx.T * tx.T)
+    assert_tensor_equal(torch_x[:, ::2] / torch_y[::2], tx[:, ::2] / ty[::2])
+    assert_tensor_equal(torch_x - torch_x[1:2], tx - tx[1:2])
+
+    # dividing integers is true division, by zero gives inf and nan
+    a, b = tensor1d.tensor([3, -7, 0, 5], dtype="int32"), tensor1d.tensor([2, 2, 0, 0], dtype="int32")
+    assert (a / b).dtype == "float32" and (a - b).dtype == "int32"
+    assert (a / b).tolist()[:2] == [1.5, -3.5] and math.isnan((a / b).tolist()[2]) and (a / b).tolist()[3] == math.inf
+    assert (a * b).tolist() == [6, -14, 0, 0]
+    for dtype in ["float64", "float16"]:
+        torch_a = torch.tensor(y, dtype=getattr(torch, dtype))
+        ta = tensor1d.tensor(y, dtype=dtype)
+        assert (ta * ta).dtype == dtype
+        assert_tensor_equal(torch_a * torch_a, ta * ta)
+        assert_tensor_equal(torch_a / torch_a[1:2], ta / ta[1:2])
+
+    # in place and into out
+    torch_z, tz = torch_x.clone(), tx.clone()
+    before = tz
+    torch_z -= torch_y
+    tz -= ty
+    torch_z *= 2.0
+    tz *= 2.0
+    torch_z /= torch_y
+    tz /= ty
+    assert tz is before
+    assert_tensor_equal(torch_z, tz)
+    out = tensor1d.empty(3, 5)
+    assert tensor1d.mul(tx, ty, out=out) is out
+    assert_tensor_equal(torch_x * torch_y, out)
+    with pytest.raises(ValueError):
+        tx * tensor1d.tensor([1.0, 2.0])
+    with pytest.raises(TypeError):
+        tx * "2"
+
+def ulp_error(expected, got):
+    # |got - expected| in float32 units in the last place of expected
+    if abs(expected) >= 2.0 ** 128 - 2.0 ** 103: # rounds to inf in float32
+        expected = math.copysign(math.inf, expected)
+    if math.isnan(expected) or math.isnan(got):
+        return 0 if math.isnan(expected) and math.isnan(got) else math.inf
+    if math.isinf(expected) or abs(expected) < 2 ** -126:
+        # inf has to match, subnormal results may be off by their own size
+        return 0 if got == expected or abs(got - expected) < 2 ** -126 else math.inf
+    return abs(got - expected) / 2 ** (math.frexp(expected)[1] - 24)
+
+# float32 exp/log/tanh/sigmoid/sqrt are polynomials, within their documented
+# max errors on every ISA (contiguous or strided); other dtypes use libm
+MATH_MAX_ULP = {"exp": 1.02, "log": 0.83, "tanh": 1.33, "sigmoid": 2.41, "sqrt": 0.5}
+
+def test_unary_ops():
+    values = [-math.inf, -1e30, -104.0, -88.5, -87.0, -20.0, -1.5, -0.625, -0.3, -1e-6, -0.0, 0.0, 1e-40,
+              1e-30, 1e-6, 0.3, 0.624, 0.626, 1.0, 2.5, 9.0, 10.0, 88.0, 88.7, 89.0, 1e30, math.inf, math.nan]
+    values += [i * 0.37 - 30.0 for i in range(170)]
+    t = tensor1d.tensor(values)
+    reference = torch.tensor(values).double() # the float32 inputs, exactly
+    original = tensor1d.get_kernel_isa()
+    try:
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            for name, max_ulp in MATH_MAX_ULP.items():
+                expected = getattr(torch, name)(reference).tolist()
+                for view, step in [(t, 1), (t[::3], 3)]:
+                    got = getattr(view, name)().tolist()
+                    for x, e, g in zip(values[::step], expected[::step], got):
+                        assert ulp_error(e, g) <= max_ulp, (isa, name, x, e, g)
+    finally:
+        tensor1d.set_kernel_isa(original)
+    for dtype in ["float64", "float16", "int32"]:
+        inputs = [0.25, 0.5, 1.0, 2.0, 3.0] if dtype != "int32" else [1, 2, 3, 4, 5]
+        torch_t, tt = torch.tensor(inputs, dtype=getattr(torch, dtype)), tensor1d.tensor(inputs, dtype=dtype)
+        for name in MATH_MAX_ULP:
+            result = getattr(tensor1d, name)(tt)
+            assert result.dtype == (dtype if dtype != "int32" else "float32")
+            assert_tensor_close(getattr(torch, name)(torch_t), result, tol=1e-12 if dtype == "float64" else 1e-3)
+    out = tensor1d.empty(20)
+    assert t[:20].exp(out=out) is out and out.tolist() == t[:20].exp().tolist()
+
+# fma and axpy round once, clamp and where select
+def test_fma_axpy_clamp_where():
+    u = 1.0 + 2.0 ** -12
+    ta, tc = tensor1d.tensor([u, 2.0, -3.0]), tensor1d.tensor([-1.0, 0.5, 4.0])
+    assert tensor1d.fma(ta, ta, tc).tolist() == [2.0 ** -11 + 2.0 ** -24, 4.5, 13.0]
+    assert (ta * ta + tc).tolist()[0] == 2.0 ** -11 # rounded twice
+    x = [[i * 0.3 - 1.0 + j for i in range(4)] for j in range(3)]
+    y = [0.5, -0.25, 1.0, 2.0]
+    torch_x, torch_y = torch.tensor(x), torch.tensor(y)
+    tx, ty = tensor1d.tensor(x), tensor1d.tensor(y)
+    assert_tensor_close(torch_x * torch_y + torch_y, tensor1d.fma(tx, ty, ty), tol=1e-6)
+    assert_tensor_close(torch_x.T * torch_x.T + 1.0, tensor1d.fma(tx.T, tx.T, tensor1d.tensor([1.0])), tol=1e-6)
+    assert_tensor_close(2.5 * torch_x + torch_y, tensor1d.axpy(2.5, tx, ty), tol=1e-6)
+    tz = tx.clone()
+    assert tz.axpy_(-2.0, ty) is tz
+    assert_tensor_close(torch_x - 2.0 * torch_y, tz, tol=1e-6)
+
+    assert_tensor_equal(torch_x.clamp(-0.5, 1.5), tx.clamp(-0.5, 1.5))
+    assert_tensor_equal(torch_x.clamp(min=0.1), tx.clamp(min=0.1))
+    assert_tensor_equal(torch_x.T.clamp(max=0.0), tx.T.clamp(max=0.0))
+    assert math.isnan(tensor1d.tensor([math.nan, 5.0]).clamp(0.0, 1.0).tolist()[0])
+    ti = tensor1d.tensor([-5, 0, 7], dtype="int32").clamp(-1, 3)
+    assert ti.dtype == "int32" and ti.tolist() == [-1, 0, 3]
+
+    cond = [[1.0], [0.0], [math.nan]]
+    torch_cond, tcond = torch.tensor(cond), tensor1d.tensor(cond)
+    assert_tensor_equal(torch.where(torch_cond != 0, torch_x, torch_y), tensor1d.where(tcond, tx, ty))
+    assert_tensor_equal(torch.where(torch_cond.T != 0, torch_x.T, torch_x[:, :1].T),
+                        tensor1d.where(tcond.T, tx.T, tx[:, :1].T))
+    mask = tensor1d.tensor([0, 2, 0, -1], dtype="int32")
+    result = tensor1d.where(mask, ty, ty.to("float64"))
+    assert result.dtype == "float64" and result.tolist() == y
+    with pytest.raises(ValueError):
+        tensor1d.where(tensor1d.tensor([1.0, 0.0]), tx, ty)
+
+# freed tensors go back to the pool and get reused by the next allocation
+def test_pool_allocator():
+    stats = tensor1d.pool_stats()
+    if not stats["enabled"]:
+        pytest.skip("built with TENSOR1D_NO_POOL")
+    t = tensor1d.arange(100)
+    del t
+    assert tensor1d.pool_stats()["bytes_held"] > 0
+    before = tensor1d.pool_stats()["hits"]
+    t = tensor1d.arange(100)
+    assert tensor1d.pool_stats()["hits"] >= before + 2 # Tensor and Storage blocks
+    assert_tensor_equal(torch.arange(100, dtype=torch.float32), t)
+    del t
+    tensor1d.pool_trim()
+    assert tensor1d.pool_stats()["bytes_held"] == 0
+
+# inside an arena scope tensors come from the arena, results are promoted to the heap
+def squared_error(x, y):
+    d = x - y
+    return d * d
+
+def test_arena():
+    x, y = tensor1d.arange(1000), tensor1d.arange(1000) * 0.5
+    torch_x = torch.arange(1000, dtype=torch.float32)
+    with tensor1d.arena() as scope:
+        pool = tensor1d.pool_stats()
+        z = x * y + 1.0
+        after = tensor1d.pool_stats()
+        assert after["hits"] + after["misses"] == pool["hits"] + pool["misses"] # the pool isn't used
+        assert z.tensor.arena != tensor1d.ffi.NULL and z.tensor.storage.arena != tensor1d.ffi.NULL
+        addr = int(tensor1d.ffi.cast("uintptr_t", z[10:].contiguous().tensor.storage.data))
+        assert addr % 64 == 0
+        out = scope.promote(z)
+        del z
+        assert out.tensor.arena == tensor1d.ffi.NULL and out.tensor.storage.arena == tensor1d.ffi.NULL
+        with tensor1d.arena() as inner: # nested, with a chunk of its own for the big one
+            big = scope.promote(tensor1d.arange(2_000_000) + 1.0)
+        assert inner.escaped == 0
+        heap = scope.promote(x)
+        assert heap.tensor == x.tensor
+        del heap
+        total = scope.promote(squared_error(x, y)) # its temporaries died on return
+    assert scope.escaped == 0
+    assert_tensor_equal(torch_x * (torch_x * 0.5) + 1.0, out)
+    assert big.tolist()[-1] == 2_000_000.0 and len(big) == 2_000_000
+    assert_tensor_equal((torch_x * 0.5) * (torch_x * 0.5), total)
+
+    # escaping tensors are reported, and stay valid until they are freed
+    with pytest.warns(ResourceWarning):
+        with tensor1d.arena() as scope:
+            kept = x + 2.0
+            view = kept[::2]
+    assert scope.escaped == 3 # two Tensors and their Storage
+    assert_tensor_equal((torch_x + 2.0)[::2], view)
+    del kept, view
+    assert tensor1d.lib.tensor_arena_end() == -1 # no open scope
+
+def test_stats():
+    stats = tensor1d.stats()
+    assert set(stats["ops"]) >= {"add", "slice", "to_string", "matmul"}
+    if not stats["enabled"]:
+        assert stats["live_bytes"] == 0 and stats["ops"]["add"]["count"] == 0
+        pytest.skip("built without TENSOR1D_STATS")
+    tensor1d.stats_reset()
+    before = tensor1d.stats()
+    assert before["peak_bytes"] == before["live_bytes"]
+    t = tensor1d.arange(1000)
+    v = t[::2]
+    u = v + v # one add, not also the empty and add_out it is made of
+    str(u)
+    stats = tensor1d.stats()
+    ops = stats["ops"]
+    assert ops["arange"]["count"] == 1 and ops["slice"]["count"] == 1
+    assert ops["add"]["count"] == 1 and ops["empty"]["count"] == 0 and ops["to_string"]["count"] == 1
+    assert ops["add"]["total_ns"] > 0
+    assert stats["live_tensors"] == before["live_tensors"] + 3
+    assert stats["live_storages"] == before["live_storages"] + 2
+    assert stats["live_bytes"] == before["live_bytes"] + 6000
+    assert stats["storages_allocated"] == 2
+    del t, v, u
+    stats = tensor1d.stats()
+    assert stats["live_bytes"] == before["live_bytes"] and stats["peak_bytes"] == before["live_bytes"] + 6000
+
+# Storage data lives inline after the header, aligned to 64 bytes
+@pytest.mark.parametrize("size", [0, 1, 17, 1000, 2_000_000])
+def test_storage_alignment(size):
+    t = tensor1d.empty(size)
+    addr = int(tensor1d.ffi.cast("uintptr_t", t.tensor.storage.data))
+    assert addr % 64 == 0
+
+# tensors are reference-counted, views share (and hold a reference to) the storage
+def test_refcount():
+    t = tensor1d.arange(5)
+    assert t.tensor.ref_count == 1
+    tensor1d.lib.tensor_incref(t.tensor)
+    assert t.tensor.ref_count == 2
+    tensor1d.lib.tensor_decref(t.tensor)
+    assert t.tensor.ref_count == 1
+    s = t[1:3]
+    assert t.tensor.storage.ref_count == 2
+    del s
+    assert t.tensor.storage.ref_count == 1
+
+# with copy-on-write, a view that writes to shared storage gets its own copy
+def test_copy_on_write():
+    t = tensor1d.arange(10).set_copy_on_write()
+    assert t.is_copy_on_write() and not tensor1d.arange(3).is_copy_on_write()
+    a, b = t[2:6], t[::3]
+    assert a.is_copy_on_write()
+    a[0] = 100
+    assert t.tolist() == list(range(10)) and b.tolist() == [0, 3, 6, 9]
+    assert a.tolist() == [100, 3, 4, 5] and a.is_copy_on_write()
+    assert a.tensor.storage != t.tensor.storage and a.tensor.storage.data_size == 4
+    # a is the only user of its copy now, so further writes stay in place
+    storage = a.tensor.storage
+    a += 1
+    assert a.tensor.storage == storage and a.tolist() == [101, 4, 5, 6]
+    # writing through the base leaves the remaining view alone
+    t[3] = -1
+    assert t[3].item() == -1 and b.tolist() == [0, 3, 6, 9]
+    del b
+    storage = t.tensor.storage
+    t[0, ] = 7
+    assert t.tensor.storage == storage and t[0].item() == 7
+
+def test_copy_on_write_nd_and_dtypes():
+    m = tensor1d.arange(12).reshape(3, 4).set_copy_on_write()
+    col = m[:, 1]
+    m[1, 2] = 50
+    m[2:3, -1] = 60
+    assert m[1, 2].item() == 50 and m[2, 3].item() == 60 and col.tolist() == [1, 5, 9]
+    tensor1d.add(col, 1.0, out=col)
+    assert col.tolist() == [2, 6, 10] and m[:, 1].tolist() == [1, 5, 9]
+    m[1] = 0
+    assert m[1].tolist() == [0, 0, 0, 0] and col.tolist() == [2, 6, 10]
+    q = tensor1d.quantize(tensor1d.tensor([1.0, 2.0, 3.0]), 0.5).set_copy_on_write()
+    view = q[1:]
+    view[0] = 4.0
+    assert view.scale == 0.5 and view.tolist() == [4, 3] and q.tolist() == [1, 2, 3]
+    # read-only storage still refuses writes, copy-on-write or not
+    ro = tensor1d.from_buffer(bytes(8)).set_copy_on_write()
+    with pytest.raises(ValueError):
+        ro[0:1] += 1.0
+
+# a small view can be moved off the big storage it pins
+def test_clone_and_compact():
+    t = tensor1d.arange(1000)
+    c = t[10:20:2].clone()
+    assert c.tolist() == list(range(10, 20, 2)) and c.is_contiguous()
+    assert c.tensor.storage != t.tensor.storage and c.tensor.storage.data_size == 5
+    assert_tensor_equal(torch.arange(12, dtype=torch.float32).reshape(3, 4).T.clone(),
+                        tensor1d.clone(tensor1d.arange(12).reshape(3, 4).T))
+    view = t[100:104]
+    assert view.storage_utilization() == pytest.approx(0.004)
+    assert t.expand(3, 1000).storage_utilization() == 1.0
+    assert view.compact() and not view.compact()
+    assert view.tolist() == [100, 101, 102, 103] and view.storage_utilization() == 1.0
+    assert view.tensor.storage.data_size == 4 and t.tensor.storage.ref_count == 1
+    view[0] = -1
+    assert t[100].item() == 100
+    q = tensor1d.quantize(tensor1d.arange(8), 0.5)[2:4]
+    assert q.compact() and q.scale == 0.5 and q.tolist() == [2, 3]
+
+def test_auto_compact():
+    t = tensor1d.arange(1000).set_auto_compact(0.1)
+    small, big = t[::100], t[100:]
+    ptr = big.tensor.storage
+    del t
+    # two views left, nothing to compact yet
+    assert small.tensor.storage == ptr and small.storage_utilization() == pytest.approx(0.01)
+    del big
+    assert small.tensor.storage != ptr and small.tensor.storage.data_size == 10
+    assert small.tolist() == list(range(0, 1000, 100))
+    # a view that uses enough of its storage stays
+    t = tensor1d.arange(100).set_auto_compact(0.1)
+    v = t[50:]
+    del t
+    assert v.tensor.storage.data_size == 100
+    # views made before it was turned on are not tracked
+    t = tensor1d.arange(100)
+    v = t[:2]
+    t.set_auto_compact(0.5)
+    del t
+    assert v.tensor.storage.data_size == 100
+    # the last view is compacted right away
+    assert v.set_auto_compact(0.5).tensor.storage.data_size == 2
+    # numpy arrays keep their memory, even if the tensor moves
+    np = pytest.importorskip("numpy")
+    t = tensor1d.arange(100).set_auto_compact(0.5)
+    v = t[10:12]
+    array = v.numpy()
+    del t
+    assert v.compact() and array.tolist() == [10, 11]
+
+# multithreaded ops must give the same result as single-threaded ones
+@pytest.mark.parametrize("num_threads", [2, 3, 8])
+def test_multithreaded_addition(num_threads):
+    torch_tensor = torch.arange(5000, dtype=torch.float32)
+    tensor1d_tensor = tensor1d.arange(5000)
+    old_threads = tensor1d.get_num_threads()
+    old_threshold = tensor1d.get_parallel_threshold()
+    try:
+        tensor1d.set_num_threads(num_threads)
+        tensor1d.set_parallel_threshold(100)
+        assert tensor1d.get_num_threads() == num_threads
+        assert_tensor_equal(torch_tensor + 0.5, tensor1d_tensor + 0.5)
+        assert_tensor_equal(torch_tensor[::2] + torch_tensor[1::2], tensor1d_tensor[::2] + tensor1d_tensor[1::2])
+        torch_view = torch_tensor[1::3]
+        tensor1d_view = tensor1d_tensor[1::3]
+        torch_view += 7.0
+        tensor1d_view += 7.0
+        assert_tensor_equal(torch_tensor, tensor1d_tensor)
+    finally:
+        tensor1d.set_num_threads(old_threads)
+        tensor1d.set_parallel_threshold(old_threshold)
+
+# test reductions, on contiguous tensors and on strided views
+@pytest.mark.parametrize("size", [1, 7, 100, 1000, 5001])
+@pytest.mark.parametrize("step", [1, 3])
+def test_reductions(size, step):
+    # a permutation of 0..n-1, scaled, so the max/min are unique
+    values = [((i * 7919) % size) * 0.25 - size / 8 for i in range(size)]
+    torch_tensor = torch.tensor(values)[::step]
+    tensor1d_tensor = tensor1d.tensor(values)[::step]
+    assert tensor1d_tensor.sum() == pytest.approx(torch_tensor.sum().item(), rel=1e-5, abs=1e-3)
+    assert tensor1d_tensor.sum(kahan=True) == pytest.approx(torch_tensor.sum().item(), rel=1e-5, abs=1e-3)
+    assert tensor1d_tensor.mean() == pytest.approx(torch_tensor.mean().item(), rel=1e-5, abs=1e-5)
+    assert tensor1d_tensor.max() == torch_tensor.max().item()
+    assert tensor1d_tensor.min() == torch_tensor.min().item()
+    assert tensor1d_tensor.argmax() == torch_tensor.argmax().item()
+    assert tensor1d_tensor.argmin() == torch_tensor.argmin().item()
+    other = torch_tensor + 1.0
+    assert tensor1d_tensor.dot(tensor1d_tensor + 1.0) == pytest.approx(torch.dot(torch_tensor, other).item(), rel=1e-5, abs=1e-3)
+
+def test_reductions_edge_cases():
+    empty = tensor1d.empty(0)
+    assert empty.sum() == 0.0
+    assert math.isnan(empty.mean())
+    with pytest.raises(ValueError):
+        empty.max()
+    with pytest.raises(ValueError):
+        empty.argmin()
+    with pytest.raises(ValueError):
+        tensor1d.arange(3).dot(tensor1d.arange(4))
+    # NaN propagates through max/min, and argmax points at the first NaN
+    original_isa = tensor1d.get_kernel_isa()
+    try:
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            for prefix in [0, 13]:
+                t = tensor1d.tensor([0.0] * prefix + [1.0, float("nan"), 3.0, float("nan")] + [0.0] * 20)
+                assert math.isnan(t.max())
+                assert math.isnan(t.min())
+                assert t.argmax() == prefix + 1
+    finally:
+        tensor1d.set_kernel_isa(original_isa)
+
+# compensated summation stays accurate where a naive float sum drifts
+def test_sum_kahan_accuracy():
+    values = [0.1] * 100000 + [1e4, -1e4]
+    t = tensor1d.tensor(values)
+    exact = math.fsum(float(tensor1d.tensor([0.1]).item()) for _ in range(100000))
+    assert t.sum(kahan=True) == pytest.approx(exact, rel=1e-6)
+    assert t.sum() == pytest.approx(exact, rel=1e-4)
+
+# SIMD and multithreaded reductions agree with the scalar single-threaded ones
+def test_reductions_simd_and_threads():
+    values = [((i * 31) % 977) * 0.01 - 3.0 for i in range(20000)]
+    t = tensor1d.tensor(values)
+    original_isa = tensor1d.get_kernel_isa()
+    old_threads = tensor1d.get_num_threads()
+    old_threshold = tensor1d.get_parallel_threshold()
+    try:
+        tensor1d.set_kernel_isa("scalar")
+        tensor1d.set_num_threads(1)
+        expected = (t.sum(), t.dot(t), t.max(), t.min(), t.argmax(), t.argmin())
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            for num_threads in [1, 4]:
+                tensor1d.set_num_threads(num_threads)
+                tensor1d.set_parallel_threshold(1000)
+                assert t.sum() == pytest.approx(expected[0], rel=1e-5)
+                assert t.dot(t) == pytest.approx(expected[1], rel=1e-5)
+                assert (t.max(), t.min(), t.argmax(), t.argmin()) == expected[2:]
+    finally:
+        tensor1d.set_kernel_isa(original_isa)
+        tensor1d.set_num_threads(old_threads)
+        tensor1d.set_parallel_threshold(old_threshold)
+
+def scan_sort_values(n):
+    # with repeats, so that sorting has ties
+    return [((i * 7919) % 1009) * 0.5 - 200.0 for i in range(n)]
+
+@pytest.mark.parametrize("dtype", ["float32", "float64", "int32"])
+def test_scans(dtype):
+    values = scan_sort_values(300) if dtype != "int32" else [(i * 37) % 101 - 50 for i in range(300)]
+    torch_t = torch.tensor(values, dtype=getattr(torch, dtype))
+    t = tensor1d.tensor(values, dtype=dtype)
+    for torch_view, view in [(torch_t, t), (torch_t[5:290:3], t[5:290:3]), (torch_t.flip(0), t[::-1]),
+                             (torch_t.reshape(15, 20).T, t.reshape(15, 20).T)]:
+        cumsum = view.cumsum()
+        assert cumsum.dtype == dtype and cumsum.tolist() == torch_view.flatten().cumsum(0).tolist()
+        assert_tensor_equal(torch_view.flatten().cummax(0).values, view.cummax())
+    assert tensor1d.empty(0).cumsum().tolist() == []
+    assert tensor1d.cummax(tensor1d.tensor([1.0, math.nan, 5.0])).tolist()[0] == 1.0
+    assert all(math.isnan(x) for x in tensor1d.tensor([1.0, math.nan, 5.0]).cummax().tolist()[1:])
+    q = tensor1d.tensor([0.5, -1.0, 2.0]).quantize()
+    assert q.cumsum().dtype == "float32"
+
+def test_sort_argsort():
+    values = scan_sort_values(1000) + [math.nan, -0.0, 0.0, math.inf, -math.inf]
+    for dtype in ["float32", "float64", "float16", "int32"]:
+        data = values if dtype.startswith("float") else [int(x) for x in values if math.isfinite(x)]
+        torch_t = torch.tensor(data, dtype=getattr(torch, dtype))
+        t = tensor1d.tensor(data, dtype=dtype)
+        for torch_view, view in [(torch_t, t), (torch_t[::7], t[::7]), (torch_t[:40], t[:40]), (torch_t.flip(0), t[::-1])]:
+            for descending in [False, True]:
+                expected = torch_view.sort(descending=descending, stable=True)
+                sorted_values, indices = view.sort(descending=descending)
+                assert sorted_values.dtype == dtype and indices.dtype == "int32"
+                assert str(sorted_values.tolist()) == str(expected.values.tolist()) # NaN == NaN
+                assert indices.tolist() == expected.indices.tolist()
+                assert tensor1d.argsort(view, descending).tolist() == expected.indices.tolist()
+    m = tensor1d.tensor([[3.0, 1.0], [2.0, 0.0]])
+    assert m.T.sort()[0].tolist() == [0.0, 1.0, 2.0, 3.0] and m.T.argsort().tolist() == [3, 2, 1, 0]
+    assert tensor1d.empty(0).sort()[0].tolist() == []
+
+def test_topk():
+    values = scan_sort_values(1000) + [math.nan]
+    torch_t, t = torch.tensor(values), tensor1d.tensor(values)
+    for torch_view, view in [(torch_t, t), (torch_t[::3], t[::3])]:
+        for k in [0, 1, 5, 100, len(view)]: # the heap, and a sort for the bigger ones
+            for largest in [True, False]:
+                expected = torch_view.sort(descending=largest, stable=True) # ties to the smaller index
+                top_values, indices = view.topk(k, largest=largest)
+                assert str(top_values.tolist()) == str(expected.values.tolist()[:k])
+                assert indices.tolist() == expected.indices.tolist()[:k]
+    ti = tensor1d.tensor([5, 1, 9, 9, 3], dtype="int32")
+    assert tensor1d.topk(ti, 2)[0].tolist() == [9, 9] and tensor1d.topk(ti, 2)[1].tolist() == [2, 3]
+    with pytest.raises(ValueError):
+        t.topk(len(t) + 1)
+
+# the parallel scans, sort and top-k give the same results as the serial ones
+def test_scan_sort_threads():
+    values = scan_sort_values(50000)
+    t = tensor1d.tensor(values)[::-2]
+    old_threads = tensor1d.get_num_threads()
+    old_threshold = tensor1d.get_parallel_threshold()
+    try:
+        tensor1d.set_num_threads(1)
+        expected = (t.cumsum().tolist(), t.cummax().tolist(), t.argsort().tolist(), t.topk(50)[1].tolist(), t.topk(0)[1].tolist())
+        tensor1d.set_num_threads(4)
+        tensor1d.set_parallel_threshold(1000)
+        result = (t.cumsum().tolist(), t.cummax().tolist(), t.argsort().tolist(), t.topk(50)[1].tolist(), t.topk(0)[1].tolist())
+        assert result == expected
+        assert t.cumsum().tolist() == torch.tensor(values).flip(0)[::2].cumsum(0).tolist()
+    finally:
+        tensor1d.set_num_threads(old_threads)
+        tensor1d.set_parallel_threshold(old_threshold)
+
+# large storages placed on NUMA nodes or backed by huge pages (mapped, instead
+# of malloc'ed) give the same results, with the chunks pinned to threads too
+def test_numa_and_huge_pages():
+    n = 1 << 21 # 8MB of floats, too big for the pool
+    def compute():
+        a = tensor1d.arange(n)
+        b = a + 0.5
+        return (b.sum(), a.dot(b), b.argmax(), b.cumsum()[::4096].tolist(), b[::1000].tolist())
+    old_threads = tensor1d.get_num_threads()
+    try:
+        tensor1d.set_num_threads(3)
+        expected = compute()
+        big = tensor1d.empty(n)
+        assert big.tensor.storage.mapped_bytes == 0
+        policies = ["default"]
+        if tensor1d.numa_num_nodes() > 0:
+            policies += ["interleave", "first_touch"]
+        else:
+            with pytest.raises(ValueError):
+                tensor1d.set_numa_policy("interleave")
+        for policy in policies:
+            for huge_pages in ["off", "thp", "hugetlb"]:
+                tensor1d.set_numa_policy(policy)
+                tensor1d.set_huge_pages(huge_pages)
+                assert (tensor1d.get_numa_policy(), tensor1d.get_huge_pages()) == (policy, huge_pages)
+                assert compute() == expected
+                big = tensor1d.empty(n)
+                storage = big.tensor.storage
+                if policy == "default" and huge_pages == "off":
+                    assert storage.mapped_bytes == 0
+                else:
+                    assert storage.mapped_bytes >= 4 * n
+                if huge_pages != "off":
+                    # hugetlb falls back to transparent huge pages, which are aligned too
+                    assert int(tensor1d.ffi.cast("uintptr_t", storage)) % (2 << 20) == 0
+                # the pool still serves the smaller ones
+                small = tensor1d.empty(1000)
+                assert small.tensor.storage.mapped_bytes == 0
+        with pytest.raises(ValueError):
+            tensor1d.set_numa_policy("local")
+        with pytest.raises(ValueError):
+            tensor1d.set_huge_pages("1gb")
+    finally:
+        tensor1d.set_numa_policy("default")
+        tensor1d.set_huge_pages("off")
+        tensor1d.set_num_threads(old_threads)
+
+# lazy mode builds an expression and evaluates it in one fused pass
+def test_lazy_expression():
+    torch_a = torch.arange(1000, dtype=torch.float32)
+    torch_b = torch_a[::2] + torch_a[1::2]
+    a = tensor1d.arange(1000)
+    b = a[::2] + a[1::2]
+    with tensor1d.lazy():
+        assert tensor1d.get_lazy()
+        x = a[:500] + b
+        y = x + 1.0
+        z = y + a[500:] + tensor1d.tensor([0.5])
+    assert not tensor1d.get_lazy()
+    # nothing has been computed yet, there is no storage behind the results
+    assert z.is_lazy() and z.tensor.storage == tensor1d.ffi.NULL
+    torch_z = torch_a[:500] + torch_b + 1.0 + torch_a[500:] + torch.tensor([0.5])
+    assert_tensor_equal(torch_z, z)
+    # z was evaluated straight from the inputs, without materializing x or y
+    assert not z.is_lazy()
+    assert x.is_lazy() and y.is_lazy()
+    assert y[3].item() == (torch_a[:500] + torch_b + 1.0)[3].item()
+    assert y.sum() == pytest.approx((torch_a[:500] + torch_b + 1.0).sum().item())
+    assert str(x.eval()) == str(tensor1d.tensor((torch_a[:500] + torch_b).tolist()))
+
+def test_lazy_expression_edge_cases():
+    a = tensor1d.arange(10)
+    with tensor1d.lazy():
+        # a deep chain is cut into pieces, but gives the same result
+        t = a
+        for _ in range(100):
+            t = t + 1.0
+        # broadcasting against a lazy 1-element tensor
+        u = (tensor1d.tensor([1.0]) + 2.0) + a
+        v = a + a
+        w = v + v
+        with pytest.raises(ValueError):
+            a + tensor1d.arange(3)
+    r = torch.arange(10, dtype=torch.float32)
+    assert_tensor_equal(r + 100.0, t)
+    assert_tensor_equal(r + 3.0, u)
+    assert_tensor_equal(r + r + r + r, w)
+    # in-place ops on a lazy tensor evaluate it first
+    v += 1.0
+    assert_tensor_equal(r + r + 1.0, v)
+
+# zero-copy wrapping of buffer-protocol objects
+def test_from_buffer():
+    buf = array.array("f", [float(i) for i in range(20)])
+    t = tensor1d.from_buffer(buf)
+    assert not t.tensor.storage.owns_data
+    assert_tensor_equal(torch.arange(20, dtype=torch.float32), t)
+    # writes go both ways, there is no copy
+    t[3] = 100.0
+    assert buf[3] == 100.0
+    buf[4] = 200.0
+    assert t[4].item() == 200.0
+    # views and results keep working after the tensor (and buf) go away
+    view = t[::5]
+    del t, buf
+    assert view.tolist() == [0.0, 5.0, 10.0, 15.0]
+    assert (view + 1.0).tolist() == [1.0, 6.0, 11.0, 16.0]
+
+def test_from_buffer_keeps_owner_alive():
+    buf = array.array("f", [1.0, 2.0, 3.0])
+    t = tensor1d.from_buffer(buf)
+    assert len(tensor1d._external) >= 1
+    key_count = len(tensor1d._external)
+    del buf
+    assert t.tolist() == [1.0, 2.0, 3.0]
+    del t
+    assert len(tensor1d._external) == key_count - 1
+
+def test_numpy_interop():
+    np = pytest.importorskip("numpy")
+    a = np.arange(20, dtype=np.float32)
+    t = tensor1d.from_numpy(a)
+    t[0] = 42.0
+    assert a[0] == 42.0
+    s = tensor1d.from_numpy(a[1::3])
+    assert s.tolist() == a[1::3].tolist()
+    # and back: the array is a view of the tensor
+    u = tensor1d.arange(10)[::2]
+    v = u.numpy()
+    assert v.tolist() == u.tolist()
+    v[1] = -1.0
+    assert u[1].item() == -1.0
+    assert np.asarray(u).tolist() == u.tolist()
+
+# memory-mapped files
+def test_mmap(tmp_path):
+    path = tmp_path / "data.bin"
+    values = array.array("f", [float(i) for i in range(5000)])
+    path.write_bytes(values.tobytes())
+    expected = torch.arange(5000, dtype=torch.float32)
+    t = tensor1d.mmap(path)
+    assert t.is_readonly() and not t.tensor.storage.owns_data
+    assert_tensor_equal(expected, t)
+    # views (on unaligned offsets too) see the file, and can be advised
+    assert_tensor_equal(expected[1003:4000:7], t[1003:4000:7].advise("sequential"))
+    assert_tensor_equal(expected[1003:1010], tensor1d.mmap(path, offset=1003 * 4, size=7).advise("willneed"))
+    assert_tensor_equal(expected + 1.0, t + 1.0)
+    assert t.sum() == expected.sum().item()
+    # read-only: all writes are rejected, and the file is unchanged
+    with pytest.raises(ValueError):
+        t[0] = 1.0
+    with pytest.raises(ValueError):
+        t += 1.0
+    with pytest.raises(ValueError):
+        tensor1d.add(t, 1.0, out=t[::2])
+    # copy-on-write: writes stay in memory
+    c = tensor1d.mmap(path, mode="c")
+    c[0] = -1.0
+    c += 1.0
+    assert c[0].item() == 0.0 and c[1].item() == 2.0
+    assert path.read_bytes() == values.tobytes()
+    assert tensor1d.mmap(path)[0].item() == 0.0
+    # a view keeps the mapping alive
+    view = tensor1d.mmap(path)[4990:]
+    assert view.tolist() == [float(i) for i in range(4990, 5000)]
+
+def test_mmap_errors(tmp_path):
+    path = tmp_path / "data.bin"
+    path.write_bytes(array.array("f", [1.0, 2.0, 3.0]).tobytes())
+    assert len(tensor1d.mmap(path, offset=12)) == 0
+    with pytest.raises(OSError):
+        tensor1d.mmap(tmp_path / "missing.bin")
+    with pytest.raises(OSError):
+        tensor1d.mmap(path, size=4)
+    with pytest.raises(OSError):
+        tensor1d.mmap(path, offset=2)
+    with pytest.raises(ValueError):
+        tensor1d.mmap(path, mode="w")
+    with pytest.raises(ValueError):
+        tensor1d.mmap(path).advise("forever")
+
+def test_from_readonly_buffer():
+    t = tensor1d.from_buffer(array.array("f", [1.0, 2.0]).tobytes())
+    assert t.is_readonly() and t.tolist() == [1.0, 2.0]
+    with pytest.raises(ValueError):
+        t[0] = 0.0
+    assert (t + 1.0).tolist() == [2.0, 3.0] and not (t + 1.0).is_readonly()
+
+# .t1d serialization
+@pytest.mark.parametrize("size", [0, 1, 1000, 70000])
+@pytest.mark.parametrize("step", [1, 3])
+def test_save_load(tmp_path, size, step):
+    path = tmp_path / "t.t1d"
+    t = tensor1d.tensor([i * 0.37 - 5.0 for i in range(size)])[::step]
+    t.save(path)
+    assert path.stat().st_size == 64 + 4 * len(t) # only the logical elements
+    loaded = tensor1d.load(path)
+    assert loaded.tolist() == t.tolist() # bit exact
+    for mode in ["r", "c"]:
+        assert tensor1d.load(path, mmap_mode=mode).tolist() == t.tolist()
+
+def test_save_load_errors(tmp_path):
+    path = tmp_path / "t.t1d"
+    tensor1d.arange(100).save(path)
+    data = bytearray(path.read_bytes())
+    data[64 + 40] ^= 1 # flip one bit of the data
+    (tmp_path / "corrupt.t1d").write_bytes(bytes(data))
+    (tmp_path / "short.t1d").write_bytes(bytes(data[:-4]))
+    (tmp_path / "junk.t1d").write_bytes(b"hello" * 20)
+    for name in ["corrupt.t1d", "short.t1d", "junk.t1d", "missing.t1d"]:
+        with pytest.raises(OSError):
+            tensor1d.load(tmp_path / name)
+    # mapping only checks the header
+    assert tensor1d.load(tmp_path / "corrupt.t1d", mmap_mode="r")[10].item() != 10.0
+    with pytest.raises(OSError):
+        tensor1d.load(tmp_path / "short.t1d", mmap_mode="r")
+
+def test_streaming_writer_reader(tmp_path):
+    path = tmp_path / "stream.t1d"
+    expected = []
+    with tensor1d.Writer(path) as w:
+        for k in range(10):
+            piece = tensor1d.arange(1000 + k)[::k + 1] + float(k)
+            w.write(piece)
+            expected += piece.tolist()
+    assert tensor1d.load(path).tolist() == expected
+    with tensor1d.Reader(path) as r:
+        assert r.size == len(expected)
+        got = []
+        for chunk in r.chunks(777):
+            assert len(chunk) <= 777
+            got += chunk.tolist()
+    assert got == expected
+    # reading into a strided view
+    with tensor1d.Reader(path) as r:
+        out = tensor1d.empty(2 * len(expected))
+        assert r.read_into(out[::2]) == len(expected)
+        assert out[::2].tolist() == expected
+        assert r.read_into(out) == 0
+
+# async ops run in the background and resolve futures, also awaitable ones
+def test_async_ops(tmp_path):
+    torch_a, torch_b = torch.arange(300_000, dtype=torch.float32), torch.ones(300_000)
+    a, b = tensor1d.arange(300_000), tensor1d.empty(300_000).fill_(1)
+    futures = [tensor1d.add_async(a, b), tensor1d.add_async(a, -2.5), tensor1d.sum_async(b)]
+    # the inputs stay alive until the ops are done
+    del a, b
+    assert_tensor_equal(torch_a + torch_b, futures[0].result())
+    assert_tensor_equal(torch_a + -2.5, futures[1].result())
+    assert futures[2].result() == 300_000.0 and all(f.done() for f in futures)
+    torch_m = torch.arange(12, dtype=torch.float32).reshape(3, 4)
+    m = tensor1d.arange(12).reshape(3, 4)
+    assert_tensor_equal(torch.matmul(torch_m, torch_m.t()), tensor1d.matmul_async(m, m.T).result())
+    with pytest.raises(ValueError):
+        tensor1d.add_async(m, tensor1d.arange(3)).result()
+    with pytest.raises(ValueError):
+        tensor1d.load_async(tmp_path / "missing.t1d").result()
+    # the next file loads while the current one is computed on
+    for i in range(3):
+        tensor1d.arange(1000 * (i + 1)).save(tmp_path / f"{i}.t1d")
+    async def pipeline():
+        total = 0.0
+        next_load = tensor1d.load_async(tmp_path / "0.t1d", mmap_mode="r")
+        for i in range(3):
+            t = await next_load
+            if i < 2:
+                next_load = tensor1d.load_async(tmp_path / f"{i + 1}.t1d")
+            total += await tensor1d.dot_async(t, tensor1d.empty(len(t)).fill_(1))
+        return total
+    import asyncio
+    assert asyncio.run(pipeline()) == sum(n * (n - 1) / 2 for n in (1000, 2000, 3000))
+
+# streams hand out fixed-size chunks of two reused buffers, reducers carry
+# their state across the chunks
+@pytest.mark.parametrize("source", ["read", "mmap", "iterable"])
+def test_streams(tmp_path, source):
+    values = scan_sort_values(10_000)
+    torch_t = torch.tensor(values, dtype=torch.float64)
+    path = tmp_path / "stream.t1d"
+    tensor1d.tensor(values, dtype="float64").save(path)
+    if source == "iterable":
+        # tensors, a list and single numbers, regrouped into chunks
+        pieces = [tensor1d.tensor(values[i:i + 300], dtype="float64") for i in range(0, 6000, 300)]
+        stream = tensor1d.stream(pieces + [values[6000:8000]] + values[8000:], 1024, dtype="float64")
+    else:
+        stream = tensor1d.stream(path, 1024, mmap=source == "mmap")
+    assert stream.size == (None if source == "iterable" else len(values))
+    reducers = {op: tensor1d.Reducer(op) for op in ["sum", "mean", "max", "min", "argmax", "argmin", "cumsum", "cummax"]}
+    scans = {"cumsum": [], "cummax": []}
+    storages = set()
+    with stream:
+        for chunk in stream:
+            assert chunk.dtype == "float64" and len(chunk) == min(1024, len(values) - reducers["sum"].count)
+            storages.add(int(tensor1d.ffi.cast("uintptr_t", chunk.tensor.storage)))
+            for op, r in reducers.items():
+                if op in scans:
+                    scans[op] += r.scan(chunk).tolist()
+                else:
+                    r.update(chunk)
+    assert len(storages) == (1 if source == "mmap" else 2)
+    assert math.isclose(reducers["sum"].value, torch_t.sum().item(), rel_tol=1e-12)
+    assert math.isclose(reducers["mean"].value, torch_t.mean().item(), rel_tol=1e-12)
+    for op in ["max", "min", "argmax", "argmin"]:
+        assert reducers[op].value == getattr(torch_t, op)().item()
+    assert all(math.isclose(x, y, rel_tol=1e-12, abs_tol=1e-9) for x, y in zip(scans["cumsum"], torch_t.cumsum(0).tolist()))
+    assert scans["cummax"] == torch_t.cummax(0).values.tolist()
+
+def test_stream_edge_cases(tmp_path):
+    # an int8 file dequantized on the fly, and a scan into a reused out
+    q = tensor1d.tensor([0.5, -1.0, 2.0, 1.5, -0.25] * 100).quantize()
+    q.save(tmp_path / "q.t1d")
+    r = tensor1d.Reducer("cumsum")
+    out = tensor1d.empty(64)
+    got = []
+    for chunk in tensor1d.stream(tmp_path / "q.t1d", 64, dtype="float32"):
+        assert chunk.dtype == "float32"
+        got += r.scan(chunk, out=out[:len(chunk)]).tolist()
+    assert_tensor_equal(torch.tensor(q.to("float32").tolist()).cumsum(0), tensor1d.tensor(got))
+    # NaN wins argmax, from its first occurrence on
+    r = tensor1d.Reducer("argmax")
+    for chunk in tensor1d.stream([[1.0, 5.0], [math.nan, 7.0], [math.nan]], 2):
+        r.update(chunk)
+    assert r.value == 2
+    # nothing streamed
+    empty = {op: tensor1d.Reducer(op) for op in ["sum", "mean", "max", "argmax"]}
+    for chunk in tensor1d.stream([], 16):
+        empty["sum"].update(chunk)
+    assert empty["sum"].value == 0.0 and math.isnan(empty["mean"].value)
+    assert math.isnan(empty["max"].value) and empty["argmax"].value == -1
+    # errors: of the file, of the iterable, and closing before the end
+    with pytest.raises(OSError):
+        tensor1d.stream(tmp_path / "missing.t1d")
+    data = bytearray((tmp_path / "q.t1d").read_bytes())
+    data[-1] ^= 1
+    (tmp_path / "corrupt.t1d").write_bytes(bytes(data))
+    with pytest.raises(OSError):
+        for chunk in tensor1d.stream(tmp_path / "corrupt.t1d", 64):
+            pass
+    def failing():
+        yield [1.0, 2.0]
+        raise RuntimeError("source failed")
+    with pytest.raises(RuntimeError):
+        list(tensor1d.stream(failing(), 1))
+    with pytest.raises(ValueError):
+        tensor1d.Reducer("sum").scan(tensor1d.arange(3))
+    with tensor1d.stream(iter(range(10_000)), 100) as s:
+        assert next(s).tolist() == [float(i) for i in range(100)]
+    # a stream dropped before its end is collected, and closes its source
+    closed = []
+    def numbers():
+        try:
+            yield from range(10_000)
+        finally:
+            closed.append(True)
+    for chunk in tensor1d.stream(numbers(), 100):
+        break
+    del chunk
+    gc.collect()
+    assert len(tensor1d._streams) == 0 and closed == [True]
+
+# printing
+def test_float_formatting():
+    values = [0.0, -0.0, 0.05, 0.25, 0.35, -0.04, -0.05, 1.5, 2.5, 123456.75, -9.95, 1e10, 3.4e38, -3.4e38,
+              1e-30, float("inf"), float("-inf"), float("nan")]
+    values += [math.sin(i) * 10 ** (i % 12) for i in range(2000)]
+    t = tensor1d.tensor(values)
+    # exactly what "%.1f" prints for the float32 value
+    expected = ["%.1f" % v for v in t.tolist()]
+    assert t.to_string(summarize=False) == "[" + ", ".join(expected) + "]"
+
+def test_print_summarization():
+    t = tensor1d.arange(5000)
+    assert str(t) == "[0.0, 1.0, 2.0, ..., 4997.0, 4998.0, 4999.0]"
+    assert str(t[:1000]) == str(tensor1d.tensor(list(range(1000))))
+    assert str(t[::2]) == "[0.0, 2.0, 4.0, ..., 4994.0, 4996.0, 4998.0]"
+    assert t.to_string(summarize=False) == "[" + ", ".join("%.1f" % i for i in range(5000)) + "]"
+    old = tensor1d.get_printoptions()
+    try:
+        tensor1d.set_printoptions(threshold=4, edgeitems=1)
+        assert str(tensor1d.arange(4)) == "[0.0, 1.0, 2.0, 3.0]"
+        assert str(tensor1d.arange(5)) == "[0.0, ..., 4.0]"
+        # no edge items: nothing but the ellipsis, and nothing past the end of the view
+        tensor1d.set_printoptions(threshold=2, edgeitems=0)
+        assert str(tensor1d.arange(10)[:5]) == "[...]"
+        assert str(tensor1d.arange(12).reshape(3, 4)) == "[...]"
+        assert str(tensor1d.arange(2)) == "[0.0, 1.0]"
+    finally:
+        tensor1d.set_printoptions(**old)
+    assert str(tensor1d.empty(0)) == "[]"
+
+def test_print_after_mutation():
+    t = tensor1d.arange(4)
+    view = t[1:3]
+    assert str(t) == "[0.0, 1.0, 2.0, 3.0]" and str(view) == "[1.0, 2.0]"
+    t[1] = 10.0
+    view += 1.0
+    assert str(t) == "[0.0, 11.0, 3.0, 3.0]" and str(view) == "[11.0, 3.0]"
+
+def test_write_streams(tmp_path):
+    t = tensor1d.arange(3000)[::3]
+    path = tmp_path / "t.txt"
+    with open(path, "w") as f:
+        t.write(f, summarize=False)
+    assert path.read_text() == t.to_string(summarize=False)
+    assert len(path.read_text()) > 4096 # more than one piece
+
+# dtypes
+DTYPES = ["float32", "float64", "float16", "bfloat16", "int32"]
+
+@pytest.mark.parametrize("dtype", DTYPES)
+def test_dtype_roundtrip(dtype):
+    values = [0.0, -1.5, 2.75, 1e-3, 1 / 3, -123.456, 65504.0, 1e5, 3.0001, -0.0]
+    if dtype == "int32":
+        values = [0, -1, 2, 7, -123, 65504, 100000, 2**31 - 1, -2**31]
+    torch_tensor = torch.tensor(values, dtype=getattr(torch, dtype))
+    t = tensor1d.tensor(values, dtype=dtype)
+    assert t.dtype == dtype and len(t) == len(values)
+    assert_tensor_equal(torch_tensor, t)
+    assert t[::2].tolist() == torch_tensor[::2].tolist()
+    assert t[3].item() == torch_tensor[3].item()
+    t[1] = 5
+    assert t[1].item() == 5
+    # a conversion to float64 and back is exact
+    assert t.to("float64").to(dtype).tolist() == t.tolist()
+    assert tensor1d.empty(4, dtype=dtype).dtype == dtype
+    with pytest.raises(ValueError):
+        tensor1d.empty(4, dtype="complex64")
+
+def test_dtype_rounding():
+    # float16 and bfloat16 round to nearest, ties to even, and overflow to inf
+    values = [1 + 2**-11, 1 + 3 * 2**-11, 65520.0, 1 + 2**-8, 1 + 3 * 2**-8, 3.4e38, float("nan")]
+    for dtype in ["float16", "bfloat16"]:
+        got = tensor1d.tensor(values, dtype=dtype).to("float64").tolist()
+        expected = torch.tensor(values, dtype=getattr(torch, dtype)).tolist()
+        assert got[:-1] == expected[:-1] and math.isnan(got[-1])
+    # int32 truncates toward zero, like a C cast
+    assert tensor1d.tensor([1.9, -1.9, 2.5], dtype="float32").to("int32").tolist() == [1, -1, 2]
+
+@pytest.mark.parametrize("dtype1", DTYPES)
+@pytest.mark.parametrize("dtype2", DTYPES)
+def test_dtype_promotion(dtype1, dtype2):
+    expected = str(torch.promote_types(getattr(torch, dtype1), getattr(torch, dtype2))).replace("torch.", "")
+    assert tensor1d.promote_types(dtype1, dtype2) == expected
+    values1, values2 = [1.0, 2.5, -3.0, 1000.125], [0.1, 7.0, 0.5, -2.0]
+    if dtype1 == "int32":
+        values1 = [1, 2, -3, 1000]
+    if dtype2 == "int32":
+        values2 = [0, 7, 1, -2]
+    a, b = tensor1d.tensor(values1, dtype=dtype1), tensor1d.tensor(values2, dtype=dtype2)
+    torch_a, torch_b = torch.tensor(values1, dtype=getattr(torch, dtype1)), torch.tensor(values2, dtype=getattr(torch, dtype2))
+    result = a + b
+    assert result.dtype == expected
+    assert_tensor_equal(torch_a + torch_b, result)
+    a += b
+    assert a.dtype == dtype1
+    assert_tensor_equal((torch_a + torch_b).to(getattr(torch, dtype1)), a)
+
+def test_dtype_scalar_add():
+    t = tensor1d.tensor([1, 2, 3], dtype="int32")
+    assert (t + 1.5).dtype == "float32" and (t + 1.5).tolist() == [2.5, 3.5, 4.5]
+    t = tensor1d.tensor([1.0, 2.0], dtype="float64")
+    assert (t + 0.1).dtype == "float64" and (t + 0.1).tolist() == [1.1, 2.1]
+    t = tensor1d.tensor([1.0, 2.0], dtype="float16")
+    assert (t + 0.1).tolist() == torch.tensor([1.0, 2.0], dtype=torch.float16).__add__(0.1).tolist()
+
+def test_dtype_reductions():
+    values = [math.sin(i) * 1000 for i in range(10000)]
+    t = tensor1d.tensor(values, dtype="float64")
+    assert t.sum() == pytest.approx(math.fsum(values), rel=1e-6)
+    assert t.mean() == pytest.approx(math.fsum(values) / len(values), rel=1e-6)
+    assert t.max() == pytest.approx(max(values)) and t.argmax() == values.index(max(values))
+    assert t.dot(t) == pytest.approx(math.fsum(v * v for v in values), rel=1e-6)
+    ints = tensor1d.tensor(list(range(-500, 1500)), dtype="int32")
+    assert ints.sum() == sum(range(-500, 1500))
+    assert (ints.min(), ints.argmin(), ints.max()) == (-500, 0, 1499)
+    halves = tensor1d.tensor(values[:100], dtype="float16")
+    assert halves.sum() == pytest.approx(math.fsum(halves.tolist()), rel=1e-5)
+    assert tensor1d.empty(0, dtype="int32").sum() == 0
+
+def test_int8_quantize():
+    values = [math.sin(i) * 5 for i in range(1000)]
+    t = tensor1d.tensor(values)
+    q = t.quantize()
+    assert q.dtype == "int8"
+    assert q.scale == pytest.approx(max(abs(v) for v in t.tolist()) / 127)
+    for x, y in zip(t.tolist(), q.tolist()):
+        assert abs(x - y) <= q.scale / 2 + 1e-6
+    # arithmetic on int8 dequantizes to float32
+    assert (q + 1.0).dtype == "float32"
+    assert (q + t).tolist() == (q.to("float32") + t).tolist()
+    assert tensor1d.quantize(t, 0.5).scale == 0.5
+    # out of range values saturate
+    assert tensor1d.quantize(tensor1d.tensor([1000.0, -1000.0]), 1.0).tolist() == [127, -128]
+    # with scale 1, int8 holds plain small integers
+    assert tensor1d.tensor([1, -2, 3], dtype="int8").tolist() == [1, -2, 3]
+
+@pytest.mark.parametrize("dtype", DTYPES + ["int8"])
+def test_dtype_save_load(dtype, tmp_path):
+    t = tensor1d.tensor([math.cos(i) * 100 for i in range(3000)]).to(dtype) if dtype != "int8" else \
+        tensor1d.quantize(tensor1d.tensor([math.cos(i) * 100 for i in range(3000)]))
+    path = tmp_path / "t.t1d"
+    t[::3].save(path)
+    for loaded in [tensor1d.load(path), tensor1d.load(path, mmap_mode="r")]:
+        assert loaded.dtype == dtype and loaded.scale == t.scale
+        assert loaded.tolist() == t[::3].tolist()
+    with tensor1d.Reader(path) as r:
+        assert r.dtype == dtype
+        got = []
+        for chunk in r.chunks(100, dtype="float64"):
+            got += chunk.tolist()
+    assert got == t[::3].to("float64").tolist()
+
+def test_dtype_printing():
+    assert str(tensor1d.tensor([1, -2, 3], dtype="int32")) == "[1, -2, 3]"
+    assert str(tensor1d.tensor([1.5, -2.25], dtype="float64")) == "[1.5, -2.2]"
+    assert str(tensor1d.tensor([1.5, 0.1], dtype="float16")) == "[1.5, 0.1]"
+
+# N-d views
+def test_nd_views():
+    torch_tensor = torch.arange(24, dtype=torch.float32).reshape(2, 3, 4)
+    t = tensor1d.arange(24).reshape(2, 3, 4)
+    assert t.shape == tuple(torch_tensor.shape) and t.ndim == 3 and len(t) == 2
+    assert t.stride() == torch_tensor.stride() and t.is_contiguous()
+    for torch_view, view in [(torch_tensor.transpose(0, 2), t.transpose(0, 2)),
+                             (torch_tensor.permute(1, 2, 0), t.permute(1, 2, 0)),
+                             (torch_tensor.reshape(4, -1), t.reshape(4, -1)),
+                             (torch_tensor.unsqueeze(1), t.unsqueeze(1)),
+                             (torch_tensor[1].T, t[1].T),
+                             (torch_tensor[0, 1].expand(3, 4), t[0, 1].expand(3, 4))]:
+        assert view.shape == tuple(torch_view.shape) and view.stride() == torch_view.stride()
+        assert_tensor_equal(torch_view, view)
+    # views share the storage
+    view = t.transpose(0, 1)
+    t[1, 2, 3] = 100.0
+    assert view[2, 1, 3].item() == 100.0
+
+@pytest.mark.parametrize("key", [1, -1, (0, 2), (1, 2, 3), (slice(None), 1), (slice(1, None), slice(None, None, 2)),
+                                 (slice(None), slice(None), slice(1, 3)), (0, slice(None), -1)])
+def test_nd_indexing(key):
+    torch_tensor = torch.arange(24, dtype=torch.float32).reshape(2, 3, 4)
+    t = tensor1d.arange(24).reshape(2, 3, 4)
+    assert_tensor_equal(torch_tensor[key], t[key])
+    assert_tensor_equal(torch_tensor.transpose(0, 2)[key[::-1] if isinstance(key, tuple) else key],
+                        t.transpose(0, 2)[key[::-1] if isinstance(key, tuple) else key])
+
+def test_nd_contiguous_and_reshape_copies():
+    t = tensor1d.arange(6).reshape(2, 3)
+    assert t.contiguous().stride() == (3, 1)
+    t.contiguous()[0, 0] = 10.0 # no copy needed, so shares the storage
+    assert t[0, 0].item() == 10.0
+    transposed = t.T
+    assert not transposed.is_contiguous() and transposed.contiguous().is_contiguous()
+    assert transposed.contiguous().tolist() == transposed.tolist()
+    # a transposed view can't be flattened in place, so reshape copies
+    flat = transposed.reshape(6)
+    assert flat.tolist() == [10.0, 3.0, 1.0, 4.0, 2.0, 5.0]
+    flat[0] = -1.0
+    assert t[0, 0].item() == 10.0
+
+def test_nd_add():
+    torch_a = torch.arange(12, dtype=torch.float32).reshape(3, 4)
+    a = tensor1d.arange(12).reshape(3, 4)
+    assert_tensor_equal(torch_a.T + torch_a.T, a.T + a.T)
+    assert_tensor_equal(torch_a.T + 1.5, a.T + 1.5)
+    assert_tensor_equal(torch_a[:, ::2] + torch_a[:, 1::2], a[:, ::2] + a[:, 1::2])
+    out = tensor1d.empty(4, 3)
+    torch_out = torch.empty(4, 3)
+    torch.add(torch_a.T, torch_a.T, out=torch_out)
+    tensor1d.add(a.T, a.T, out=out)
+    assert_tensor_equal(torch_out, out)
+    # into a non-contiguous view of another tensor
+    b = tensor1d.empty(3, 4)
+    a.T.add(1.0, out=b.T)
+    assert_tensor_equal(torch_a + 1.0, b)
+    view = a.T
+    view += 1.0
+    assert_tensor_equal(torch_a + 1.0, a)
+    with tensor1d.lazy():
+        c = a.T + a.T + 1.0
+    assert_tensor_equal((torch_a + 1.0).T * 2 + 1.0, c)
+
+def test_nd_reductions():
+    values = [math.sin(i) for i in range(1200)]
+    torch_tensor = torch.tensor(values).reshape(30, 40).T[::2, 1:]
+    t = tensor1d.tensor(values).reshape(30, 40).T[::2, 1:]
+    assert t.sum() == pytest.approx(torch_tensor.sum().item(), rel=1e-5)
+    assert t.max() == torch_tensor.max().item() and t.argmax() == torch_tensor.argmax().item()
+    assert t.min() == torch_tensor.min().item() and t.argmin() == torch_tensor.argmin().item()
+    assert t.dot(t) == pytest.approx(torch_tensor.reshape(-1).dot(torch_tensor.reshape(-1)).item(), rel=1e-5)
+
+def test_nd_printing_and_save(tmp_path):
+    t = tensor1d.arange(6).reshape(2, 3)
+    assert str(t) == "[[0.0, 1.0, 2.0], [3.0, 4.0, 5.0]]"
+    assert str(t.T) == "[[0.0, 3.0], [1.0, 4.0], [2.0, 5.0]]"
+    assert str(t[1, 2]) == "5.0"
+    old = tensor1d.get_printoptions()
+    try:
+        tensor1d.set_printoptions(threshold=4, edgeitems=1)
+        assert str(tensor1d.arange(12).reshape(3, 4)) == "[[0.0, ..., 3.0], ..., [8.0, ..., 11.0]]"
+    finally:
+        tensor1d.set_printoptions(**old)
+    # .t1d files hold the elements in row-major order
+    path = tmp_path / "t.t1d"
+    t.T.save(path)
+    assert tensor1d.load(path).tolist() == [0.0, 3.0, 1.0, 4.0, 2.0, 5.0]
+    r = tensor1d.Reader(path)
+    out = tensor1d.empty(3, 2)
+    r.read_into(out.T)
+    r.close()
+    assert out.T.reshape(6).tolist() == [0.0, 3.0, 1.0, 4.0, 2.0, 5.0]
+
+def test_nd_errors():
+    t = tensor1d.arange(6).reshape(2, 3)
+    with pytest.raises(ValueError):
+        t.reshape(4, 2)
+    with pytest.raises(ValueError):
+        t.transpose(0, 2)
+    with pytest.raises(ValueError):
+        t.expand(3, 3)
+    with pytest.raises(ValueError):
+        t.permute(0, 0)
+    with pytest.raises(IndexError):
+        t[:, 5]
+    with pytest.raises(IndexError):
+        t[0, 0, 0]
+    with pytest.raises(TypeError):
+        len(t[0, 0])
+
+@pytest.mark.parametrize("shapes", [((3, 4), (4,)), ((3, 1), (1, 4)), ((2, 3, 4), (3, 1)), ((1,), (2, 3)),
+                                    ((5, 1, 3), (4, 1)), ((0, 3), (3,)), ((2, 1), ())])
+def test_broadcasting(shapes):
+    shape1, shape2 = shapes
+    n1, n2 = math.prod(shape1), math.prod(shape2)
+    torch_a = torch.arange(n1, dtype=torch.float32).reshape(shape1)
+    torch_b = (torch.arange(n2, dtype=torch.float32) * 0.5).reshape(shape2)
+    a = tensor1d.arange(n1).reshape(shape1)
+    b = tensor1d.tensor([i * 0.5 for i in range(n2)]).reshape(shape2)
+    for x, y, torch_x, torch_y in [(a, b, torch_a, torch_b), (b, a, torch_b, torch_a)]:
+        result = x + y
+        assert result.shape == tuple((torch_x + torch_y).shape)
+        assert_tensor_equal(torch_x + torch_y, result)
+    # against a transposed view, and in another dtype
+    assert_tensor_equal(torch_a.T + torch_b.reshape(-1)[:1], a.T + b.reshape(-1)[:1])
+    assert_tensor_equal(torch_a.to(torch.float64) + torch_b, a.to("float64") + b)
+
+def test_broadcasting_out_and_errors():
+    a = tensor1d.arange(12).reshape(3, 4)
+    row = tensor1d.tensor([1.0, 2.0, 3.0, 4.0])
+    a += row
+    assert_tensor_equal(torch.arange(12, dtype=torch.float32).reshape(3, 4) + torch.tensor([1.0, 2.0, 3.0, 4.0]), a)
+    # into a strided view of the right shape
+    big = tensor1d.empty(3, 8)
+    tensor1d.add(a, row, out=big[:, ::2])
+    assert big[:, ::2].tolist() == (a + row).tolist()
+    with pytest.raises(ValueError):
+        a + tensor1d.arange(3)
+    with pytest.raises(ValueError):
+        row += a # the result doesn't fit in row
+    with pytest.raises(ValueError):
+        tensor1d.add(row, 1.0, out=tensor1d.empty(1).expand(4)) # elements of out share memory
+    with tensor1d.lazy():
+        c = a + row + 1.0
+    assert c.tolist() == (a + row + 1.0).tolist()
+
+# matmul
+def assert_tensor_close(torch_tensor, tensor1d_tensor, tol=1e-4):
+    assert list(torch_tensor.shape) == list(tensor1d_tensor.shape)
+    expected = torch_tensor.reshape(-1).tolist() if torch_tensor.ndim else [torch_tensor.item()]
+    got = tensor1d_tensor.reshape(-1).tolist() if tensor1d_tensor.ndim else [tensor1d_tensor.item()]
+    for x, y in zip(expected, got):
+        assert abs(x - y) <= tol * max(1.0, abs(x))
+
+def matmul_operand(shape, seed):
+    values = [math.sin(seed + 0.7 * i) for i in range(math.prod(shape))]
+    return torch.tensor(values).reshape(shape), tensor1d.tensor(values).reshape(shape)
+
+@pytest.mark.parametrize("shapes", [((3, 4), (4, 5)), ((4,), (4, 5)), ((3, 4), (4,)), ((4,), (4,)),
+                                    ((2, 3, 4), (4, 5)), ((2, 1, 3, 4), (5, 4, 2)), ((1, 7), (7, 1)),
+                                    ((0, 3), (3, 2)), ((3, 0), (0, 2)), ((50, 70), (70, 60)), ((1, 300), (300, 40)),
+                                    ((40, 300), (300,)), ((3, 20, 30), (3, 30, 40))])
+def test_matmul(shapes):
+    torch_a, a = matmul_operand(shapes[0], 1)
+    torch_b, b = matmul_operand(shapes[1], 2)
+    assert_tensor_close(torch.matmul(torch_a, torch_b), a @ b)
+    if len(shapes[0]) >= 2 and len(shapes[1]) >= 2:
+        # transposed (non-contiguous) operands
+        assert_tensor_close(torch_a.mT.contiguous().mT @ torch_b.mT.contiguous().mT,
+                            a.transpose(-1, -2).contiguous().transpose(-1, -2) @ b.transpose(-1, -2).contiguous().transpose(-1, -2))
+
+def test_matmul_blocked_threads_and_isas():
+    torch_a, a = matmul_operand((150, 300), 3)
+    torch_b, b = matmul_operand((300, 70), 4)
+    expected = torch_a @ torch_b
+    old_threads, old_threshold = tensor1d.get_num_threads(), tensor1d.get_parallel_threshold()
+    original = tensor1d.get_kernel_isa()
+    try:
+        for isa in tensor1d.supported_kernel_isas():
+            tensor1d.set_kernel_isa(isa)
+            for num_threads in [1, 4]:
+                tensor1d.set_num_threads(num_threads)
+                tensor1d.set_parallel_threshold(1000)
+                assert_tensor_close(expected, a @ b)
+                assert_tensor_close(expected.T, b.T @ a.T)
+                # batches of small products across the threads
+                assert_tensor_close(torch_a.reshape(10, 15, 300) @ torch_b, a.reshape(10, 15, 300) @ b)
+    finally:
+        tensor1d.set_kernel_isa(original)
+        tensor1d.set_num_threads(old_threads)
+        tensor1d.set_parallel_threshold(old_threshold)
+
+def test_matmul_dtypes_and_out():
+    torch_a, a = matmul_operand((5, 6), 5)
+    torch_b, b = matmul_operand((6, 3), 6)
+    for dtype in ["float64", "float16", "bfloat16"]:
+        result = a.to(dtype) @ b
+        assert result.dtype == str(torch.promote_types(getattr(torch, dtype), torch.float32)).split(".")[1]
+    assert_tensor_close(torch_a.double() @ torch_b.double(), a.to("float64") @ b.to("float64"), 1e-12)
+    ints = tensor1d.tensor([[1, 2], [3, 4]], dtype="int32")
+    assert (ints @ ints).dtype == "int32" and (ints @ ints).tolist() == [[7, 10], [15, 22]]
+    # into existing tensors: a transposed view, another dtype, and an input
+    out = tensor1d.empty(3, 5)
+    tensor1d.matmul(a, b, out=out.T)
+    assert_tensor_close(torch_a @ torch_b, out.T)
+    out64 = tensor1d.empty(5, 3, dtype="float64")
+    a.matmul(b, out=out64)
+    assert_tensor_close(torch_a @ torch_b, out64)
+    square = tensor1d.tensor([[1.0, 2.0], [3.0, 4.0]])
+    tensor1d.matmul(square, square, out=square)
+    assert square.tolist() == [[7.0, 10.0], [15.0, 22.0]]
+    assert_tensor_close(torch_a @ torch_b, tensor1d.mm(a, b))
+    assert_tensor_close(torch_a @ torch_b[:, 0], tensor1d.mv(a, b[:, 0]))
+    assert_tensor_close(torch_a.unsqueeze(0) @ torch_b.unsqueeze(0), tensor1d.bmm(a.unsqueeze(0), b.unsqueeze(0)))
+
+def test_matmul_errors():
+    a = tensor1d.empty(3, 4)
+    with pytest.raises(ValueError):
+        a @ tensor1d.empty(3, 4)
+    with pytest.raises(ValueError):
+        a @ a[0, 0]
+    with pytest.raises(ValueError):
+        tensor1d.empty(2, 3, 4) @ tensor1d.empty(3, 4, 5)
+    with pytest.raises(ValueError):
+        tensor1d.matmul(a, a.T, out=tensor1d.empty(4))
+    with pytest.raises(ValueError):
+        tensor1d.mm(a, tensor1d.empty(4))
+    with pytest.raises(ValueError):
+        tensor1d.bmm(tensor1d.empty(2, 3, 4), tensor1d.empty(3, 4, 5))